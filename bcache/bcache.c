@@ -1,5 +1,10 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sync_file_range, O_DIRECT, statx
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -7,9 +12,173 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "bcache.h"
 
+#define BC_ROUND_UP(N, S) ((((N) + (S) - 1) / (S)) * (S))
+
+static uint64_t bc_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t bc_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+// per-thread slots:
+//  a thread is handed a slot number the first time it needs one, and uses that
+//  slot in every cache. slots can be shared, so updates are still atomic, but
+//  they're uncontended
+//
+
+static __thread uint32_t bc_tslot_mine = UINT32_MAX;
+static uint32_t bc_tslot_next;
+
+static uint32_t bc_tslot(void) {
+    if (bc_tslot_mine == UINT32_MAX)
+        bc_tslot_mine = __atomic_fetch_add(&bc_tslot_next, 1, __ATOMIC_RELAXED) % BC_NSLOTS;
+    return bc_tslot_mine;
+}
+
+//
+// stats:
+//  nothing here takes a lock
+//
+
+static bc_stats_slot_t *bc_stats_slot(bcache_t *bc) {
+    return &bc->bc_stats[bc_tslot()];
+}
+
+#define BC_STAT_ADD(bc, f, n) __atomic_add_fetch(&bc_stats_slot(bc)->ss_stats.f, (n), __ATOMIC_RELAXED)
+#define BC_STAT_INC(bc, f) BC_STAT_ADD(bc, f, 1)
+
+static void bc_stat_max(uint64_t *p, uint64_t v) {
+    uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while ((v > old) && !__atomic_compare_exchange_n(p, &old, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void bc_hist_add(bcache_t *bc, int h, uint64_t ns) {
+    bc_hist_t *bh = &bc_stats_slot(bc)->ss_hists[h];
+    uint32_t i = ns ? 63 - __builtin_clzll(ns) : 0;
+    
+    if (i >= BC_HIST_NBUCKETS)
+        i = BC_HIST_NBUCKETS - 1;
+    __atomic_add_fetch(&bh->bh_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bh->bh_sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bh->bh_buckets[i], 1, __ATOMIC_RELAXED);
+    bc_stat_max(&bh->bh_max, ns);
+}
+
+uint64_t bc_hist_quantile(bc_hist_t *bh, double q) {
+    uint64_t n = 0, want;
+    
+    if (!bh->bh_count)
+        return 0;
+    want = (uint64_t)(q * bh->bh_count);
+    if (want >= bh->bh_count)
+        want = bh->bh_count - 1;
+    for (uint32_t i = 0; i < BC_HIST_NBUCKETS - 1; i++) {
+        n += bh->bh_buckets[i];
+        if (n > want)
+            return (bh->bh_max < (2ULL << i)) ? bh->bh_max : (2ULL << i);
+    }
+    
+    return bh->bh_max;
+}
+
+static uint64_t bc_stat_take(uint64_t *p, bool reset) {
+    return reset ? __atomic_exchange_n(p, 0, __ATOMIC_RELAXED) : __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+//
+// add up every slot. with reset, each counter is zeroed as it's read, so
+// nothing that happens in the meantime is lost or counted twice
+//
+void bc_get_snapshot(bcache_t *bc, bc_snapshot_t *bss, bool reset) {
+    bc_stats_t *to = &bss->bss_stats, *from;
+    bc_hist_t *th, *fh;
+    bc_part_t *bcp;
+    uint64_t now = bc_now();
+    
+    memset(bss, 0, sizeof(bc_snapshot_t));
+    bss->bss_time = now;
+    bss->bss_since = reset ? __atomic_exchange_n(&bc->bc_stats_since, now, __ATOMIC_RELAXED) :
+                             __atomic_load_n(&bc->bc_stats_since, __ATOMIC_RELAXED);
+    
+    for (int i = 0; i < BC_NSLOTS; i++) {
+        from = &bc->bc_stats[i].ss_stats;
+        to->bcs_hits += bc_stat_take(&from->bcs_hits, reset);
+        to->bcs_misses += bc_stat_take(&from->bcs_misses, reset);
+        to->bcs_writes += bc_stat_take(&from->bcs_writes, reset);
+        to->bcs_flushes += bc_stat_take(&from->bcs_flushes, reset);
+        to->bcs_evictions += bc_stat_take(&from->bcs_evictions, reset);
+        to->bcs_evictions_clean += bc_stat_take(&from->bcs_evictions_clean, reset);
+        to->bcs_evictions_dirty += bc_stat_take(&from->bcs_evictions_dirty, reset);
+        to->bcs_enomem += bc_stat_take(&from->bcs_enomem, reset);
+        to->bcs_ghost_hits += bc_stat_take(&from->bcs_ghost_hits, reset);
+        to->bcs_fg_writebacks += bc_stat_take(&from->bcs_fg_writebacks, reset);
+        to->bcs_bg_writebacks += bc_stat_take(&from->bcs_bg_writebacks, reset);
+        to->bcs_prefetches += bc_stat_take(&from->bcs_prefetches, reset);
+        to->bcs_prefetch_hits += bc_stat_take(&from->bcs_prefetch_hits, reset);
+        to->bcs_prefetch_drops += bc_stat_take(&from->bcs_prefetch_drops, reset);
+        to->bcs_flush_runs += bc_stat_take(&from->bcs_flush_runs, reset);
+        to->bcs_flush_blocks += bc_stat_take(&from->bcs_flush_blocks, reset);
+        bc_stat_max(&to->bcs_flush_maxrun, bc_stat_take(&from->bcs_flush_maxrun, reset));
+        to->bcs_lock_acquires += bc_stat_take(&from->bcs_lock_acquires, reset);
+        to->bcs_lock_wait_ns += bc_stat_take(&from->bcs_lock_wait_ns, reset);
+        bc_stat_max(&to->bcs_dirty_max, bc_stat_take(&from->bcs_dirty_max, reset));
+        to->bcs_pin_overflows += bc_stat_take(&from->bcs_pin_overflows, reset);
+        to->bcs_admissions += bc_stat_take(&from->bcs_admissions, reset);
+        to->bcs_rejections += bc_stat_take(&from->bcs_rejections, reset);
+        to->bcs_read_bytes += bc_stat_take(&from->bcs_read_bytes, reset);
+        to->bcs_write_bytes += bc_stat_take(&from->bcs_write_bytes, reset);
+        
+        for (int h = 0; h < BC_NHISTS; h++) {
+            th = &bss->bss_hists[h];
+            fh = &bc->bc_stats[i].ss_hists[h];
+            th->bh_count += bc_stat_take(&fh->bh_count, reset);
+            th->bh_sum += bc_stat_take(&fh->bh_sum, reset);
+            bc_stat_max(&th->bh_max, bc_stat_take(&fh->bh_max, reset));
+            for (int j = 0; j < BC_HIST_NBUCKETS; j++)
+                th->bh_buckets[j] += bc_stat_take(&fh->bh_buckets[j], reset);
+        }
+    }
+    
+    // usage isn't a counter, so it comes from the partitions themselves
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bcp = &bc->bc_parts[i];
+        lock_lock(bcp->bcp_lock); // not bcp_lock, which would count itself in the stats
+        bss->bss_pinned += bcp->bcp_npinned;
+        bss->bss_pinned_max += bcp->bcp_pinned_max;
+        bss->bss_unpinned += bcp->bcp_currsz / bc->bc_blksz - bcp->bcp_npinned;
+        lock_unlock(bcp->bcp_lock);
+    }
+}
+
+void bc_get_stats(bcache_t *bc, bc_stats_t *bcs) {
+    bc_snapshot_t bss;
+    
+    bc_get_snapshot(bc, &bss, false);
+    memcpy(bcs, &bss.bss_stats, sizeof(bc_stats_t));
+}
+
 uint32_t bl_phys_type(blk_phys_t *bp) {
     return bp->bp_type;
 }
@@ -18,407 +187,5006 @@ void bl_phys_dump(blk_phys_t *bp) {
     printf("bp_type %" PRIu32 " ", bp->bp_type);
 }
 
-blk_phys_t *bl_phys(blk_t *b) {
-    return b->bl_phys;
+blk_phys_t *bl_phys(blk_t *b) {
+    return b->bl_phys;
+}
+
+uint32_t bl_type(blk_t *b) {
+    return bl_phys_type(bl_phys(b));
+}
+
+void bl_dump(blk_t *b) {
+    printf("bl_blkno: %llu bl_refcount: %d%s%s%s%s ", b->bl_blkno, b->bl_refcnt,
+            (b->bl_flags & B_DIRTY) ? " B_DIRTY" : "", (b->bl_flags & B_LOADING) ? " B_LOADING" : "",
+            (b->bl_flags & B_WRITEBACK) ? " B_WRITEBACK" : "", (b->bl_flags & B_ERROR) ? " B_ERROR" : "");
+    if (b->bl_bco && b->bl_bco_ops->bco_dump) {
+        printf("bl_bco: ");
+        b->bl_bco_ops->bco_dump(b->bl_bco);
+    }
+}
+
+//
+// blocks are keyed by (file, blkno). the key spreads adjacent blocks across
+// partitions the same way for every file, and the first file's keys are just
+// its blknos. bl_file and bl_blkno are what actually identify a block; keys
+// only pick its partition and hash bucket
+//
+static uint64_t bc_key(bc_file_t *bf, uint64_t blkno) {
+    return blkno + ((uint64_t)bf->bf_id << 32);
+}
+
+static uint64_t bl_key(blk_t *b) {
+    return bc_key(b->bl_file, b->bl_blkno);
+}
+
+//
+// epochs for the hash tables lock-free lookups walk. a reader bumps its slot's
+// count for the current epoch's parity while it's walking. bc_rcu_wait moves
+// the epoch on and waits for the old parity's readers to drain, twice, since a
+// reader can pick up the parity just before it flips and only count itself in
+// after the first wait has looked. readers never wait on partition locks, so
+// bc_rcu_wait can be called with them held
+//
+
+static uint32_t *bc_rcu_enter(bcache_t *bc) {
+    uint32_t *readers;
+    
+    readers = &bc->bc_rcu[bc_tslot()].rs_readers[__atomic_load_n(&bc->bc_rcu_epoch, __ATOMIC_RELAXED) & 1];
+    __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+    
+    return readers;
+}
+
+static void bc_rcu_exit(uint32_t *readers) {
+    __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+}
+
+// wait until nothing can still be looking at whatever was unpublished before the call
+static void bc_rcu_wait(bcache_t *bc) {
+    uint32_t old;
+    
+    lock_lock(bc->bc_rcu_lock);
+    for (int pass = 0; pass < 2; pass++) {
+        old = __atomic_fetch_add(&bc->bc_rcu_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (int i = 0; i < BC_NSLOTS; i++) {
+            while (__atomic_load_n(&bc->bc_rcu[i].rs_readers[old], __ATOMIC_ACQUIRE))
+                sched_yield();
+        }
+    }
+    lock_unlock(bc->bc_rcu_lock);
+}
+
+//
+// tracing:
+//  records go into the calling thread's slot buffer, which is written out to
+//  the trace file at an offset claimed atomically once it fills up. records
+//  are never made with a partition lock held, since a full buffer means a write
+//
+
+static __thread uint16_t bc_thread_mine;
+static uint32_t bc_thread_next;
+
+static uint16_t bc_thread_id(void) {
+    if (!bc_thread_mine)
+        bc_thread_mine = __atomic_add_fetch(&bc_thread_next, 1, __ATOMIC_RELAXED);
+    return bc_thread_mine;
+}
+
+// tb_lock must be held
+static void bt_write(bc_trace_t *bt, bc_trace_buf_t *tb) {
+    size_t len = sizeof(bc_trace_rec_t) * tb->tb_n;
+    uint64_t off;
+    int zero = 0;
+    
+    if (!len)
+        return;
+    
+    off = __atomic_fetch_add(&bt->bt_off, len, __ATOMIC_RELAXED);
+    if (pwrite(bt->bt_fd, tb->tb_recs, len, off) != len)
+        __atomic_compare_exchange_n(&bt->bt_err, &zero, errno ? errno : EIO, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    tb->tb_n = 0;
+}
+
+// bf is NULL for a flush of every file
+static void bc_trace(bcache_t *bc, uint8_t op, bc_file_t *bf, uint64_t blkno) {
+    bc_trace_rec_t *btr;
+    bc_trace_buf_t *tb;
+    bc_trace_t *bt;
+    uint32_t *readers;
+    
+    if (!__atomic_load_n(&bc->bc_trace, __ATOMIC_RELAXED))
+        return;
+    
+    readers = bc_rcu_enter(bc);
+    bt = __atomic_load_n(&bc->bc_trace, __ATOMIC_ACQUIRE);
+    if (bt) {
+        tb = &bt->bt_bufs[bc_tslot()];
+        lock_lock(tb->tb_lock);
+        btr = &tb->tb_recs[tb->tb_n++];
+        btr->btr_time = bc_now_ns();
+        btr->btr_blkno = blkno;
+        btr->btr_file = bf ? bf->bf_id : BC_TRACE_ALLFILES;
+        btr->btr_thread = bc_thread_id();
+        btr->btr_op = op;
+        btr->btr_pad = 0;
+        if (tb->tb_n == BC_TRACE_BATCH)
+            bt_write(bt, tb);
+        lock_unlock(tb->tb_lock);
+    }
+    bc_rcu_exit(readers);
+}
+
+static uint32_t bl_flags(blk_t *b) {
+    return __atomic_load_n(&b->bl_flags, __ATOMIC_ACQUIRE);
+}
+
+// bcp_lock must be held. the release pairs with bl_flags in lock-free hits
+static void bl_set_flags(blk_t *b, uint32_t set, uint32_t clear) {
+    __atomic_store_n(&b->bl_flags, (b->bl_flags & ~clear) | set, __ATOMIC_RELEASE);
+}
+
+// get a reference without bcp_lock. fails if b isn't in the cache
+static bool bl_tryref(blk_t *b) {
+    int refcnt = __atomic_load_n(&b->bl_refcnt, __ATOMIC_RELAXED);
+    
+    do {
+        if (refcnt == BL_DEAD)
+            return false;
+    } while (!__atomic_compare_exchange_n(&b->bl_refcnt, &refcnt, refcnt + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    
+    return true;
+}
+
+static int bl_refcnt(blk_t *b) {
+    return __atomic_load_n(&b->bl_refcnt, __ATOMIC_RELAXED);
+}
+
+// note a hit for the replacement policy
+static void bl_touch(blk_t *b) {
+    if (!__atomic_load_n(&b->bl_ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&b->bl_ref, true, __ATOMIC_RELAXED);
+}
+
+// clear b's reference bit, returning whether it was set. bcp_lock must be held
+static bool bl_untouch(blk_t *b) {
+    return __atomic_load_n(&b->bl_ref, __ATOMIC_RELAXED) && __atomic_exchange_n(&b->bl_ref, false, __ATOMIC_RELAXED);
+}
+
+//
+// hash chains are walked without bcp_lock by lock-free hits, so a block's link
+// has to be set up before the block is published in its bucket
+//
+static void bl_ht_insert(blk_list_t *bl, blk_t *b) {
+    __atomic_store_n(&b->bl_ht_link.le_next, bl->lh_first, __ATOMIC_RELAXED);
+    if (bl->lh_first)
+        bl->lh_first->bl_ht_link.le_prev = &b->bl_ht_link.le_next;
+    b->bl_ht_link.le_prev = &bl->lh_first;
+    __atomic_store_n(&bl->lh_first, b, __ATOMIC_RELEASE);
+}
+
+// LIST_REMOVE, for the same reason. b's own link is left alone for anyone walking through it
+static void bl_ht_remove(blk_t *b) {
+    blk_t *next = b->bl_ht_link.le_next;
+    
+    if (next)
+        next->bl_ht_link.le_prev = b->bl_ht_link.le_prev;
+    __atomic_store_n(b->bl_ht_link.le_prev, next, __ATOMIC_RELEASE);
+}
+
+static bc_part_t *bc_part(bcache_t *bc, uint64_t key) {
+    return &bc->bc_parts[key % bc->bc_nparts];
+}
+
+// take bcp_lock, keeping track of how long that took
+static void bcp_lock(bcache_t *bc, bc_part_t *bcp) {
+    uint64_t start = bc_now_ns(), ns;
+    
+    lock_lock(bcp->bcp_lock);
+    ns = bc_now_ns() - start;
+    BC_STAT_INC(bc, bcs_lock_acquires);
+    BC_STAT_ADD(bc, bcs_lock_wait_ns, ns);
+    bc_hist_add(bc, BC_HIST_LOCK, ns);
+}
+
+// partition i's share of nblocks. the first partitions get any remainder
+static uint32_t bc_part_nblocks(bcache_t *bc, uint32_t nblocks, int i) {
+    return nblocks / bc->bc_nparts + ((i < (nblocks % bc->bc_nparts)) ? 1 : 0);
+}
+
+static blk_list_t *bcp_bucket(bcache_t *bc, bc_part_t *bcp, uint64_t key) {
+    return &bcp->bcp_ht[(key / bc->bc_nparts) % bcp->bcp_htsz];
+}
+
+//
+// when bc_set_capacity grows a partition's hash table, the old table's buckets
+// are moved over a few at a time by each lookup, so no one bc_get pays for the
+// whole rehash. buckets below bcp_rehash have been moved already
+//
+static void bcp_rehash(bcache_t *bc, bc_part_t *bcp, uint32_t nbuckets) {
+    blk_t *b, *bnext;
+    
+    while (bcp->bcp_ht_old && nbuckets--) {
+        LIST_FOREACH_SAFE(b, &bcp->bcp_ht_old[bcp->bcp_rehash], bl_ht_link, bnext) {
+            bl_ht_remove(b);
+            bl_ht_insert(bcp_bucket(bc, bcp, bl_key(b)), b);
+        }
+        if (++bcp->bcp_rehash == bcp->bcp_htsz_old) {
+            bc_rcu_wait(bc); // lock-free lookups that started before the swap may still be in it
+            free(bcp->bcp_ht_old);
+            bcp->bcp_ht_old = NULL;
+        }
+    }
+}
+
+// swap in a new (empty) hash table. bcp_lock must be held
+static void bcp_ht_publish(bc_part_t *bcp, blk_list_t *ht, uint32_t htsz) {
+    __atomic_store_n(&bcp->bcp_htseq, bcp->bcp_htseq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&bcp->bcp_ht, ht, __ATOMIC_RELAXED);
+    __atomic_store_n(&bcp->bcp_htsz, htsz, __ATOMIC_RELAXED);
+    __atomic_store_n(&bcp->bcp_htseq, bcp->bcp_htseq + 1, __ATOMIC_RELEASE);
+}
+
+static blk_t *bcp_find(bcache_t *bc, bc_part_t *bcp, bc_file_t *bf, uint64_t blkno) {
+    uint64_t key = bc_key(bf, blkno);
+    uint32_t i;
+    blk_t *b;
+    
+    LIST_FOREACH(b, bcp_bucket(bc, bcp, key), bl_ht_link) {
+        if ((b->bl_blkno == blkno) && (b->bl_file == bf))
+            return b;
+    }
+    
+    if (bcp->bcp_ht_old) { // mid rehash. it might not have been moved yet
+        i = (key / bc->bc_nparts) % bcp->bcp_htsz_old;
+        if (i >= bcp->bcp_rehash) {
+            LIST_FOREACH(b, &bcp->bcp_ht_old[i], bl_ht_link) {
+                if ((b->bl_blkno == blkno) && (b->bl_file == bf))
+                    return b;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+//
+// lock-free hits:
+//  blk_ts stay put in their arenas until bc_destroy, so a lookup can walk a
+//  hash chain without bcp_lock. a block it walks through can be evicted and
+//  reused under it, which at worst lands it on the wrong chain, so the walk is
+//  cut short after BC_FAST_MAXHOPS blocks. a block's key is only trusted once
+//  bl_tryref has a reference to it, since it can't be reused while it's
+//  referenced. the hash table itself can be swapped out by bc_set_capacity and
+//  freed once it's been rehashed, so it's walked in a bc_rcu read section.
+//  anything that doesn't pan out (including blocks that are mid rehash) goes
+//  the locked way, through bcp_lookup
+//
+
+#define BC_FAST_MAXHOPS 16
+
+static blk_t *bc_find_fast(bcache_t *bc, bc_file_t *bf, uint64_t blkno) {
+    uint64_t key = bc_key(bf, blkno);
+    bc_part_t *bcp = bc_part(bc, key);
+    uint32_t seq, htsz, *readers;
+    blk_t *b, *found = NULL;
+    blk_list_t *ht;
+    
+    readers = bc_rcu_enter(bc);
+    
+    seq = __atomic_load_n(&bcp->bcp_htseq, __ATOMIC_ACQUIRE);
+    ht = __atomic_load_n(&bcp->bcp_ht, __ATOMIC_RELAXED);
+    htsz = __atomic_load_n(&bcp->bcp_htsz, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq & 1) || (__atomic_load_n(&bcp->bcp_htseq, __ATOMIC_RELAXED) != seq))
+        goto out; // it's being swapped out
+    
+    b = __atomic_load_n(&ht[(key / bc->bc_nparts) % htsz].lh_first, __ATOMIC_ACQUIRE);
+    for (int hops = 0; b && (hops < BC_FAST_MAXHOPS); hops++) {
+        if ((__atomic_load_n(&b->bl_blkno, __ATOMIC_RELAXED) == blkno) &&
+            (__atomic_load_n(&b->bl_file, __ATOMIC_RELAXED) == bf)) {
+            if (bl_tryref(b)) {
+                if ((b->bl_blkno == blkno) && (b->bl_file == bf))
+                    found = b;
+                else // reused before we got to it
+                    __atomic_sub_fetch(&b->bl_refcnt, 1, __ATOMIC_RELEASE);
+            }
+            break;
+        }
+        b = __atomic_load_n(&b->bl_ht_link.le_next, __ATOMIC_ACQUIRE);
+    }
+    
+    if (found && bcp->bcp_policy->bpo_access)
+        bcp->bcp_policy->bpo_access(bcp, key);
+    
+out:
+    bc_rcu_exit(readers);
+    
+    if (found)
+        bl_touch(found);
+    
+    return found;
+}
+
+//
+// replacement policies:
+//
+
+static bool bl_evictable(blk_t *b) {
+    return (bl_refcnt(b) == 0) && !(b->bl_flags & (B_LOADING | B_WRITEBACK));
+}
+
+//
+// the first evictable block on bq. blocks that have been hit since they were
+// last looked at are moved to the back instead, CLOCK style, so that hits
+// never have to relink them. one lap at most: if everything was either in use
+// or hit, the oldest evictable block goes anyway
+//
+static blk_t *bpo_clock_victim(blk_tailq_t *bq, uint64_t *nlaps) {
+    blk_t *b, *bnext, *last = TAILQ_LAST(bq, blk_tailq);
+    bool done = false;
+    
+    for (b = TAILQ_FIRST(bq); b && !done; b = bnext) {
+        bnext = TAILQ_NEXT(b, bl_pl_link);
+        done = (b == last);
+        if (bl_untouch(b)) {
+            TAILQ_REMOVE(bq, b, bl_pl_link);
+            TAILQ_INSERT_TAIL(bq, b, bl_pl_link);
+            if (nlaps)
+                (*nlaps)++;
+            continue;
+        }
+        if (bl_evictable(b))
+            return b;
+    }
+    
+    TAILQ_FOREACH(b, bq, bl_pl_link) {
+        if (bl_evictable(b))
+            return b;
+    }
+    
+    return NULL;
+}
+
+//
+// LRU:
+//  every block sits on a queue in roughly the order it was last used, and
+//  the least recently used unreferenced block is evicted first. hits don't
+//  move blocks to the back of the queue themselves (they'd need bcp_lock);
+//  bpo_clock_victim does it for them when it comes across their bl_ref
+//
+
+typedef struct bc_lru {
+    blk_tailq_t lru_q;
+    uint64_t lru_laps; // blocks bpo_clock_victim has sent to the back
+} bc_lru_t;
+
+static int lru_init(bc_part_t *bcp, uint32_t nblocks) {
+    bc_lru_t *lru;
+    
+    lru = malloc(sizeof(bc_lru_t));
+    if (!lru)
+        return ENOMEM;
+    
+    TAILQ_INIT(&lru->lru_q);
+    lru->lru_laps = 0;
+    bcp->bcp_policy_data = lru;
+    
+    return 0;
+}
+
+static void lru_destroy(bc_part_t *bcp) {
+    free(bcp->bcp_policy_data);
+    bcp->bcp_policy_data = NULL;
+}
+
+static void lru_insert(bc_part_t *bcp, blk_t *b) {
+    bc_lru_t *lru = (bc_lru_t *)bcp->bcp_policy_data;
+    TAILQ_INSERT_TAIL(&lru->lru_q, b, bl_pl_link);
+}
+
+static void lru_failed(bc_part_t *bcp, blk_t *b) {
+    bc_lru_t *lru = (bc_lru_t *)bcp->bcp_policy_data;
+    // nothing worth keeping. reuse it first
+    TAILQ_REMOVE(&lru->lru_q, b, bl_pl_link);
+    TAILQ_INSERT_HEAD(&lru->lru_q, b, bl_pl_link);
+}
+
+static blk_t *lru_victim(bc_part_t *bcp) {
+    bc_lru_t *lru = (bc_lru_t *)bcp->bcp_policy_data;
+    return bpo_clock_victim(&lru->lru_q, &lru->lru_laps);
+}
+
+static void lru_remove(bc_part_t *bcp, blk_t *b) {
+    bc_lru_t *lru = (bc_lru_t *)bcp->bcp_policy_data;
+    TAILQ_REMOVE(&lru->lru_q, b, bl_pl_link);
+}
+
+static void lru_evict(bc_part_t *bcp, blk_t *b) {
+    lru_remove(bcp, b);
+}
+
+static void lru_dump(bc_part_t *bcp) {
+    bc_lru_t *lru = (bc_lru_t *)bcp->bcp_policy_data;
+    blk_t *b;
+    printf("lru_laps: %" PRIu64 "\n", lru->lru_laps);
+    printf("lru_q: ");
+    TAILQ_FOREACH(b, &lru->lru_q, bl_pl_link)
+        printf(" %" PRIu64 "%s", b->bl_blkno, b->bl_ref ? "*" : "");
+    printf("\n");
+}
+
+static void lru_check(bc_part_t *bcp) {
+    bc_lru_t *lru = (bc_lru_t *)bcp->bcp_policy_data;
+    blk_t *b;
+    uint32_t nqueued = 0, nblocks = 0;
+    
+    TAILQ_FOREACH(b, &lru->lru_q, bl_pl_link)
+        nqueued++;
+    
+    // every block that isn't pinned should be on the queue exactly once
+    for (int i = 0; i < bcp->bcp_htsz; i++) {
+        LIST_FOREACH(b, &bcp->bcp_ht[i], bl_ht_link) {
+            if (!(b->bl_flags & B_PINNED))
+                nblocks++;
+        }
+    }
+    assert(nqueued == nblocks);
+}
+
+bc_policy_t bc_policy_lru = {
+    .bpo_name = "lru",
+    .bpo_init = lru_init,
+    .bpo_destroy = lru_destroy,
+    .bpo_insert = lru_insert,
+    .bpo_failed = lru_failed,
+    .bpo_victim = lru_victim,
+    .bpo_evict = lru_evict,
+    .bpo_remove = lru_remove,
+    .bpo_resize = NULL,
+    .bpo_access = NULL,
+    .bpo_dump = lru_dump,
+    .bpo_check = lru_check
+};
+
+//
+// 2Q (Johnson & Shasha, VLDB '94):
+//  blocks seen for the first time go on a1in, a FIFO. when a1in grows past
+//  q_kin blocks, its oldest block is evicted and its key is remembered on
+//  a1out. a block that's read back in while it's still on a1out has proven
+//  itself hot and goes on am, an LRU. a big scan only churns through a1in,
+//  so it can't push the hot blocks out of am. referenced blocks stay on their
+//  queue and are just skipped over when picking a victim. hits on am blocks
+//  are picked up from bl_ref as with LRU; hits on a1in blocks don't count
+//
+
+#define BC_2Q_A1IN 1
+#define BC_2Q_AM   2
+
+typedef struct bc_2q_ghost {
+    uint64_t g_key; // file ids aren't reused, so this can't outlive its file
+    LIST_ENTRY(bc_2q_ghost) g_ht_link;
+    TAILQ_ENTRY(bc_2q_ghost) g_link;
+} bc_2q_ghost_t;
+
+LIST_HEAD(bc_2q_ghost_list, bc_2q_ghost);
+TAILQ_HEAD(bc_2q_ghost_tailq, bc_2q_ghost);
+
+typedef struct bc_2q {
+    blk_tailq_t q_a1in;
+    blk_tailq_t q_am;
+    uint32_t q_na1in;
+    uint32_t q_nam;
+    uint32_t q_kin; // max a1in size before we start evicting from it
+    uint32_t q_kout; // number of keys a1out remembers
+    struct bc_2q_ghost_tailq q_a1out; // oldest first
+    struct bc_2q_ghost_tailq q_gfree; // unused ghost entries
+    struct bc_2q_ghost_list *q_ght; // a1out hash table (q_kout buckets)
+    bc_2q_ghost_t *q_ghosts;
+    uint64_t q_am_laps; // am blocks bpo_clock_victim has sent to the back
+} bc_2q_t;
+
+static int q2_init(bc_part_t *bcp, uint32_t nblocks) {
+    bc_2q_t *q;
+    int err;
+    
+    q = malloc(sizeof(bc_2q_t));
+    if (!q) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    memset(q, 0, sizeof(bc_2q_t));
+    TAILQ_INIT(&q->q_a1in);
+    TAILQ_INIT(&q->q_am);
+    TAILQ_INIT(&q->q_a1out);
+    TAILQ_INIT(&q->q_gfree);
+    
+    // the paper's recommended sizes: a1in gets 25% of the cache, a1out remembers 50%
+    q->q_kin = nblocks / 4 ? nblocks / 4 : 1;
+    q->q_kout = nblocks / 2 ? nblocks / 2 : 1;
+    
+    q->q_ght = malloc(sizeof(struct bc_2q_ghost_list) * q->q_kout);
+    if (!q->q_ght) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    memset(q->q_ght, 0, sizeof(struct bc_2q_ghost_list) * q->q_kout);
+    
+    q->q_ghosts = malloc(sizeof(bc_2q_ghost_t) * q->q_kout);
+    if (!q->q_ghosts) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    for (int i = 0; i < q->q_kout; i++)
+        TAILQ_INSERT_TAIL(&q->q_gfree, &q->q_ghosts[i], g_link);
+    
+    bcp->bcp_policy_data = q;
+    
+    return 0;
+    
+error_out:
+    if (q) {
+        if (q->q_ght)
+            free(q->q_ght);
+        free(q);
+    }
+    
+    return err;
+}
+
+static void q2_destroy(bc_part_t *bcp) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    free(q->q_ghosts);
+    free(q->q_ght);
+    free(q);
+    bcp->bcp_policy_data = NULL;
+}
+
+//
+// the cache was resized. a1in's target follows the new size, and a1out keeps
+// its newest entries that still fit. if we can't get memory for a new a1out
+// it just stays the size it was
+//
+static void q2_resize(bc_part_t *bcp, uint32_t nblocks) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    struct bc_2q_ghost_list *ght;
+    bc_2q_ghost_t *ghosts, *g;
+    uint32_t kout, nold = 0, skip, n = 0;
+    
+    q->q_kin = nblocks / 4 ? nblocks / 4 : 1;
+    kout = nblocks / 2 ? nblocks / 2 : 1;
+    if (kout == q->q_kout)
+        return;
+    
+    ght = malloc(sizeof(struct bc_2q_ghost_list) * kout);
+    ghosts = malloc(sizeof(bc_2q_ghost_t) * kout);
+    if (!ght || !ghosts) {
+        if (ght)
+            free(ght);
+        if (ghosts)
+            free(ghosts);
+        return;
+    }
+    memset(ght, 0, sizeof(struct bc_2q_ghost_list) * kout);
+    
+    TAILQ_FOREACH(g, &q->q_a1out, g_link)
+        nold++;
+    skip = (nold > kout) ? nold - kout : 0;
+    TAILQ_FOREACH(g, &q->q_a1out, g_link) {
+        if (skip) {
+            skip--;
+            continue;
+        }
+        ghosts[n++].g_key = g->g_key;
+    }
+    
+    free(q->q_ghosts);
+    free(q->q_ght);
+    q->q_ghosts = ghosts;
+    q->q_ght = ght;
+    q->q_kout = kout;
+    TAILQ_INIT(&q->q_a1out);
+    TAILQ_INIT(&q->q_gfree);
+    for (uint32_t i = 0; i < kout; i++) {
+        g = &ghosts[i];
+        if (i < n) {
+            TAILQ_INSERT_TAIL(&q->q_a1out, g, g_link);
+            LIST_INSERT_HEAD(&q->q_ght[g->g_key % q->q_kout], g, g_ht_link);
+        } else
+            TAILQ_INSERT_TAIL(&q->q_gfree, g, g_link);
+    }
+}
+
+static void q2_insert(bc_part_t *bcp, blk_t *b) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    uint64_t key = bl_key(b);
+    bc_2q_ghost_t *g;
+    
+    LIST_FOREACH(g, &q->q_ght[key % q->q_kout], g_ht_link) {
+        if (g->g_key == key)
+            break;
+    }
+    
+    if (g) { // we saw it recently. it's hot
+        LIST_REMOVE(g, g_ht_link);
+        TAILQ_REMOVE(&q->q_a1out, g, g_link);
+        TAILQ_INSERT_TAIL(&q->q_gfree, g, g_link);
+        b->bl_pstate = BC_2Q_AM;
+        TAILQ_INSERT_TAIL(&q->q_am, b, bl_pl_link);
+        q->q_nam++;
+        BC_STAT_INC(bcp->bcp_bc, bcs_ghost_hits);
+    } else {
+        b->bl_pstate = BC_2Q_A1IN;
+        TAILQ_INSERT_TAIL(&q->q_a1in, b, bl_pl_link);
+        q->q_na1in++;
+    }
+}
+
+static void q2_failed(bc_part_t *bcp, blk_t *b) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    // nothing worth keeping. reuse it first
+    if (b->bl_pstate == BC_2Q_AM) {
+        TAILQ_REMOVE(&q->q_am, b, bl_pl_link);
+        q->q_nam--;
+    } else {
+        TAILQ_REMOVE(&q->q_a1in, b, bl_pl_link);
+        q->q_na1in--;
+    }
+    b->bl_pstate = BC_2Q_A1IN;
+    TAILQ_INSERT_HEAD(&q->q_a1in, b, bl_pl_link);
+    q->q_na1in++;
+}
+
+static blk_t *q2_first_evictable(blk_tailq_t *bq) {
+    blk_t *b;
+    TAILQ_FOREACH(b, bq, bl_pl_link) {
+        if (bl_evictable(b))
+            return b;
+    }
+    return NULL;
+}
+
+static blk_t *q2_victim(bc_part_t *bcp) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    blk_t *b = NULL;
+    
+    if (q->q_na1in > q->q_kin)
+        b = q2_first_evictable(&q->q_a1in);
+    if (!b)
+        b = bpo_clock_victim(&q->q_am, &q->q_am_laps);
+    if (!b)
+        b = q2_first_evictable(&q->q_a1in);
+    
+    return b;
+}
+
+static void q2_remove(bc_part_t *bcp, blk_t *b) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    
+    if (b->bl_pstate == BC_2Q_AM) {
+        TAILQ_REMOVE(&q->q_am, b, bl_pl_link);
+        q->q_nam--;
+    } else {
+        TAILQ_REMOVE(&q->q_a1in, b, bl_pl_link);
+        q->q_na1in--;
+    }
+}
+
+static void q2_evict(bc_part_t *bcp, blk_t *b) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    bc_2q_ghost_t *g;
+    
+    q2_remove(bcp, b);
+    
+    if ((b->bl_pstate == BC_2Q_AM) || (b->bl_flags & B_ERROR))
+        return;
+    
+    // remember it on a1out, forgetting the oldest entry if a1out is full
+    g = TAILQ_FIRST(&q->q_gfree);
+    if (g) {
+        TAILQ_REMOVE(&q->q_gfree, g, g_link);
+    } else {
+        g = TAILQ_FIRST(&q->q_a1out);
+        TAILQ_REMOVE(&q->q_a1out, g, g_link);
+        LIST_REMOVE(g, g_ht_link);
+    }
+    g->g_key = bl_key(b);
+    TAILQ_INSERT_TAIL(&q->q_a1out, g, g_link);
+    LIST_INSERT_HEAD(&q->q_ght[g->g_key % q->q_kout], g, g_ht_link);
+}
+
+static void q2_dump(bc_part_t *bcp) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    blk_t *b;
+    bc_2q_ghost_t *g;
+    printf("q_kin: %" PRIu32 " q_kout: %" PRIu32 " q_am_laps: %" PRIu64 "\n",
+            q->q_kin, q->q_kout, q->q_am_laps);
+    printf("q_a1in (%" PRIu32 "): ", q->q_na1in);
+    TAILQ_FOREACH(b, &q->q_a1in, bl_pl_link)
+        printf(" %" PRIu64, b->bl_blkno);
+    printf("\n");
+    printf("q_am (%" PRIu32 "): ", q->q_nam);
+    TAILQ_FOREACH(b, &q->q_am, bl_pl_link)
+        printf(" %" PRIu64, b->bl_blkno);
+    printf("\n");
+    printf("q_a1out: ");
+    TAILQ_FOREACH(g, &q->q_a1out, g_link)
+        printf(" %" PRIu64, g->g_key);
+    printf("\n");
+}
+
+static void q2_check(bc_part_t *bcp) {
+    bc_2q_t *q = (bc_2q_t *)bcp->bcp_policy_data;
+    blk_t *b, *_b;
+    bc_2q_ghost_t *g;
+    uint32_t na1in = 0, nam = 0, nblocks = 0, nghosts = 0;
+    
+    TAILQ_FOREACH(b, &q->q_a1in, bl_pl_link) {
+        assert(b->bl_pstate == BC_2Q_A1IN);
+        na1in++;
+    }
+    TAILQ_FOREACH(b, &q->q_am, bl_pl_link) {
+        assert(b->bl_pstate == BC_2Q_AM);
+        nam++;
+    }
+    assert(na1in == q->q_na1in && nam == q->q_nam);
+    
+    for (int i = 0; i < bcp->bcp_htsz; i++) {
+        LIST_FOREACH(b, &bcp->bcp_ht[i], bl_ht_link) {
+            if (!(b->bl_flags & B_PINNED))
+                nblocks++;
+        }
+    }
+    assert(nblocks == na1in + nam);
+    
+    // nothing on a1out should be resident
+    TAILQ_FOREACH(g, &q->q_a1out, g_link) {
+        for (int i = 0; i < bcp->bcp_htsz; i++) {
+            LIST_FOREACH(_b, &bcp->bcp_ht[i], bl_ht_link)
+                assert(bl_key(_b) != g->g_key);
+        }
+        nghosts++;
+    }
+    assert(nghosts <= q->q_kout);
+}
+
+bc_policy_t bc_policy_2q = {
+    .bpo_name = "2q",
+    .bpo_init = q2_init,
+    .bpo_destroy = q2_destroy,
+    .bpo_insert = q2_insert,
+    .bpo_failed = q2_failed,
+    .bpo_victim = q2_victim,
+    .bpo_evict = q2_evict,
+    .bpo_remove = q2_remove,
+    .bpo_resize = q2_resize,
+    .bpo_access = NULL,
+    .bpo_dump = q2_dump,
+    .bpo_check = q2_check
+};
+
+//
+// W-TinyLFU (Einziger, Friedman & Manes, "TinyLFU: A Highly Efficient Cache
+// Admission Policy", ACM ToS '17):
+//  a count-min sketch estimates how often each key has been asked for lately,
+//  cached or not. it's aged by halving every counter once t_sample increments
+//  have gone into it. new blocks go on a small LRU window (1% of the
+//  partition). when the window overflows, its oldest block only gets into the
+//  main cache if the sketch says it's been asked for more often than the main
+//  cache's victim. if it hasn't, it's the one that's evicted, so a block that
+//  a scan touches once can't push out anything that's been used more than
+//  that. the main cache is a segmented LRU: blocks start on probation and move
+//  to the protected segment (80% of it) once they're hit again. hits set bl_ref
+//  as with LRU, and also count in the sketch, through bpo_access
+//
+
+#define BC_TLFU_WINDOW    1
+#define BC_TLFU_PROBATION 2
+#define BC_TLFU_PROTECTED 3
+
+#define BC_TLFU_DEPTH  4  // rows in the sketch
+#define BC_TLFU_CMAX   15 // counters saturate here, as if they were 4 bits
+#define BC_TLFU_SAMPLE 10 // the sketch is aged after 10 times the partition's size in increments
+
+typedef struct bc_sketch {
+    uint32_t sk_mask; // row width - 1. rows are a power of 2 wide
+    uint32_t sk_adds; // increments since it was last aged
+    uint8_t sk_counts[]; // BC_TLFU_DEPTH rows
+} bc_sketch_t;
+
+typedef struct bc_tlfu {
+    blk_tailq_t t_win;
+    blk_tailq_t t_prob;
+    blk_tailq_t t_prot;
+    uint32_t t_nwin;
+    uint32_t t_nprob;
+    uint32_t t_nprot;
+    uint32_t t_winmax;
+    uint32_t t_mainmax; // probation and protected together
+    uint32_t t_protmax;
+    uint32_t t_sample;
+    bc_sketch_t *t_sk; // bpo_access uses it without bcp_lock. see tlfu_resize
+    uint64_t t_ages;
+    uint64_t t_laps; // blocks bpo_clock_victim has sent to the back
+} bc_tlfu_t;
+
+// splitmix64's finalizer. keys are mostly consecutive block numbers, so they need mixing
+static uint64_t tlfu_hash(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+// key's counter in row i. the rows' indexes are double hashed off one hash
+static uint8_t *tlfu_counter(bc_sketch_t *sk, uint64_t h, int i) {
+    uint32_t idx = ((uint32_t)h + i * ((uint32_t)(h >> 32) | 1)) & sk->sk_mask;
+    return &sk->sk_counts[(size_t)i * (sk->sk_mask + 1) + idx];
+}
+
+//
+// a few counters per block in each row. a key whose counters all collide with
+// hotter keys' looks hot itself, and a scan is a lot of keys
+//
+static uint32_t tlfu_width(uint32_t nblocks) {
+    uint32_t width = 16;
+    while ((width < 4 * (uint64_t)nblocks) && (width < (1U << 31)))
+        width <<= 1;
+    return width;
+}
+
+static bc_sketch_t *tlfu_sketch_create(uint32_t nblocks) {
+    uint32_t width = tlfu_width(nblocks);
+    size_t sz = sizeof(bc_sketch_t) + (size_t)BC_TLFU_DEPTH * width;
+    bc_sketch_t *sk;
+    
+    sk = malloc(sz);
+    if (!sk)
+        return NULL;
+    memset(sk, 0, sz);
+    sk->sk_mask = width - 1;
+    
+    return sk;
+}
+
+static uint32_t tlfu_estimate(bc_tlfu_t *t, uint64_t key) {
+    uint64_t h = tlfu_hash(key);
+    uint32_t n, min = BC_TLFU_CMAX;
+    
+    for (int i = 0; i < BC_TLFU_DEPTH; i++) {
+        n = __atomic_load_n(tlfu_counter(t->t_sk, h, i), __ATOMIC_RELAXED);
+        if (n < min)
+            min = n;
+    }
+    
+    return min;
+}
+
+//
+// halve every counter once enough has been counted, so that blocks that were
+// hot a while ago don't stay ahead of ones that are hot now. increments that
+// race with this can be lost; the sketch is an estimate anyway
+//
+static void tlfu_age(bc_tlfu_t *t) {
+    bc_sketch_t *sk = t->t_sk;
+    size_t ncounts = (size_t)BC_TLFU_DEPTH * (sk->sk_mask + 1);
+    uint8_t *c;
+    
+    if (__atomic_load_n(&sk->sk_adds, __ATOMIC_RELAXED) < t->t_sample)
+        return;
+    
+    for (size_t i = 0; i < ncounts; i++) {
+        c = &sk->sk_counts[i];
+        __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&sk->sk_adds, __atomic_load_n(&sk->sk_adds, __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+    t->t_ages++;
+}
+
+static void tlfu_size(bc_tlfu_t *t, uint32_t nblocks) {
+    t->t_winmax = nblocks / 100 ? nblocks / 100 : 1;
+    t->t_mainmax = (nblocks > t->t_winmax) ? nblocks - t->t_winmax : 1;
+    t->t_protmax = (t->t_mainmax / 5) * 4;
+    t->t_sample = BC_TLFU_SAMPLE * nblocks;
+}
+
+static blk_tailq_t *tlfu_queue(bc_tlfu_t *t, uint32_t pstate, uint32_t **np) {
+    switch (pstate) {
+        case BC_TLFU_WINDOW:
+            *np = &t->t_nwin;
+            return &t->t_win;
+        case BC_TLFU_PROBATION:
+            *np = &t->t_nprob;
+            return &t->t_prob;
+        default:
+            *np = &t->t_nprot;
+            return &t->t_prot;
+    }
+}
+
+static void tlfu_link(bc_tlfu_t *t, blk_t *b, uint32_t pstate, bool head) {
+    blk_tailq_t *bq;
+    uint32_t *n;
+    
+    bq = tlfu_queue(t, pstate, &n);
+    if (head)
+        TAILQ_INSERT_HEAD(bq, b, bl_pl_link);
+    else
+        TAILQ_INSERT_TAIL(bq, b, bl_pl_link);
+    (*n)++;
+    b->bl_pstate = pstate;
+}
+
+static void tlfu_unlink(bc_tlfu_t *t, blk_t *b) {
+    blk_tailq_t *bq;
+    uint32_t *n;
+    
+    bq = tlfu_queue(t, b->bl_pstate, &n);
+    TAILQ_REMOVE(bq, b, bl_pl_link);
+    (*n)--;
+}
+
+static void tlfu_move(bc_tlfu_t *t, blk_t *b, uint32_t pstate) {
+    tlfu_unlink(t, b);
+    tlfu_link(t, b, pstate, false);
+}
+
+// protected is over its share. its oldest blocks go back on probation
+static void tlfu_demote(bc_tlfu_t *t) {
+    while (t->t_nprot > t->t_protmax)
+        tlfu_move(t, TAILQ_FIRST(&t->t_prot), BC_TLFU_PROBATION);
+}
+
+static int tlfu_init(bc_part_t *bcp, uint32_t nblocks) {
+    bc_tlfu_t *t;
+    int err;
+    
+    t = malloc(sizeof(bc_tlfu_t));
+    if (!t) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    memset(t, 0, sizeof(bc_tlfu_t));
+    TAILQ_INIT(&t->t_win);
+    TAILQ_INIT(&t->t_prob);
+    TAILQ_INIT(&t->t_prot);
+    tlfu_size(t, nblocks);
+    
+    t->t_sk = tlfu_sketch_create(nblocks);
+    if (!t->t_sk) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    bcp->bcp_policy_data = t;
+    
+    return 0;
+    
+error_out:
+    if (t)
+        free(t);
+    
+    return err;
+}
+
+static void tlfu_destroy(bc_part_t *bcp) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    free(t->t_sk);
+    free(t);
+    bcp->bcp_policy_data = NULL;
+}
+
+//
+// the segments follow the new size. the sketch is replaced if its width
+// should change; its counts can't be carried over without the keys, so
+// admission is on a cold sketch for a while. if we can't get memory for a new
+// one we keep the old one, which just collides more
+//
+static void tlfu_resize(bc_part_t *bcp, uint32_t nblocks) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    bc_sketch_t *sk, *osk = t->t_sk;
+    
+    tlfu_size(t, nblocks);
+    tlfu_demote(t);
+    if (tlfu_width(nblocks) == osk->sk_mask + 1)
+        return;
+    
+    sk = tlfu_sketch_create(nblocks);
+    if (!sk)
+        return;
+    
+    __atomic_store_n(&t->t_sk, sk, __ATOMIC_RELEASE);
+    bc_rcu_wait(bcp->bcp_bc); // lock-free hits may still be counting in the old one
+    free(osk);
+}
+
+//
+// count an access to key. only its smallest counters go up (conservative
+// update), since the others are already counting some other key as well.
+// lock-free hits call this too, so a lost race on a counter just loses the
+// increment. hot keys' counters saturate and then stop being written, so they
+// don't bounce between cpus
+//
+static void tlfu_access(bc_part_t *bcp, uint64_t key) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    bc_sketch_t *sk = __atomic_load_n(&t->t_sk, __ATOMIC_ACQUIRE);
+    uint64_t h = tlfu_hash(key);
+    uint8_t *c[BC_TLFU_DEPTH], n[BC_TLFU_DEPTH], min = BC_TLFU_CMAX;
+    bool added = false;
+    
+    for (int i = 0; i < BC_TLFU_DEPTH; i++) {
+        c[i] = tlfu_counter(sk, h, i);
+        n[i] = __atomic_load_n(c[i], __ATOMIC_RELAXED);
+        if (n[i] < min)
+            min = n[i];
+    }
+    if (min == BC_TLFU_CMAX)
+        return;
+    
+    for (int i = 0; i < BC_TLFU_DEPTH; i++) {
+        if (n[i] == min)
+            added |= __atomic_compare_exchange_n(c[i], &n[i], min + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (added)
+        __atomic_add_fetch(&sk->sk_adds, 1, __ATOMIC_RELAXED);
+}
+
+static void tlfu_insert(bc_part_t *bcp, blk_t *b) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    
+    tlfu_link(t, b, BC_TLFU_WINDOW, false);
+    
+    // until the main cache fills up, the window's overflow goes straight in
+    while ((t->t_nwin > t->t_winmax) && (t->t_nprob + t->t_nprot < t->t_mainmax))
+        tlfu_move(t, TAILQ_FIRST(&t->t_win), BC_TLFU_PROBATION);
+}
+
+static void tlfu_failed(bc_part_t *bcp, blk_t *b) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    // nothing worth keeping. reuse it first
+    tlfu_unlink(t, b);
+    tlfu_link(t, b, BC_TLFU_WINDOW, true);
+}
+
+//
+// the main cache's victim: the oldest block on probation, promoting the ones
+// that have been hit since they got there on the way. if everything on
+// probation is in use, protected gives up its oldest
+//
+static blk_t *tlfu_main_victim(bc_tlfu_t *t) {
+    blk_t *b, *bnext, *last = TAILQ_LAST(&t->t_prob, blk_tailq);
+    bool done = false;
+    
+    for (b = TAILQ_FIRST(&t->t_prob); b && !done; b = bnext) {
+        bnext = TAILQ_NEXT(b, bl_pl_link);
+        done = (b == last);
+        if (bl_untouch(b)) {
+            tlfu_move(t, b, BC_TLFU_PROTECTED);
+            tlfu_demote(t);
+            continue;
+        }
+        if (bl_evictable(b))
+            return b;
+    }
+    
+    return bpo_clock_victim(&t->t_prot, &t->t_laps);
+}
+
+static blk_t *tlfu_victim(bc_part_t *bcp) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    blk_t *cand = NULL, *b;
+    
+    tlfu_age(t);
+    
+    // the block we're making room for is going on the window too
+    if (t->t_nwin >= t->t_winmax)
+        cand = bpo_clock_victim(&t->t_win, &t->t_laps);
+    b = tlfu_main_victim(t);
+    
+    if (cand && b) {
+        // the window's candidate has to have been asked for more often than the block it would replace
+        if (tlfu_estimate(t, bl_key(cand)) <= tlfu_estimate(t, bl_key(b)))
+            return cand;
+        tlfu_move(t, cand, BC_TLFU_PROBATION);
+        BC_STAT_INC(bcp->bcp_bc, bcs_admissions);
+        return b;
+    }
+    if (!cand && !b)
+        cand = bpo_clock_victim(&t->t_win, &t->t_laps);
+    
+    return cand ? cand : b;
+}
+
+static void tlfu_remove(bc_part_t *bcp, blk_t *b) {
+    tlfu_unlink((bc_tlfu_t *)bcp->bcp_policy_data, b);
+}
+
+static void tlfu_evict(bc_part_t *bcp, blk_t *b) {
+    tlfu_remove(bcp, b);
+    if ((b->bl_pstate == BC_TLFU_WINDOW) && !(b->bl_flags & B_ERROR))
+        BC_STAT_INC(bcp->bcp_bc, bcs_rejections);
+}
+
+static void tlfu_dump(bc_part_t *bcp) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    blk_t *b;
+    printf("t_winmax: %" PRIu32 " t_mainmax: %" PRIu32 " t_protmax: %" PRIu32 " t_sample: %" PRIu32 " "
+            "sk_width: %" PRIu32 " sk_adds: %" PRIu32 " t_ages: %" PRIu64 " t_laps: %" PRIu64 "\n", t->t_winmax,
+            t->t_mainmax, t->t_protmax, t->t_sample, t->t_sk->sk_mask + 1, t->t_sk->sk_adds, t->t_ages, t->t_laps);
+    printf("t_win (%" PRIu32 "): ", t->t_nwin);
+    TAILQ_FOREACH(b, &t->t_win, bl_pl_link)
+        printf(" %" PRIu64 "/%" PRIu32 "%s", b->bl_blkno, tlfu_estimate(t, bl_key(b)), b->bl_ref ? "*" : "");
+    printf("\n");
+    printf("t_prob (%" PRIu32 "): ", t->t_nprob);
+    TAILQ_FOREACH(b, &t->t_prob, bl_pl_link)
+        printf(" %" PRIu64 "/%" PRIu32 "%s", b->bl_blkno, tlfu_estimate(t, bl_key(b)), b->bl_ref ? "*" : "");
+    printf("\n");
+    printf("t_prot (%" PRIu32 "): ", t->t_nprot);
+    TAILQ_FOREACH(b, &t->t_prot, bl_pl_link)
+        printf(" %" PRIu64 "/%" PRIu32 "%s", b->bl_blkno, tlfu_estimate(t, bl_key(b)), b->bl_ref ? "*" : "");
+    printf("\n");
+}
+
+static void tlfu_check(bc_part_t *bcp) {
+    bc_tlfu_t *t = (bc_tlfu_t *)bcp->bcp_policy_data;
+    uint32_t nwin = 0, nprob = 0, nprot = 0, nblocks = 0;
+    blk_t *b;
+    
+    TAILQ_FOREACH(b, &t->t_win, bl_pl_link) {
+        assert(b->bl_pstate == BC_TLFU_WINDOW);
+        nwin++;
+    }
+    TAILQ_FOREACH(b, &t->t_prob, bl_pl_link) {
+        assert(b->bl_pstate == BC_TLFU_PROBATION);
+        nprob++;
+    }
+    TAILQ_FOREACH(b, &t->t_prot, bl_pl_link) {
+        assert(b->bl_pstate == BC_TLFU_PROTECTED);
+        nprot++;
+    }
+    assert(nwin == t->t_nwin && nprob == t->t_nprob && nprot == t->t_nprot);
+    assert(nprot <= t->t_protmax);
+    
+    for (int i = 0; i < bcp->bcp_htsz; i++) {
+        LIST_FOREACH(b, &bcp->bcp_ht[i], bl_ht_link) {
+            if (!(b->bl_flags & B_PINNED))
+                nblocks++;
+        }
+    }
+    assert(nblocks == nwin + nprob + nprot);
+    assert(t->t_sk->sk_mask + 1 >= 16);
+}
+
+bc_policy_t bc_policy_tinylfu = {
+    .bpo_name = "tinylfu",
+    .bpo_init = tlfu_init,
+    .bpo_destroy = tlfu_destroy,
+    .bpo_insert = tlfu_insert,
+    .bpo_failed = tlfu_failed,
+    .bpo_victim = tlfu_victim,
+    .bpo_evict = tlfu_evict,
+    .bpo_remove = tlfu_remove,
+    .bpo_resize = tlfu_resize,
+    .bpo_access = tlfu_access,
+    .bpo_dump = tlfu_dump,
+    .bpo_check = tlfu_check
+};
+
+//
+// I/O backends:
+//
+
+//
+// pread/pwrite: one preadv/pwritev per request, one after the other
+//
+
+static int bio_pread_init(bcache_t *bc) {
+    bc->bc_io_data = NULL;
+    return 0;
+}
+
+static void bio_pread_destroy(bcache_t *bc) {
+    return;
+}
+
+static void bio_pread_rw(bcache_t *bc, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    bc_ioreq_t *req;
+    
+    for (uint32_t i = 0; i < nreqs; i++) {
+        req = &reqs[i];
+        if (op == BC_IO_READ)
+            req->bior_res = preadv(req->bior_file->bf_fd, req->bior_iov, req->bior_iovcnt, req->bior_off);
+        else
+            req->bior_res = pwritev(req->bior_file->bf_fd, req->bior_iov, req->bior_iovcnt, req->bior_off);
+        if (req->bior_res < 0)
+            req->bior_res = -errno;
+    }
+}
+
+bc_io_t bc_io_pread = {
+    .bio_name = "pread",
+    .bio_init = bio_pread_init,
+    .bio_destroy = bio_pread_destroy,
+    .bio_rw = bio_pread_rw
+};
+
+//
+// io_uring: a batch of requests goes into the submission queue with a single
+// io_uring_enter, and the kernel works on all of them at once. the ring is
+// shared by every thread using the cache. u_lock protects both queues; whoever
+// holds it reaps all the completions that are there, including other threads',
+// and hands each result back to its request. this talks to the kernel directly
+// (no liburing) so it only needs the kernel headers
+//
+
+#ifdef __linux__
+
+typedef struct bc_uring {
+    lock_t *u_lock;
+    int u_fd;
+    uint32_t u_features;
+    uint32_t u_inflight; // submitted but not yet reaped
+    uint32_t u_sq_entries;
+    uint32_t u_cq_entries;
+    void *u_sq_ring;
+    size_t u_sq_ring_sz;
+    void *u_cq_ring;
+    size_t u_cq_ring_sz;
+    struct io_uring_sqe *u_sqes;
+    size_t u_sqes_sz;
+    unsigned *u_sq_head;
+    unsigned *u_sq_tail;
+    unsigned *u_sq_mask;
+    unsigned *u_sq_array;
+    unsigned *u_cq_head;
+    unsigned *u_cq_tail;
+    unsigned *u_cq_mask;
+    struct io_uring_cqe *u_cqes;
+} bc_uring_t;
+
+// submit *nqueued sqes. on failure, *nqueued is left at the number the kernel didn't take
+static int bc_uring_submit(bc_uring_t *u, uint32_t *nqueued) {
+    int ret;
+    
+    while (*nqueued) {
+        ret = (int)syscall(__NR_io_uring_enter, u->u_fd, *nqueued, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (ret == 0)
+            return EAGAIN;
+        *nqueued -= ret;
+    }
+    
+    return 0;
+}
+
+static void bio_uring_destroy(bcache_t *bc) {
+    bc_uring_t *u = (bc_uring_t *)bc->bc_io_data;
+    
+    if (!u)
+        return;
+    
+    if (u->u_sqes)
+        munmap(u->u_sqes, u->u_sqes_sz);
+    if (u->u_cq_ring && (u->u_cq_ring != u->u_sq_ring))
+        munmap(u->u_cq_ring, u->u_cq_ring_sz);
+    if (u->u_sq_ring)
+        munmap(u->u_sq_ring, u->u_sq_ring_sz);
+    if (u->u_fd >= 0)
+        close(u->u_fd);
+    if (u->u_lock)
+        lock_destroy(u->u_lock);
+    free(u);
+    
+    bc->bc_io_data = NULL;
+}
+
+static int bio_uring_init(bcache_t *bc) {
+    struct io_uring_params p;
+    bc_uring_t *u;
+    uint8_t *sq, *cq;
+    int err;
+    
+    u = malloc(sizeof(bc_uring_t));
+    if (!u)
+        return ENOMEM;
+    
+    memset(u, 0, sizeof(bc_uring_t));
+    u->u_fd = -1;
+    bc->bc_io_data = u;
+    
+    u->u_lock = lock_create();
+    if (!u->u_lock) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    memset(&p, 0, sizeof(struct io_uring_params));
+    u->u_fd = (int)syscall(__NR_io_uring_setup, BC_URING_DEPTH, &p);
+    if (u->u_fd < 0) { // ENOSYS if the kernel doesn't have it, EPERM if it's been turned off
+        err = errno;
+        goto error_out;
+    }
+    
+    u->u_features = p.features;
+    u->u_sq_entries = p.sq_entries;
+    u->u_cq_entries = p.cq_entries;
+    
+    u->u_sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->u_cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->u_cq_ring_sz > u->u_sq_ring_sz)
+            u->u_sq_ring_sz = u->u_cq_ring_sz;
+        u->u_cq_ring_sz = u->u_sq_ring_sz;
+    }
+    
+    sq = mmap(NULL, u->u_sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->u_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        err = errno;
+        goto error_out;
+    }
+    u->u_sq_ring = sq;
+    
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, u->u_cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->u_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            err = errno;
+            goto error_out;
+        }
+    }
+    u->u_cq_ring = cq;
+    
+    u->u_sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->u_sqes = mmap(NULL, u->u_sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->u_fd, IORING_OFF_SQES);
+    if (u->u_sqes == MAP_FAILED) {
+        u->u_sqes = NULL;
+        err = errno;
+        goto error_out;
+    }
+    
+    u->u_sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->u_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->u_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->u_sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->u_cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->u_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->u_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->u_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    
+    return 0;
+    
+error_out:
+    bio_uring_destroy(bc);
+    
+    return err;
+}
+
+// hand back every completion that's there. u_lock must be held
+static void bc_uring_reap(bc_uring_t *u) {
+    struct io_uring_cqe *cqe;
+    bc_ioreq_t *req;
+    unsigned head, tail;
+    
+    head = *u->u_cq_head;
+    tail = __atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE);
+    
+    while (head != tail) {
+        cqe = &u->u_cqes[head & *u->u_cq_mask];
+        req = (bc_ioreq_t *)(uintptr_t)cqe->user_data;
+        req->bior_res = cqe->res;
+        __atomic_fetch_sub(req->bior_npending, 1, __ATOMIC_RELEASE);
+        u->u_inflight--;
+        head++;
+    }
+    
+    __atomic_store_n(u->u_cq_head, head, __ATOMIC_RELEASE);
+}
+
+//
+// wait (briefly) for completions without u_lock held. someone else may reap
+// the ones we're after, so this only waits so long before checking again
+//
+static void bc_uring_wait(bc_uring_t *u) {
+#ifdef IORING_FEAT_EXT_ARG
+    struct __kernel_timespec ts = { 0, BC_URING_WAIT * 1000 };
+    struct io_uring_getevents_arg arg;
+    
+    if (u->u_features & IORING_FEAT_EXT_ARG) {
+        memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        syscall(__NR_io_uring_enter, u->u_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(struct io_uring_getevents_arg));
+        return;
+    }
+#endif
+    sched_yield();
+}
+
+static void bio_uring_rw(bcache_t *bc, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    bc_uring_t *u = (bc_uring_t *)bc->bc_io_data;
+    struct io_uring_sqe *sqe;
+    uint32_t npending = nreqs, nqueued = 0, i = 0;
+    unsigned tail;
+    int err = 0;
+    
+    lock_lock(u->u_lock);
+    
+    while (i < nreqs) {
+        tail = *u->u_sq_tail;
+        if ((tail - __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE) == u->u_sq_entries) ||
+            (u->u_inflight == u->u_cq_entries)) {
+            //
+            // no room. submit what we have so far, and make room on the
+            // completion queue if it could overflow
+            //
+            err = bc_uring_submit(u, &nqueued);
+            if (err)
+                break;
+            bc_uring_reap(u);
+            if (u->u_inflight == u->u_cq_entries) {
+                lock_unlock(u->u_lock);
+                bc_uring_wait(u);
+                lock_lock(u->u_lock);
+            }
+            continue;
+        }
+        
+        sqe = &u->u_sqes[tail & *u->u_sq_mask];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = (op == BC_IO_READ) ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = reqs[i].bior_file->bf_fd;
+        sqe->off = reqs[i].bior_off;
+        sqe->addr = (uint64_t)(uintptr_t)reqs[i].bior_iov;
+        sqe->len = reqs[i].bior_iovcnt;
+        sqe->user_data = (uint64_t)(uintptr_t)&reqs[i];
+        reqs[i].bior_npending = &npending;
+        u->u_sq_array[tail & *u->u_sq_mask] = tail & *u->u_sq_mask;
+        __atomic_store_n(u->u_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        u->u_inflight++;
+        nqueued++;
+        i++;
+    }
+    
+    if (!err)
+        err = bc_uring_submit(u, &nqueued);
+    
+    if (err) {
+        //
+        // the kernel wouldn't take the rest. take back what it didn't
+        // take, fail those requests here and wait for the rest
+        //
+        __atomic_store_n(u->u_sq_tail, *u->u_sq_tail - nqueued, __ATOMIC_RELEASE);
+        u->u_inflight -= nqueued;
+        for (uint32_t j = i - nqueued; j < nreqs; j++) {
+            reqs[j].bior_res = -err;
+            npending--;
+        }
+    }
+    
+    while (1) {
+        bc_uring_reap(u);
+        if (__atomic_load_n(&npending, __ATOMIC_ACQUIRE) == 0)
+            break;
+        lock_unlock(u->u_lock);
+        bc_uring_wait(u);
+        lock_lock(u->u_lock);
+    }
+    
+    lock_unlock(u->u_lock);
+}
+
+#else // !__linux__
+
+static int bio_uring_init(bcache_t *bc) {
+    return ENOTSUP;
+}
+
+static void bio_uring_destroy(bcache_t *bc) {
+    return;
+}
+
+static void bio_uring_rw(bcache_t *bc, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    for (uint32_t i = 0; i < nreqs; i++)
+        reqs[i].bior_res = -ENOTSUP;
+}
+
+#endif // __linux__
+
+bc_io_t bc_io_uring = {
+    .bio_name = "io_uring",
+    .bio_init = bio_uring_init,
+    .bio_destroy = bio_uring_destroy,
+    .bio_rw = bio_uring_rw
+};
+
+//
+// O_DIRECT:
+//  reads and writes have to start and end on bf_dioalign boundaries, to and
+//  from memory aligned the same way. arena frames are, as long as the block
+//  size is a multiple of it. when it isn't (say 512 byte blocks on a disk with
+//  4k sectors) all of the file's I/O goes through bf_bounce instead, a block at
+//  a time and under bf_bounce_lock: reads read in the sectors around the block
+//  and writes read-modify-write them
+//
+
+static uint32_t bc_dio_align(int fd) {
+#ifdef __linux__
+    struct stat st;
+    int ssz;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    
+    if ((statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0) && (stx.stx_mask & STATX_DIOALIGN) &&
+        stx.stx_dio_offset_align) {
+        if (stx.stx_dio_mem_align > stx.stx_dio_offset_align)
+            return stx.stx_dio_mem_align;
+        return stx.stx_dio_offset_align;
+    }
+#endif
+    if ((fstat(fd, &st) == 0) && S_ISBLK(st.st_mode) && (ioctl(fd, BLKSSZGET, &ssz) == 0) && (ssz > 0))
+        return (uint32_t)ssz;
+#endif
+    return BC_DIO_ALIGN_DEF;
+}
+
+//
+// open the backing file, O_DIRECT if asked to and the file system lets us
+//
+static int bc_open(bc_file_t *bf, char *path, bool direct) {
+#ifdef O_DIRECT
+    if (direct) {
+        bf->bf_fd = open(path, O_RDWR | O_DIRECT);
+        if (bf->bf_fd >= 0) {
+            bf->bf_direct = true;
+            bf->bf_dioalign = bc_dio_align(bf->bf_fd);
+            return 0;
+        }
+        if (errno != EINVAL)
+            return errno;
+        // e.g. tmpfs on older kernels. fall back to buffered I/O
+    }
+#endif
+    bf->bf_fd = open(path, O_RDWR);
+    if (bf->bf_fd < 0)
+        return errno;
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    // no alignment requirements here
+    if (direct && (fcntl(bf->bf_fd, F_NOCACHE, 1) == 0))
+        bf->bf_direct = true;
+#endif
+    
+    return 0;
+}
+
+static ssize_t bc_bounce_block(bc_file_t *bf, int op, uint8_t *buf, size_t len, off_t off) {
+    uint8_t *bounce = bf->bf_bounce;
+    off_t start, end, eof;
+    size_t skip;
+    ssize_t n;
+    
+    start = off - (off % bf->bf_dioalign);
+    end = BC_ROUND_UP(off + (off_t)len, bf->bf_dioalign);
+    skip = off - start;
+    
+    n = pread(bf->bf_fd, bounce, end - start, start);
+    if (n < 0)
+        return -errno;
+    
+    if (op == BC_IO_READ) {
+        if (n <= skip)
+            return 0;
+        n -= skip;
+        if (n > len)
+            n = len;
+        memcpy(buf, bounce + skip, n);
+        return n;
+    }
+    
+    eof = start + n;
+    memset(bounce + n, 0, (end - start) - n);
+    memcpy(bounce + skip, buf, len);
+    
+    n = pwrite(bf->bf_fd, bounce, end - start, start);
+    if (n < 0)
+        return -errno;
+    if (n < end - start) {
+        if (n <= skip)
+            return 0;
+        return (n - skip > len) ? len : n - skip;
+    }
+    
+    // don't leave the file padded out to the end of the sector
+    if ((end > eof) && (end > off + (off_t)len)) {
+        if (ftruncate(bf->bf_fd, (eof > off + (off_t)len) ? eof : off + (off_t)len))
+            return -errno;
+    }
+    
+    return len;
+}
+
+static void bc_bounce_rw(bc_file_t *bf, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    bc_ioreq_t *req;
+    struct iovec *iov;
+    off_t off;
+    ssize_t n;
+    
+    lock_lock(bf->bf_bounce_lock);
+    for (uint32_t i = 0; i < nreqs; i++) {
+        req = &reqs[i];
+        req->bior_res = 0;
+        off = req->bior_off;
+        for (int c = 0; c < req->bior_iovcnt; c++) {
+            iov = &req->bior_iov[c];
+            n = bc_bounce_block(bf, op, iov->iov_base, iov->iov_len, off);
+            if (n < 0) {
+                if (req->bior_res == 0)
+                    req->bior_res = n;
+                break;
+            }
+            req->bior_res += n;
+            off += n;
+            if (n < iov->iov_len)
+                break;
+        }
+    }
+    lock_unlock(bf->bf_bounce_lock);
+}
+
+//
+// BC_MMAP:
+//  each file is mapped shared and a block's bl_phys points straight into
+//  the mapping, so 'loading' a block is just pointing it at its blkno and the
+//  page cache does the reading. blk_ts, refcounts, the replacement policy and
+//  dirty lists work as usual. writing a block out is an msync of its range,
+//  and evicting one gives its pages back with MADV_DONTNEED
+//
+
+static int bc_map(bcache_t *bc, bc_file_t *bf) {
+    struct stat st;
+    void *map;
+    
+    if (fstat(bf->bf_fd, &st))
+        return errno;
+    if (st.st_size < bc->bc_blksz) {
+        printf("bc_map: file is smaller than a block\n");
+        return EINVAL;
+    }
+    
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, bf->bf_fd, 0);
+    if (map == MAP_FAILED) {
+        printf("bc_map: couldn't map %lld bytes: %s\n", (long long)st.st_size, strerror(errno));
+        return errno;
+    }
+    // the cache decides what's worth keeping. don't read ahead for it
+    madvise(map, st.st_size, MADV_RANDOM);
+    
+    bf->bf_map = map;
+    bf->bf_mapsz = st.st_size;
+    
+    return 0;
+}
+
+//
+// madvise [blkno, blkno + count). MADV_DONTNEED only covers pages that lie
+// entirely within the range, in case the blocks around it are still cached
+//
+static void bc_madvise(bcache_t *bc, bc_file_t *bf, uint64_t blkno, uint32_t count, int advice) {
+    uintptr_t pgsz = sysconf(_SC_PAGESIZE), start, end;
+    
+    if (blkno * bc->bc_blksz >= bf->bf_mapsz)
+        return;
+    start = (uintptr_t)bf->bf_map + blkno * bc->bc_blksz;
+    end = start + (uintptr_t)count * bc->bc_blksz;
+    if (end > (uintptr_t)bf->bf_map + bf->bf_mapsz)
+        end = (uintptr_t)bf->bf_map + bf->bf_mapsz;
+    
+    if (advice == MADV_DONTNEED) {
+        start = BC_ROUND_UP(start, pgsz);
+        end -= end % pgsz;
+    } else
+        start -= start % pgsz;
+    if (start < end)
+        madvise((void *)start, end - start, advice);
+}
+
+static void bc_msync_rw(bcache_t *bc, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    uintptr_t pgsz = sysconf(_SC_PAGESIZE), start;
+    bc_ioreq_t *req;
+    size_t len;
+    
+    assert(op == BC_IO_WRITE); // reads never get this far
+    
+    for (uint32_t i = 0; i < nreqs; i++) {
+        req = &reqs[i];
+        assert(req->bior_iov[0].iov_base == req->bior_file->bf_map + req->bior_off);
+        len = 0;
+        for (int c = 0; c < req->bior_iovcnt; c++)
+            len += req->bior_iov[c].iov_len;
+        start = (uintptr_t)req->bior_file->bf_map + req->bior_off;
+        if (msync((void *)(start - start % pgsz), len + start % pgsz, MS_SYNC))
+            req->bior_res = -errno;
+        else
+            req->bior_res = len;
+    }
+}
+
+//
+// compressed files (see bcache.h). compressing a block, allocating an extent
+// for it and writing it out all happen with the block's I/O, in bc_rw, so the
+// cache itself never knows. a block is compressed (or decompressed) outside of
+// cm_lock, which is only held to look up or change the map and bitmaps
+//
+
+//
+// the codec: LZ77 in the spirit of LZ4. the output is a run of sequences,
+// each a token byte whose high nibble is the number of literals that follow
+// it and whose low nibble is the length of the match after them, less
+// BC_LZ_MINMATCH. a nibble of 15 means the length carries on in the bytes
+// after the token (or after the literals, for the match), 255 at a time. the
+// literals come next, then a 2 byte little endian offset back to the match.
+// the last sequence is just literals
+//
+#define BC_LZ_MINMATCH 4
+#define BC_LZ_HBITS 11
+#define BC_LZ_MAXOFF 65535
+
+static uint32_t bc_lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t bc_lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - BC_LZ_HBITS);
+}
+
+// the rest of a length that didn't fit in its nibble
+static uint8_t *bc_lz_putlen(uint8_t *op, uint8_t *oend, uint32_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op == oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op == oend)
+        return NULL;
+    *op++ = len;
+    
+    return op;
+}
+
+static const uint8_t *bc_lz_getlen(const uint8_t *ip, const uint8_t *iend, uint32_t *len) {
+    uint8_t c;
+    
+    do {
+        if (ip == iend)
+            return NULL;
+        c = *ip++;
+        *len += c;
+    } while (c == 255);
+    
+    return ip;
+}
+
+// one sequence. mlen is 0 for the last one
+static uint8_t *bc_lz_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit, uint32_t nlit, uint32_t off, uint32_t mlen) {
+    uint32_t ml = mlen ? mlen - BC_LZ_MINMATCH : 0;
+    uint8_t *token;
+    
+    if (op == oend)
+        return NULL;
+    token = op++;
+    *token = (((nlit < 15) ? nlit : 15) << 4) | ((ml < 15) ? ml : 15);
+    if ((nlit >= 15) && !(op = bc_lz_putlen(op, oend, nlit)))
+        return NULL;
+    if (oend - op < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+    
+    if (oend - op < 2)
+        return NULL;
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    if ((ml >= 15) && !(op = bc_lz_putlen(op, oend, ml)))
+        return NULL;
+    
+    return op;
+}
+
+//
+// compress len bytes of src into at most dstmax bytes of dst. returns the
+// compressed length, or 0 if it doesn't fit
+//
+static uint32_t bc_lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t dstmax) {
+    uint32_t ht[1 << BC_LZ_HBITS], ip = 0, anchor = 0, ref, h, mlen;
+    uint8_t *op = dst, *oend = dst + dstmax;
+    
+    memset(ht, 0xff, sizeof(ht));
+    while (ip + BC_LZ_MINMATCH <= len) {
+        h = bc_lz_hash(bc_lz_read32(src + ip));
+        ref = ht[h];
+        ht[h] = ip;
+        if ((ref == UINT32_MAX) || (ip - ref > BC_LZ_MAXOFF) || (bc_lz_read32(src + ref) != bc_lz_read32(src + ip))) {
+            ip++;
+            continue;
+        }
+        for (mlen = BC_LZ_MINMATCH; (ip + mlen < len) && (src[ref + mlen] == src[ip + mlen]); mlen++)
+            ;
+        op = bc_lz_emit(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!op)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    op = bc_lz_emit(op, oend, src + anchor, len - anchor, 0, 0);
+    
+    return op ? op - dst : 0;
+}
+
+//
+// decompress src into exactly dstlen bytes of dst. nothing in src is trusted:
+// anything that would read or write out of bounds is EIO
+//
+static int bc_lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t dstlen) {
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + dstlen, token;
+    uint32_t nlit, mlen, off;
+    
+    while (ip < iend) {
+        token = *ip++;
+        nlit = token >> 4;
+        if ((nlit == 15) && !(ip = bc_lz_getlen(ip, iend, &nlit)))
+            return EIO;
+        if ((iend - ip < nlit) || (oend - op < nlit))
+            return EIO;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            break;
+        
+        if (iend - ip < 2)
+            return EIO;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if ((mlen == 15) && !(ip = bc_lz_getlen(ip, iend, &mlen)))
+            return EIO;
+        mlen += BC_LZ_MINMATCH;
+        if (!off || (off > op - dst) || (oend - op < mlen))
+            return EIO;
+        // a byte at a time: the match can overlap what it's copying
+        for (uint32_t i = 0; i < mlen; i++, op++)
+            *op = *(op - off);
+    }
+    
+    return (op == oend) ? 0 : EIO;
+}
+
+// FNV-1a
+static uint32_t bc_csum(const void *p, size_t len) {
+    const uint8_t *bp = p;
+    uint32_t h = 2166136261U;
+    
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ bp[i]) * 16777619U;
+    
+    return h;
+}
+
+#define BC_CSECTS(len) (((uint64_t)(len) + BC_CSECT - 1) / BC_CSECT)
+#define BC_CRESERVED (BC_CDATA_START / BC_CSECT) // the header slots' sectors
+#define BC_CEXT_LEN(ce) ((ce).ce_len & ~BC_CEXT_RAW)
+
+static uint64_t bc_cmap_word(bc_cmap_t *cm, uint64_t w) {
+    uint64_t bits = cm->cm_used[w] | cm->cm_held[w];
+    if (w < cm->cm_nfreeing)
+        bits |= cm->cm_freeing[w];
+    return bits;
+}
+
+static bool bc_cmap_busy(bc_cmap_t *cm, uint64_t s) {
+    return bc_cmap_word(cm, s / 64) & (1ULL << (s % 64));
+}
+
+static void bc_cmap_mark(uint64_t *bits, uint64_t s, uint64_t n, bool set) {
+    for (; n; s++, n--) {
+        if (set)
+            bits[s / 64] |= 1ULL << (s % 64);
+        else
+            bits[s / 64] &= ~(1ULL << (s % 64));
+    }
+}
+
+// make room in the bitmaps for nsects sectors, and grow the file's size to them
+static int bc_cmap_grow(bc_cmap_t *cm, uint64_t nsects) {
+    uint64_t nwords = cm->cm_nwords, *used, *held;
+    
+    if (nsects > UINT32_MAX) // ce_sect is 32 bits
+        return EFBIG;
+    
+    while (nwords * 64 < nsects)
+        nwords = nwords ? nwords * 2 : 64;
+    if (nwords > cm->cm_nwords) {
+        used = realloc(cm->cm_used, nwords * sizeof(uint64_t));
+        if (!used)
+            return ENOMEM;
+        cm->cm_used = used;
+        held = realloc(cm->cm_held, nwords * sizeof(uint64_t));
+        if (!held)
+            return ENOMEM;
+        cm->cm_held = held;
+        memset(cm->cm_used + cm->cm_nwords, 0, (nwords - cm->cm_nwords) * sizeof(uint64_t));
+        memset(cm->cm_held + cm->cm_nwords, 0, (nwords - cm->cm_nwords) * sizeof(uint64_t));
+        cm->cm_nwords = nwords;
+    }
+    if (nsects > cm->cm_nsects)
+        cm->cm_nsects = nsects;
+    
+    return 0;
+}
+
+static int bc_cmap_grow_map(bc_cmap_t *cm, uint64_t nblocks) {
+    uint64_t maxblocks = cm->cm_maxblocks;
+    bc_cext_t *map;
+    
+    if (nblocks <= maxblocks)
+        return 0;
+    
+    while (maxblocks < nblocks)
+        maxblocks = maxblocks ? maxblocks * 2 : 64;
+    map = realloc(cm->cm_map, maxblocks * sizeof(bc_cext_t));
+    if (!map)
+        return ENOMEM;
+    memset(map + cm->cm_maxblocks, 0, (maxblocks - cm->cm_maxblocks) * sizeof(bc_cext_t));
+    cm->cm_map = map;
+    cm->cm_maxblocks = maxblocks;
+    
+    return 0;
+}
+
+//
+// n free sectors in a row, which are marked used. the search carries on from
+// where the last one left off, and the file grows if there's no room in it
+//
+static int bc_cmap_alloc(bc_cmap_t *cm, uint32_t n, uint64_t *sect) {
+    uint64_t s, start, end, run;
+    int err;
+    
+    for (int pass = 0; pass < 2; pass++) {
+        start = pass ? BC_CRESERVED : cm->cm_hint;
+        end = pass ? cm->cm_hint : cm->cm_nsects;
+        run = 0;
+        for (s = start; s < end; s++) {
+            if (!(s % 64) && (s + 64 <= end) && (bc_cmap_word(cm, s / 64) == UINT64_MAX)) {
+                run = 0;
+                s += 63;
+                continue;
+            }
+            if (bc_cmap_busy(cm, s)) {
+                run = 0;
+                continue;
+            }
+            if (++run == n) {
+                *sect = s + 1 - n;
+                goto found;
+            }
+        }
+    }
+    
+    // put them at the end of the file, along with any free sectors it ends with
+    for (s = cm->cm_nsects; (s > BC_CRESERVED) && !bc_cmap_busy(cm, s - 1); s--)
+        ;
+    err = bc_cmap_grow(cm, s + n);
+    if (err)
+        return err;
+    *sect = s;
+    
+found:
+    bc_cmap_mark(cm->cm_used, *sect, n, true);
+    cm->cm_hint = *sect + n;
+    
+    return 0;
+}
+
+// a block's old extent: the committed map might still refer to it
+static void bc_cmap_release(bc_cmap_t *cm, bc_cext_t ce) {
+    if (!BC_CEXT_LEN(ce))
+        return;
+    bc_cmap_mark(cm->cm_used, ce.ce_sect, BC_CSECTS(BC_CEXT_LEN(ce)), false);
+    bc_cmap_mark(cm->cm_held, ce.ce_sect, BC_CSECTS(BC_CEXT_LEN(ce)), true);
+}
+
+static void bc_cmap_free(bc_cmap_t *cm) {
+    if (cm->cm_lock)
+        lock_destroy(cm->cm_lock);
+    if (cm->cm_commit_lock)
+        lock_destroy(cm->cm_commit_lock);
+    if (cm->cm_map)
+        free(cm->cm_map);
+    if (cm->cm_used)
+        free(cm->cm_used);
+    if (cm->cm_held)
+        free(cm->cm_held);
+    free(cm);
+}
+
+// does path start with a compressed file header? an empty file is treated as one if flags has BC_COMPRESS
+static int bc_cfile_probe(const char *path, uint32_t flags, bool *compressed, bool *format) {
+    uint64_t magic;
+    struct stat st;
+    int fd, err = 0;
+    
+    *compressed = *format = false;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    if (fstat(fd, &st)) {
+        err = errno;
+        goto out;
+    }
+    if (st.st_size == 0) {
+        *compressed = *format = (flags & BC_COMPRESS) != 0;
+        goto out;
+    }
+    for (int i = 0; (i < 2) && !*compressed; i++) {
+        if ((pread(fd, &magic, sizeof(magic), i * BC_CHDR_SLOTSZ) == sizeof(magic)) && (magic == BC_CMAGIC))
+            *compressed = true;
+    }
+    
+out:
+    close(fd);
+    
+    return err;
+}
+
+static int bc_cfile_write_hdr(int fd, uint32_t blksz, uint64_t gen, uint64_t nblocks, bc_cext_t mapext, uint32_t map_sum) {
+    uint8_t slot[BC_CHDR_SLOTSZ];
+    bc_chdr_t *ch = (bc_chdr_t *)slot;
+    ssize_t n;
+    
+    memset(slot, 0, sizeof(slot));
+    ch->ch_magic = BC_CMAGIC;
+    ch->ch_version = BC_CVERSION;
+    ch->ch_blksz = blksz;
+    ch->ch_gen = gen;
+    ch->ch_nblocks = nblocks;
+    ch->ch_map_sect = mapext.ce_sect;
+    ch->ch_map_len = mapext.ce_len;
+    ch->ch_map_sum = map_sum;
+    ch->ch_sum = bc_csum(ch, offsetof(bc_chdr_t, ch_sum));
+    
+    n = pwrite(fd, slot, sizeof(slot), (gen % 2) * BC_CHDR_SLOTSZ);
+    if (n < 0)
+        return errno;
+    if (n != sizeof(slot))
+        return EIO;
+    
+    return 0;
+}
+
+//
+// read in the map the newest valid header points to, and work out which
+// sectors are in use from it. an empty file is set up first, if format
+//
+static int bc_cfile_open(bc_file_t *bf, uint32_t blksz, bool format) {
+    bc_chdr_t ch, best;
+    bc_cmap_t *cm;
+    struct stat st;
+    bc_cext_t ce;
+    bool found = false;
+    ssize_t n;
+    int err;
+    
+    if (format) {
+        memset(&ce, 0, sizeof(ce));
+        err = bc_cfile_write_hdr(bf->bf_fd, blksz, 0, 0, ce, bc_csum(NULL, 0));
+        if (err)
+            return err;
+        if (ftruncate(bf->bf_fd, BC_CDATA_START) || fdatasync(bf->bf_fd))
+            return errno;
+    }
+    
+    memset(&best, 0, sizeof(best));
+    for (int i = 0; i < 2; i++) {
+        n = pread(bf->bf_fd, &ch, sizeof(ch), i * BC_CHDR_SLOTSZ);
+        if ((n != sizeof(ch)) || (ch.ch_magic != BC_CMAGIC) || (ch.ch_sum != bc_csum(&ch, offsetof(bc_chdr_t, ch_sum))))
+            continue;
+        if (!found || (ch.ch_gen > best.ch_gen))
+            best = ch;
+        found = true;
+    }
+    if (!found) {
+        printf("bc_cfile_open: no valid header\n");
+        return EILSEQ;
+    }
+    if ((best.ch_version != BC_CVERSION) || (best.ch_blksz != blksz) ||
+        (best.ch_map_len != best.ch_nblocks * sizeof(bc_cext_t))) {
+        printf("bc_cfile_open: version %" PRIu32 " blksz %" PRIu32 " isn't what we expected\n", best.ch_version,
+               best.ch_blksz);
+        return EINVAL;
+    }
+    if (fstat(bf->bf_fd, &st))
+        return errno;
+    
+    cm = malloc(sizeof(bc_cmap_t));
+    if (!cm)
+        return ENOMEM;
+    memset(cm, 0, sizeof(bc_cmap_t));
+    cm->cm_blksz = blksz;
+    cm->cm_gen = best.ch_gen;
+    cm->cm_mapext.ce_sect = best.ch_map_sect;
+    cm->cm_mapext.ce_len = best.ch_map_len;
+    cm->cm_hint = BC_CRESERVED;
+    
+    cm->cm_lock = lock_create();
+    cm->cm_commit_lock = lock_create();
+    if (!cm->cm_lock || !cm->cm_commit_lock) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    err = bc_cmap_grow_map(cm, best.ch_nblocks);
+    if (err)
+        goto error_out;
+    cm->cm_nblocks = best.ch_nblocks;
+    err = bc_cmap_grow(cm, BC_CSECTS(st.st_size) > BC_CRESERVED ? BC_CSECTS(st.st_size) : BC_CRESERVED);
+    if (err)
+        goto error_out;
+    bc_cmap_mark(cm->cm_used, 0, BC_CRESERVED, true);
+    
+    if (best.ch_map_len) {
+        n = pread(bf->bf_fd, cm->cm_map, best.ch_map_len, (off_t)best.ch_map_sect * BC_CSECT);
+        if ((n != best.ch_map_len) || (bc_csum(cm->cm_map, best.ch_map_len) != best.ch_map_sum)) {
+            printf("bc_cfile_open: the map is damaged\n");
+            err = EILSEQ;
+            goto error_out;
+        }
+        bc_cmap_mark(cm->cm_used, cm->cm_mapext.ce_sect, BC_CSECTS(best.ch_map_len), true);
+    }
+    for (uint64_t i = 0; i < cm->cm_nblocks; i++) {
+        ce = cm->cm_map[i];
+        if (!BC_CEXT_LEN(ce))
+            continue;
+        if ((ce.ce_sect < BC_CRESERVED) || (ce.ce_sect + BC_CSECTS(BC_CEXT_LEN(ce)) > cm->cm_nsects) ||
+            (BC_CEXT_LEN(ce) > blksz)) {
+            printf("bc_cfile_open: blkno %" PRIu64 "'s extent is bad\n", i);
+            err = EILSEQ;
+            goto error_out;
+        }
+        bc_cmap_mark(cm->cm_used, ce.ce_sect, BC_CSECTS(BC_CEXT_LEN(ce)), true);
+    }
+    
+    bf->bf_cmap = cm;
+    
+    return 0;
+    
+error_out:
+    bc_cmap_free(cm);
+    
+    return err;
+}
+
+//
+// the extent is looked up and then read without cm_lock. that's safe because
+// the cache never reads a block in while it's writing it out
+//
+static int bc_cfile_read(bc_file_t *bf, uint64_t blkno, uint8_t *buf, uint8_t *scratch, uint64_t *nbytes) {
+    bc_cmap_t *cm = bf->bf_cmap;
+    bc_cext_t ce;
+    uint32_t len;
+    ssize_t n;
+    
+    memset(&ce, 0, sizeof(ce));
+    lock_lock(cm->cm_lock);
+    if (blkno < cm->cm_nblocks)
+        ce = cm->cm_map[blkno];
+    lock_unlock(cm->cm_lock);
+    
+    len = BC_CEXT_LEN(ce);
+    if (!len) { // never written
+        memset(buf, 0, cm->cm_blksz);
+        return 0;
+    }
+    
+    n = pread(bf->bf_fd, (ce.ce_len & BC_CEXT_RAW) ? buf : scratch, len, (off_t)ce.ce_sect * BC_CSECT);
+    if (n < 0)
+        return errno;
+    if (n != len)
+        return EIO;
+    *nbytes += len;
+    
+    if (ce.ce_len & BC_CEXT_RAW)
+        return (len == cm->cm_blksz) ? 0 : EIO;
+    
+    return bc_lz_decompress(scratch, len, buf, cm->cm_blksz);
+}
+
+//
+// write blkno out to a new extent. blocks that wouldn't save a sector by being
+// compressed are stored as they are
+//
+static int bc_cfile_write(bc_file_t *bf, uint64_t blkno, uint8_t *buf, uint8_t *scratch, uint64_t *nbytes) {
+    bc_cmap_t *cm = bf->bf_cmap;
+    uint8_t *data = scratch;
+    uint64_t sect;
+    bc_cext_t ce;
+    uint32_t len;
+    ssize_t n;
+    int err;
+    
+    len = bc_lz_compress(buf, cm->cm_blksz, scratch, cm->cm_blksz);
+    ce.ce_len = len;
+    if (!len || (BC_CSECTS(len) >= BC_CSECTS(cm->cm_blksz))) {
+        data = buf;
+        len = cm->cm_blksz;
+        ce.ce_len = len | BC_CEXT_RAW;
+    }
+    
+    lock_lock(cm->cm_lock);
+    err = bc_cmap_grow_map(cm, blkno + 1);
+    if (!err)
+        err = bc_cmap_alloc(cm, BC_CSECTS(len), &sect);
+    lock_unlock(cm->cm_lock);
+    if (err)
+        return err;
+    ce.ce_sect = sect;
+    
+    n = pwrite(bf->bf_fd, data, len, (off_t)sect * BC_CSECT);
+    err = (n < 0) ? errno : ((n != len) ? EIO : 0);
+    
+    lock_lock(cm->cm_lock);
+    if (err) {
+        bc_cmap_mark(cm->cm_used, sect, BC_CSECTS(len), false);
+    } else {
+        if (blkno < cm->cm_nblocks)
+            bc_cmap_release(cm, cm->cm_map[blkno]);
+        else
+            cm->cm_nblocks = blkno + 1;
+        cm->cm_map[blkno] = ce;
+        cm->cm_dirty = true;
+    }
+    lock_unlock(cm->cm_lock);
+    
+    if (!err)
+        *nbytes += len;
+    
+    return err;
+}
+
+//
+// a batch of requests for a compressed file, a block at a time. returns the
+// bytes actually read or written
+//
+static uint64_t bc_cfile_rw(bc_file_t *bf, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    bc_cmap_t *cm = bf->bf_cmap;
+    uint64_t nbytes = 0, blkno;
+    uint8_t *scratch;
+    bc_ioreq_t *req;
+    int err;
+    
+    scratch = malloc(cm->cm_blksz);
+    
+    for (uint32_t i = 0; i < nreqs; i++) {
+        req = &reqs[i];
+        req->bior_res = 0;
+        if (!scratch) {
+            req->bior_res = -ENOMEM;
+            continue;
+        }
+        assert((req->bior_off % cm->cm_blksz) == 0);
+        blkno = req->bior_off / cm->cm_blksz;
+        for (int c = 0; c < req->bior_iovcnt; c++, blkno++) {
+            assert(req->bior_iov[c].iov_len == cm->cm_blksz);
+            if (op == BC_IO_READ)
+                err = bc_cfile_read(bf, blkno, req->bior_iov[c].iov_base, scratch, &nbytes);
+            else
+                err = bc_cfile_write(bf, blkno, req->bior_iov[c].iov_base, scratch, &nbytes);
+            if (err) {
+                if (req->bior_res == 0)
+                    req->bior_res = -err;
+                break;
+            }
+            req->bior_res += cm->cm_blksz;
+        }
+    }
+    
+    if (scratch)
+        free(scratch);
+    
+    return nbytes;
+}
+
+//
+// make everything written so far durable: the blocks' extents and a copy of
+// the map go out and are synced, then the other header slot is pointed at the
+// new map and synced. extents only the old map referred to are free after
+// that, and the file is truncated to what's still in use. writes carry on
+// while this is going; blocks they replace are held until the next commit.
+// adds the bytes written to *nbytes
+//
+static int bc_cfile_commit(bc_file_t *bf, uint64_t *nbytes) {
+    bc_cmap_t *cm = bf->bf_cmap;
+    uint64_t *freeing = NULL, nblocks, gen, mapsect = 0, s;
+    bc_cext_t *map = NULL, mapext;
+    uint32_t maplen;
+    ssize_t n;
+    int err = 0;
+    
+    lock_lock(cm->cm_commit_lock);
+    lock_lock(cm->cm_lock);
+    
+    if (!cm->cm_dirty) { // no new extents, and nothing to free
+        lock_unlock(cm->cm_lock);
+        if (fdatasync(bf->bf_fd))
+            err = errno;
+        goto out;
+    }
+    
+    nblocks = cm->cm_nblocks;
+    maplen = nblocks * sizeof(bc_cext_t);
+    map = malloc(maplen);
+    freeing = malloc(cm->cm_nwords * sizeof(uint64_t));
+    if (!map || !freeing) {
+        lock_unlock(cm->cm_lock);
+        err = ENOMEM;
+        goto out;
+    }
+    err = bc_cmap_alloc(cm, BC_CSECTS(maplen), &mapsect);
+    if (err) {
+        lock_unlock(cm->cm_lock);
+        goto out;
+    }
+    memcpy(map, cm->cm_map, maplen);
+    mapext.ce_sect = mapsect;
+    mapext.ce_len = maplen;
+    
+    // what's held now (and the old map) can go once the new map is committed
+    memcpy(freeing, cm->cm_held, cm->cm_nwords * sizeof(uint64_t));
+    memset(cm->cm_held, 0, cm->cm_nwords * sizeof(uint64_t));
+    if (cm->cm_mapext.ce_len) {
+        bc_cmap_mark(cm->cm_used, cm->cm_mapext.ce_sect, BC_CSECTS(cm->cm_mapext.ce_len), false);
+        bc_cmap_mark(freeing, cm->cm_mapext.ce_sect, BC_CSECTS(cm->cm_mapext.ce_len), true);
+    }
+    cm->cm_freeing = freeing;
+    cm->cm_nfreeing = cm->cm_nwords;
+    cm->cm_dirty = false;
+    gen = cm->cm_gen + 1;
+    
+    lock_unlock(cm->cm_lock);
+    
+    n = pwrite(bf->bf_fd, map, maplen, (off_t)mapsect * BC_CSECT);
+    if (n != maplen) {
+        err = (n < 0) ? errno : EIO;
+        goto undo;
+    }
+    *nbytes += maplen;
+    if (fdatasync(bf->bf_fd)) {
+        err = errno;
+        goto undo;
+    }
+    
+    err = bc_cfile_write_hdr(bf->bf_fd, cm->cm_blksz, gen, nblocks, mapext, bc_csum(map, maplen));
+    if (err)
+        goto undo;
+    *nbytes += BC_CHDR_SLOTSZ;
+    if (fdatasync(bf->bf_fd)) {
+        err = errno;
+        goto undo;
+    }
+    
+    lock_lock(cm->cm_lock);
+    cm->cm_gen = gen;
+    cm->cm_mapext = mapext;
+    cm->cm_freeing = NULL;
+    cm->cm_nfreeing = 0;
+    // give back the end of the file, if nothing's using it any more
+    for (s = cm->cm_nsects; (s > BC_CRESERVED) && !bc_cmap_busy(cm, s - 1); s--)
+        ;
+    if ((s < cm->cm_nsects) && (ftruncate(bf->bf_fd, (off_t)s * BC_CSECT) == 0)) {
+        cm->cm_nsects = s;
+        if (cm->cm_hint > s)
+            cm->cm_hint = s;
+    }
+    lock_unlock(cm->cm_lock);
+    goto out;
+    
+undo:
+    // the old map is still the committed one, so nothing it refers to can go
+    lock_lock(cm->cm_lock);
+    for (uint64_t w = 0; w < cm->cm_nfreeing; w++)
+        cm->cm_held[w] |= freeing[w];
+    cm->cm_freeing = NULL;
+    cm->cm_nfreeing = 0;
+    if (cm->cm_mapext.ce_len) {
+        bc_cmap_mark(cm->cm_held, cm->cm_mapext.ce_sect, BC_CSECTS(cm->cm_mapext.ce_len), false);
+        bc_cmap_mark(cm->cm_used, cm->cm_mapext.ce_sect, BC_CSECTS(cm->cm_mapext.ce_len), true);
+    }
+    bc_cmap_mark(cm->cm_used, mapsect, BC_CSECTS(maplen), false);
+    cm->cm_dirty = true;
+    lock_unlock(cm->cm_lock);
+    
+out:
+    if (map)
+        free(map);
+    if (freeing)
+        free(freeing);
+    lock_unlock(cm->cm_commit_lock);
+    
+    return err;
+}
+
+// every extent is marked used, and none of them overlap
+static void bc_cfile_check(bc_file_t *bf) {
+    bc_cmap_t *cm = bf->bf_cmap;
+    uint64_t *seen;
+    bc_cext_t ce;
+    
+    lock_lock(cm->cm_lock);
+    seen = calloc(cm->cm_nwords, sizeof(uint64_t));
+    assert(seen);
+    for (uint64_t i = 0; i <= cm->cm_nblocks; i++) {
+        ce = (i < cm->cm_nblocks) ? cm->cm_map[i] : cm->cm_mapext;
+        for (uint64_t s = ce.ce_sect; s < ce.ce_sect + BC_CSECTS(BC_CEXT_LEN(ce)); s++) {
+            assert(s >= BC_CRESERVED);
+            assert(s < cm->cm_nsects);
+            assert(cm->cm_used[s / 64] & (1ULL << (s % 64)) || ((i == cm->cm_nblocks) && cm->cm_freeing));
+            assert(!(seen[s / 64] & (1ULL << (s % 64))));
+            seen[s / 64] |= 1ULL << (s % 64);
+        }
+    }
+    for (uint64_t w = 0; w < cm->cm_nwords; w++)
+        assert(!(cm->cm_used[w] & cm->cm_held[w]));
+    free(seen);
+    lock_unlock(cm->cm_lock);
+}
+
+// files whose requests can't go to the I/O backend
+static bool bc_file_own_rw(bc_file_t *bf) {
+    return bf->bf_bounce || bf->bf_cmap;
+}
+
+static uint64_t bc_ioreq_bytes(bc_ioreq_t *reqs, uint32_t nreqs) {
+    uint64_t nbytes = 0;
+    for (uint32_t i = 0; i < nreqs; i++) {
+        if (reqs[i].bior_res > 0)
+            nbytes += reqs[i].bior_res;
+    }
+    return nbytes;
+}
+
+//
+// all of the cache's reads and writes go through here. a bounced or
+// compressed file's requests are done by its own code, a file at a time; runs
+// of everyone else's go to the I/O backend together
+//
+static void bc_rw(bcache_t *bc, int op, bc_ioreq_t *reqs, uint32_t nreqs) {
+    uint64_t start = bc_now_ns(), nbytes = 0;
+    bc_file_t *bf;
+    uint32_t i, j;
+    
+    if (bc->bc_flags & BC_MMAP) {
+        bc_msync_rw(bc, op, reqs, nreqs);
+        nbytes = bc_ioreq_bytes(reqs, nreqs);
+        goto out;
+    }
+    
+    for (i = 0; i < nreqs; i = j) {
+        bf = reqs[i].bior_file;
+        for (j = i + 1; j < nreqs; j++) {
+            if (bc_file_own_rw(bf) ? (reqs[j].bior_file != bf) : bc_file_own_rw(reqs[j].bior_file))
+                break;
+        }
+        if (bf->bf_cmap) {
+            nbytes += bc_cfile_rw(bf, op, reqs + i, j - i);
+            continue;
+        }
+        if (bf->bf_bounce)
+            bc_bounce_rw(bf, op, reqs + i, j - i);
+        else
+            bc->bc_io->bio_rw(bc, op, reqs + i, j - i);
+        nbytes += bc_ioreq_bytes(reqs + i, j - i);
+    }
+    
+out:
+    if (op == BC_IO_READ)
+        BC_STAT_ADD(bc, bcs_read_bytes, nbytes);
+    else
+        BC_STAT_ADD(bc, bcs_write_bytes, nbytes);
+    bc_hist_add(bc, (op == BC_IO_READ) ? BC_HIST_READ : BC_HIST_WRITE, bc_now_ns() - start);
+}
+
+static void bcp_dump_locked(bcache_t *bc, bc_part_t *bcp) {
+    blk_t *b;
+    blk_list_t *bl;
+    printf("partition %ld: ", bcp - bc->bc_parts);
+    printf("bcp_currsz: %" PRIu32 " (%" PRIu32 ") ", bcp->bcp_currsz, bcp->bcp_currsz / bc->bc_blksz);
+    printf("bcp_maxsz: %" PRIu32 " (%" PRIu32 ") ", bcp->bcp_maxsz, bcp->bcp_maxsz / bc->bc_blksz);
+    printf("bcp_nwriteback: %" PRIu32 " ", bcp->bcp_nwriteback);
+    printf("bcp_npinned: %" PRIu32 " (max %" PRIu32 ") ", bcp->bcp_npinned, bcp->bcp_pinned_max);
+    printf("\n");
+    for (int i = 0; i < bcp->bcp_htsz; i++) {
+        bl = &bcp->bcp_ht[i];
+        if (!LIST_EMPTY(bl)) {
+            printf("bcp_ht[%d]:\n", i);
+            LIST_FOREACH(b, bl, bl_ht_link) {
+                printf(" ");
+                bl_dump(b);
+                printf("\n");
+            }
+        }
+    }
+    printf("bcp_dl (%" PRIu32 "): ", bcp->bcp_ndirty);
+    TAILQ_FOREACH(b, &bcp->bcp_dl, bl_dl_link)
+        printf(" %llu", b->bl_blkno);
+    printf("\n");
+    if (bcp->bcp_policy->bpo_dump)
+        bcp->bcp_policy->bpo_dump(bcp);
+}
+
+static const char *bc_hist_names[BC_NHISTS] = { "hit", "miss", "read", "write", "sync", "lock" };
+
+static void bc_dump_stats(bcache_t *bc) {
+    bc_snapshot_t bss;
+    bc_stats_t *bcs = &bss.bss_stats;
+    bc_hist_t *bh;
+    
+    bc_get_snapshot(bc, &bss, false);
+    printf("stats (%" PRIu64 " ms): ", bss.bss_time - bss.bss_since);
+    printf("bcs_hits: %" PRIu64 " ", bcs->bcs_hits);
+    printf("bcs_misses: %" PRIu64 " ", bcs->bcs_misses);
+    printf("bcs_writes: %" PRIu64 " ", bcs->bcs_writes);
+    printf("bcs_flushes: %" PRIu64 " ", bcs->bcs_flushes);
+    printf("bcs_evictions: %" PRIu64 " (clean %" PRIu64 " dirty %" PRIu64 ") ", bcs->bcs_evictions,
+            bcs->bcs_evictions_clean, bcs->bcs_evictions_dirty);
+    printf("bcs_enomem: %" PRIu64 " ", bcs->bcs_enomem);
+    printf("bcs_ghost_hits: %" PRIu64 " ", bcs->bcs_ghost_hits);
+    printf("bcs_fg_writebacks: %" PRIu64 " ", bcs->bcs_fg_writebacks);
+    printf("bcs_bg_writebacks: %" PRIu64 " ", bcs->bcs_bg_writebacks);
+    printf("bcs_prefetches: %" PRIu64 " ", bcs->bcs_prefetches);
+    printf("bcs_prefetch_hits: %" PRIu64 " ", bcs->bcs_prefetch_hits);
+    printf("bcs_prefetch_drops: %" PRIu64 " ", bcs->bcs_prefetch_drops);
+    printf("bcs_flush_runs: %" PRIu64 " ", bcs->bcs_flush_runs);
+    printf("bcs_flush_blocks: %" PRIu64 " ", bcs->bcs_flush_blocks);
+    printf("bcs_flush_maxrun: %" PRIu64 " ", bcs->bcs_flush_maxrun);
+    printf("bcs_lock_acquires: %" PRIu64 " ", bcs->bcs_lock_acquires);
+    printf("bcs_lock_wait_ns: %" PRIu64 " ", bcs->bcs_lock_wait_ns);
+    printf("bcs_dirty_max: %" PRIu64 " ", bcs->bcs_dirty_max);
+    printf("bcs_pin_overflows: %" PRIu64 " ", bcs->bcs_pin_overflows);
+    printf("bcs_admissions: %" PRIu64 " ", bcs->bcs_admissions);
+    printf("bcs_rejections: %" PRIu64 " ", bcs->bcs_rejections);
+    printf("bcs_read_bytes: %" PRIu64 " ", bcs->bcs_read_bytes);
+    printf("bcs_write_bytes: %" PRIu64 " ", bcs->bcs_write_bytes);
+    printf("\n");
+    printf("pinned: %" PRIu32 " of %" PRIu32 " unpinned: %" PRIu32 "\n", bss.bss_pinned, bss.bss_pinned_max,
+            bss.bss_unpinned);
+    for (int h = 0; h < BC_NHISTS; h++) {
+        bh = &bss.bss_hists[h];
+        if (!bh->bh_count)
+            continue;
+        printf("%s latency (ns): count %" PRIu64 " mean %" PRIu64 " p50 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 "\n",
+                bc_hist_names[h], bh->bh_count, bh->bh_sum / bh->bh_count, bc_hist_quantile(bh, 0.5),
+                bc_hist_quantile(bh, 0.99), bh->bh_max);
+    }
+}
+
+void bc_dump(bcache_t *bc) {
+    bc_part_t *bcp;
+    bc_file_t *bf;
+    printf("block cache @ %p: ", bc);
+    printf("bc_blksz: %" PRIu32 " ", bc->bc_blksz);
+    printf("bc_maxsz: %" PRIu32 " (%" PRIu32 ") ", bc->bc_maxsz, bc->bc_maxsz / bc->bc_blksz);
+    printf("bc_nparts: %" PRIu32 " ", bc->bc_nparts);
+    printf("policy: %s ", bc->bc_parts[0].bcp_policy->bpo_name);
+    printf("io: %s ", bc->bc_io->bio_name);
+    printf("bc_nblocks: %" PRIu32 " ", bc->bc_nblocks);
+    printf("\n");
+    bc_dump_stats(bc);
+    lock_lock(bc->bc_files_lock);
+    LIST_FOREACH(bf, &bc->bc_files, bf_link) {
+        printf("file %" PRIu32 ": ", bf->bf_id);
+        printf("bf_fd: %d ", bf->bf_fd);
+        printf("bf_mapsz: %zu ", bf->bf_mapsz);
+        printf("direct: %s ", bf->bf_direct ? (bf->bf_bounce ? "bounced" : "yes") : "no");
+        printf("bf_dioalign: %" PRIu32 " ", bf->bf_dioalign);
+        printf("bf_nwriteback: %" PRIu32 " ", __atomic_load_n(&bf->bf_nwriteback, __ATOMIC_RELAXED));
+        if (bf->bf_cmap)
+            printf("compressed: cm_nblocks %" PRIu64 " cm_nsects %" PRIu64 " cm_gen %" PRIu64 " ", bf->bf_cmap->cm_nblocks,
+                   bf->bf_cmap->cm_nsects, bf->bf_cmap->cm_gen);
+        printf("\n");
+    }
+    lock_unlock(bc->bc_files_lock);
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bcp = &bc->bc_parts[i];
+        bcp_lock(bc, bcp);
+        bcp_rehash(bc, bcp, UINT32_MAX);
+        bcp_dump_locked(bc, bcp);
+        lock_unlock(bcp->bcp_lock);
+    }
+    return;
+}
+
+//
+// arenas:
+//  every block frame, blk_t and bco slot the cache uses is carved out of a
+//  page aligned mapping made at bc_create time, so bc_get never allocates
+//  memory and the cache's footprint is known up front. frames come first so
+//  they stay aligned, then the blk_ts, then the bco slots. growing the cache
+//  with bc_set_capacity adds another arena; they're only unmapped by
+//  bc_destroy
+//
+
+static void bc_arena_destroy(bcache_t *bc) {
+    bc_arena_t *ba;
+    blk_t *b;
+    
+    while ((ba = bc->bc_arena)) {
+        for (uint32_t i = 0; i < ba->ba_nblocks; i++) {
+            b = &ba->ba_blks[i];
+            if (b->bl_rwlock)
+                rwl_destroy(b->bl_rwlock);
+            if (b->bl_iolock)
+                lock_destroy(b->bl_iolock);
+        }
+        munmap(ba->ba_base, ba->ba_size);
+        bc->bc_arena = ba->ba_next;
+        bc->bc_nblocks -= ba->ba_nblocks;
+        free(ba);
+    }
+}
+
+static int bc_arena_create(bcache_t *bc, uint32_t nblocks) {
+    size_t framesz, slotsz, pgsz;
+    bc_arena_t *ba;
+    uint8_t *arena;
+    blk_t *b;
+    
+    ba = malloc(sizeof(bc_arena_t));
+    if (!ba)
+        return ENOMEM;
+    memset(ba, 0, sizeof(bc_arena_t));
+    
+    framesz = (bc->bc_flags & BC_MMAP) ? 0 : (size_t)nblocks * bc->bc_blksz; // BC_MMAP blocks point into the mapping
+    slotsz = BC_ROUND_UP(bc->bc_bcosz, sizeof(void *));
+    ba->ba_size = BC_ROUND_UP(framesz, sizeof(void *)) + (size_t)nblocks * (sizeof(blk_t) + slotsz);
+    
+    arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (bc->bc_flags & BC_HUGEPAGES) {
+        pgsz = BC_HUGEPAGE_SIZE;
+        ba->ba_size = BC_ROUND_UP(ba->ba_size, pgsz);
+        arena = mmap(NULL, ba->ba_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (arena == MAP_FAILED) { // no huge pages reserved (or asked for). use regular ones
+        pgsz = (size_t)sysconf(_SC_PAGESIZE);
+        ba->ba_size = BC_ROUND_UP(ba->ba_size, pgsz);
+        arena = mmap(NULL, ba->ba_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            printf("bc_arena_create: couldn't map %zu bytes: %s\n", ba->ba_size, strerror(errno));
+            free(ba);
+            return ENOMEM;
+        }
+#ifdef MADV_HUGEPAGE
+        if (bc->bc_flags & BC_HUGEPAGES)
+            madvise(arena, ba->ba_size, MADV_HUGEPAGE);
+#endif
+    }
+    
+    ba->ba_base = arena;
+    ba->ba_nblocks = nblocks;
+    ba->ba_blks = (blk_t *)(arena + BC_ROUND_UP(framesz, sizeof(void *)));
+    ba->ba_next = bc->bc_arena;
+    bc->bc_arena = ba;
+    bc->bc_nblocks += nblocks;
+    
+    // anonymous mappings come zeroed
+    for (uint32_t i = 0; i < nblocks; i++) {
+        b = &ba->ba_blks[i];
+        if (framesz)
+            b->bl_phys = (blk_phys_t *)(arena + (size_t)i * bc->bc_blksz);
+        if (slotsz)
+            b->bl_bcoslot = (uint8_t *)(ba->ba_blks + nblocks) + (size_t)i * slotsz;
+        b->bl_refcnt = BL_DEAD;
+        b->bl_rwlock = rwl_create();
+        b->bl_iolock = lock_create();
+        if (!b->bl_rwlock || !b->bl_iolock) {
+            printf("bc_arena_create: failed to create block locks\n");
+            // only this arena's blocks have been handed out
+            bc->bc_arena = ba->ba_next;
+            bc->bc_nblocks -= nblocks;
+            ba->ba_next = NULL;
+            for (uint32_t j = 0; j <= i; j++) {
+                if (ba->ba_blks[j].bl_rwlock)
+                    rwl_destroy(ba->ba_blks[j].bl_rwlock);
+                if (ba->ba_blks[j].bl_iolock)
+                    lock_destroy(ba->ba_blks[j].bl_iolock);
+            }
+            munmap(arena, ba->ba_size);
+            free(ba);
+            return ENOMEM;
+        }
+    }
+    
+    return 0;
+}
+
+//
+// pinned pool:
+//  blocks whose bco_class says BC_CLASS_PINNED are taken off the replacement
+//  policy's hands and kept on bcp_pinned instead, while there are fewer than
+//  bcp_pinned_max of them. they count against the partition's capacity like
+//  any other block, but they're never victims. they go back to the policy if
+//  their class changes or the pool shrinks, and are only evicted outright by
+//  bc_file_close. all of this needs bcp_lock
+//
+
+static uint32_t bl_class(blk_t *b) {
+    if (!b->bl_bco_ops->bco_class)
+        return BC_CLASS_NORMAL;
+    return b->bl_bco_ops->bco_class(b->bl_bco);
+}
+
+static void bcp_pin(bcache_t *bc, bc_part_t *bcp, blk_t *b) {
+    bcp->bcp_policy->bpo_remove(bcp, b);
+    bl_set_flags(b, B_PINNED, 0);
+    TAILQ_INSERT_TAIL(&bcp->bcp_pinned, b, bl_pl_link);
+    bcp->bcp_npinned++;
+}
+
+static void bcp_unpin(bcache_t *bc, bc_part_t *bcp, blk_t *b) {
+    TAILQ_REMOVE(&bcp->bcp_pinned, b, bl_pl_link);
+    bcp->bcp_npinned--;
+    bl_set_flags(b, 0, B_PINNED);
+    bcp->bcp_policy->bpo_insert(bcp, b);
+}
+
+// move b into or out of the pool, depending on its class
+static void bcp_classify(bcache_t *bc, bc_part_t *bcp, blk_t *b) {
+    bool pinned = b->bl_flags & B_PINNED;
+    
+    if (bl_class(b) != BC_CLASS_PINNED) {
+        if (pinned)
+            bcp_unpin(bc, bcp, b);
+    } else if (!pinned) {
+        if (bcp->bcp_npinned < bcp->bcp_pinned_max)
+            bcp_pin(bc, bcp, b);
+        else
+            BC_STAT_INC(bc, bcs_pin_overflows);
+    }
+}
+
+// the partition's capacity changed. if the pool's share shrank, its oldest blocks go back to the policy
+static void bcp_set_pinned_max(bcache_t *bc, bc_part_t *bcp) {
+    bcp->bcp_pinned_max = (uint64_t)(bcp->bcp_maxsz / bc->bc_blksz) * bc->bc_pinned_pct / 100;
+    while (bcp->bcp_npinned > bcp->bcp_pinned_max)
+        bcp_unpin(bc, bcp, TAILQ_FIRST(&bcp->bcp_pinned));
+}
+
+static void bl_bco_destroy(blk_t *b) {
+    if (b->bl_bco && b->bl_bco_ops->bco_destroy)
+        b->bl_bco_ops->bco_destroy(b->bl_bco);
+    b->bl_bco = NULL;
+}
+
+static int bcp_init(bcache_t *bc, bc_part_t *bcp, uint32_t maxsz, uint32_t blksz, bc_policy_t *policy) {
+    int err;
+    
+    memset(bcp, 0, sizeof(bc_part_t));
+    bcp->bcp_bc = bc;
+    
+    bcp->bcp_lock = lock_create();
+    if (!bcp->bcp_lock) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    bcp->bcp_maxsz = maxsz;
+    bcp->bcp_htsz = (maxsz / blksz) * 2;
+    if (!bcp->bcp_htsz)
+        bcp->bcp_htsz = 1;
+    
+    bcp->bcp_ht = malloc(sizeof(blk_list_t) * bcp->bcp_htsz);
+    if (!bcp->bcp_ht) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    memset(bcp->bcp_ht, 0, sizeof(blk_list_t) * bcp->bcp_htsz);
+    TAILQ_INIT(&bcp->bcp_dl);
+    LIST_INIT(&bcp->bcp_unused);
+    TAILQ_INIT(&bcp->bcp_pinned);
+    
+    bcp->bcp_policy = policy;
+    err = policy->bpo_init(bcp, maxsz / blksz);
+    if (err)
+        goto error_out;
+    
+    return 0;
+    
+error_out:
+    if (bcp->bcp_lock)
+        lock_destroy(bcp->bcp_lock);
+    if (bcp->bcp_ht)
+        free(bcp->bcp_ht);
+    
+    return err;
+}
+
+static void bc_file_free(bc_file_t *bf) {
+    uint64_t nbytes = 0;
+    int err;
+    
+    if (bf->bf_cmap) {
+        // don't lose what's been written since the last sync
+        if (bf->bf_cmap->cm_dirty) {
+            err = bc_cfile_commit(bf, &nbytes);
+            if (err)
+                printf("bc_file_free: couldn't commit the map: %s\n", strerror(err));
+        }
+        bc_cmap_free(bf->bf_cmap);
+    }
+    if (bf->bf_map)
+        munmap(bf->bf_map, bf->bf_mapsz);
+    if (bf->bf_bounce)
+        free(bf->bf_bounce);
+    if (bf->bf_bounce_lock)
+        lock_destroy(bf->bf_bounce_lock);
+    if (bf->bf_fd >= 0)
+        close(bf->bf_fd);
+    free(bf);
+}
+
+//
+// open another backing file to be cached alongside the others. it's opened the
+// way the cache's flags say (O_DIRECT, mapped etc.), unless it's compressed:
+// compressed extents aren't aligned, so their I/O is always buffered
+//
+bc_file_t *bc_file_open(bcache_t *bc, char *path) {
+    bool compressed, format;
+    bc_file_t *bf;
+    int err;
+    
+    bf = malloc(sizeof(bc_file_t));
+    if (!bf)
+        return NULL;
+    
+    memset(bf, 0, sizeof(bc_file_t));
+    bf->bf_fd = -1;
+    
+    err = bc_cfile_probe(path, bc->bc_flags, &compressed, &format);
+    if (err) {
+        printf("bc_file_open: couldn't open %s: %s\n", path, strerror(err));
+        goto error_out;
+    }
+    if (compressed && (bc->bc_flags & BC_MMAP)) {
+        printf("bc_file_open: %s is compressed, so it can't be mapped\n", path);
+        goto error_out;
+    }
+    
+    if (bc_open(bf, path, (bc->bc_flags & BC_DIRECT) && !compressed)) {
+        printf("bc_file_open: couldn't open %s: %s\n", path, strerror(errno));
+        goto error_out;
+    }
+    
+    if (compressed) {
+        err = bc_cfile_open(bf, bc->bc_blksz, format);
+        if (err) {
+            printf("bc_file_open: couldn't set up compressed file %s: %s\n", path, strerror(err));
+            goto error_out;
+        }
+    }
+    
+    if ((bc->bc_flags & BC_MMAP) && bc_map(bc, bf))
+        goto error_out;
+    
+    // arena frames are page aligned to begin with
+    if (bf->bf_dioalign && ((bc->bc_blksz % bf->bf_dioalign) || (bf->bf_dioalign > sysconf(_SC_PAGESIZE)))) {
+        bf->bf_bounce_lock = lock_create();
+        if (!bf->bf_bounce_lock)
+            goto error_out;
+        if (posix_memalign(&bf->bf_bounce, bf->bf_dioalign, BC_ROUND_UP(bc->bc_blksz, bf->bf_dioalign) + bf->bf_dioalign)) {
+            bf->bf_bounce = NULL;
+            goto error_out;
+        }
+    }
+    
+    lock_lock(bc->bc_files_lock);
+    bf->bf_id = bc->bc_nextid++;
+    LIST_INSERT_HEAD(&bc->bc_files, bf, bf_link);
+    lock_unlock(bc->bc_files_lock);
+    
+    return bf;
+    
+error_out:
+    bc_file_free(bf);
+    
+    return NULL;
+}
+
+//
+// have the cache call wal before writing out any of bf's blocks (see the
+// write-ahead logging comment in bcache.h). NULL turns it off again. set it
+// before any of bf's blocks are dirtied
+//
+int bc_file_set_wal(bcache_t *bc, bc_file_t *bf, int (*wal)(void *ctx, uint64_t lsn), void *ctx) {
+    if (bf->bf_map) {
+        printf("bc_file_set_wal: mapped files can't have a log\n");
+        return EINVAL;
+    }
+    
+    bf->bf_wal_ctx = ctx;
+    bf->bf_wal = wal;
+    
+    return 0;
+}
+
+//
+// bc_blkfile_t: a block at a time, straight to and from the file
+//
+int bc_blkfile_open(const char *path, uint32_t blksz, uint32_t flags, bc_blkfile_t **bbf) {
+    bc_blkfile_t *_bbf;
+    bool compressed, format;
+    int err;
+    
+    _bbf = malloc(sizeof(bc_blkfile_t));
+    if (!_bbf)
+        return ENOMEM;
+    _bbf->bbf_blksz = blksz;
+    _bbf->bbf_file = malloc(sizeof(bc_file_t));
+    if (!_bbf->bbf_file) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    memset(_bbf->bbf_file, 0, sizeof(bc_file_t));
+    _bbf->bbf_file->bf_fd = -1;
+    
+    err = bc_cfile_probe(path, flags, &compressed, &format);
+    if (err)
+        goto error_out;
+    
+    _bbf->bbf_file->bf_fd = open(path, O_RDWR);
+    if ((_bbf->bbf_file->bf_fd < 0) && ((errno == EACCES) || (errno == EROFS)))
+        _bbf->bbf_file->bf_fd = open(path, O_RDONLY);
+    if (_bbf->bbf_file->bf_fd < 0) {
+        err = errno;
+        goto error_out;
+    }
+    
+    if (compressed) {
+        err = bc_cfile_open(_bbf->bbf_file, blksz, format);
+        if (err)
+            goto error_out;
+    }
+    
+    *bbf = _bbf;
+    
+    return 0;
+    
+error_out:
+    if (_bbf->bbf_file)
+        bc_file_free(_bbf->bbf_file);
+    free(_bbf);
+    
+    return err;
+}
+
+int bc_blkfile_read(bc_blkfile_t *bbf, uint64_t blkno, void *buf) {
+    uint64_t nbytes = 0;
+    uint8_t *scratch;
+    ssize_t n;
+    int err;
+    
+    if (bbf->bbf_file->bf_cmap) {
+        scratch = malloc(bbf->bbf_blksz);
+        if (!scratch)
+            return ENOMEM;
+        err = bc_cfile_read(bbf->bbf_file, blkno, buf, scratch, &nbytes);
+        free(scratch);
+        return err;
+    }
+    
+    n = pread(bbf->bbf_file->bf_fd, buf, bbf->bbf_blksz, blkno * bbf->bbf_blksz);
+    if (n < 0)
+        return errno;
+    
+    return (n == bbf->bbf_blksz) ? 0 : EIO;
+}
+
+int bc_blkfile_write(bc_blkfile_t *bbf, uint64_t blkno, void *buf) {
+    uint64_t nbytes = 0;
+    uint8_t *scratch;
+    ssize_t n;
+    int err;
+    
+    if (bbf->bbf_file->bf_cmap) {
+        scratch = malloc(bbf->bbf_blksz);
+        if (!scratch)
+            return ENOMEM;
+        err = bc_cfile_write(bbf->bbf_file, blkno, buf, scratch, &nbytes);
+        free(scratch);
+        return err;
+    }
+    
+    n = pwrite(bbf->bbf_file->bf_fd, buf, bbf->bbf_blksz, blkno * bbf->bbf_blksz);
+    if (n < 0)
+        return errno;
+    
+    return (n == bbf->bbf_blksz) ? 0 : EIO;
+}
+
+int bc_blkfile_sync(bc_blkfile_t *bbf) {
+    uint64_t nbytes = 0;
+    
+    if (bbf->bbf_file->bf_cmap)
+        return bc_cfile_commit(bbf->bbf_file, &nbytes);
+    
+    return fsync(bbf->bbf_file->bf_fd) ? errno : 0;
+}
+
+int bc_blkfile_close(bc_blkfile_t *bbf) {
+    uint64_t nbytes = 0;
+    int err = 0;
+    
+    if (bbf->bbf_file->bf_cmap && bbf->bbf_file->bf_cmap->cm_dirty)
+        err = bc_cfile_commit(bbf->bbf_file, &nbytes);
+    bc_file_free(bbf->bbf_file);
+    free(bbf);
+    
+    return err;
+}
+
+static int bc_flusher(void *arg);
+
+bcache_t *bc_create(char *path, uint32_t blksz, uint32_t maxsz, bc_opts_t *opts) {
+    bcache_t *bc = NULL;
+    bc_policy_t *policy = &bc_policy_lru;
+    bc_io_t *io;
+    blk_t *b;
+    uint32_t nblocks, nparts = 1, pblocks;
+    int ninited = 0;
+    
+    if (opts && opts->bcop_npartitions)
+        nparts = opts->bcop_npartitions;
+    if (opts && opts->bcop_policy)
+        policy = opts->bcop_policy;
+    
+    // every partition gets at least one block
+    nblocks = maxsz / blksz;
+    if (nparts > nblocks)
+        nparts = nblocks ? nblocks : 1;
+    
+    bc = malloc(sizeof(bcache_t));
+    if (!bc)
+        goto error_out;
+    
+    memset(bc, 0, sizeof(bcache_t));
+    if (opts)
+        bc->bc_flags = opts->bcop_flags;
+    
+    if (opts && (opts->bcop_flags & BC_MMAP) && (opts->bcop_flags & BC_DIRECT)) {
+        printf("bc_create: BC_MMAP and BC_DIRECT don't mix\n");
+        goto error_out;
+    }
+    
+    LIST_INIT(&bc->bc_files);
+    
+    io = &bc_io_pread;
+    if (opts && opts->bcop_io && !(opts->bcop_flags & BC_MMAP)) // BC_MMAP doesn't use it
+        io = opts->bcop_io;
+    if (io->bio_init(bc)) {
+        if (io == &bc_io_pread)
+            goto error_out;
+        // e.g. this kernel doesn't have io_uring. fall back to pread/pwrite
+        io = &bc_io_pread;
+        if (io->bio_init(bc))
+            goto error_out;
+    }
+    bc->bc_io = io;
+    
+    bc->bc_blksz = blksz;
+    bc->bc_maxsz = maxsz;
+    bc->bc_nparts = nparts;
+    
+    bc->bc_dirty_hiwat = BC_DIRTY_HIWAT_DEF;
+    bc->bc_dirty_lowat = BC_DIRTY_LOWAT_DEF;
+    bc->bc_dirty_maxage = BC_DIRTY_MAXAGE_DEF;
+    bc->bc_flusher_intvl = BC_FLUSHER_INTVL_DEF;
+    if (opts) {
+        if (opts->bcop_dirty_hiwat)
+            bc->bc_dirty_hiwat = opts->bcop_dirty_hiwat;
+        if (opts->bcop_dirty_lowat)
+            bc->bc_dirty_lowat = opts->bcop_dirty_lowat;
+        if (opts->bcop_dirty_maxage)
+            bc->bc_dirty_maxage = opts->bcop_dirty_maxage;
+        if (opts->bcop_flusher_intvl)
+            bc->bc_flusher_intvl = opts->bcop_flusher_intvl;
+    }
+    if (opts)
+        bc->bc_sync = opts->bcop_sync;
+    if (bc->bc_dirty_lowat > bc->bc_dirty_hiwat)
+        bc->bc_dirty_lowat = bc->bc_dirty_hiwat;
+    
+    if (posix_memalign((void **)&bc->bc_stats, 64, sizeof(bc_stats_slot_t) * BC_NSLOTS)) {
+        bc->bc_stats = NULL;
+        goto error_out;
+    }
+    memset(bc->bc_stats, 0, sizeof(bc_stats_slot_t) * BC_NSLOTS);
+    bc->bc_stats_since = bc_now();
+    
+    if (posix_memalign((void **)&bc->bc_rcu, 64, sizeof(bc_rcu_slot_t) * BC_NSLOTS)) {
+        bc->bc_rcu = NULL;
+        goto error_out;
+    }
+    memset(bc->bc_rcu, 0, sizeof(bc_rcu_slot_t) * BC_NSLOTS);
+    bc->bc_rcu_lock = lock_create();
+    if (!bc->bc_rcu_lock)
+        goto error_out;
+    
+    bc->bc_bcosz = BC_BCOSZ_DEF;
+    if (opts && opts->bcop_bcosz)
+        bc->bc_bcosz = opts->bcop_bcosz;
+    bc->bc_pinned_pct = BC_PINNED_PCT_DEF;
+    if (opts && opts->bcop_pinned_pct)
+        bc->bc_pinned_pct = (opts->bcop_pinned_pct > 100) ? 100 : opts->bcop_pinned_pct;
+    
+    if (bc_arena_create(bc, nblocks))
+        goto error_out;
+    
+    bc->bc_parts = malloc(sizeof(bc_part_t) * nparts);
+    if (!bc->bc_parts)
+        goto error_out;
+    
+    // split capacity evenly, handing out any remainder to the first partitions
+    b = bc->bc_arena->ba_blks;
+    for (int i = 0; i < nparts; i++) {
+        pblocks = bc_part_nblocks(bc, nblocks, i);
+        if (bcp_init(bc, &bc->bc_parts[i], pblocks * blksz, blksz, policy))
+            goto error_out;
+        ninited++;
+        for (uint32_t j = 0; j < pblocks; j++, b++)
+            LIST_INSERT_HEAD(&bc->bc_parts[i].bcp_unused, b, bl_ht_link);
+        bc->bc_parts[i].bcp_nblocks = pblocks;
+        bcp_set_pinned_max(bc, &bc->bc_parts[i]);
+    }
+    
+    bc->bc_pf_lock = lock_create();
+    if (!bc->bc_pf_lock)
+        goto error_out;
+    
+    bc->bc_resize_lock = lock_create();
+    if (!bc->bc_resize_lock)
+        goto error_out;
+    
+    bc->bc_files_lock = lock_create();
+    if (!bc->bc_files_lock)
+        goto error_out;
+    
+    if (path) {
+        bc->bc_file = bc_file_open(bc, path);
+        if (!bc->bc_file)
+            goto error_out;
+    }
+    
+    if (opts && opts->bcop_trace && bc_trace_start(bc, opts->bcop_trace))
+        goto error_out;
+    
+    if (opts && (opts->bcop_flags & BC_FLUSHER)) {
+        bc->bc_flusher_lock = lock_create();
+        if (!bc->bc_flusher_lock)
+            goto error_out;
+        bc->bc_flusher = thread_create("bc_flusher");
+        if (!bc->bc_flusher)
+            goto error_out;
+        if (thread_start(bc->bc_flusher, bc_flusher, bc)) {
+            printf("bc_create: couldn't start the flusher\n");
+            goto error_out;
+        }
+    }
+    
+    return bc;
+    
+error_out:
+    if (bc) {
+        if (bc->bc_flusher)
+            thread_destroy(bc->bc_flusher);
+        if (bc->bc_flusher_lock)
+            lock_destroy(bc->bc_flusher_lock);
+        if (bc->bc_pf_lock)
+            lock_destroy(bc->bc_pf_lock);
+        if (bc->bc_resize_lock)
+            lock_destroy(bc->bc_resize_lock);
+        if (bc->bc_trace)
+            bc_trace_stop(bc);
+        if (bc->bc_file)
+            bc_file_free(bc->bc_file);
+        if (bc->bc_files_lock)
+            lock_destroy(bc->bc_files_lock);
+        bc_arena_destroy(bc);
+        if (bc->bc_stats)
+            free(bc->bc_stats);
+        if (bc->bc_rcu)
+            free(bc->bc_rcu);
+        if (bc->bc_rcu_lock)
+            lock_destroy(bc->bc_rcu_lock);
+        if (bc->bc_io)
+            bc->bc_io->bio_destroy(bc);
+        if (bc->bc_parts) {
+            for (int i = 0; i < ninited; i++) {
+                bc->bc_parts[i].bcp_policy->bpo_destroy(&bc->bc_parts[i]);
+                lock_destroy(bc->bc_parts[i].bcp_lock);
+                free(bc->bc_parts[i].bcp_ht);
+            }
+            free(bc->bc_parts);
+        }
+        free(bc);
+    }
+    
+    return NULL;
+}
+
+// TODO: synchronize this
+void bc_destroy(bcache_t *bc) {
+    blk_t *b, *bnext;
+    blk_list_t *bl;
+    bc_part_t *bcp;
+    bc_file_t *bf;
+    
+    if (bc->bc_flusher) {
+        lock_lock(bc->bc_flusher_lock);
+        bc->bc_flusher_stop = true;
+        lock_unlock(bc->bc_flusher_lock);
+        thread_wait(bc->bc_flusher, NULL);
+        thread_destroy(bc->bc_flusher);
+        lock_destroy(bc->bc_flusher_lock);
+    }
+    
+    if (bc->bc_pf_thread) {
+        lock_lock(bc->bc_pf_lock);
+        bc->bc_pf_stop = true;
+        lock_unlock(bc->bc_pf_lock);
+        thread_wait(bc->bc_pf_thread, NULL);
+        thread_destroy(bc->bc_pf_thread);
+    }
+    lock_destroy(bc->bc_pf_lock);
+    lock_destroy(bc->bc_resize_lock);
+    
+    if (bc->bc_trace && bc_trace_stop(bc))
+        printf("bc_destroy: WARNING: trace not completely written out\n");
+    
+    for (int p = 0; p < bc->bc_nparts; p++) {
+        bcp = &bc->bc_parts[p];
+        bcp_rehash(bc, bcp, UINT32_MAX);
+        
+        if (!TAILQ_EMPTY(&bcp->bcp_dl))
+            printf("bc_destroy: WARNING: dirty list not empty\n");
+        
+        for (int i = 0; i < bcp->bcp_htsz; i++) {
+            bl = &bcp->bcp_ht[i];
+            if (!LIST_EMPTY(bl)) {
+                LIST_FOREACH_SAFE(b, bl, bl_ht_link, bnext) {
+                    bl_bco_destroy(b);
+                    assert(b->bl_refcnt == 0);
+                    if (b->bl_flags & B_DIRTY)
+                        printf("bc_destroy: bl_blkno %" PRIu64 " destroyed while dirty\n", b->bl_blkno);
+                }
+            }
+        }
+        
+        bcp->bcp_policy->bpo_destroy(bcp);
+        free(bcp->bcp_ht);
+        lock_destroy(bcp->bcp_lock);
+    }
+    
+    free(bc->bc_parts);
+    bc_arena_destroy(bc);
+    while ((bf = LIST_FIRST(&bc->bc_files))) {
+        LIST_REMOVE(bf, bf_link);
+        bc_file_free(bf);
+    }
+    lock_destroy(bc->bc_files_lock);
+    bc->bc_io->bio_destroy(bc);
+    free(bc->bc_stats);
+    free(bc->bc_rcu);
+    lock_destroy(bc->bc_rcu_lock);
+    free(bc);
+}
+
+//
+// write out a dirty block with bcp_lock dropped. b must be unreferenced.
+// B_WRITEBACK keeps it from being evicted while the lock is dropped, but
+// it can still be found and referenced (and even re-dirtied) by others
+//
+static int bc_writeback(bcache_t *bc, bc_part_t *bcp, blk_t *b) {
+    bc_file_t *bf = b->bl_file;
+    struct iovec iov;
+    bc_ioreq_t req;
+    uint64_t lsn;
+    int err = 0;
+    
+    assert((b->bl_flags & B_DIRTY) && !(b->bl_flags & B_WRITEBACK));
+    
+    bl_set_flags(b, B_WRITEBACK, B_DIRTY);
+    TAILQ_REMOVE(&bcp->bcp_dl, b, bl_dl_link);
+    bcp->bcp_ndirty--;
+    bcp->bcp_nwriteback++;
+    __atomic_add_fetch(&bf->bf_nwriteback, 1, __ATOMIC_RELAXED);
+    lsn = __atomic_load_n(&b->bl_lsn, __ATOMIC_ACQUIRE);
+    
+    lock_unlock(bcp->bcp_lock);
+    req.bior_res = 0;
+    if (bf->bf_wal && lsn)
+        err = bf->bf_wal(bf->bf_wal_ctx, lsn);
+    if (!err) {
+        iov.iov_base = b->bl_phys;
+        iov.iov_len = bc->bc_blksz;
+        req.bior_file = bf;
+        req.bior_off = b->bl_blkno * bc->bc_blksz;
+        req.bior_iov = &iov;
+        req.bior_iovcnt = 1;
+        bc_rw(bc, BC_IO_WRITE, &req, 1);
+    }
+    bcp_lock(bc, bcp);
+    
+    bl_set_flags(b, 0, B_WRITEBACK);
+    bcp->bcp_nwriteback--;
+    __atomic_sub_fetch(&bf->bf_nwriteback, 1, __ATOMIC_RELEASE);
+    
+    if (req.bior_res != bc->bc_blksz) {
+        if (!(b->bl_flags & B_DIRTY)) { // it's still the oldest
+            bl_set_flags(b, B_DIRTY, 0);
+            TAILQ_INSERT_HEAD(&bcp->bcp_dl, b, bl_dl_link);
+            bcp->bcp_ndirty++;
+        }
+        return err ? err : EIO;
+    }
+    
+    BC_STAT_INC(bc, bcs_writes);
+    
+    return 0;
+}
+
+// by file, then blkno
+static int bl_blkno_cmp(const void *a, const void *b) {
+    blk_t *x = *(blk_t **)a, *y = *(blk_t **)b;
+    
+    if (x->bl_file != y->bl_file)
+        return (x->bl_file->bf_id > y->bl_file->bf_id) ? 1 : -1;
+    
+    return (x->bl_blkno > y->bl_blkno) - (x->bl_blkno < y->bl_blkno);
+}
+
+//
+// dirty says whether b had to be written out before it could go. b was
+// unreferenced when it was picked, but a lock-free hit can still get to it
+// first, in which case it stays and false is returned
+//
+static bool bcp_evict(bcache_t *bc, bc_part_t *bcp, blk_t *b, bool dirty) {
+    int refcnt = 0;
+    
+    if (!__atomic_compare_exchange_n(&b->bl_refcnt, &refcnt, BL_DEAD, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+    
+    if (b->bl_flags & B_PINNED) { // bc_file_close
+        TAILQ_REMOVE(&bcp->bcp_pinned, b, bl_pl_link);
+        bcp->bcp_npinned--;
+    } else
+        bcp->bcp_policy->bpo_evict(bcp, b);
+    bl_ht_remove(b);
+    BC_STAT_INC(bc, bcs_evictions);
+    if (dirty)
+        BC_STAT_INC(bc, bcs_evictions_dirty);
+    else
+        BC_STAT_INC(bc, bcs_evictions_clean);
+    bl_bco_destroy(b);
+    bl_set_flags(b, 0, b->bl_flags);
+    if (b->bl_file->bf_map)
+        bc_madvise(bc, b->bl_file, b->bl_blkno, 1, MADV_DONTNEED);
+    
+    return true;
+}
+
+//
+// put an evicted block back on the unused list, because the partition has been
+// shrunk. its frame's pages go back to the system until it's needed again
+//
+static void bcp_unuse(bcache_t *bc, bc_part_t *bcp, blk_t *b) {
+    bcp->bcp_currsz -= bc->bc_blksz;
+    bl_ht_insert(&bcp->bcp_unused, b);
+    if (!(bc->bc_flags & BC_MMAP) && ((bc->bc_blksz % sysconf(_SC_PAGESIZE)) == 0))
+        madvise(b->bl_phys, bc->bc_blksz, MADV_DONTNEED);
+}
+
+//
+// evict blocks until bcp fits in bcp_maxsz, writing back dirty ones. referenced
+// blocks can't go yet. bcp_lookup gives them up once they've been released and
+// the partition needs a block. bcp_lock must be held, and may be dropped
+//
+static int bcp_shrink(bcache_t *bc, bc_part_t *bcp) {
+    blk_t *b, *wb = NULL; // the last victim we wrote out
+    int err;
+    
+    while (bcp->bcp_currsz > bcp->bcp_maxsz) {
+        b = bcp->bcp_policy->bpo_victim(bcp);
+        if (!b) {
+            if (!bcp->bcp_nwriteback)
+                break;
+            lock_unlock(bcp->bcp_lock);
+            sched_yield();
+            bcp_lock(bc, bcp);
+            continue;
+        }
+        if (b->bl_flags & B_DIRTY) {
+            err = bc_writeback(bc, bcp, b);
+            if (err)
+                return err;
+            BC_STAT_INC(bc, bcs_fg_writebacks);
+            wb = b;
+            continue;
+        }
+        if (bcp_evict(bc, bcp, b, b == wb))
+            bcp_unuse(bc, bcp, b);
+    }
+    
+    return 0;
+}
+
+//
+// the partition lock is never held across disk I/O. a miss inserts a B_LOADING
+// placeholder block into the hash table and reads it in with only the placeholder's
+// bl_iolock held, so other getters of the same blkno wait on that block alone, and
+// everyone else carries on
+//
+
+//
+// look up bf's blkno in bcp. bcp_lock must be held, and may be dropped and retaken.
+// if it's cached, *bp gets a new reference to it, but it may still be being
+// read in by someone else (see bcp_wait). if it isn't, *bp gets a referenced
+// B_LOADING placeholder with bl_iolock held, *load is set, and it's up to the
+// caller to read it in (see bc_load and bcp_load_done). prefetch lookups don't
+// take references on blocks that are already cached; *bp is set to NULL instead
+//
+static int bcp_lookup(bcache_t *bc, bc_part_t *bcp, bc_file_t *bf, uint64_t blkno, bco_ops_t *bco_ops, bool prefetch, blk_t **bp, bool *load) {
+    blk_t *b, *wb = NULL; // the last victim we wrote out
+    int err;
+    
+    *load = false;
+    
+    bcp_rehash(bc, bcp, BC_REHASH_STEP);
+    
+    if (!prefetch && bcp->bcp_policy->bpo_access)
+        bcp->bcp_policy->bpo_access(bcp, bc_key(bf, blkno));
+    
+again:
+    b = bcp_find(bc, bcp, bf, blkno);
+    if (b)
+        goto found;
+    
+    // it's not in the cache, so we need to read it from disk
+    if ((bcp->bcp_currsz + bc->bc_blksz) > bcp->bcp_maxsz) {
+        //
+        // partition is at max capacity. evict a block
+        //
+        b = bcp->bcp_policy->bpo_victim(bcp);
+        if (!b) {
+            if (bcp->bcp_nwriteback) {
+                // everything free is being written out by someone else. wait for them
+                lock_unlock(bcp->bcp_lock);
+                sched_yield();
+                bcp_lock(bc, bcp);
+                goto again;
+            }
+            if (!prefetch)
+                printf("bc_get: no blocks free\n");
+            //bcp_dump_locked(bc, bcp);
+            BC_STAT_INC(bc, bcs_enomem);
+            err = ENOMEM;
+            goto error_out;
+        }
+        
+        //
+        // flush it out if it's dirty. this drops bcp_lock, so someone
+        // else may have brought blkno in by the time we get it back
+        //
+        if (b->bl_flags & B_DIRTY) {
+            err = bc_writeback(bc, bcp, b);
+            if (err)
+                goto error_out;
+            BC_STAT_INC(bc, bcs_fg_writebacks);
+            wb = b;
+            goto again;
+        }
+        
+        // take it out of the cache
+        if (!bcp_evict(bc, bcp, b, b == wb))
+            goto again;
+        if (bcp->bcp_currsz > bcp->bcp_maxsz) { // bc_set_capacity shrank the partition. give it up
+            bcp_unuse(bc, bcp, b);
+            goto again;
+        }
+    } else {
+        //
+        // partition is not yet at max capacity. use one of its unused blocks
+        //
+        b = LIST_FIRST(&bcp->bcp_unused);
+        assert(b);
+        bl_ht_remove(b);
+        bcp->bcp_currsz += bc->bc_blksz;
+    }
+    
+    if (prefetch)
+        BC_STAT_INC(bc, bcs_prefetches);
+    else
+        BC_STAT_INC(bc, bcs_misses);
+    
+    //
+    // b is BL_DEAD, so lock-free lookups that come across it won't touch it
+    // until it has a reference, and by then its new key is in place
+    //
+    assert(b->bl_refcnt == BL_DEAD);
+    __atomic_store_n(&b->bl_file, bf, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->bl_blkno, blkno, __ATOMIC_RELAXED);
+    bl_set_flags(b, B_LOADING, 0);
+    b->bl_ref = false;
+    b->bl_lsn = 0;
+    b->bl_bco_ops = bco_ops;
+    __atomic_store_n(&b->bl_refcnt, 1, __ATOMIC_RELEASE);
+    bl_ht_insert(bcp_bucket(bc, bcp, bc_key(bf, blkno)), b);
+    bcp->bcp_policy->bpo_insert(bcp, b);
+    
+    // anyone else after blkno will wait on bl_iolock
+    lock_lock(b->bl_iolock);
+    
+    *load = true;
+    *bp = b;
+    
+    return 0;
+    
+found:
+    if (prefetch) {
+        *bp = NULL;
+        return 0;
+    }
+    
+    bl_touch(b);
+    __atomic_add_fetch(&b->bl_refcnt, 1, __ATOMIC_RELAXED);
+    
+    *bp = b;
+    
+    return 0;
+    
+error_out:
+    return err;
+}
+
+//
+// set up b's block cache object. objects with a bco_size live in b's bco slot
+//
+static int bl_bco_init(bcache_t *bc, blk_t *b) {
+    bco_ops_t *ops = b->bl_bco_ops;
+    int err;
+    
+    b->bl_bco = NULL;
+    if (ops->bco_size) {
+        if (ops->bco_size > bc->bc_bcosz) {
+            printf("bc_get: bco_size %zu is bigger than the cache's bco slots (%" PRIu32 ")\n", ops->bco_size, bc->bc_bcosz);
+            return EINVAL;
+        }
+        memset(b->bl_bcoslot, 0, ops->bco_size);
+        b->bl_bco = b->bl_bcoslot;
+    }
+    
+    err = ops->bco_init(&b->bl_bco, b);
+    if (err)
+        b->bl_bco = NULL;
+    
+    return err;
+}
+
+//
+// build one I/O request per run of adjacent blocks of the same file at the
+// start of blks (sorted by file, then blkno), using up to maxblks blocks.
+// returns the number of blocks used
+//
+static uint32_t bc_ioreqs(bcache_t *bc, blk_t **blks, uint32_t nblks, struct iovec *iov, uint32_t maxblks, bc_ioreq_t *reqs, uint32_t *nreqs) {
+    uint32_t i;
+    
+    *nreqs = 0;
+    for (i = 0; (i < nblks) && (i < maxblks); i++) {
+        if ((i == 0) || (blks[i]->bl_file != blks[i - 1]->bl_file) ||
+            (blks[i]->bl_blkno != blks[i - 1]->bl_blkno + 1)) {
+            reqs[*nreqs].bior_file = blks[i]->bl_file;
+            reqs[*nreqs].bior_off = blks[i]->bl_blkno * bc->bc_blksz;
+            reqs[*nreqs].bior_iov = &iov[i];
+            reqs[*nreqs].bior_iovcnt = 0;
+            (*nreqs)++;
+        }
+        iov[i].iov_base = blks[i]->bl_phys;
+        iov[i].iov_len = bc->bc_blksz;
+        reqs[*nreqs - 1].bior_iovcnt++;
+    }
+    
+    return i;
+}
+
+//
+// read in placeholder blocks from bcp_lookup, sorted by file and blkno. each batch of up
+// to BC_LOAD_MAXRUN blocks goes to the I/O backend together, one request per run
+// of adjacent blocks. the result for each block is left in bl_ioerr for
+// bcp_load_done
+//
+static void bc_load(bcache_t *bc, blk_t **blks, uint32_t nblks) {
+    struct iovec iov[BC_LOAD_MAXRUN];
+    bc_ioreq_t reqs[BC_LOAD_MAXRUN];
+    uint32_t n, nreqs, k;
+    bc_file_t *bf;
+    int err;
+    
+    if (bc->bc_flags & BC_MMAP) {
+        for (uint32_t i = 0; i < nblks; i++) {
+            bf = blks[i]->bl_file;
+            if ((blks[i]->bl_blkno + 1) * bc->bc_blksz > bf->bf_mapsz) { // past the end of the file
+                blks[i]->bl_ioerr = EIO;
+                continue;
+            }
+            blks[i]->bl_phys = (blk_phys_t *)(bf->bf_map + blks[i]->bl_blkno * bc->bc_blksz);
+            blks[i]->bl_ioerr = bl_bco_init(bc, blks[i]);
+        }
+        return;
+    }
+    
+    while (nblks) {
+        n = bc_ioreqs(bc, blks, nblks, iov, BC_LOAD_MAXRUN, reqs, &nreqs);
+        bc_rw(bc, BC_IO_READ, reqs, nreqs);
+        
+        k = 0;
+        for (uint32_t r = 0; r < nreqs; r++) {
+            // TODO: this should keep reading as long as there's no error; short reads aren't errors
+            err = (reqs[r].bior_res != (ssize_t)reqs[r].bior_iovcnt * bc->bc_blksz) ? EIO : 0;
+            for (int c = 0; c < reqs[r].bior_iovcnt; c++, k++)
+                blks[k]->bl_ioerr = err ? err : bl_bco_init(bc, blks[k]);
+        }
+        
+        blks += n;
+        nblks -= n;
+    }
+}
+
+//
+// finish loading b and let anyone waiting on it go. if the load failed, b is
+// left in the cache marked B_ERROR and our reference is dropped. whoever gets it
+// next (including anyone waiting on it now) will retry the read. prefetches
+// drop their reference either way
+//
+static int bcp_load_done(bcache_t *bc, blk_t *b, bool prefetch) {
+    bc_part_t *bcp = bc_part(bc, bl_key(b));
+    int err = b->bl_ioerr;
+    
+    bcp_lock(bc, bcp);
+    
+    bl_set_flags(b, err ? B_ERROR : (prefetch ? B_PREFETCHED : 0), B_LOADING);
+    if (err)
+        bcp->bcp_policy->bpo_failed(bcp, b);
+    else
+        bcp_classify(bc, bcp, b);
+    if (err || prefetch)
+        __atomic_sub_fetch(&b->bl_refcnt, 1, __ATOMIC_RELEASE);
+    lock_unlock(b->bl_iolock);
+    
+    lock_unlock(bcp->bcp_lock);
+    
+    return err;
+}
+
+//
+// wait for a referenced block from bcp_lookup to be read in by whoever is reading
+// it in. if that read failed, read it in ourselves. bcp_lock must be held. on
+// failure our reference is dropped
+//
+static int bcp_wait(bcache_t *bc, bc_part_t *bcp, blk_t *b, bco_ops_t *bco_ops) {
+    int err;
+    
+    while (b->bl_flags & B_LOADING) {
+        // someone else is reading it in. our reference keeps it from being evicted
+        lock_unlock(bcp->bcp_lock);
+        lock_lock(b->bl_iolock);
+        lock_unlock(b->bl_iolock);
+        bcp_lock(bc, bcp);
+    }
+    
+    if (b->bl_flags & B_ERROR) { // last read failed. try it again ourselves
+        BC_STAT_INC(bc, bcs_misses);
+        bl_set_flags(b, B_LOADING, B_ERROR);
+        b->bl_bco_ops = bco_ops;
+        lock_lock(b->bl_iolock);
+        lock_unlock(bcp->bcp_lock);
+        bc_load(bc, &b, 1);
+        err = bcp_load_done(bc, b, false);
+        bcp_lock(bc, bcp);
+        return err;
+    }
+    
+    BC_STAT_INC(bc, bcs_hits);
+    if (b->bl_flags & B_PREFETCHED) {
+        BC_STAT_INC(bc, bcs_prefetch_hits);
+        bl_set_flags(b, 0, B_PREFETCHED);
+    }
+    
+    return 0;
+}
+
+//
+// get nblks of bf's blocks at once. all of them stay referenced until the end,
+// so they have to fit in the cache together. missing blocks are read in
+// together, in blkno order, with adjacent blocks coalesced into one read. on
+// failure none of the blocks are left referenced
+//
+int bc_file_get_many(bcache_t *bc, bc_file_t *bf, uint64_t *blknos, uint32_t nblks, bco_ops_t *bco_ops, void **bcos) {
+    blk_t *_bs[BC_GET_MANY_STACK], **bs = _bs, *_ld[BC_GET_MANY_STACK], **ld = _ld;
+    bool _mine[BC_GET_MANY_STACK], *mine = _mine;
+    uint64_t start = bc_now_ns();
+    uint32_t nld = 0, ngot = 0, i;
+    bc_part_t *bcp;
+    int err = 0, _err;
+    
+    if (nblks > BC_GET_MANY_STACK) {
+        bs = malloc(sizeof(blk_t *) * nblks);
+        ld = malloc(sizeof(blk_t *) * nblks);
+        mine = malloc(sizeof(bool) * nblks);
+        if (!bs || !ld || !mine) {
+            err = ENOMEM;
+            goto out;
+        }
+    }
+    
+    // find everything that's cached, and put in placeholders for everything that isn't
+    for (ngot = 0; ngot < nblks; ngot++) {
+        bs[ngot] = bc_find_fast(bc, bf, blknos[ngot]);
+        if (bs[ngot]) {
+            mine[ngot] = false;
+            continue;
+        }
+        bcp = bc_part(bc, bc_key(bf, blknos[ngot]));
+        bcp_lock(bc, bcp);
+        err = bcp_lookup(bc, bcp, bf, blknos[ngot], bco_ops, false, &bs[ngot], &mine[ngot]);
+        lock_unlock(bcp->bcp_lock);
+        if (err)
+            break;
+        if (mine[ngot])
+            ld[nld++] = bs[ngot];
+    }
+    
+    //
+    // read in our placeholders before waiting on anyone else's, so that two
+    // getters with overlapping blocks can't end up waiting on each other
+    //
+    if (err) {
+        for (i = 0; i < nld; i++)
+            ld[i]->bl_ioerr = err;
+    } else {
+        qsort(ld, nld, sizeof(blk_t *), bl_blkno_cmp);
+        bc_load(bc, ld, nld);
+    }
+    
+    for (i = 0; i < ngot; i++) {
+        bcp = bc_part(bc, bl_key(bs[i]));
+        if (mine[i]) {
+            _err = bcp_load_done(bc, bs[i], false);
+        } else if (bl_flags(bs[i]) & (B_LOADING | B_ERROR | B_PREFETCHED)) {
+            bcp_lock(bc, bcp);
+            _err = bcp_wait(bc, bcp, bs[i], bco_ops);
+            lock_unlock(bcp->bcp_lock);
+        } else {
+            //
+            // it's all there, and nothing can change that while we have a
+            // reference, so there's no need for bcp_lock
+            //
+            BC_STAT_INC(bc, bcs_hits);
+            _err = 0;
+        }
+        if (_err) {
+            bs[i] = NULL; // our reference is gone
+            if (!err)
+                err = _err;
+        }
+    }
+    
+    if (err) {
+        for (i = 0; i < ngot; i++) {
+            if (bs[i]) // not bc_release, since the get was never traced
+                __atomic_sub_fetch(&bs[i]->bl_refcnt, 1, __ATOMIC_RELEASE);
+        }
+        goto out;
+    }
+    
+    for (i = 0; i < nblks; i++)
+        bcos[i] = bs[i]->bl_bco;
+    
+    bc_hist_add(bc, nld ? BC_HIST_MISS : BC_HIST_HIT, bc_now_ns() - start);
+    
+    for (i = 0; i < nblks; i++)
+        bc_trace(bc, BC_TRACE_GET, bf, blknos[i]);
+    
+out:
+    if (bs != _bs) {
+        free(bs);
+        free(ld);
+        free(mine);
+    }
+    
+    return err;
+}
+
+int bc_file_get(bcache_t *bc, bc_file_t *bf, uint64_t blkno, bco_ops_t *bco_ops, void **bco) {
+    return bc_file_get_many(bc, bf, &blkno, 1, bco_ops, bco);
+}
+
+int bc_get_many(bcache_t *bc, uint64_t *blknos, uint32_t nblks, bco_ops_t *bco_ops, void **bcos) {
+    return bc_file_get_many(bc, bc->bc_file, blknos, nblks, bco_ops, bcos);
+}
+
+int bc_get(bcache_t *bc, uint64_t blkno, bco_ops_t *bco_ops, void **bco) {
+    return bc_file_get_many(bc, bc->bc_file, &blkno, 1, bco_ops, bco);
+}
+
+//
+// read in whatever isn't cached in [blkno, blkno + count), BC_LOAD_MAXRUN
+// blocks at a time. blocks that are already cached are left alone
+//
+static void bc_prefetch_range(bcache_t *bc, bc_file_t *bf, uint64_t blkno, uint32_t count, bco_ops_t *bco_ops) {
+    blk_t *ld[BC_LOAD_MAXRUN], *b;
+    uint32_t nld;
+    bc_part_t *bcp;
+    bool load;
+    int err = 0;
+    
+    // start the page cache reading it in now. bc_load won't
+    if (bf->bf_map)
+        bc_madvise(bc, bf, blkno, count, MADV_WILLNEED);
+    
+    while (count && !err) {
+        nld = 0;
+        while (count && (nld < BC_LOAD_MAXRUN)) {
+            bcp = bc_part(bc, bc_key(bf, blkno));
+            bcp_lock(bc, bcp);
+            err = bcp_lookup(bc, bcp, bf, blkno, bco_ops, true, &b, &load);
+            lock_unlock(bcp->bcp_lock);
+            if (err) // the cache is full of referenced blocks. give up
+                break;
+            if (load)
+                ld[nld++] = b;
+            blkno++;
+            count--;
+        }
+        
+        bc_load(bc, ld, nld); // already sorted
+        for (uint32_t i = 0; i < nld; i++)
+            bcp_load_done(bc, ld[i], true);
+    }
+}
+
+static int bc_prefetcher(void *arg) {
+    bcache_t *bc = (bcache_t *)arg;
+    struct timespec ts = { 0, BC_PREFETCH_IDLE * 1000 };
+    bc_pf_req_t req;
+    
+    while (1) {
+        lock_lock(bc->bc_pf_lock);
+        if (bc->bc_pf_stop) {
+            lock_unlock(bc->bc_pf_lock);
+            break;
+        }
+        if (bc->bc_pf_nreqs == 0) {
+            lock_unlock(bc->bc_pf_lock);
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        req = bc->bc_pf_q[bc->bc_pf_head];
+        bc->bc_pf_head = (bc->bc_pf_head + 1) % BC_PREFETCH_QSZ;
+        bc->bc_pf_nreqs--;
+        bc->bc_pf_busy = req.pf_file; // bc_file_close waits for us
+        lock_unlock(bc->bc_pf_lock);
+        
+        bc_prefetch_range(bc, req.pf_file, req.pf_blkno, req.pf_count, req.pf_bco_ops);
+        
+        lock_lock(bc->bc_pf_lock);
+        bc->bc_pf_busy = NULL;
+        lock_unlock(bc->bc_pf_lock);
+    }
+    
+    return 0;
+}
+
+//
+// queue up bf's [blkno, blkno + count) to be read in by the prefetch thread,
+// which is started on first use. this doesn't wait for anything. if the queue
+// is full, the request is dropped
+//
+int bc_file_prefetch(bcache_t *bc, bc_file_t *bf, uint64_t blkno, uint32_t count, bco_ops_t *bco_ops) {
+    int err;
+    
+    lock_lock(bc->bc_pf_lock);
+    
+    if (!bc->bc_pf_thread) {
+        bc->bc_pf_thread = thread_create("bc_prefetcher");
+        if (!bc->bc_pf_thread) {
+            err = ENOMEM;
+            goto error_out;
+        }
+        err = thread_start(bc->bc_pf_thread, bc_prefetcher, bc);
+        if (err) {
+            thread_destroy(bc->bc_pf_thread);
+            bc->bc_pf_thread = NULL;
+            goto error_out;
+        }
+    }
+    
+    if (bc->bc_pf_nreqs == BC_PREFETCH_QSZ) {
+        lock_unlock(bc->bc_pf_lock);
+        BC_STAT_INC(bc, bcs_prefetch_drops);
+        return 0;
+    }
+    
+    bc->bc_pf_q[(bc->bc_pf_head + bc->bc_pf_nreqs) % BC_PREFETCH_QSZ] = (bc_pf_req_t){ bf, blkno, count, bco_ops };
+    bc->bc_pf_nreqs++;
+    
+    lock_unlock(bc->bc_pf_lock);
+    
+    return 0;
+    
+error_out:
+    lock_unlock(bc->bc_pf_lock);
+    
+    return err;
+}
+
+int bc_prefetch(bcache_t *bc, uint64_t blkno, uint32_t count, bco_ops_t *bco_ops) {
+    return bc_file_prefetch(bc, bc->bc_file, blkno, count, bco_ops);
+}
+
+void bc_dirty(bcache_t *bc, blk_t *b) {
+    bc_part_t *bcp = bc_part(bc, bl_key(b));
+    bc_trace(bc, BC_TRACE_DIRTY, b->bl_file, b->bl_blkno);
+    bcp_lock(bc, bcp);
+    if (!(b->bl_flags & B_DIRTY)) {
+        bl_set_flags(b, B_DIRTY, 0);
+        b->bl_dirtied = bc_now();
+        TAILQ_INSERT_TAIL(&bcp->bcp_dl, b, bl_dl_link);
+        bcp->bcp_ndirty++;
+        bc_stat_max(&bc_stats_slot(bc)->ss_stats.bcs_dirty_max, bcp->bcp_ndirty);
+    }
+    bcp_classify(bc, bcp, b); // it may not have been what it is now when it was read in
+    lock_unlock(bcp->bcp_lock);
+    return;
+}
+
+//
+// no bcp_lock needed. unreferenced blocks stay where they are in the policy's
+// queues, and the release orders our changes to b before whoever evicts it
+//
+void bc_release(bcache_t *bc, blk_t *b) {
+    int refcnt;
+    bc_trace(bc, BC_TRACE_RELEASE, b->bl_file, b->bl_blkno); // b can be reused once it's released
+    refcnt = __atomic_sub_fetch(&b->bl_refcnt, 1, __ATOMIC_RELEASE);
+    assert(refcnt >= 0);
+    return;
+}
+
+//
+// b is already referenced, so it can't go anywhere. traced as a get, so that
+// replays see the extra reference too
+//
+void bc_hold(bcache_t *bc, blk_t *b) {
+    int refcnt;
+    bc_trace(bc, BC_TRACE_GET, b->bl_file, b->bl_blkno);
+    refcnt = __atomic_add_fetch(&b->bl_refcnt, 1, __ATOMIC_RELAXED);
+    assert(refcnt > 1);
+    return;
+}
+
+//
+// b's contents are covered by log record lsn. lsns only go up, and b must be
+// referenced. writers read it without bcp_lock
+//
+void bc_set_lsn(bcache_t *bc, blk_t *b, uint64_t lsn) {
+    assert(bl_refcnt(b) > 0);
+    if (lsn > b->bl_lsn)
+        __atomic_store_n(&b->bl_lsn, lsn, __ATOMIC_RELEASE);
+    return;
+}
+
+//
+// note: partitions are locked one at a time, so this isn't
+// a consistent snapshot of the whole cache
+//
+int bc_iterate(bcache_t *bc, int (*callback)(blk_t *b, void *ctx, bool *stop), void *ctx) {
+    blk_t *b;
+    blk_list_t *bl;
+    bc_part_t *bcp;
+    bool stop = false;
+    int err;
+    
+    for (int p = 0; p < bc->bc_nparts; p++) {
+        bcp = &bc->bc_parts[p];
+        bcp_lock(bc, bcp);
+        bcp_rehash(bc, bcp, UINT32_MAX);
+        for (int i = 0; i < bcp->bcp_htsz; i++) {
+            bl = &bcp->bcp_ht[i];
+            if (!LIST_EMPTY(bl)) {
+                LIST_FOREACH(b, bl, bl_ht_link) {
+                    if (b->bl_flags & (B_LOADING | B_ERROR)) // no bco yet
+                        continue;
+                    err = callback(b, ctx, &stop);
+                    if (err)
+                        goto error_out;
+                    if (stop)
+                        goto out;
+                }
+            }
+        }
+        lock_unlock(bcp->bcp_lock);
+    }
+    
+    return 0;
+    
+out:
+    lock_unlock(bcp->bcp_lock);
+    
+    return 0;
+    
+error_out:
+    lock_unlock(bcp->bcp_lock);
+    return err;
+}
+
+//
+// bc_flush writes out dirty blocks in blkno order. adjacent blocks live in
+// different partitions, so dirty blocks are gathered from all partitions
+// first, then sorted, then written out in runs of adjacent blocks with one
+// pwritev per run. partitions' dirty lists hold every file's blocks;
+// bc_file_flush only picks out one file's
+//
+
+typedef struct bc_flush_list {
+    blk_t **fl_blks;
+    uint32_t fl_nblks;
+    uint32_t fl_maxblks;
+    uint32_t fl_nbusy; // dirty blocks we had to leave for later
+} bc_fl_t;
+
+//
+// take all of bcp's dirty blocks (of bf, or of every file if bf is NULL) off its
+// dirty list and mark them B_WRITEBACK. a block that was re-dirtied while an
+// older copy is still being written out is left alone; its write has to finish
+// first so it can't land on top of ours
+//
+static int bcp_flush_collect(bcache_t *bc, bc_part_t *bcp, bc_file_t *bf, bc_fl_t *fl) {
+    blk_t *b, *bnext, **blks;
+    uint32_t maxblks;
+    int err = 0;
+    
+    bcp_lock(bc, bcp);
+    
+    TAILQ_FOREACH_SAFE(b, &bcp->bcp_dl, bl_dl_link, bnext) {
+        assert(b->bl_flags & B_DIRTY);
+        if (bf && (b->bl_file != bf))
+            continue;
+        if (b->bl_flags & B_WRITEBACK) {
+            fl->fl_nbusy++;
+            continue;
+        }
+        if (fl->fl_nblks == fl->fl_maxblks) {
+            maxblks = fl->fl_maxblks ? fl->fl_maxblks * 2 : 64;
+            blks = realloc(fl->fl_blks, sizeof(blk_t *) * maxblks);
+            if (!blks) {
+                err = ENOMEM;
+                goto error_out;
+            }
+            fl->fl_blks = blks;
+            fl->fl_maxblks = maxblks;
+        }
+        bl_set_flags(b, B_WRITEBACK, B_DIRTY);
+        TAILQ_REMOVE(&bcp->bcp_dl, b, bl_dl_link);
+        bcp->bcp_ndirty--;
+        bcp->bcp_nwriteback++;
+        __atomic_add_fetch(&b->bl_file->bf_nwriteback, 1, __ATOMIC_RELAXED);
+        fl->fl_blks[fl->fl_nblks++] = b;
+    }
+    
+error_out:
+    lock_unlock(bcp->bcp_lock);
+    
+    return err;
+}
+
+static void bc_flush_done(bcache_t *bc, blk_t *b, bool failed) {
+    bc_part_t *bcp = bc_part(bc, bl_key(b));
+    
+    bcp_lock(bc, bcp);
+    
+    bl_set_flags(b, 0, B_WRITEBACK);
+    bcp->bcp_nwriteback--;
+    __atomic_sub_fetch(&b->bl_file->bf_nwriteback, 1, __ATOMIC_RELEASE);
+    
+    if (failed) {
+        if (!(b->bl_flags & B_DIRTY)) {
+            bl_set_flags(b, B_DIRTY, 0);
+            TAILQ_INSERT_HEAD(&bcp->bcp_dl, b, bl_dl_link);
+            bcp->bcp_ndirty++;
+        }
+    } else
+        BC_STAT_INC(bc, bcs_writes);
+    
+    lock_unlock(bcp->bcp_lock);
+}
+
+//
+// make sure the log of every file in fl (sorted by file) that has one covers
+// its blocks before any of them are written
+//
+static int bc_flush_wal(bcache_t *bc, bc_fl_t *fl) {
+    bc_file_t *bf;
+    uint64_t lsn, maxlsn;
+    uint32_t i = 0;
+    int err;
+    
+    while (i < fl->fl_nblks) {
+        bf = fl->fl_blks[i]->bl_file;
+        maxlsn = 0;
+        for (; (i < fl->fl_nblks) && (fl->fl_blks[i]->bl_file == bf); i++) {
+            lsn = __atomic_load_n(&fl->fl_blks[i]->bl_lsn, __ATOMIC_ACQUIRE);
+            if (lsn > maxlsn)
+                maxlsn = lsn;
+        }
+        if (bf->bf_wal && maxlsn) {
+            err = bf->bf_wal(bf->bf_wal_ctx, maxlsn);
+            if (err)
+                return err;
+        }
+    }
+    
+    return 0;
+}
+
+//
+// write out fl's (sorted) blocks, BC_FLUSH_MAXRUN at a time. once a write
+// fails, no more batches are written and their blocks go back on their
+// dirty lists. so do all of them if a log can't be forced out first
+//
+static int bc_flush_write(bcache_t *bc, bc_fl_t *fl) {
+    struct iovec iov[BC_FLUSH_MAXRUN];
+    bc_ioreq_t reqs[BC_FLUSH_MAXRUN];
+    blk_t **blks = fl->fl_blks;
+    uint32_t nblks = fl->fl_nblks, n, nreqs, k, nruns = 0, nwritten = 0, maxrun = 0;
+    bool failed;
+    int err, rerr;
+    
+    err = bc_flush_wal(bc, fl);
+    
+    while (nblks) {
+        n = bc_ioreqs(bc, blks, nblks, iov, BC_FLUSH_MAXRUN, reqs, &nreqs);
+        if (!err)
+            bc_rw(bc, BC_IO_WRITE, reqs, nreqs);
+        
+        k = 0;
+        rerr = err;
+        for (uint32_t r = 0; r < nreqs; r++) {
+            // TODO: short writes aren't necessarily errors
+            failed = err || (reqs[r].bior_res != (ssize_t)reqs[r].bior_iovcnt * bc->bc_blksz);
+            if (failed && !rerr)
+                rerr = EIO;
+            for (int c = 0; c < reqs[r].bior_iovcnt; c++, k++)
+                bc_flush_done(bc, blks[k], failed);
+            if (!failed) {
+                nruns++;
+                nwritten += reqs[r].bior_iovcnt;
+                if (reqs[r].bior_iovcnt > maxrun)
+                    maxrun = reqs[r].bior_iovcnt;
+            }
+        }
+        if (!err)
+            err = rerr;
+        
+        blks += n;
+        nblks -= n;
+    }
+    
+    BC_STAT_ADD(bc, bcs_flush_runs, nruns);
+    BC_STAT_ADD(bc, bcs_flush_blocks, nwritten);
+    bc_stat_max(&bc_stats_slot(bc)->ss_stats.bcs_flush_maxrun, maxrun);
+    
+    return err;
+}
+
+static int bc_sync(bcache_t *bc, bc_file_t *bf) {
+    uint64_t start = bc_now_ns(), nbytes = 0;
+    int ret;
+    
+    // compressed files need their map committed, which takes fdatasyncs whatever bc_sync says
+    if (bf->bf_cmap) {
+        ret = bc_cfile_commit(bf, &nbytes);
+        BC_STAT_ADD(bc, bcs_write_bytes, nbytes);
+        if (ret)
+            return ret;
+        goto out;
+    }
+    
+    switch (bc->bc_sync) {
+        case BC_SYNC_FDATASYNC:
+            ret = fdatasync(bf->bf_fd);
+            break;
+#ifdef __linux__
+        case BC_SYNC_RANGE:
+            ret = sync_file_range(bf->bf_fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+                    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            break;
+#endif
+        default:
+            ret = fsync(bf->bf_fd);
+            break;
+    }
+    if (ret)
+        return errno;
+    
+out:
+    bc_hist_add(bc, BC_HIST_SYNC, bc_now_ns() - start);
+    
+    return 0;
+}
+
+// flush bf, or every file if bf is NULL
+static int bc_flush_files(bcache_t *bc, bc_file_t *bf) {
+    bc_file_t *_bf;
+    bc_fl_t fl;
+    bc_part_t *bcp;
+    int err, serr;
+    
+    memset(&fl, 0, sizeof(bc_fl_t));
+    bc_trace(bc, BC_TRACE_FLUSH, bf, 0);
+    
+again:
+    fl.fl_nblks = 0;
+    fl.fl_nbusy = 0;
+    
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        err = bcp_flush_collect(bc, &bc->bc_parts[i], bf, &fl);
+        if (err) {
+            for (uint32_t k = 0; k < fl.fl_nblks; k++)
+                bc_flush_done(bc, fl.fl_blks[k], true);
+            goto error_out;
+        }
+    }
+    
+    if (fl.fl_nblks) { // fl_blks is NULL until something is collected
+        qsort(fl.fl_blks, fl.fl_nblks, sizeof(blk_t *), bl_blkno_cmp);
+        
+        err = bc_flush_write(bc, &fl);
+        if (err)
+            goto error_out;
+    }
+    
+    if (fl.fl_nbusy) {
+        sched_yield();
+        goto again;
+    }
+    
+    //
+    // wait out any writebacks that were started before we got here, so
+    // that the sync covers them too
+    //
+    if (bf) {
+        while (__atomic_load_n(&bf->bf_nwriteback, __ATOMIC_ACQUIRE))
+            sched_yield();
+    } else {
+        for (int i = 0; i < bc->bc_nparts; i++) {
+            bcp = &bc->bc_parts[i];
+            bcp_lock(bc, bcp);
+            while (bcp->bcp_nwriteback) {
+                lock_unlock(bcp->bcp_lock);
+                sched_yield();
+                bcp_lock(bc, bcp);
+            }
+            lock_unlock(bcp->bcp_lock);
+        }
+    }
+    
+    // sync everything out
+    if (bf) {
+        err = bc_sync(bc, bf);
+    } else {
+        lock_lock(bc->bc_files_lock);
+        LIST_FOREACH(_bf, &bc->bc_files, bf_link) {
+            serr = bc_sync(bc, _bf);
+            if (serr && !err)
+                err = serr;
+        }
+        lock_unlock(bc->bc_files_lock);
+    }
+    if (err)
+        goto error_out;
+    
+    BC_STAT_INC(bc, bcs_flushes);
+    
+    free(fl.fl_blks);
+    
+    return 0;
+    
+error_out:
+    if (fl.fl_blks)
+        free(fl.fl_blks);
+    
+    return err;
+}
+
+int bc_flush(bcache_t *bc) {
+    return bc_flush_files(bc, NULL);
+}
+
+int bc_file_flush(bcache_t *bc, bc_file_t *bf) {
+    return bc_flush_files(bc, bf);
+}
+
+//
+// flush bf, evict all of its blocks and close it. none of them can still be
+// referenced. the file's dirty blocks are written out even if the cache was
+// never told to flush, since there'd be nothing to write them to afterwards
+//
+int bc_file_close(bcache_t *bc, bc_file_t *bf) {
+    bc_pf_req_t *req;
+    uint32_t n = 0;
+    bc_part_t *bcp;
+    blk_t *b, *bnext;
+    int err;
+    
+    // forget any prefetches for it, and wait out the one in progress
+    lock_lock(bc->bc_pf_lock);
+    for (uint32_t i = 0; i < bc->bc_pf_nreqs; i++) {
+        req = &bc->bc_pf_q[(bc->bc_pf_head + i) % BC_PREFETCH_QSZ];
+        if (req->pf_file != bf)
+            bc->bc_pf_q[(bc->bc_pf_head + n++) % BC_PREFETCH_QSZ] = *req;
+    }
+    bc->bc_pf_nreqs = n;
+    while (bc->bc_pf_busy == bf) {
+        lock_unlock(bc->bc_pf_lock);
+        sched_yield();
+        lock_lock(bc->bc_pf_lock);
+    }
+    lock_unlock(bc->bc_pf_lock);
+    
+    err = bc_file_flush(bc, bf);
+    if (err)
+        return err;
+    
+    for (int p = 0; p < bc->bc_nparts; p++) {
+        bcp = &bc->bc_parts[p];
+        bcp_lock(bc, bcp);
+        bcp_rehash(bc, bcp, UINT32_MAX);
+again:
+        for (uint32_t i = 0; i < bcp->bcp_htsz; i++) {
+            LIST_FOREACH_SAFE(b, &bcp->bcp_ht[i], bl_ht_link, bnext) {
+                if (b->bl_file != bf)
+                    continue;
+                if (b->bl_flags & B_WRITEBACK) { // the flusher got to it first
+                    lock_unlock(bcp->bcp_lock);
+                    sched_yield();
+                    bcp_lock(bc, bcp);
+                    goto again;
+                }
+                if (bl_refcnt(b) || (b->bl_flags & B_DIRTY)) {
+                    printf("bc_file_close: bl_blkno %" PRIu64 " is still in use\n", b->bl_blkno);
+                    lock_unlock(bcp->bcp_lock);
+                    return EBUSY;
+                }
+                if (!bcp_evict(bc, bcp, b, false)) { // a lock-free lookup has it for now. look again
+                    lock_unlock(bcp->bcp_lock);
+                    sched_yield();
+                    bcp_lock(bc, bcp);
+                    goto again;
+                }
+                bcp_unuse(bc, bcp, b);
+            }
+        }
+        lock_unlock(bcp->bcp_lock);
+    }
+    
+    lock_lock(bc->bc_files_lock);
+    LIST_REMOVE(bf, bf_link);
+    lock_unlock(bc->bc_files_lock);
+    if (bc->bc_file == bf)
+        bc->bc_file = NULL;
+    bc_file_free(bf);
+    
+    return 0;
+}
+
+//
+// one flusher pass over a partition. a partition that's over the high dirty
+// watermark is written out oldest first until it's down to the low watermark.
+// after that, only blocks that have been dirty for too long are written out.
+// referenced blocks are skipped; their holders may be in the middle of
+// changing them
+//
+static void bcp_flusher_pass(bcache_t *bc, bc_part_t *bcp) {
+    blk_t *b;
+    uint32_t nblocks, hiwat, lowat;
+    uint64_t now;
+    bool draining;
+    int err;
+    
+    bcp_lock(bc, bcp);
+    
+    // bc_set_capacity can change bcp_maxsz
+    nblocks = bcp->bcp_maxsz / bc->bc_blksz;
+    hiwat = (uint32_t)(((uint64_t)nblocks * bc->bc_dirty_hiwat) / 100);
+    lowat = (uint32_t)(((uint64_t)nblocks * bc->bc_dirty_lowat) / 100);
+    
+    now = bc_now();
+    draining = (bcp->bcp_ndirty > hiwat);
+    
+restart:
+    TAILQ_FOREACH(b, &bcp->bcp_dl, bl_dl_link) {
+        if (draining && (bcp->bcp_ndirty <= lowat))
+            draining = false;
+        if (!draining && ((now - b->bl_dirtied) < bc->bc_dirty_maxage))
+            break; // everything after this was dirtied later
+        if (bl_refcnt(b) || (b->bl_flags & B_WRITEBACK))
+            continue;
+        err = bc_writeback(bc, bcp, b);
+        if (err) {
+            printf("bc_flusher: failed to write out block %" PRIu64 ": %s\n", b->bl_blkno, strerror(err));
+            break;
+        }
+        BC_STAT_INC(bc, bcs_bg_writebacks);
+        goto restart; // the list could have changed while bcp_lock was dropped
+    }
+    
+    lock_unlock(bcp->bcp_lock);
 }
 
-uint32_t bl_type(blk_t *b) {
-    return bl_phys_type(bl_phys(b));
+static int bc_flusher(void *arg) {
+    bcache_t *bc = (bcache_t *)arg;
+    struct timespec ts;
+    bool stop;
+    
+    ts.tv_sec = bc->bc_flusher_intvl / 1000;
+    ts.tv_nsec = (bc->bc_flusher_intvl % 1000) * 1000000;
+    
+    while (1) {
+        lock_lock(bc->bc_flusher_lock);
+        stop = bc->bc_flusher_stop;
+        lock_unlock(bc->bc_flusher_lock);
+        if (stop)
+            break;
+        
+        for (int i = 0; i < bc->bc_nparts; i++)
+            bcp_flusher_pass(bc, &bc->bc_parts[i]);
+        
+        nanosleep(&ts, NULL);
+    }
+    
+    return 0;
 }
 
-void bl_dump(blk_t *b) {
-    printf("bl_blkno: %llu bl_refcount: %d%s ", b->bl_blkno, b->bl_refcnt,
-            (b->bl_flags & B_DIRTY) ? " B_DIRTY" : "");
-    if (b->bl_bco_ops->bco_dump) {
-        printf("bl_bco: ");
-        b->bl_bco_ops->bco_dump(b->bl_bco);
+uint32_t bc_currsz(bcache_t *bc) {
+    bc_part_t *bcp;
+    uint32_t currsz = 0;
+    
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bcp = &bc->bc_parts[i];
+        bcp_lock(bc, bcp);
+        currsz += bcp->bcp_currsz;
+        lock_unlock(bcp->bcp_lock);
     }
+    
+    return currsz;
 }
 
-static void bc_dump_locked(bcache_t *bc) {
-    blk_t *b;
-    blk_list_t *bl;
-    printf("block cache @ %p: ", bc);
-    printf("bc_blksz: %" PRIu32 " ", bc->bc_blksz);
-    printf("bc_currsz: %" PRIu32 " (%" PRIu32 ") ", bc->bc_currsz, bc->bc_currsz / bc->bc_blksz);
-    printf("bc_maxsz: %" PRIu32 " (%" PRIu32 ") ", bc->bc_maxsz, bc->bc_maxsz / bc->bc_blksz);
-    printf("bcs_hits: %" PRIu64 " ", bc->bc_stats.bcs_hits);
-    printf("bcs_misses: %" PRIu64 " ", bc->bc_stats.bcs_misses);
-    printf("bcs_writes: %" PRIu64 " ", bc->bc_stats.bcs_writes);
-    printf("bcs_flushes: %" PRIu64 " ", bc->bc_stats.bcs_flushes);
-    printf("\n");
-    for (int i = 0; i < (bc->bc_maxsz / bc->bc_blksz) * 2; i++) {
-        bl = &bc->bc_ht[i];
-        if (!LIST_EMPTY(bl)) {
-            printf("bc_ht[%d]:\n", i);
-            LIST_FOREACH(b, bl, bl_ht_link) {
-                printf(" ");
-                bl_dump(b);
-                printf("\n");
-            }
+//
+// log every block got, dirtied and released, and every flush, to path (which
+// is truncated) until bc_trace_stop. the trace can be replayed with bc_sim
+//
+int bc_trace_start(bcache_t *bc, const char *path) {
+    bc_trace_t *bt, *none = NULL;
+    bc_trace_hdr_t bth;
+    int ninited = 0, err;
+    
+    if (__atomic_load_n(&bc->bc_trace, __ATOMIC_RELAXED))
+        return EBUSY;
+    
+    bt = malloc(sizeof(bc_trace_t));
+    if (!bt)
+        return ENOMEM;
+    
+    memset(bt, 0, sizeof(bc_trace_t));
+    bt->bt_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (bt->bt_fd < 0) {
+        err = errno;
+        printf("bc_trace_start: couldn't open %s: %s\n", path, strerror(err));
+        goto error_out;
+    }
+    
+    for (ninited = 0; ninited < BC_NSLOTS; ninited++) {
+        bt->bt_bufs[ninited].tb_lock = lock_create();
+        if (!bt->bt_bufs[ninited].tb_lock) {
+            err = ENOMEM;
+            goto error_out;
         }
     }
-    printf("bc_dl: ");
-    LIST_FOREACH(b, &bc->bc_dl, bl_dl_link)
-        printf(" %llu", b->bl_blkno);
-    printf("\n");
-    printf("bc_fl: ");
-    TAILQ_FOREACH(b, &bc->bc_fl, bl_fl_link)
-        printf(" %llu", b->bl_blkno);
-    printf("\n");
+    
+    memset(&bth, 0, sizeof(bc_trace_hdr_t));
+    bth.bth_magic = BC_TRACE_MAGIC;
+    bth.bth_version = BC_TRACE_VERSION;
+    bth.bth_blksz = bc->bc_blksz;
+    bth.bth_maxsz = bc->bc_maxsz;
+    if (pwrite(bt->bt_fd, &bth, sizeof(bc_trace_hdr_t), 0) != sizeof(bc_trace_hdr_t)) {
+        err = errno ? errno : EIO;
+        goto error_out;
+    }
+    bt->bt_off = sizeof(bc_trace_hdr_t);
+    
+    if (!__atomic_compare_exchange_n(&bc->bc_trace, &none, bt, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        err = EBUSY; // someone beat us to it
+        goto error_out;
+    }
+    
+    return 0;
+    
+error_out:
+    for (int i = 0; i < ninited; i++)
+        lock_destroy(bt->bt_bufs[i].tb_lock);
+    if (bt->bt_fd >= 0)
+        close(bt->bt_fd);
+    free(bt);
+    
+    return err;
 }
 
-void bc_dump(bcache_t *bc) {
-    lock_lock(bc->bc_lock);
-    bc_dump_locked(bc);
-    lock_unlock(bc->bc_lock);
-    return;
+int bc_trace_stop(bcache_t *bc) {
+    bc_trace_t *bt;
+    int err;
+    
+    bt = __atomic_exchange_n(&bc->bc_trace, NULL, __ATOMIC_SEQ_CST);
+    if (!bt)
+        return EINVAL;
+    
+    bc_rcu_wait(bc); // anyone still adding records to it
+    
+    for (int i = 0; i < BC_NSLOTS; i++) {
+        bt_write(bt, &bt->bt_bufs[i]);
+        lock_destroy(bt->bt_bufs[i].tb_lock);
+    }
+    
+    err = bt->bt_err;
+    if (close(bt->bt_fd) && !err)
+        err = errno;
+    free(bt);
+    
+    return err;
 }
 
-bcache_t *bc_create(char *path, uint32_t blksz, uint32_t maxsz){
-    bcache_t *bc = NULL;
+//
+// simulation:
+//  a bc_sim_t is a cut down cache made of the same partitions and policies as
+//  the real thing, but its blocks have no frames, bcos or locks, and it's only
+//  ever used by one thread. sizes are counted in blocks (bc_blksz is 1). a
+//  miss takes over an unused block or a victim, and a dirty victim or a flush
+//  counts the writes the real cache would have done. if every block is
+//  referenced, a miss is counted as bypassed, where the real cache would have
+//  failed with ENOMEM
+//
+
+bc_sim_t *bc_sim_create(bc_policy_t *policy, uint32_t nblocks, uint32_t nparts) {
+    bcache_t *bc;
+    bc_sim_t *bs;
+    blk_t *b;
+    uint32_t pblocks;
+    int ninited = 0;
+    
+    if (!nparts)
+        nparts = 1;
+    if (nparts > nblocks) {
+        printf("bc_sim_create: every partition needs at least one block\n");
+        return NULL;
+    }
+    
+    bs = malloc(sizeof(bc_sim_t));
+    if (!bs)
+        return NULL;
+    
+    memset(bs, 0, sizeof(bc_sim_t));
     
     bc = malloc(sizeof(bcache_t));
     if (!bc)
         goto error_out;
     
     memset(bc, 0, sizeof(bcache_t));
+    bs->bs_bc = bc;
+    bc->bc_blksz = 1;
+    bc->bc_maxsz = nblocks;
+    bc->bc_nparts = nparts;
+    bc->bc_nblocks = nblocks;
     
-    bc->bc_lock = lock_create();
-    if (!bc->bc_lock)
+    // policies count their ghost hits etc. in here
+    if (posix_memalign((void **)&bc->bc_stats, 64, sizeof(bc_stats_slot_t) * BC_NSLOTS)) {
+        bc->bc_stats = NULL;
         goto error_out;
+    }
+    memset(bc->bc_stats, 0, sizeof(bc_stats_slot_t) * BC_NSLOTS);
     
-    bc->bc_fd = open(path, O_RDWR);
-    if (bc->bc_fd < 0) {
-        printf("cache_create: couldn't open %s: %s\n", path, strerror(errno));
+    bs->bs_blks = malloc(sizeof(blk_t) * nblocks);
+    if (!bs->bs_blks)
         goto error_out;
-    }
     
-    bc->bc_blksz = blksz;
-    bc->bc_currsz = 0;
-    bc->bc_maxsz = maxsz;
+    memset(bs->bs_blks, 0, sizeof(blk_t) * nblocks);
     
-    bc->bc_ht = malloc(sizeof(blk_list_t) * ((bc->bc_maxsz / bc->bc_blksz) * 2));
-    if (!bc->bc_ht)
+    bc->bc_parts = malloc(sizeof(bc_part_t) * nparts);
+    if (!bc->bc_parts)
         goto error_out;
     
-    memset(bc->bc_ht, 0, sizeof(blk_list_t) * ((bc->bc_maxsz / bc->bc_blksz) * 2));
-    
-    TAILQ_INIT(&bc->bc_fl);
+    b = bs->bs_blks;
+    for (int i = 0; i < nparts; i++) {
+        pblocks = bc_part_nblocks(bc, nblocks, i);
+        if (bcp_init(bc, &bc->bc_parts[i], pblocks, 1, policy))
+            goto error_out;
+        ninited++;
+        for (uint32_t j = 0; j < pblocks; j++, b++) {
+            b->bl_refcnt = BL_DEAD;
+            LIST_INSERT_HEAD(&bc->bc_parts[i].bcp_unused, b, bl_ht_link);
+        }
+        bc->bc_parts[i].bcp_nblocks = pblocks;
+    }
     
-    return bc;
+    return bs;
     
 error_out:
     if (bc) {
-        if (bc->bc_lock)
-            lock_destroy(bc->bc_lock);
-        if (bc->bc_fd)
-            close(bc->bc_fd);
-        if (bc->bc_ht)
-            free(bc->bc_ht);
+        if (bc->bc_parts) {
+            for (int i = 0; i < ninited; i++) {
+                bc->bc_parts[i].bcp_policy->bpo_destroy(&bc->bc_parts[i]);
+                lock_destroy(bc->bc_parts[i].bcp_lock);
+                free(bc->bc_parts[i].bcp_ht);
+            }
+            free(bc->bc_parts);
+        }
+        if (bc->bc_stats)
+            free(bc->bc_stats);
         free(bc);
     }
+    if (bs->bs_blks)
+        free(bs->bs_blks);
+    free(bs);
     
     return NULL;
 }
 
-// TODO: synchronize this
-void bc_destroy(bcache_t *bc) {
-    blk_t *b, *bnext;
-    blk_list_t *bl;
+// files are made up as they turn up in the trace
+static bc_file_t *bc_sim_file(bc_sim_t *bs, uint32_t id) {
+    bc_file_t **files, *bf;
     
-    if (!LIST_EMPTY(&bc->bc_dl))
-        printf("bc_destroy: WARNING: dirty list not empty\n");
+    if (id >= bs->bs_nfiles) {
+        files = realloc(bs->bs_files, sizeof(bc_file_t *) * (id + 1));
+        if (!files)
+            return NULL;
+        memset(&files[bs->bs_nfiles], 0, sizeof(bc_file_t *) * (id + 1 - bs->bs_nfiles));
+        bs->bs_files = files;
+        bs->bs_nfiles = id + 1;
+    }
     
-    for (int i = 0; i < (bc->bc_maxsz / bc->bc_blksz) * 2; i++) {
-        bl = &bc->bc_ht[i];
-        if (!LIST_EMPTY(bl)) {
-            LIST_FOREACH_SAFE(b, bl, bl_ht_link, bnext) {
-                b->bl_bco_ops->bco_destroy(b->bl_bco);
-                free(b->bl_bco_ops);
-                free(b->bl_phys);
-                assert(b->bl_refcnt == 0);
-                if (b->bl_flags & B_DIRTY)
-                    printf("bc_destroy: bl_blkno %" PRIu64 " destroyed while dirty\n", b->bl_blkno);
-                free(b);
-            }
-        }
+    if (!bs->bs_files[id]) {
+        bf = malloc(sizeof(bc_file_t));
+        if (!bf)
+            return NULL;
+        memset(bf, 0, sizeof(bc_file_t));
+        bf->bf_fd = -1;
+        bf->bf_id = id;
+        bs->bs_files[id] = bf;
     }
     
-    free(bc->bc_ht);
-    close(bc->bc_fd);
-    lock_destroy(bc->bc_lock);
-    free(bc);
+    return bs->bs_files[id];
 }
 
-int bc_get(bcache_t *bc, uint64_t blkno, bco_ops_t *bco_ops, void **bco) {
+static void bc_sim_clean(bc_sim_t *bs, bc_part_t *bcp, blk_t *b) {
+    TAILQ_REMOVE(&bcp->bcp_dl, b, bl_dl_link);
+    bcp->bcp_ndirty--;
+    bl_set_flags(b, 0, B_DIRTY);
+    bs->bs_writes++;
+}
+
+// the same steps as bcp_lookup
+static void bc_sim_get(bc_sim_t *bs, bc_file_t *bf, uint64_t blkno) {
+    bcache_t *bc = bs->bs_bc;
+    uint64_t key = bc_key(bf, blkno);
+    bc_part_t *bcp = bc_part(bc, key);
     blk_t *b;
-    blk_list_t *bl;
-    bool alloced_b = false;
-    int err;
     
-    lock_lock(bc->bc_lock);
+    bs->bs_gets++;
+    if (bcp->bcp_policy->bpo_access)
+        bcp->bcp_policy->bpo_access(bcp, key);
     
-    bl = &bc->bc_ht[blkno % ((bc->bc_maxsz / bc->bc_blksz) * 2)];
-    LIST_FOREACH(b, bl, bl_ht_link) {
-        if (b->bl_blkno == blkno) {
-            bc->bc_stats.bcs_hits++;
-            goto found;
-        }
+    b = bcp_find(bc, bcp, bf, blkno);
+    if (b) {
+        bl_touch(b);
+        b->bl_refcnt++;
+        return;
     }
     
-    bc->bc_stats.bcs_misses++;
+    bs->bs_misses++;
     
-    // it's not in the cache, so we need to read it from disk
-    if ((bc->bc_currsz + bc->bc_blksz) > bc->bc_maxsz) {
-        //
-        // cache is at max capacity. evict a block
-        //
-        if (TAILQ_EMPTY(&bc->bc_fl)) {
-            printf("bc_get: no blocks free\n");
-            //bc_dump_locked(bc);
-            err = ENOMEM;
-            goto error_out;
-        }
-        b = TAILQ_FIRST(&bc->bc_fl);
-        
-        // flush it out if it's dirty
-        if (b->bl_flags & B_DIRTY) {
-            // TODO: drop lock
-            if (pwrite(bc->bc_fd, b->bl_phys, bc->bc_blksz, b->bl_blkno * bc->bc_blksz) != bc->bc_blksz) {
-                err = EIO;
-                goto error_out;
+    if ((bcp->bcp_currsz + 1) > bcp->bcp_maxsz) {
+        for (;;) {
+            b = bcp->bcp_policy->bpo_victim(bcp);
+            if (!b) {
+                bs->bs_bypassed++;
+                return;
             }
-            b->bl_flags &= ~B_DIRTY;
-            LIST_REMOVE(b, bl_dl_link);
-            bc->bc_stats.bcs_writes++;
+            if (!(b->bl_flags & B_DIRTY))
+                break;
+            bc_sim_clean(bs, bcp, b); // written back. the real cache picks again
         }
-        
-        // read in the new block
-        if (pread(bc->bc_fd, b->bl_phys, bc->bc_blksz, blkno * bc->bc_blksz) != bc->bc_blksz) {
-            err = EIO;
-            goto error_out;
-        }
-        
-        b->bl_blkno = blkno;
-        
-        // re-init bco
-        b->bl_bco_ops->bco_destroy(b->bl_bco);
-        b->bl_bco = NULL;
-        
-        memcpy(b->bl_bco_ops, bco_ops, sizeof(bco_ops_t));
-        
-        err = b->bl_bco_ops->bco_init(&b->bl_bco, b);
-        if (err)
-            goto error_out;
-        
-        // get it on the right hash list
-        LIST_REMOVE(b, bl_ht_link);
-        LIST_INSERT_HEAD(bl, b, bl_ht_link);
+        bcp_evict(bc, bcp, b, false);
     } else {
-        //
-        // cache is not yet at max capacity. allocate a block
-        //
-        b = malloc(sizeof(blk_t));
-        if (!b) {
-            printf("bc_get: failed to allocate memory for b\n");
-            err = ENOMEM;
-            goto error_out;
-        }
-        alloced_b = true;
-        
-        memset(b, 0, sizeof(blk_t));
-        
-        b->bl_rwlock = rwl_create();
-        if (!b->bl_rwlock) {
-            printf("bc_get: failed to rwl_create bl_rwlock\n");
-            err = ENOMEM;
-            goto error_out;
-        }
-        
-        b->bl_bco_ops = malloc(sizeof(bco_ops_t));
-        if (!b->bl_bco_ops) {
-            printf("bc_get: failed to allocate memory for bl_bco_ops\n");
-            err = ENOMEM;
-            goto error_out;
-        }
-        memcpy(b->bl_bco_ops, bco_ops, sizeof(bco_ops_t));
-        
-        b->bl_phys = malloc(bc->bc_blksz);
-        if (!b->bl_phys) {
-            printf("bc_get: failed to allocate memory for bl_phys\n");
-            err = ENOMEM;
-            goto error_out;
+        b = LIST_FIRST(&bcp->bcp_unused);
+        bl_ht_remove(b);
+        bcp->bcp_currsz++;
+    }
+    
+    b->bl_file = bf;
+    b->bl_blkno = blkno;
+    b->bl_ref = false;
+    b->bl_refcnt = 1;
+    bl_ht_insert(bcp_bucket(bc, bcp, key), b);
+    bcp->bcp_policy->bpo_insert(bcp, b);
+}
+
+void bc_sim_step(bc_sim_t *bs, bc_trace_rec_t *btr) {
+    bcache_t *bc = bs->bs_bc;
+    bc_file_t *bf = NULL;
+    bc_part_t *bcp = NULL;
+    blk_t *b = NULL, *bnext;
+    
+    if (btr->btr_file != BC_TRACE_ALLFILES) {
+        bf = bc_sim_file(bs, btr->btr_file);
+        if (!bf) {
+            printf("bc_sim_step: no memory for file %" PRIu32 "\n", btr->btr_file);
+            return;
         }
-        
-        // TODO: this should loop until all data is read in as long as pread != -1; short reads aren't errors
-        // TODO: drop lock
-        if (pread(bc->bc_fd, b->bl_phys, bc->bc_blksz, blkno * bc->bc_blksz) != bc->bc_blksz) {
-            err = EIO;
-            goto error_out;
+        if (btr->btr_op != BC_TRACE_FLUSH) {
+            bcp = bc_part(bc, bc_key(bf, btr->btr_blkno));
+            b = bcp_find(bc, bcp, bf, btr->btr_blkno);
         }
-        
-        b->bl_blkno = blkno;
-        
-        err = b->bl_bco_ops->bco_init(&b->bl_bco, b);
-        if (err)
-            goto error_out;
-        
-        LIST_INSERT_HEAD(bl, b, bl_ht_link);
-        TAILQ_INSERT_TAIL(&bc->bc_fl, b, bl_fl_link);
-        bc->bc_currsz += bc->bc_blksz;
     }
     
-found:
-    if (b->bl_refcnt == 0) {
-        //
-        // if it was free, it isn't anymore.
-        // take it off the free list
-        //
-        TAILQ_REMOVE(&bc->bc_fl, b, bl_fl_link);
-    }
-    b->bl_refcnt++;
-    *bco = b->bl_bco;
-    lock_unlock(bc->bc_lock);
+    switch (btr->btr_op) {
+    case BC_TRACE_GET:
+        bc_sim_get(bs, bf, btr->btr_blkno);
+        break;
     
-    return 0;
+    // blocks that aren't there were got before the trace started, or bypassed
+    case BC_TRACE_DIRTY:
+        if (b && !(b->bl_flags & B_DIRTY)) {
+            bl_set_flags(b, B_DIRTY, 0);
+            TAILQ_INSERT_TAIL(&bcp->bcp_dl, b, bl_dl_link);
+            bcp->bcp_ndirty++;
+        }
+        break;
     
-error_out:
-    if (alloced_b) {
-        if (b->bl_rwlock)
-            rwl_destroy(b->bl_rwlock);
-        if (b->bl_bco_ops)
-            free(b->bl_bco_ops);
-        if (b->bl_phys)
-            free(b->bl_phys);
-        free(b);
-    }
+    case BC_TRACE_RELEASE:
+        if (b && (b->bl_refcnt > 0))
+            b->bl_refcnt--;
+        break;
     
-    lock_unlock(bc->bc_lock);
+    case BC_TRACE_FLUSH:
+        for (int i = 0; i < bc->bc_nparts; i++) {
+            bcp = &bc->bc_parts[i];
+            TAILQ_FOREACH_SAFE(b, &bcp->bcp_dl, bl_dl_link, bnext) {
+                if (!bf || (b->bl_file == bf))
+                    bc_sim_clean(bs, bcp, b);
+            }
+        }
+        break;
     
-    return err;
-}
-
-void bc_dirty(bcache_t *bc, blk_t *b) {
-    lock_lock(bc->bc_lock);
-    if (!(b->bl_flags & B_DIRTY)) {
-        b->bl_flags |= B_DIRTY;
-        LIST_INSERT_HEAD(&bc->bc_dl, b, bl_dl_link);
+    default: // e.g. a hole left by a failed write
+        break;
     }
-    lock_unlock(bc->bc_lock);
-    return;
-}
-
-void bc_release(bcache_t *bc, blk_t *b) {
-    lock_lock(bc->bc_lock);
-    assert(b->bl_refcnt > 0);
-    b->bl_refcnt--;
-    if (b->bl_refcnt == 0)
-        TAILQ_INSERT_TAIL(&bc->bc_fl, b, bl_fl_link);
-    lock_unlock(bc->bc_lock);
-    return;
 }
 
-int bc_iterate(bcache_t *bc, int (*callback)(blk_t *b, void *ctx, bool *stop), void *ctx) {
-    blk_t *b;
-    blk_list_t *bl;
-    bool stop = false;
-    int err;
+void bc_sim_destroy(bc_sim_t *bs) {
+    bcache_t *bc = bs->bs_bc;
     
-    lock_lock(bc->bc_lock);
-    
-    for (int i = 0; i < (bc->bc_maxsz / bc->bc_blksz) * 2; i++) {
-        bl = &bc->bc_ht[i];
-        if (!LIST_EMPTY(bl)) {
-            LIST_FOREACH(b, bl, bl_ht_link) {
-                err = callback(b, ctx, &stop);
-                if (err)
-                    goto error_out;
-                if (stop)
-                    goto out;
-            }
-        }
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bc->bc_parts[i].bcp_policy->bpo_destroy(&bc->bc_parts[i]);
+        lock_destroy(bc->bc_parts[i].bcp_lock);
+        free(bc->bc_parts[i].bcp_ht);
     }
+    free(bc->bc_parts);
+    free(bc->bc_stats);
+    free(bc);
     
-out:
-    lock_unlock(bc->bc_lock);
-    
-    return 0;
-    
-error_out:
-    lock_unlock(bc->bc_lock);
-    return err;
+    for (uint32_t i = 0; i < bs->bs_nfiles; i++) {
+        if (bs->bs_files[i])
+            free(bs->bs_files[i]);
+    }
+    if (bs->bs_files)
+        free(bs->bs_files);
+    free(bs->bs_blks);
+    free(bs);
 }
 
-int bc_flush(bcache_t *bc) {
-    blk_t *b, *bnext;
-    int err;
+//
+// grow or shrink a live cache to maxsz. partitions that are short of blk_ts get
+// them from a new arena, and their hash tables are rehashed into bigger ones as
+// they're used. shrinking evicts blocks, writing back dirty ones, until each
+// partition fits; anything still referenced goes once it's released
+//
+int bc_set_capacity(bcache_t *bc, uint32_t maxsz) {
+    uint32_t nblocks = maxsz / bc->bc_blksz, pblocks, need = 0;
+    blk_list_t **hts = NULL;
+    bc_part_t *bcp;
+    blk_t *b = NULL;
+    int err = 0, rerr;
     
-    lock_lock(bc->bc_lock);
+    if (nblocks < bc->bc_nparts) {
+        printf("bc_set_capacity: every partition needs at least one block\n");
+        return EINVAL;
+    }
     
-    LIST_FOREACH_SAFE(b, &bc->bc_dl, bl_dl_link, bnext) {
-        assert(b->bl_flags & B_DIRTY);
-        if (pwrite(bc->bc_fd, b->bl_phys, bc->bc_blksz, b->bl_blkno * bc->bc_blksz) != bc->bc_blksz) {
-            err = EIO;
-            goto error_out;
+    lock_lock(bc->bc_resize_lock);
+    
+    // everything that can fail up front. bcp_nblocks and bcp_htsz only change
+    // with bc_resize_lock held
+    hts = malloc(sizeof(blk_list_t *) * bc->bc_nparts);
+    if (!hts) {
+        err = ENOMEM;
+        goto out;
+    }
+    memset(hts, 0, sizeof(blk_list_t *) * bc->bc_nparts);
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bcp = &bc->bc_parts[i];
+        pblocks = bc_part_nblocks(bc, nblocks, i);
+        if (pblocks > bcp->bcp_nblocks)
+            need += pblocks - bcp->bcp_nblocks;
+        if (pblocks * 2 > bcp->bcp_htsz) {
+            hts[i] = malloc(sizeof(blk_list_t) * pblocks * 2);
+            if (!hts[i]) {
+                err = ENOMEM;
+                goto out;
+            }
+            memset(hts[i], 0, sizeof(blk_list_t) * pblocks * 2);
         }
-        b->bl_flags &= ~B_DIRTY;
-        LIST_REMOVE(b, bl_dl_link);
-        bc->bc_stats.bcs_writes++;
     }
-    
-    // sync everything out
-    err = fsync(bc->bc_fd);
-    if (err) {
-        err = errno;
-        goto error_out;
+    if (need) {
+        err = bc_arena_create(bc, need);
+        if (err)
+            goto out;
+        b = bc->bc_arena->ba_blks;
     }
     
-    bc->bc_stats.bcs_flushes++;
+    if (nblocks * bc->bc_blksz > bc->bc_maxsz)
+        bc->bc_maxsz = nblocks * bc->bc_blksz;
     
-    lock_unlock(bc->bc_lock);
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bcp = &bc->bc_parts[i];
+        pblocks = bc_part_nblocks(bc, nblocks, i);
+        
+        bcp_lock(bc, bcp);
+        
+        for (; bcp->bcp_nblocks < pblocks; bcp->bcp_nblocks++, b++)
+            LIST_INSERT_HEAD(&bcp->bcp_unused, b, bl_ht_link);
+        
+        if (hts[i]) {
+            bcp_rehash(bc, bcp, UINT32_MAX); // finish off the last one
+            bcp->bcp_ht_old = bcp->bcp_ht;
+            bcp->bcp_htsz_old = bcp->bcp_htsz;
+            bcp->bcp_rehash = 0;
+            bcp_ht_publish(bcp, hts[i], pblocks * 2);
+            hts[i] = NULL;
+        }
+        
+        bcp->bcp_maxsz = pblocks * bc->bc_blksz;
+        if (bcp->bcp_policy->bpo_resize)
+            bcp->bcp_policy->bpo_resize(bcp, pblocks);
+        bcp_set_pinned_max(bc, bcp);
+        
+        rerr = bcp_shrink(bc, bcp);
+        if (rerr && !err)
+            err = rerr;
+        
+        lock_unlock(bcp->bcp_lock);
+    }
     
-    return 0;
+    bc->bc_maxsz = nblocks * bc->bc_blksz;
+    
+out:
+    lock_unlock(bc->bc_resize_lock);
+    if (hts) {
+        for (int i = 0; i < bc->bc_nparts; i++) {
+            if (hts[i])
+                free(hts[i]);
+        }
+        free(hts);
+    }
     
-error_out:
-    lock_unlock(bc->bc_lock);
     return err;
 }
 
-void bc_check(bcache_t *bc) {
+static void bcp_check(bcache_t *bc, bc_part_t *bcp) {
     blk_t *b, *_b;
     blk_list_t *bl;
-    uint32_t nblocks = 0;
-    bool free, dirty;
-    lock_lock(bc->bc_lock);
-    for (int i = 0; i < (bc->bc_maxsz / bc->bc_blksz) * 2; i++) {
-        bl = &bc->bc_ht[i];
+    uint32_t nblocks = 0, ndirty = 0;
+    uint32_t nunused = 0, npinned = 0;
+    bool dirty;
+    bcp_lock(bc, bcp);
+    bcp_rehash(bc, bcp, UINT32_MAX);
+    for (int i = 0; i < bcp->bcp_htsz; i++) {
+        bl = &bcp->bcp_ht[i];
         if (!LIST_EMPTY(bl)) {
             LIST_FOREACH(b, bl, bl_ht_link) {
-                free = false;
                 dirty = false;
-                LIST_FOREACH(_b, &bc->bc_dl, bl_dl_link) {
+                assert(b->bl_file && (bc_part(bc, bl_key(b)) == bcp));
+                TAILQ_FOREACH(_b, &bcp->bcp_dl, bl_dl_link) {
                     if (_b == b) {
                         assert(!dirty); // make sure there aren't duplicates
                         dirty = true;
                     }
                 }
-                TAILQ_FOREACH(_b, &bc->bc_fl, bl_fl_link) {
-                    if (_b == b) {
-                        assert(!free); // make sure there aren't duplicates
-                        free = true;
-                    }
-                }
-                assert((free && (b->bl_refcnt == 0)) || (b->bl_refcnt > 0));
+                assert(b->bl_refcnt >= 0);
                 assert((dirty && (b->bl_flags & B_DIRTY)) || !(b->bl_flags & B_DIRTY));
-                if (b->bl_bco_ops->bco_check)
+                assert(!(b->bl_flags & B_LOADING) || (b->bl_refcnt > 0));
+                if (b->bl_bco && b->bl_bco_ops->bco_check)
                     b->bl_bco_ops->bco_check(b->bl_bco);
                 nblocks++;
             }
         }
     }
-    assert(bc->bc_currsz == (nblocks * bc->bc_blksz));
-    assert(bc->bc_currsz <= bc->bc_maxsz);
-    lock_unlock(bc->bc_lock);
+    TAILQ_FOREACH(b, &bcp->bcp_dl, bl_dl_link) {
+        assert(b->bl_flags & B_DIRTY);
+        ndirty++;
+    }
+    assert(bcp->bcp_ndirty == ndirty);
+    TAILQ_FOREACH(b, &bcp->bcp_pinned, bl_pl_link) {
+        assert((b->bl_flags & B_PINNED) && (b->bl_refcnt >= 0));
+        npinned++;
+    }
+    assert((bcp->bcp_npinned == npinned) && (npinned <= bcp->bcp_pinned_max));
+    LIST_FOREACH(b, &bcp->bcp_unused, bl_ht_link) {
+        assert(b->bl_refcnt == BL_DEAD);
+        nunused++;
+    }
+    assert(bcp->bcp_currsz == (nblocks * bc->bc_blksz));
+    assert(nblocks + nunused == bcp->bcp_nblocks);
+    assert(bcp->bcp_maxsz <= bcp->bcp_nblocks * bc->bc_blksz);
+    if (bcp->bcp_policy->bpo_check)
+        bcp->bcp_policy->bpo_check(bcp);
+    lock_unlock(bcp->bcp_lock);
+    return;
+}
+
+void bc_check(bcache_t *bc) {
+    uint32_t maxsz = 0;
+    bc_file_t *bf;
+    lock_lock(bc->bc_resize_lock); // so the partitions' sizes add up
+    for (int i = 0; i < bc->bc_nparts; i++) {
+        bcp_check(bc, &bc->bc_parts[i]);
+        maxsz += bc->bc_parts[i].bcp_maxsz;
+    }
+    assert(maxsz <= bc->bc_maxsz);
+    lock_unlock(bc->bc_resize_lock);
+    lock_lock(bc->bc_files_lock);
+    LIST_FOREACH(bf, &bc->bc_files, bf_link) {
+        if (bf->bf_cmap)
+            bc_cfile_check(bf);
+    }
+    lock_unlock(bc->bc_files_lock);
     return;
 }
@@ -38,6 +38,24 @@ typedef struct test_bcache_object { // btree node, for example
 } tbco_t;
 
 static int tbco_init(void **bco, blk_t *b) {
+    tbco_t *tbco = (tbco_t *)*bco; // our slot in the cache
+    
+    tbco->bco_block = b;
+    tbco->bco_phys = (tbco_phys_t *)b->bl_phys;
+    
+    return 0;
+}
+
+static bco_ops_t tbco_ops = {
+    .bco_size = sizeof(tbco_t),
+    .bco_init = tbco_init,
+    .bco_destroy = NULL,
+    .bco_dump = NULL,
+    .bco_check = NULL
+};
+
+// the same, but allocating the object ourselves
+static int tbco_malloc_init(void **bco, blk_t *b) {
     tbco_t **tbco, *_tbco;
     tbco_phys_t *tbcop = (tbco_phys_t *)b->bl_phys;
     int err;
@@ -62,14 +80,14 @@ error_out:
     return err;
 }
 
-static void tbco_destroy(void *bco) {
+static void tbco_malloc_destroy(void *bco) {
     tbco_t *tbco = (tbco_t *)bco;
     free(tbco);
 }
 
-static bco_ops_t tbco_ops = {
-    .bco_init = tbco_init,
-    .bco_destroy = tbco_destroy,
+static bco_ops_t tbco_malloc_ops = {
+    .bco_init = tbco_malloc_init,
+    .bco_destroy = tbco_malloc_destroy,
     .bco_dump = NULL,
     .bco_check = NULL
 };
@@ -110,6 +128,26 @@ static void create_and_init_backing_file(const char *fname) {
     assert(close(fd) == 0);
 }
 
+// the same, compressed
+static void create_and_init_compressed_file(const char *fname) {
+    bc_blkfile_t *bbf;
+    uint8_t buf[TEST_BCACHE_BLKSZ];
+    int fd;
+    
+    assert(unlink(fname) == 0 || (errno == ENOENT));
+    fd = open(fname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    assert(close(fd) == 0);
+    
+    memset(buf, 0, sizeof(buf));
+    assert(bc_blkfile_open(fname, TEST_BCACHE_BLKSZ, BC_COMPRESS, &bbf) == 0);
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        *(uint64_t *)buf = (uint64_t)i;
+        assert(bc_blkfile_write(bbf, i, buf) == 0);
+    }
+    assert(bc_blkfile_close(bbf) == 0);
+}
+
 //
 // get, modify and release all blocks in the file
 // will cause blocks to get evicted and flushed
@@ -127,7 +165,7 @@ static void test_bcache2(void) {
     
     create_and_init_backing_file(fname);
     
-    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ));
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, NULL));
     
     for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
         assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
@@ -152,7 +190,8 @@ static void test_bcache2(void) {
     bc_check(bc);
     
     // all blocks should have been flushed via bc_get, so no need to bc_flush
-    assert(LIST_EMPTY(&bc->bc_dl));
+    for (int i = 0; i < bc->bc_nparts; i++)
+        assert(TAILQ_EMPTY(&bc->bc_parts[i].bcp_dl));
     
     bc_destroy(bc);
     free(fname);
@@ -175,10 +214,10 @@ static void test_bcache1(void) {
     
     create_and_init_backing_file(fname);
     
-    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ));
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, NULL));
     
     for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
-        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(bc_get(bc, i, &tbco_malloc_ops, (void **)&tbco) == 0);
         tbcop = tbco->bco_phys;
         assert(tbcop->bcp_data == (uint64_t)i);
         bc_check(bc);
@@ -248,19 +287,23 @@ static int tbr_thr_start(void *arg) {
     return 0;
 }
 
-static void test_bcache_random(int num_ops) {
+static void test_bcache_random(int num_ops, uint32_t nparts, bc_policy_t *policy, uint32_t flags, bc_io_t *io) {
     bcache_t *bc;
+    bc_opts_t opts;
     char *tname = "test_bcache_random", *fname, thr_name[5];;
     uint64_t *blocks;
     thread_t *threads[8];
     tbr_thr_start_arg_t targ[8];
     
-    printf("%s (num_ops %d)\n", tname, num_ops);
+    printf("%s (num_ops %d nparts %" PRIu32 " policy %s flags 0x%" PRIx32 " io %s)\n", tname, num_ops, nparts, policy->bpo_name, flags, io->bio_name);
     
     assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
     sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
     
-    create_and_init_backing_file(fname);
+    if (flags & BC_COMPRESS)
+        create_and_init_compressed_file(fname);
+    else
+        create_and_init_backing_file(fname);
     
     assert(blocks = malloc(sizeof(uint64_t) * TEST_BCACHE_NFBLOCKS));
     
@@ -269,7 +312,15 @@ static void test_bcache_random(int num_ops) {
     
     //dump_blocks(blocks);
     
-    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ));
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = nparts;
+    opts.bcop_policy = policy;
+    opts.bcop_flags = flags;
+    opts.bcop_io = io;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    if (bc->bc_io != io)
+        printf("  (fell back to %s)\n", bc->bc_io->bio_name);
     
     // spawn 8 threads, have them each do num_ops / 8 random operations
     for (int i = 0; i < 8; i++) {
@@ -301,45 +352,1676 @@ static void test_bcache_random(int num_ops) {
     free(blocks);
 }
 
-#define DEFAULT_NUM_OPS (TEST_BCACHE_NFBLOCKS * 8)
+typedef struct tbs_thr_start_arg {
+    thread_t *t;
+    bcache_t *bc;
+} tbs_thr_start_arg_t;
 
-int main(int argc, char **argv) {
-    unsigned int seed = 0;
-    int ch, num_ops = DEFAULT_NUM_OPS, err;
+static int tbs_thr_start(void *arg) {
+    tbs_thr_start_arg_t *targ = (tbs_thr_start_arg_t *)arg;
+    bcache_t *bc = targ->bc;
+    tbco_t *tbco;
+    tbco_phys_t *tbcop;
     
-    struct option longopts[] = {
-        { "num",    required_argument,   NULL,   'n' },
-        { "seed",   required_argument,   NULL,   's' },
-        { NULL,                0,        NULL,    0 }
-    };
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        tbcop = tbco->bco_phys;
+        assert(tbcop->bcp_data == (uint64_t)i);
+        bc_release(bc, tbco_block(tbco));
+    }
+    
+    return 0;
+}
 
-    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
-        switch (ch) {
-            case 'n':
-                num_ops = (int)strtol(optarg, NULL, 10);
-                break;
-            case 's':
-                seed = (unsigned int)strtol(optarg, NULL, 10);
-                break;
-            default:
-                printf("usage: %s [--num <num-elements>] [--seed <seed>]\n", argv[0]);
-                return -1;
-        }
+//
+// have 8 threads walk the file in the same order, so that they
+// all miss on the same blocks at the same time
+//
+static void test_bcache_same_blocks(void) {
+    bcache_t *bc;
+    char *tname = "test_bcache_same_blocks", *fname, thr_name[5];
+    thread_t *threads[8];
+    tbs_thr_start_arg_t targ[8];
+    bc_stats_t bcs;
+    
+    printf("%s\n", tname);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, NULL));
+    
+    for (int i = 0; i < 8; i++) {
+        sprintf(thr_name, "%s%d", "thr", i);
+        assert(threads[i] = thread_create(thr_name));
+        
+        memset(&targ[i], 0, sizeof(tbs_thr_start_arg_t));
+        targ[i].t = threads[i];
+        targ[i].bc = bc;
+        
+        assert(thread_start(threads[i], tbs_thr_start, &targ[i]) == 0);
     }
     
-    if (!seed) {
-        seed = (unsigned int)time(NULL);
-        srand(seed);
-    } else
-        srand(seed);
+    for (int i = 0; i < 8; i++)
+        assert(thread_wait(threads[i], NULL) == 0);
     
-    printf("seed %u\n", seed);
+    for (int i = 0; i < 8; i++)
+        thread_destroy(threads[i]);
     
-    assert(mkdir(TEST_BCACHE_DIR, S_IRWXU) == 0 || (errno == EEXIST));
+    bc_check(bc);
+    bc_get_stats(bc, &bcs);
     
-    test_bcache1();
-    test_bcache2();
-    test_bcache_random(num_ops);
+    // getters that waited on someone else's read count as hits, not misses
+    assert(bcs.bcs_misses >= TEST_BCACHE_NFBLOCKS);
+    assert(bcs.bcs_hits + bcs.bcs_misses == 8 * TEST_BCACHE_NFBLOCKS);
+    
+    bc_destroy(bc);
+    free(fname);
+}
+
+static void tbsc_get_range(bcache_t *bc, uint64_t start, uint64_t end) {
+    tbco_t *tbco;
+    
+    for (uint64_t i = start; i < end; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco->bco_phys->bcp_data == i);
+        bc_release(bc, tbco_block(tbco));
+    }
+}
+
+#define TBSC_NHOT 32
+
+//
+// touch a small hot set twice with a cache-sized scan in between, then scan
+// the rest of the file. return the number of misses taken on a last pass
+// over the hot set
+//
+static uint64_t test_bcache_scan(bc_policy_t *policy) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    char *tname = "test_bcache_scan", *fname;
+    uint64_t misses;
+    
+    printf("%s (policy %s)\n", tname, policy->bpo_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 1;
+    opts.bcop_policy = policy;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    // the two scans don't overlap, so nothing they bring in is ever seen twice
+    tbsc_get_range(bc, 0, TBSC_NHOT);
+    tbsc_get_range(bc, TEST_BCACHE_NFBLOCKS - TEST_BCACHE_NCBLOCKS, TEST_BCACHE_NFBLOCKS);
+    tbsc_get_range(bc, 0, TBSC_NHOT);
+    tbsc_get_range(bc, TBSC_NHOT, TEST_BCACHE_NFBLOCKS - TEST_BCACHE_NCBLOCKS);
+    
+    bc_get_stats(bc, &bcs);
+    misses = bcs.bcs_misses;
+    
+    tbsc_get_range(bc, 0, TBSC_NHOT);
+    
+    bc_get_stats(bc, &bcs);
+    misses = bcs.bcs_misses - misses;
+    
+    bc_check(bc);
+    
+    bc_destroy(bc);
+    free(fname);
+    
+    return misses;
+}
+
+//
+// tinylfu's admission filter: blocks that have only been asked for once can't
+// push out ones that have been asked for more, but a block that gets hot while
+// it's on the window does get in
+//
+static void test_bcache_admission(void) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    char *tname = "test_bcache_admission", *fname;
+    uint64_t misses, hot = 2 * TEST_BCACHE_NCBLOCKS + 1, cold = 2 * TEST_BCACHE_NCBLOCKS + 2;
+    
+    printf("%s\n", tname);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 1;
+    opts.bcop_policy = &bc_policy_tinylfu;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    // fill the cache with blocks that have been asked for twice, then scan past it
+    tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS);
+    tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS);
+    tbsc_get_range(bc, TEST_BCACHE_NCBLOCKS, 2 * TEST_BCACHE_NCBLOCKS);
+    bc_check(bc);
+    
+    // the scan only ever displaced the window: the last block of the fill
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_admissions == 0);
+    assert(bcs.bcs_rejections == TEST_BCACHE_NCBLOCKS);
+    misses = bcs.bcs_misses;
+    tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS - 1);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_misses == misses);
+    
+    //
+    // the blocks in the main cache have been asked for three times now. hot is
+    // asked for four times while it's on the window, so it's let in when cold
+    // pushes it off
+    //
+    for (int i = 0; i < 4; i++)
+        tbsc_get_range(bc, hot, hot + 1);
+    tbsc_get_range(bc, cold, cold + 1);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_admissions == 1);
+    misses = bcs.bcs_misses;
+    tbsc_get_range(bc, hot, hot + 1);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_misses == misses);
+    
+    bc_check(bc);
+    
+    bc_destroy(bc);
+    free(fname);
+}
+
+//
+// dirty blocks and leave them alone. the flusher should write them all
+// out on its own, first down to the low watermark, then as they age
+//
+static void test_bcache_flusher(void) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    tbco_t *tbco;
+    char *tname = "test_bcache_flusher", *fname;
+    struct timespec ts = { 0, 10 * 1000000 };
+    int ndirty = (3 * TEST_BCACHE_NCBLOCKS) / 4, i;
+    
+    printf("%s\n", tname);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_flags = BC_FLUSHER;
+    opts.bcop_dirty_maxage = 500;
+    opts.bcop_flusher_intvl = 5;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    for (i = 0; i < ndirty; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco_lock_exclusive(tbco) == 0);
+        tbco->bco_phys->bcp_data += TEST_BCACHE_NFBLOCKS;
+        bc_dirty(bc, tbco_block(tbco));
+        assert(tbco_unlock(tbco) == 0);
+        bc_release(bc, tbco_block(tbco));
+    }
+    
+    // wait for it to drain everything (up to 5 seconds)
+    for (i = 0; i < 500; i++) {
+        bc_get_stats(bc, &bcs);
+        if (bcs.bcs_bg_writebacks == ndirty)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    assert(bcs.bcs_bg_writebacks == ndirty);
+    assert(TAILQ_EMPTY(&bc->bc_parts[0].bcp_dl));
+    
+    // scan the rest of the file. every victim should be clean
+    for (i = ndirty; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        bc_release(bc, tbco_block(tbco));
+    }
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_fg_writebacks == 0);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    // make sure it all made it to disk
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, NULL));
+    for (i = 0; i < ndirty; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco->bco_phys->bcp_data == (uint64_t)(i + TEST_BCACHE_NFBLOCKS));
+        bc_release(bc, tbco_block(tbco));
+    }
+    bc_destroy(bc);
+    
+    free(fname);
+}
+
+static void tbfr_dirty(bcache_t *bc, uint64_t blkno) {
+    tbco_t *tbco;
+    
+    assert(bc_get(bc, blkno, &tbco_ops, (void **)&tbco) == 0);
+    assert(tbco_lock_exclusive(tbco) == 0);
+    tbco->bco_phys->bcp_data++;
+    bc_dirty(bc, tbco_block(tbco));
+    assert(tbco_unlock(tbco) == 0);
+    bc_release(bc, tbco_block(tbco));
+}
+
+//
+// dirty a cache's worth of blocks in random order and make sure
+// bc_flush writes them out in as few runs as it can
+//
+static void test_bcache_flush_runs(uint32_t sync, bc_io_t *io) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    char *tname = "test_bcache_flush_runs", *fname;
+    uint64_t blocks[TEST_BCACHE_NCBLOCKS], tmp, data;
+    int fd, j;
+    
+    printf("%s (sync %" PRIu32 " io %s)\n", tname, sync, io->bio_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 8;
+    opts.bcop_sync = sync;
+    opts.bcop_io = io;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS; i++)
+        blocks[i] = (uint64_t)i;
+    for (int i = TEST_BCACHE_NCBLOCKS - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = blocks[i];
+        blocks[i] = blocks[j];
+        blocks[j] = tmp;
+    }
+    
+    // every block once, then every other block again
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS; i++)
+        tbfr_dirty(bc, blocks[i]);
+    assert(bc_flush(bc) == 0);
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS; i++) {
+        if ((blocks[i] % 2) == 0)
+            tbfr_dirty(bc, blocks[i]);
+    }
+    assert(bc_flush(bc) == 0);
+    
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_flush_blocks == TEST_BCACHE_NCBLOCKS + TEST_BCACHE_NCBLOCKS / 2);
+    assert(bcs.bcs_flush_runs == 1 + TEST_BCACHE_NCBLOCKS / 2);
+    assert(bcs.bcs_flush_maxrun == TEST_BCACHE_NCBLOCKS);
+    assert(bcs.bcs_flushes == 2);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    fd = open(fname, O_RDONLY);
+    assert(fd >= 0);
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS; i++) {
+        assert(pread(fd, &data, sizeof(uint64_t), TEST_BCACHE_BLKSZ * i) == sizeof(uint64_t));
+        assert(data == (uint64_t)i + 1 + ((i % 2) == 0));
+    }
+    assert(close(fd) == 0);
+    
+    free(fname);
+}
+
+//
+// prefetch the first half of the cache and get it with bc_get_many. then
+// have a few threads prefetch and get random ranges of blocks all at once
+//
+#define TBGM_NBLKS 4
+
+typedef struct tbgm_thr_start_arg {
+    thread_t *t;
+    bcache_t *bc;
+    int num_ops;
+} tbgm_thr_start_arg_t;
+
+static int tbgm_thr_start(void *arg) {
+    tbgm_thr_start_arg_t *targ = (tbgm_thr_start_arg_t *)arg;
+    bcache_t *bc = targ->bc;
+    uint64_t blknos[TBGM_NBLKS];
+    tbco_t *tbcos[TBGM_NBLKS];
+    
+    for (int i = 0; i < targ->num_ops; i++) {
+        blknos[0] = rand() % (TEST_BCACHE_NFBLOCKS - TBGM_NBLKS * 4);
+        if (rand() % 2)
+            assert(bc_prefetch(bc, blknos[0], TBGM_NBLKS * 4, &tbco_ops) == 0);
+        for (int j = 1; j < TBGM_NBLKS; j++) // adjacent, duplicate or random
+            blknos[j] = ((rand() % 2) ? blknos[j - 1] + (rand() % 2) : rand()) % TEST_BCACHE_NFBLOCKS;
+        
+        assert(bc_get_many(bc, blknos, TBGM_NBLKS, &tbco_ops, (void **)tbcos) == 0);
+        for (int j = 0; j < TBGM_NBLKS; j++)
+            assert(tbcos[j]->bco_phys->bcp_data == blknos[j]);
+        for (int j = 0; j < TBGM_NBLKS; j++)
+            bc_release(bc, tbco_block(tbcos[j]));
+    }
+    
+    return 0;
+}
+
+static void test_bcache_get_many(int num_ops, bc_io_t *io) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    char *tname = "test_bcache_get_many", *fname, thr_name[5];
+    struct timespec ts = { 0, 10 * 1000000 };
+    uint64_t blknos[TEST_BCACHE_NCBLOCKS / 2];
+    tbco_t *tbcos[TEST_BCACHE_NCBLOCKS / 2];
+    thread_t *threads[8];
+    tbgm_thr_start_arg_t targ[8];
+    int n = TEST_BCACHE_NCBLOCKS / 2, i;
+    
+    printf("%s (io %s)\n", tname, io->bio_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_io = io;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    assert(bc_prefetch(bc, 0, n, &tbco_ops) == 0);
+    
+    // wait for it to be read in (up to 5 seconds)
+    for (i = 0; i < 500; i++) {
+        bc_get_stats(bc, &bcs);
+        if (bcs.bcs_prefetches == n)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    assert(bcs.bcs_prefetches == n);
+    assert(bcs.bcs_misses == 0);
+    
+    for (i = 0; i < n; i++)
+        blknos[i] = (uint64_t)(n - i - 1);
+    
+    assert(bc_get_many(bc, blknos, n, &tbco_ops, (void **)tbcos) == 0);
+    for (i = 0; i < n; i++) {
+        assert(tbcos[i]->bco_phys->bcp_data == blknos[i]);
+        bc_release(bc, tbco_block(tbcos[i]));
+    }
+    
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_hits == n);
+    assert(bcs.bcs_prefetch_hits == n);
+    assert(bcs.bcs_misses == 0);
+    
+    // the cache holds everyone's blocks plus a few in-flight prefetches, so nothing runs out
+    for (i = 0; i < 8; i++) {
+        sprintf(thr_name, "%s%d", "thr", i);
+        assert(threads[i] = thread_create(thr_name));
+        
+        memset(&targ[i], 0, sizeof(tbgm_thr_start_arg_t));
+        targ[i].t = threads[i];
+        targ[i].bc = bc;
+        targ[i].num_ops = num_ops / 8;
+        
+        assert(thread_start(threads[i], tbgm_thr_start, &targ[i]) == 0);
+    }
+    
+    for (i = 0; i < 8; i++)
+        assert(thread_wait(threads[i], NULL) == 0);
+    
+    for (i = 0; i < 8; i++)
+        thread_destroy(threads[i]);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    free(fname);
+}
+
+//
+// every frame, blk_t and bco should come out of the arena
+//
+static void test_bcache_arena(uint32_t flags) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    tbco_t *tbco;
+    uint8_t *arena;
+    size_t arenasz;
+    char *tname = "test_bcache_arena", *fname;
+    
+    printf("%s (flags 0x%" PRIx32 ")\n", tname, flags);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 8;
+    opts.bcop_flags = flags;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    arena = (uint8_t *)bc->bc_arena->ba_base;
+    arenasz = bc->bc_arena->ba_size;
+    assert(!bc->bc_arena->ba_next);
+    assert(bc->bc_nblocks == TEST_BCACHE_NCBLOCKS);
+    assert(((uintptr_t)arena % sysconf(_SC_PAGESIZE)) == 0);
+    assert(arenasz >= TEST_BCACHE_MAXSZ + TEST_BCACHE_NCBLOCKS * (sizeof(blk_t) + BC_BCOSZ_DEF));
+    
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco->bco_phys->bcp_data == (uint64_t)i);
+        assert(((uint8_t *)tbco >= arena) && ((uint8_t *)tbco < arena + arenasz));
+        assert(((uint8_t *)tbco_block(tbco) >= arena) && ((uint8_t *)tbco_block(tbco) < arena + arenasz));
+        assert((((uint8_t *)tbco->bco_phys - arena) % TEST_BCACHE_BLKSZ) == 0);
+        bc_release(bc, tbco_block(tbco));
+    }
+    
+    assert(bc_currsz(bc) == TEST_BCACHE_MAXSZ);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    free(fname);
+}
+
+//
+// dirty every block in the file through an O_DIRECT cache (twice, so blocks get
+// written back on eviction and by bc_flush) and check it all made it to disk.
+// blocks smaller than the device's sectors go through the bounce buffer
+//
+static void test_bcache_direct(uint32_t blksz, bc_io_t *io) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    tbco_t *tbco;
+    struct stat st;
+    char *tname = "test_bcache_direct", *fname;
+    uint64_t data;
+    int fd;
+    
+    printf("%s (blksz %" PRIu32 " io %s)\n", tname, blksz, io->bio_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    assert(unlink(fname) == 0 || (errno == ENOENT));
+    fd = open(fname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    assert(posix_fallocate(fd, 0, TEST_BCACHE_NFBLOCKS * blksz) == 0);
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        data = (uint64_t)i;
+        assert(pwrite(fd, &data, sizeof(uint64_t), (off_t)blksz * i) == sizeof(uint64_t));
+    }
+    assert(close(fd) == 0);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 4;
+    opts.bcop_flags = BC_DIRECT;
+    opts.bcop_io = io;
+    
+    assert(bc = bc_create(fname, blksz, TEST_BCACHE_NCBLOCKS * blksz, &opts));
+    if (!bc->bc_file->bf_direct)
+        printf("%s: %s doesn't support O_DIRECT. testing buffered I/O\n", tname, TEST_BCACHE_DIR);
+    else
+        assert((bc->bc_file->bf_bounce != NULL) == ((blksz % bc->bc_file->bf_dioalign) != 0));
+    
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+            assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+            assert(tbco->bco_phys->bcp_data == (uint64_t)i + pass);
+            tbco->bco_phys->bcp_data++;
+            bc_dirty(bc, tbco_block(tbco));
+            bc_release(bc, tbco_block(tbco));
+        }
+    }
+    assert(bc_flush(bc) == 0);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    fd = open(fname, O_RDONLY);
+    assert(fd >= 0);
+    assert(fstat(fd, &st) == 0);
+    assert(st.st_size == (off_t)TEST_BCACHE_NFBLOCKS * blksz);
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(pread(fd, &data, sizeof(uint64_t), (off_t)blksz * i) == sizeof(uint64_t));
+        assert(data == (uint64_t)i + 2);
+    }
+    assert(close(fd) == 0);
+    
+    free(fname);
+}
+
+//
+// same as test_bcache_direct, through a mapping. blocks should point straight
+// into it, and dirty ones should get msync'd on eviction and bc_flush
+//
+static void test_bcache_mmap(uint32_t blksz) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    tbco_t *tbco;
+    char *tname = "test_bcache_mmap", *fname;
+    uint64_t data;
+    int fd;
+    
+    printf("%s (blksz %" PRIu32 ")\n", tname, blksz);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    assert(unlink(fname) == 0 || (errno == ENOENT));
+    fd = open(fname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    assert(posix_fallocate(fd, 0, TEST_BCACHE_NFBLOCKS * blksz) == 0);
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        data = (uint64_t)i;
+        assert(pwrite(fd, &data, sizeof(uint64_t), (off_t)blksz * i) == sizeof(uint64_t));
+    }
+    assert(close(fd) == 0);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 4;
+    opts.bcop_flags = BC_MMAP;
+    
+    assert(bc = bc_create(fname, blksz, TEST_BCACHE_NCBLOCKS * blksz, &opts));
+    assert(bc->bc_file->bf_map && (bc->bc_file->bf_mapsz == TEST_BCACHE_NFBLOCKS * blksz));
+    
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+            assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+            assert((uint8_t *)tbco->bco_phys == bc->bc_file->bf_map + (size_t)i * blksz);
+            assert(tbco->bco_phys->bcp_data == (uint64_t)i + pass);
+            tbco->bco_phys->bcp_data++;
+            bc_dirty(bc, tbco_block(tbco));
+            bc_release(bc, tbco_block(tbco));
+        }
+    }
+    assert(bc_flush(bc) == 0);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_fg_writebacks == 2 * TEST_BCACHE_NFBLOCKS - TEST_BCACHE_NCBLOCKS);
+    assert(bcs.bcs_flush_blocks == TEST_BCACHE_NCBLOCKS);
+    
+    // there's nothing mapped past the end of the file
+    assert(bc_get(bc, TEST_BCACHE_NFBLOCKS, &tbco_ops, (void **)&tbco) == EIO);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    fd = open(fname, O_RDONLY);
+    assert(fd >= 0);
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(pread(fd, &data, sizeof(uint64_t), (off_t)blksz * i) == sizeof(uint64_t));
+        assert(data == (uint64_t)i + 2);
+    }
+    assert(close(fd) == 0);
+    
+    free(fname);
+}
+
+// the first TEST_BCACHE_NCBLOCKS blocks get dirtied once, the rest never are
+static void tbrs_get_range(bcache_t *bc, uint64_t start, uint64_t end, bool dirty) {
+    tbco_t *tbco;
+    
+    for (uint64_t i = start; i < end; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco->bco_phys->bcp_data == i + ((dirty || (i >= TEST_BCACHE_NCBLOCKS)) ? 0 : 1));
+        if (dirty) {
+            tbco->bco_phys->bcp_data++;
+            bc_dirty(bc, tbco_block(tbco));
+        }
+        bc_release(bc, tbco_block(tbco));
+    }
+}
+
+//
+// shrink a full, dirty cache, shrink it past blocks that are still referenced,
+// then grow it past its original size. then keep resizing it while threads
+// hammer on it
+//
+static void test_bcache_resize(bc_policy_t *policy) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    tbco_t *held[TEST_BCACHE_NCBLOCKS / 8];
+    tbr_thr_start_arg_t targ[8];
+    thread_t *threads[8];
+    char *tname = "test_bcache_resize", *fname;
+    uint64_t *blocks, hits, data;
+    bool rehashing = false;
+    int fd;
+    
+    printf("%s (policy %s)\n", tname, policy->bpo_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 8;
+    opts.bcop_policy = policy;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    assert(bc_set_capacity(bc, TEST_BCACHE_BLKSZ * 4) == EINVAL); // less than a block per partition
+    
+    // fill it with dirty blocks and shrink it to a quarter. they should all be written out
+    tbrs_get_range(bc, 0, TEST_BCACHE_NCBLOCKS, true);
+    assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ / 4) == 0);
+    assert(bc->bc_maxsz == TEST_BCACHE_MAXSZ / 4);
+    assert(bc_currsz(bc) == TEST_BCACHE_MAXSZ / 4);
+    bc_check(bc);
+    assert(bc_flush(bc) == 0);
+    fd = open(fname, O_RDONLY);
+    assert(fd >= 0);
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS; i++) {
+        assert(pread(fd, &data, sizeof(uint64_t), TEST_BCACHE_BLKSZ * i) == sizeof(uint64_t));
+        assert(data == (uint64_t)i + 1);
+    }
+    assert(close(fd) == 0);
+    
+    // hold on to a quarter's worth and shrink to an eighth. the partitions stay
+    // over until the held blocks are released and something else is read in
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS / 8; i++)
+        assert(bc_get(bc, TEST_BCACHE_NCBLOCKS + i, &tbco_ops, (void **)&held[i]) == 0);
+    tbrs_get_range(bc, 0, TEST_BCACHE_NCBLOCKS / 8, false);
+    assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ / 8) == 0);
+    assert(bc_currsz(bc) == TEST_BCACHE_MAXSZ / 8);
+    bc_check(bc);
+    for (int i = 0; i < TEST_BCACHE_NCBLOCKS / 8; i++)
+        bc_release(bc, tbco_block(held[i]));
+    tbrs_get_range(bc, 0, TEST_BCACHE_NCBLOCKS, false);
+    assert(bc_currsz(bc) == TEST_BCACHE_MAXSZ / 8);
+    bc_check(bc);
+    
+    // grow it to four times its original size. it needs a new arena, and the
+    // hash tables get rehashed as we go
+    assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ * 4) == 0);
+    assert(bc->bc_arena->ba_next && (bc->bc_nblocks == TEST_BCACHE_NCBLOCKS * 4));
+    for (int i = 0; i < bc->bc_nparts; i++)
+        rehashing = rehashing || bc->bc_parts[i].bcp_ht_old;
+    assert(rehashing);
+    tbrs_get_range(bc, 0, TEST_BCACHE_NCBLOCKS * 4, false);
+    bc_get_stats(bc, &bcs);
+    hits = bcs.bcs_hits;
+    tbrs_get_range(bc, 0, TEST_BCACHE_NCBLOCKS * 4, false);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_hits == hits + TEST_BCACHE_NCBLOCKS * 4);
+    for (int i = 0; i < bc->bc_nparts; i++)
+        assert(!bc->bc_parts[i].bcp_ht_old);
+    assert(bc_currsz(bc) == TEST_BCACHE_MAXSZ * 4);
+    bc_check(bc);
+    
+    // back down to half size (it doesn't need another arena to grow again) and
+    // then resize at random under load
+    assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ / 2) == 0);
+    bc_check(bc);
+    assert(blocks = malloc(sizeof(uint64_t) * TEST_BCACHE_NFBLOCKS));
+    for (int i = 0; i < TEST_BCACHE_NFBLOCKS; i++)
+        blocks[i] = (uint64_t)i + (i < TEST_BCACHE_NCBLOCKS ? 1 : 0);
+    for (int i = 0; i < 8; i++) {
+        assert(threads[i] = thread_create("tbrs_thr"));
+        memset(&targ[i], 0, sizeof(tbr_thr_start_arg_t));
+        targ[i].t = threads[i];
+        targ[i].blocks = blocks;
+        targ[i].bc = bc;
+        targ[i].num_ops = TEST_BCACHE_NFBLOCKS;
+        assert(thread_start(threads[i], tbr_thr_start, &targ[i]) == 0);
+    }
+    for (int i = 0; i < 64; i++) {
+        // at least 8 blocks a partition, so 8 threads can't run one out
+        assert(bc_set_capacity(bc, (TEST_BCACHE_NCBLOCKS / 2 + rand() % (TEST_BCACHE_NCBLOCKS * 4)) * TEST_BCACHE_BLKSZ) == 0);
+        bc_check(bc);
+    }
+    for (int i = 0; i < 8; i++) {
+        assert(thread_wait(threads[i], NULL) == 0);
+        thread_destroy(threads[i]);
+    }
+    assert(bc->bc_nblocks <= TEST_BCACHE_NCBLOCKS * 9 / 2 + 8);
+    
+    assert(bc_flush(bc) == 0);
+    bc_check(bc);
+    bc_destroy(bc);
+    free(blocks);
+    free(fname);
+}
+
+static int tbsh_count_cb(blk_t *b, void *ctx, bool *stop) {
+    uint32_t *counts = (uint32_t *)ctx;
+    counts[b->bl_file->bf_id]++;
+    return 0;
+}
+
+static void tbsh_get_range(bcache_t *bc, bc_file_t *bf, uint64_t start, uint64_t end, uint64_t expect, uint64_t add) {
+    tbco_t *tbco;
+    
+    for (uint64_t i = start; i < end; i++) {
+        assert(bc_file_get(bc, bf, i, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco->bco_phys->bcp_data == i + expect);
+        if (add) {
+            tbco->bco_phys->bcp_data += add;
+            bc_dirty(bc, tbco_block(tbco));
+        }
+        bc_release(bc, tbco_block(tbco));
+    }
+}
+
+static void tbsh_check_file(const char *fname, uint64_t n, uint64_t expect) {
+    uint64_t data;
+    int fd;
+    
+    fd = open(fname, O_RDONLY);
+    assert(fd >= 0);
+    for (uint64_t i = 0; i < n; i++) {
+        assert(pread(fd, &data, sizeof(uint64_t), TEST_BCACHE_BLKSZ * i) == sizeof(uint64_t));
+        assert(data == i + expect);
+    }
+    assert(close(fd) == 0);
+}
+
+//
+// three files sharing one cache. the same blkno in each is a different block,
+// each file's dirty blocks get flushed on their own, and a file that's being
+// used hard takes over the capacity the others aren't using
+//
+static void test_bcache_shared(uint32_t flags) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    bc_file_t *bf[3], *bf3;
+    tbco_t *tbco;
+    char *tname = "test_bcache_shared", *fnames[3];
+    uint32_t counts[8], n = TEST_BCACHE_NCBLOCKS / 4, id;
+    
+    printf("%s (flags 0x%" PRIx32 ")\n", tname, flags);
+    
+    for (int f = 0; f < 3; f++) {
+        assert(fnames[f] = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 4));
+        sprintf(fnames[f], "%s/%s.%d", TEST_BCACHE_DIR, tname, f);
+        create_and_init_backing_file(fnames[f]);
+    }
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 4;
+    opts.bcop_flags = flags;
+    
+    assert(bc = bc_create(NULL, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    assert(!bc->bc_file);
+    for (int f = 0; f < 3; f++)
+        assert(bf[f] = bc_file_open(bc, fnames[f]));
+    assert((bf[0]->bf_id != bf[1]->bf_id) && (bf[1]->bf_id != bf[2]->bf_id));
+    
+    // the same blknos in two files are different blocks
+    tbsh_get_range(bc, bf[0], 0, n, 0, 1);
+    tbsh_get_range(bc, bf[1], 0, n, 0, 2);
+    assert(bc_currsz(bc) == 2 * n * TEST_BCACHE_BLKSZ);
+    tbsh_get_range(bc, bf[0], 0, n, 1, 0);
+    tbsh_get_range(bc, bf[1], 0, n, 2, 0);
+    bc_check(bc);
+    
+    // flushing one file leaves the other's dirty blocks alone
+    assert(bc_file_flush(bc, bf[0]) == 0);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_flush_blocks == n);
+    assert(bcs.bcs_writes == n);
+    tbsh_check_file(fnames[0], n, 1);
+    if (!(flags & BC_MMAP)) // the mapping is the file
+        tbsh_check_file(fnames[1], n, 0);
+    
+    // a scan of the third file takes over the whole cache, writing back the
+    // second file's dirty blocks as they're evicted
+    tbsh_get_range(bc, bf[2], 0, TEST_BCACHE_NFBLOCKS, 0, 0);
+    memset(counts, 0, sizeof(counts));
+    assert(bc_iterate(bc, tbsh_count_cb, counts) == 0);
+    assert(counts[bf[0]->bf_id] == 0 && counts[bf[1]->bf_id] == 0);
+    assert(counts[bf[2]->bf_id] == TEST_BCACHE_NCBLOCKS);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_fg_writebacks == n);
+    tbsh_check_file(fnames[1], n, 2);
+    bc_check(bc);
+    
+    // a file can't be closed while its blocks are in use. closing it gives
+    // its blocks back to the cache
+    assert(bc_file_get(bc, bf[2], 0, &tbco_ops, (void **)&tbco) == 0);
+    assert(bc_file_close(bc, bf[2]) == EBUSY);
+    bc_release(bc, tbco_block(tbco));
+    id = bf[2]->bf_id;
+    assert(bc_file_close(bc, bf[2]) == 0);
+    assert(bc_currsz(bc) == 0);
+    bc_check(bc);
+    
+    // reopened, it's a new file as far as the cache is concerned
+    assert(bf3 = bc_file_open(bc, fnames[2]));
+    assert(bf3->bf_id != id);
+    tbsh_get_range(bc, bf3, 0, n, 0, 3);
+    tbsh_get_range(bc, bf[0], 0, n, 1, 0);
+    
+    assert(bc_flush(bc) == 0);
+    tbsh_check_file(fnames[2], n, 3);
+    bc_check(bc);
+    assert(bc_file_close(bc, bf[0]) == 0);
+    assert(bc_file_close(bc, bf[1]) == 0);
+    assert(bc_file_close(bc, bf3) == 0);
+    assert(bc_currsz(bc) == 0);
+    bc_destroy(bc);
+    
+    for (int f = 0; f < 3; f++)
+        free(fnames[f]);
+}
+
+//
+// block contents for test_bcache_compress: every fourth block is random, so
+// it won't compress. the rest are mostly a short repeating pattern
+//
+static void tbcm_fill(uint8_t *buf, uint64_t blkno, uint64_t gen) {
+    unsigned int seed = (unsigned int)(blkno * 31 + gen);
+    
+    ((tbco_phys_t *)buf)->bcp_data = blkno + gen;
+    for (uint32_t i = sizeof(tbco_phys_t); i < TEST_BCACHE_BLKSZ; i++)
+        buf[i] = ((blkno % 4) == 3) ? (uint8_t)rand_r(&seed) : (uint8_t)("tbr0-key:"[i % 9] + gen);
+}
+
+static void tbcm_check(uint8_t *buf, uint64_t blkno, uint64_t gen) {
+    uint8_t expect[TEST_BCACHE_BLKSZ];
+    
+    tbcm_fill(expect, blkno, gen);
+    assert(memcmp(buf, expect, TEST_BCACHE_BLKSZ) == 0);
+}
+
+static void tbcm_get_range(bcache_t *bc, uint64_t gen, bool write) {
+    tbco_t *tbco;
+    
+    for (uint64_t i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(bc_get(bc, i, &tbco_ops, (void **)&tbco) == 0);
+        if (write) {
+            tbcm_fill((uint8_t *)tbco->bco_phys, i, gen);
+            bc_dirty(bc, tbco_block(tbco));
+        } else
+            tbcm_check((uint8_t *)tbco->bco_phys, i, gen);
+        bc_release(bc, tbco_block(tbco));
+    }
+}
+
+static off_t tbcm_filesz(const char *fname) {
+    struct stat st;
+    
+    assert(stat(fname, &st) == 0);
+    
+    return st.st_size;
+}
+
+//
+// a compressed file starts out empty. blocks that have never been written
+// read back as zeros, and the rest come back the same after being evicted,
+// flushed and reopened, taking up less room and I/O than they would
+// uncompressed. extents that are rewritten get reused once the map that
+// referred to them has been replaced
+//
+static void test_bcache_compress(void) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    bc_blkfile_t *bbf;
+    tbco_t *tbco;
+    uint8_t buf[TEST_BCACHE_BLKSZ];
+    char *tname = "test_bcache_compress", *fname;
+    off_t size;
+    int fd;
+    
+    printf("%s\n", tname);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    assert(unlink(fname) == 0 || (errno == ENOENT));
+    fd = open(fname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    assert(close(fd) == 0);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 4;
+    opts.bcop_flags = BC_COMPRESS;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    assert(bc->bc_file->bf_cmap);
+    
+    // never written
+    assert(bc_get(bc, 5, &tbco_ops, (void **)&tbco) == 0);
+    memset(buf, 0, sizeof(buf));
+    assert(memcmp(tbco->bco_phys, buf, TEST_BCACHE_BLKSZ) == 0);
+    bc_release(bc, tbco_block(tbco));
+    
+    // the file is bigger than the cache, so most of these get written back as they're evicted
+    tbcm_get_range(bc, 0, true);
+    tbcm_get_range(bc, 0, false);
+    assert(bc_flush(bc) == 0);
+    bc_check(bc);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_writes >= TEST_BCACHE_NFBLOCKS);
+    assert(bcs.bcs_write_bytes < bcs.bcs_writes * TEST_BCACHE_BLKSZ / 2);
+    bc_destroy(bc);
+    size = tbcm_filesz(fname);
+    assert(size < TEST_BCACHE_FILESZ / 2);
+    
+    // it says it's compressed itself
+    opts.bcop_flags = 0;
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    assert(bc->bc_file->bf_cmap);
+    tbcm_get_range(bc, 0, false);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_read_bytes < bcs.bcs_misses * TEST_BCACHE_BLKSZ / 2);
+    
+    // the space rewritten blocks leave behind is reused after the next flush
+    tbcm_get_range(bc, 1, true);
+    assert(bc_flush(bc) == 0);
+    tbcm_get_range(bc, 2, true);
+    assert(bc_flush(bc) == 0);
+    bc_check(bc);
+    bc_destroy(bc);
+    assert(tbcm_filesz(fname) < 2 * size + TEST_BCACHE_BLKSZ);
+    
+    // without a cache
+    assert(bc_blkfile_open(fname, TEST_BCACHE_BLKSZ, 0, &bbf) == 0);
+    for (uint64_t i = 0; i < TEST_BCACHE_NFBLOCKS; i++) {
+        assert(bc_blkfile_read(bbf, i, buf) == 0);
+        tbcm_check(buf, i, 2);
+    }
+    tbcm_fill(buf, 0, 3);
+    assert(bc_blkfile_write(bbf, 0, buf) == 0);
+    assert(bc_blkfile_close(bbf) == 0);
+    assert(bc_blkfile_open(fname, TEST_BCACHE_BLKSZ, 0, &bbf) == 0);
+    assert(bc_blkfile_read(bbf, 0, buf) == 0);
+    tbcm_check(buf, 0, 3);
+    assert(bc_blkfile_read(bbf, TEST_BCACHE_NFBLOCKS, buf) == 0);
+    assert(buf[0] == 0);
+    assert(bc_blkfile_close(bbf) == 0);
+    
+    // compressed files can't be mapped
+    opts.bcop_flags = BC_MMAP;
+    assert(!bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    assert(unlink(fname) == 0);
+    free(fname);
+}
+
+//
+// a pretend write-ahead log. changes get lsns from tbw_next, and forcing it
+// out just moves tbw_durable up
+//
+typedef struct tbw_log {
+    uint64_t tbw_next; // lsn the next change gets
+    uint64_t tbw_durable; // forced out up to here
+    uint32_t tbw_calls;
+    int tbw_err; // what forcing it returns
+} tbw_log_t;
+
+static int tbw_force(void *ctx, uint64_t lsn) {
+    tbw_log_t *log = (tbw_log_t *)ctx;
+    
+    assert(lsn && (lsn < log->tbw_next));
+    log->tbw_calls++;
+    if (log->tbw_err)
+        return log->tbw_err;
+    if (lsn > log->tbw_durable)
+        log->tbw_durable = lsn;
+    
+    return 0;
+}
+
+static tbco_t *tbw_change(bcache_t *bc, tbw_log_t *log, uint64_t blkno) {
+    tbco_t *tbco;
+    
+    assert(bc_get(bc, blkno, &tbco_ops, (void **)&tbco) == 0);
+    tbco->bco_phys->bcp_data += TEST_BCACHE_NFBLOCKS;
+    bc_dirty(bc, tbco_block(tbco));
+    bc_set_lsn(bc, tbco_block(tbco), log->tbw_next++);
+    
+    return tbco;
+}
+
+static uint64_t tbw_on_disk(const char *fname, uint64_t blkno) {
+    uint64_t data;
+    int fd;
+    
+    fd = open(fname, O_RDONLY);
+    assert(fd >= 0);
+    assert(pread(fd, &data, sizeof(uint64_t), TEST_BCACHE_BLKSZ * blkno) == sizeof(uint64_t));
+    assert(close(fd) == 0);
+    
+    return data;
+}
+
+//
+// the log has to be forced out past a block's lsn before the block is written,
+// whether it's flushed or evicted, and a block that's still referenced isn't
+// written back at all
+//
+static void test_bcache_wal(void) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    tbw_log_t log;
+    tbco_t *tbco, *held;
+    char *tname = "test_bcache_wal", *fname;
+    uint32_t calls;
+    
+    printf("%s\n", tname);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 4;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    memset(&log, 0, sizeof(tbw_log_t));
+    log.tbw_next = 1;
+    assert(bc_file_set_wal(bc, bc->bc_file, tbw_force, &log) == 0);
+    
+    // one force covers a whole flush
+    for (uint64_t i = 0; i < TEST_BCACHE_NCBLOCKS / 2; i++) {
+        tbco = tbw_change(bc, &log, i);
+        assert(tbco_block(tbco)->bl_lsn == log.tbw_next - 1);
+        bc_release(bc, tbco_block(tbco));
+    }
+    assert(bc_file_flush(bc, bc->bc_file) == 0);
+    assert(log.tbw_calls == 1);
+    assert(log.tbw_durable == log.tbw_next - 1);
+    for (uint64_t i = 0; i < TEST_BCACHE_NCBLOCKS / 2; i++)
+        assert(tbw_on_disk(fname, i) == i + TEST_BCACHE_NFBLOCKS);
+    
+    //
+    // hold on to a changed block while the rest of the file goes through the
+    // cache. dirty victims force the log first, one at a time
+    //
+    held = tbw_change(bc, &log, 0);
+    bc_hold(bc, tbco_block(held));
+    bc_release(bc, tbco_block(held));
+    calls = log.tbw_calls;
+    for (uint64_t i = TEST_BCACHE_NCBLOCKS / 2; i < TEST_BCACHE_NFBLOCKS; i++)
+        bc_release(bc, tbco_block(tbw_change(bc, &log, i)));
+    assert(log.tbw_calls > calls);
+    assert(tbw_on_disk(fname, 0) == TEST_BCACHE_NFBLOCKS);
+    assert(tbco_block(held)->bl_flags & B_DIRTY);
+    bc_release(bc, tbco_block(held));
+    
+    // a log that can't be forced out keeps everything dirty
+    log.tbw_err = EIO;
+    assert(bc_file_flush(bc, bc->bc_file) == EIO);
+    assert(tbw_on_disk(fname, 0) == TEST_BCACHE_NFBLOCKS);
+    log.tbw_err = 0;
+    assert(bc_file_flush(bc, bc->bc_file) == 0);
+    assert(log.tbw_durable == log.tbw_next - 1);
+    assert(tbw_on_disk(fname, 0) == 2 * TEST_BCACHE_NFBLOCKS);
+    for (uint64_t i = 1; i < TEST_BCACHE_NFBLOCKS; i++)
+        assert(tbw_on_disk(fname, i) == i + TEST_BCACHE_NFBLOCKS);
+    
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    // the kernel writes mapped files back whenever it likes
+    opts.bcop_flags = BC_MMAP;
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    assert(bc_file_set_wal(bc, bc->bc_file, tbw_force, &log) == EINVAL);
+    bc_destroy(bc);
+    
+    assert(unlink(fname) == 0);
+    free(fname);
+}
+
+#define DEFAULT_NUM_OPS (TEST_BCACHE_NFBLOCKS * 8)
+
+static int tbl_thr_start(void *arg) {
+    tbr_thr_start_arg_t *targ = (tbr_thr_start_arg_t *)arg;
+    uint64_t blkno;
+    tbco_t *tbco;
+    
+    for (int i = 0; i < targ->num_ops; i++) {
+        blkno = rand() % (TEST_BCACHE_NCBLOCKS / 4);
+        assert(bc_get(targ->bc, blkno, &tbco_ops, (void **)&tbco) == 0);
+        assert(tbco->bco_phys->bcp_data == blkno);
+        bc_release(targ->bc, tbco_block(tbco));
+    }
+    
+    return 0;
+}
+
+//
+// hits shouldn't take any partition locks, and (with LRU) a block that's been
+// hit should get a second chance before it's evicted. then have threads hit
+// a hot set while the cache grows and shrinks under them, so the hash tables
+// they're walking get swapped out and freed
+//
+static void test_bcache_lockless(bc_policy_t *policy) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    tbr_thr_start_arg_t targ[8];
+    char *tname = "test_bcache_lockless", *fname;
+    uint64_t locks, misses;
+    
+    printf("%s (policy %s)\n", tname, policy->bpo_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 1;
+    opts.bcop_policy = policy;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS);
+    bc_get_stats(bc, &bcs);
+    locks = bcs.bcs_lock_acquires;
+    misses = bcs.bcs_misses;
+    tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS);
+    bc_get_stats(bc, &bcs);
+    assert(bcs.bcs_lock_acquires == locks);
+    assert(bcs.bcs_misses == misses);
+    assert(bcs.bcs_hits == TEST_BCACHE_NCBLOCKS);
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    if (policy == &bc_policy_lru) {
+        // block 0 is the oldest, but it's been hit since it was read in, so block 1 goes instead
+        assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+        tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS);
+        tbsc_get_range(bc, 0, 1);
+        tbsc_get_range(bc, TEST_BCACHE_NCBLOCKS, TEST_BCACHE_NCBLOCKS + 1);
+        bc_get_stats(bc, &bcs);
+        misses = bcs.bcs_misses;
+        tbsc_get_range(bc, 0, 1);
+        bc_get_stats(bc, &bcs);
+        assert(bcs.bcs_misses == misses);
+        tbsc_get_range(bc, 1, 2);
+        bc_get_stats(bc, &bcs);
+        assert(bcs.bcs_misses == misses + 1);
+        bc_check(bc);
+        bc_destroy(bc);
+    }
+    
+    opts.bcop_npartitions = 8;
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    for (int i = 0; i < 8; i++) {
+        assert(targ[i].t = thread_create("tbl_thr"));
+        targ[i].bc = bc;
+        targ[i].blocks = NULL;
+        targ[i].num_ops = TEST_BCACHE_NFBLOCKS * 8;
+        assert(thread_start(targ[i].t, tbl_thr_start, &targ[i]) == 0);
+    }
+    for (int i = 2; i <= 16; i++) // every step grows the hash tables
+        assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ / 2 * i) == 0);
+    for (int i = 16; i >= 1; i--)
+        assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ / 2 * i) == 0);
+    for (int i = 0; i < 8; i++) {
+        assert(thread_wait(targ[i].t, NULL) == 0);
+        thread_destroy(targ[i].t);
+    }
+    tbsc_get_range(bc, 0, TEST_BCACHE_NCBLOCKS / 4);
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    free(fname);
+}
+
+//
+// fill a one partition cache, hit on all of it, dirty half and then push it
+// all out. the counters and histograms should add up, and a snapshot that
+// resets them should leave nothing behind
+//
+static void test_bcache_stats(void) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_snapshot_t bss;
+    bc_hist_t bh;
+    tbco_t *tbco;
+    char *tname = "test_bcache_stats", *fname;
+    uint64_t p50, p99;
+    
+    printf("%s\n", tname);
+    
+    // bucket 3 is [8, 16) ns and bucket 10 is [1024, 2048)
+    memset(&bh, 0, sizeof(bc_hist_t));
+    assert(bc_hist_quantile(&bh, 0.5) == 0);
+    bh.bh_count = 20;
+    bh.bh_buckets[3] = 10;
+    bh.bh_buckets[10] = 10;
+    bh.bh_max = 2000;
+    assert(bc_hist_quantile(&bh, 0) == 16);
+    assert(bc_hist_quantile(&bh, 0.25) == 16);
+    assert(bc_hist_quantile(&bh, 0.5) == 2000);
+    assert(bc_hist_quantile(&bh, 1) == 2000);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 1;
+    opts.bcop_policy = &bc_policy_lru;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    
+    for (int pass = 0; pass < 3; pass++) {
+        for (uint64_t i = 0; i < TEST_BCACHE_NCBLOCKS; i++) {
+            assert(bc_get(bc, (pass == 2 ? TEST_BCACHE_NCBLOCKS : 0) + i, &tbco_ops, (void **)&tbco) == 0);
+            if ((pass == 1) && (i % 2))
+                bc_dirty(bc, tbco_block(tbco));
+            bc_release(bc, tbco_block(tbco));
+        }
+    }
+    
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_time >= bss.bss_since);
+    assert(bss.bss_stats.bcs_misses == 2 * TEST_BCACHE_NCBLOCKS);
+    assert(bss.bss_stats.bcs_hits == TEST_BCACHE_NCBLOCKS);
+    assert(bss.bss_hists[BC_HIST_MISS].bh_count == 2 * TEST_BCACHE_NCBLOCKS);
+    assert(bss.bss_hists[BC_HIST_HIT].bh_count == TEST_BCACHE_NCBLOCKS);
+    assert(bss.bss_hists[BC_HIST_READ].bh_count == 2 * TEST_BCACHE_NCBLOCKS);
+    assert(bss.bss_hists[BC_HIST_WRITE].bh_count > 0);
+    assert(bss.bss_hists[BC_HIST_LOCK].bh_count == bss.bss_stats.bcs_lock_acquires);
+    assert(bss.bss_stats.bcs_evictions == TEST_BCACHE_NCBLOCKS);
+    assert(bss.bss_stats.bcs_evictions_dirty == TEST_BCACHE_NCBLOCKS / 2);
+    assert(bss.bss_stats.bcs_evictions_clean + bss.bss_stats.bcs_evictions_dirty == bss.bss_stats.bcs_evictions);
+    assert(bss.bss_stats.bcs_dirty_max == TEST_BCACHE_NCBLOCKS / 2);
+    assert(bss.bss_stats.bcs_enomem == 0);
+    for (int h = 0; h < BC_NHISTS; h++) {
+        p50 = bc_hist_quantile(&bss.bss_hists[h], 0.5);
+        p99 = bc_hist_quantile(&bss.bss_hists[h], 0.99);
+        assert((p50 <= p99) && (p99 <= bss.bss_hists[h].bh_max));
+    }
+    
+    // everything was zeroed when it was read
+    bc_get_snapshot(bc, &bss, false);
+    assert(bss.bss_stats.bcs_misses == 0);
+    assert(bss.bss_stats.bcs_evictions == 0);
+    for (int h = 0; h < BC_NHISTS; h++)
+        assert(bss.bss_hists[h].bh_count == 0);
+    
+    bc_destroy(bc);
+    free(fname);
+}
+
+#define TBT_NHOT 64
+#define TBT_FLUSH_INTVL 1000
+
+static bc_sim_t *tbt_replay(bc_trace_rec_t *recs, uint64_t nrecs, bc_policy_t *policy, uint32_t nblocks) {
+    bc_sim_t *bs;
+    
+    assert(bs = bc_sim_create(policy, nblocks, 1));
+    for (uint64_t i = 0; i < nrecs; i++)
+        bc_sim_step(bs, &recs[i]);
+    
+    return bs;
+}
+
+//
+// trace a single threaded mix of a hot set, cold blocks, dirties and flushes,
+// and check that replaying it at the same size and policy comes up with exactly
+// what the cache did
+//
+static void test_bcache_trace(bc_policy_t *policy, int num_ops) {
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_snapshot_t bss;
+    bc_trace_hdr_t bth;
+    bc_trace_rec_t *recs;
+    bc_sim_t *bs;
+    tbco_t *tbco[2];
+    uint64_t blknos[2], nrecs, nops[BC_TRACE_FLUSH + 1], ndistinct = 0;
+    bool seen[TEST_BCACHE_NFBLOCKS];
+    char *tname = "test_bcache_trace", *fname, *tracename;
+    struct stat st;
+    int fd;
+    
+    printf("%s (%s)\n", tname, policy->bpo_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    assert(tracename = malloc(strlen(fname) + strlen(".trace") + 1));
+    sprintf(tracename, "%s.trace", fname);
+    
+    create_and_init_backing_file(fname);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 1;
+    opts.bcop_policy = policy;
+    opts.bcop_trace = tracename;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    assert(bc_trace_start(bc, tracename) == EBUSY);
+    
+    memset(nops, 0, sizeof(nops));
+    memset(seen, 0, sizeof(seen));
+    for (int i = 0; i < num_ops; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (rand() % 4)
+                blknos[j] = rand() % TBT_NHOT;
+            else
+                blknos[j] = rand() % TEST_BCACHE_NFBLOCKS;
+        }
+        if ((blknos[0] != blknos[1]) && !(rand() % 8)) {
+            assert(bc_get_many(bc, blknos, 2, &tbco_ops, (void **)tbco) == 0);
+            nops[BC_TRACE_GET] += 2;
+        } else {
+            assert(bc_get(bc, blknos[0], &tbco_ops, (void **)&tbco[0]) == 0);
+            nops[BC_TRACE_GET]++;
+            tbco[1] = NULL;
+        }
+        for (int j = 0; j < 2 && tbco[j]; j++) {
+            if (!seen[blknos[j]]) {
+                seen[blknos[j]] = true;
+                ndistinct++;
+            }
+            if (!(rand() % 8)) {
+                bc_dirty(bc, tbco_block(tbco[j]));
+                nops[BC_TRACE_DIRTY]++;
+            }
+            bc_release(bc, tbco_block(tbco[j]));
+            nops[BC_TRACE_RELEASE]++;
+        }
+        if (!(i % TBT_FLUSH_INTVL)) {
+            assert(bc_flush(bc) == 0);
+            nops[BC_TRACE_FLUSH]++;
+        }
+    }
+    
+    bc_get_snapshot(bc, &bss, false);
+    assert(bc_trace_stop(bc) == 0);
+    assert(bc_trace_stop(bc) == EINVAL);
+    
+    // read it back
+    assert((fd = open(tracename, O_RDONLY)) >= 0);
+    assert(fstat(fd, &st) == 0);
+    assert(((st.st_size - sizeof(bc_trace_hdr_t)) % sizeof(bc_trace_rec_t)) == 0);
+    nrecs = (st.st_size - sizeof(bc_trace_hdr_t)) / sizeof(bc_trace_rec_t);
+    assert(nrecs == nops[BC_TRACE_GET] + nops[BC_TRACE_DIRTY] + nops[BC_TRACE_RELEASE] + nops[BC_TRACE_FLUSH]);
+    assert(read(fd, &bth, sizeof(bc_trace_hdr_t)) == sizeof(bc_trace_hdr_t));
+    assert(bth.bth_magic == BC_TRACE_MAGIC);
+    assert(bth.bth_version == BC_TRACE_VERSION);
+    assert(bth.bth_blksz == TEST_BCACHE_BLKSZ);
+    assert(bth.bth_maxsz == TEST_BCACHE_MAXSZ);
+    assert(recs = malloc(sizeof(bc_trace_rec_t) * nrecs));
+    assert(read(fd, recs, sizeof(bc_trace_rec_t) * nrecs) == sizeof(bc_trace_rec_t) * nrecs);
+    close(fd);
+    
+    for (uint64_t i = 0; i < nrecs; i++) {
+        assert((recs[i].btr_op >= BC_TRACE_GET) && (recs[i].btr_op <= BC_TRACE_FLUSH));
+        nops[recs[i].btr_op]--;
+        assert(recs[i].btr_thread == recs[0].btr_thread);
+        if (i)
+            assert(recs[i].btr_time >= recs[i - 1].btr_time); // one thread, so in order
+        if (recs[i].btr_op == BC_TRACE_FLUSH)
+            assert(recs[i].btr_file == BC_TRACE_ALLFILES);
+        else
+            assert(recs[i].btr_blkno < TEST_BCACHE_NFBLOCKS);
+    }
+    for (int op = BC_TRACE_GET; op <= BC_TRACE_FLUSH; op++)
+        assert(nops[op] == 0);
+    
+    // the same cache, simulated
+    bs = tbt_replay(recs, nrecs, policy, TEST_BCACHE_NCBLOCKS);
+    assert(bs->bs_gets == bss.bss_stats.bcs_hits + bss.bss_stats.bcs_misses);
+    assert(bs->bs_misses == bss.bss_stats.bcs_misses);
+    assert(bs->bs_writes == bss.bss_stats.bcs_writes);
+    assert(bs->bs_bypassed == 0);
+    bc_sim_destroy(bs);
+    
+    // big enough for everything, so only first touches miss
+    bs = tbt_replay(recs, nrecs, policy, TEST_BCACHE_NFBLOCKS);
+    assert(bs->bs_misses == ndistinct);
+    bc_sim_destroy(bs);
+    
+    // smaller ones miss more
+    bs = tbt_replay(recs, nrecs, policy, TEST_BCACHE_NCBLOCKS / 4);
+    assert(bs->bs_misses > bss.bss_stats.bcs_misses);
+    bc_sim_destroy(bs);
+    
+    assert(bc_flush(bc) == 0);
+    bc_destroy(bc);
+    free(recs);
+    free(tracename);
+    free(fname);
+}
+
+#define TBP_PIN (1ULL << 63) // in bcp_data: the block is metadata, so it's pinned
+#define TBP_NMETA 16
+
+static uint32_t tbp_class(void *bco) {
+    tbco_t *tbco = (tbco_t *)bco;
+    return (tbco->bco_phys->bcp_data & TBP_PIN) ? BC_CLASS_PINNED : BC_CLASS_NORMAL;
+}
+
+static bco_ops_t tbp_ops = {
+    .bco_size = sizeof(tbco_t),
+    .bco_init = tbco_init,
+    .bco_destroy = NULL,
+    .bco_dump = NULL,
+    .bco_check = NULL,
+    .bco_class = tbp_class
+};
+
+// get [start, end), setting (1) or clearing (0) TBP_PIN, or leaving it alone (-1)
+static void tbp_get_range(bcache_t *bc, bc_file_t *bf, uint64_t start, uint64_t end, int pin) {
+    tbco_t *tbco;
+    
+    for (uint64_t i = start; i < end; i++) {
+        assert(bc_file_get(bc, bf, i, &tbp_ops, (void **)&tbco) == 0);
+        assert((tbco->bco_phys->bcp_data & ~TBP_PIN) == i);
+        if (pin >= 0) {
+            tbco->bco_phys->bcp_data = pin ? (i | TBP_PIN) : i;
+            bc_dirty(bc, tbco_block(tbco));
+        }
+        bc_release(bc, tbco_block(tbco));
+    }
+}
+
+static void test_bcache_pinned(bc_policy_t *policy) {
+    bcache_t *bc;
+    bc_file_t *bf, *bf2;
+    bc_opts_t opts;
+    bc_snapshot_t bss;
+    char *tname = "test_bcache_pinned", *fname, *fname2;
+    uint32_t pmax = TEST_BCACHE_NCBLOCKS / 4;
+    
+    printf("%s (%s)\n", tname, policy->bpo_name);
+    
+    assert(fname = malloc(strlen(TEST_BCACHE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BCACHE_DIR, tname);
+    assert(fname2 = malloc(strlen(fname) + 3));
+    sprintf(fname2, "%s.2", fname);
+    
+    create_and_init_backing_file(fname);
+    create_and_init_backing_file(fname2);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 1;
+    opts.bcop_policy = policy;
+    opts.bcop_pinned_pct = 25;
+    
+    assert(bc = bc_create(fname, TEST_BCACHE_BLKSZ, TEST_BCACHE_MAXSZ, &opts));
+    bf = bc->bc_file;
+    
+    // pinned when they're dirtied as metadata
+    tbp_get_range(bc, bf, 0, TBP_NMETA, 1);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned == TBP_NMETA);
+    assert(bss.bss_pinned_max == pmax);
+    assert(bss.bss_unpinned == 0);
+    
+    // scans can't push them out
+    assert(bc_flush(bc) == 0);
+    for (int pass = 0; pass < 2; pass++)
+        tbp_get_range(bc, bf, TBP_NMETA, TEST_BCACHE_NFBLOCKS, -1);
+    bc_get_snapshot(bc, &bss, true);
+    if (policy != &bc_policy_tinylfu) // which keeps the start of the first pass, and hits it on the second
+        assert(bss.bss_stats.bcs_misses == 2 * (TEST_BCACHE_NFBLOCKS - TBP_NMETA));
+    tbp_get_range(bc, bf, 0, TBP_NMETA, -1);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_stats.bcs_misses == 0);
+    assert(bss.bss_stats.bcs_hits == TBP_NMETA);
+    assert(bss.bss_pinned == TBP_NMETA);
+    assert(bss.bss_unpinned == TEST_BCACHE_NCBLOCKS - TBP_NMETA);
+    bc_check(bc);
+    
+    // the pool only takes so many
+    tbp_get_range(bc, bf, 100, 100 + 2 * pmax, 1);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned == pmax);
+    assert(bss.bss_stats.bcs_pin_overflows == 2 * pmax - (pmax - TBP_NMETA));
+    
+    // and gives blocks back when they're no longer metadata
+    tbp_get_range(bc, bf, 0, 1, 0);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned == pmax - 1);
+    bc_check(bc);
+    
+    // or when it shrinks
+    assert(bc_flush(bc) == 0);
+    assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ / 2) == 0);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned_max == pmax / 2);
+    assert(bss.bss_pinned == pmax / 2);
+    bc_check(bc);
+    
+    //
+    // blocks are classified as they're read in too. push everything out that
+    // isn't pinned, and read back all the metadata
+    //
+    assert(bc_set_capacity(bc, TEST_BCACHE_MAXSZ) == 0);
+    tbp_get_range(bc, bf, 200, TEST_BCACHE_NFBLOCKS, -1);
+    tbp_get_range(bc, bf, 1, TBP_NMETA, -1);
+    tbp_get_range(bc, bf, 100, 100 + 2 * pmax, -1);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned == pmax);
+    bc_check(bc);
+    
+    // closing a file evicts its pinned blocks too
+    tbp_get_range(bc, bf, 100, 100 + TBP_NMETA, 0);
+    assert(bf2 = bc_file_open(bc, fname2));
+    bc_get_snapshot(bc, &bss, true);
+    tbp_get_range(bc, bf2, 0, TBP_NMETA, 1);
+    tbp_get_range(bc, bf, 0, 1, 1); // the pool's full again
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned == pmax);
+    assert(bss.bss_stats.bcs_pin_overflows == 1);
+    assert(bc_file_close(bc, bf2) == 0);
+    bc_get_snapshot(bc, &bss, true);
+    assert(bss.bss_pinned == pmax - TBP_NMETA);
+    bc_check(bc);
+    
+    assert(bc_flush(bc) == 0);
+    bc_destroy(bc);
+    free(fname2);
+    free(fname);
+}
+
+int main(int argc, char **argv) {
+    unsigned int seed = 0;
+    int ch, num_ops = DEFAULT_NUM_OPS, err;
+    
+    struct option longopts[] = {
+        { "num",    required_argument,   NULL,   'n' },
+        { "seed",   required_argument,   NULL,   's' },
+        { NULL,                0,        NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                num_ops = (int)strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = (unsigned int)strtol(optarg, NULL, 10);
+                break;
+            default:
+                printf("usage: %s [--num <num-elements>] [--seed <seed>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if (!seed) {
+        seed = (unsigned int)time(NULL);
+        srand(seed);
+    } else
+        srand(seed);
+    
+    printf("seed %u\n", seed);
+    
+    assert(mkdir(TEST_BCACHE_DIR, S_IRWXU) == 0 || (errno == EEXIST));
+    
+    test_bcache1();
+    test_bcache2();
+    test_bcache_same_blocks();
+    test_bcache_arena(0);
+    test_bcache_arena(BC_HUGEPAGES);
+    
+    // the scan should flush the hot set out of an LRU cache, but not out of 2Q or TinyLFU
+    assert(test_bcache_scan(&bc_policy_lru) == TBSC_NHOT);
+    assert(test_bcache_scan(&bc_policy_2q) == 0);
+    assert(test_bcache_scan(&bc_policy_tinylfu) == 0);
+    test_bcache_admission();
+    
+    test_bcache_flusher();
+    test_bcache_get_many(num_ops, &bc_io_pread);
+    test_bcache_get_many(num_ops, &bc_io_uring);
+    test_bcache_flush_runs(BC_SYNC_FSYNC, &bc_io_pread);
+    test_bcache_flush_runs(BC_SYNC_FDATASYNC, &bc_io_pread);
+    test_bcache_flush_runs(BC_SYNC_RANGE, &bc_io_pread);
+    test_bcache_flush_runs(BC_SYNC_FSYNC, &bc_io_uring);
+    test_bcache_direct(TEST_BCACHE_BLKSZ * 4, &bc_io_pread);
+    test_bcache_direct(TEST_BCACHE_BLKSZ * 4, &bc_io_uring);
+    test_bcache_direct(256, &bc_io_pread);
+    test_bcache_mmap(TEST_BCACHE_BLKSZ);
+    test_bcache_mmap(TEST_BCACHE_BLKSZ * 4);
+    test_bcache_resize(&bc_policy_lru);
+    test_bcache_resize(&bc_policy_2q);
+    test_bcache_resize(&bc_policy_tinylfu);
+    test_bcache_shared(0);
+    test_bcache_shared(BC_MMAP);
+    test_bcache_compress();
+    test_bcache_wal();
+    test_bcache_stats();
+    test_bcache_lockless(&bc_policy_lru);
+    test_bcache_lockless(&bc_policy_2q);
+    test_bcache_lockless(&bc_policy_tinylfu);
+    test_bcache_trace(&bc_policy_lru, num_ops);
+    test_bcache_trace(&bc_policy_2q, num_ops);
+    test_bcache_trace(&bc_policy_tinylfu, num_ops);
+    test_bcache_pinned(&bc_policy_lru);
+    test_bcache_pinned(&bc_policy_2q);
+    test_bcache_pinned(&bc_policy_tinylfu);
+    
+    test_bcache_random(num_ops, 1, &bc_policy_lru, 0, &bc_io_pread);
+    test_bcache_random(num_ops, 8, &bc_policy_lru, 0, &bc_io_pread);
+    test_bcache_random(num_ops, 8, &bc_policy_2q, 0, &bc_io_pread);
+    test_bcache_random(num_ops, 8, &bc_policy_2q, BC_FLUSHER, &bc_io_pread);
+    test_bcache_random(num_ops, 8, &bc_policy_2q, BC_FLUSHER, &bc_io_uring);
+    test_bcache_random(num_ops, 8, &bc_policy_2q, BC_FLUSHER | BC_MMAP, &bc_io_pread);
+    test_bcache_random(num_ops, 8, &bc_policy_tinylfu, 0, &bc_io_pread);
+    test_bcache_random(num_ops, 8, &bc_policy_tinylfu, BC_FLUSHER, &bc_io_uring);
+    test_bcache_random(num_ops, 8, &bc_policy_2q, BC_FLUSHER | BC_COMPRESS, &bc_io_pread);
     
     return 0;
 }
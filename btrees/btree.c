@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <sched.h>
 
 #include "btree.h"
 #include "fifo.h"
@@ -31,6 +32,557 @@ static void bt_dump_index_record(btree_t *bt, btr_phys_t *btrp) {
     printf("index_ptr %" PRIu64 " ", btr_phys_index_ptr(btrp));
 }
 
+//
+// write-ahead log functions (see the comment in btree.h):
+//
+
+static uint32_t bt_wal_csum(const void *p, size_t len) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint32_t h = 2166136261u; // FNV-1a
+    
+    for (size_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= 16777619u;
+    }
+    
+    return h;
+}
+
+static char *bt_wal_path(const char *path) {
+    char *wpath;
+    
+    wpath = malloc(strlen(path) + strlen(BT_WAL_SUFFIX) + 1);
+    if (wpath)
+        sprintf(wpath, "%s%s", path, BT_WAL_SUFFIX);
+    
+    return wpath;
+}
+
+static int bt_wal_unlink(const char *path) {
+    char *wpath;
+    int err = 0;
+    
+    wpath = bt_wal_path(path);
+    if (!wpath)
+        return ENOMEM;
+    
+    if (unlink(wpath) && (errno != ENOENT))
+        err = errno;
+    
+    free(wpath);
+    
+    return err;
+}
+
+// the log's records start at lsn base from now on
+static int bt_wal_write_hdr(int fd, uint64_t base) {
+    uint8_t buf[BT_WAL_HDRSZ];
+    bt_wal_hdr_phys_t *bwh = (bt_wal_hdr_phys_t *)buf;
+    ssize_t n;
+    
+    memset(buf, 0, BT_WAL_HDRSZ);
+    bwh->bwh_magic = BT_WAL_MAGIC;
+    bwh->bwh_base = base;
+    bwh->bwh_sum = bt_wal_csum(bwh, sizeof(bt_wal_hdr_phys_t));
+    
+    n = pwrite(fd, buf, BT_WAL_HDRSZ, 0);
+    if (n != BT_WAL_HDRSZ)
+        return (n < 0) ? errno : EIO;
+    
+    if (fdatasync(fd))
+        return errno;
+    
+    return 0;
+}
+
+// start path off with an empty log
+static int bt_wal_create(const char *path) {
+    char *wpath;
+    int fd = -1, err;
+    
+    wpath = bt_wal_path(path);
+    if (!wpath) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    fd = open(wpath, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        err = errno;
+        goto error_out;
+    }
+    
+    err = bt_wal_write_hdr(fd, 0);
+    if (err)
+        goto error_out;
+    
+    close(fd);
+    free(wpath);
+    
+    return 0;
+    
+error_out:
+    if (fd >= 0)
+        close(fd);
+    if (wpath)
+        free(wpath);
+    
+    return err;
+}
+
+//
+// write out every record logged so far, if someone else isn't already, until
+// everything before lsn is on stable storage. records logged while a write is
+// in progress go into the other buffer, and all go out together in the next
+// one. this is also the cache's hook for bt_bf, so it's called without bt_rwlock
+// held too
+//
+static int bt_wal_force(void *ctx, uint64_t lsn) {
+    bt_wal_t *bw = (bt_wal_t *)ctx;
+    uint8_t *buf;
+    uint32_t len, max;
+    uint64_t off, end;
+    ssize_t n;
+    int err;
+    
+    lock_lock(bw->bw_lock);
+    
+    assert(lsn <= bw->bw_next);
+    
+    while (1) {
+        if (bw->bw_err) {
+            err = bw->bw_err;
+            goto error_out;
+        }
+        if (bw->bw_durable >= lsn)
+            break;
+        if (bw->bw_syncing) { // it may not get as far as lsn, so look again once it's done
+            lock_unlock(bw->bw_lock);
+            sched_yield();
+            lock_lock(bw->bw_lock);
+            continue;
+        }
+        
+        // take everything that's been logged so far
+        bw->bw_syncing = true;
+        buf = bw->bw_buf;
+        len = bw->bw_buflen;
+        max = bw->bw_bufmax;
+        off = BT_WAL_HDRSZ + bw->bw_written - bw->bw_base;
+        end = bw->bw_next;
+        bw->bw_buf = bw->bw_spare;
+        bw->bw_bufmax = bw->bw_sparemax;
+        bw->bw_buflen = 0;
+        bw->bw_written = end;
+        lock_unlock(bw->bw_lock);
+        
+        err = 0;
+        n = pwrite(bw->bw_fd, buf, len, off);
+        if (n != len)
+            err = (n < 0) ? errno : EIO;
+        else if (fdatasync(bw->bw_fd))
+            err = errno;
+        
+        lock_lock(bw->bw_lock);
+        bw->bw_spare = buf;
+        bw->bw_sparemax = max;
+        bw->bw_syncing = false;
+        bw->bw_syncs++;
+        if (err) {
+            printf("bt_wal_force: couldn't write the log: %s\n", strerror(err));
+            bw->bw_err = err;
+        } else
+            bw->bw_durable = end;
+    }
+    
+    lock_unlock(bw->bw_lock);
+    
+    return 0;
+    
+error_out:
+    lock_unlock(bw->bw_lock);
+    
+    return err;
+}
+
+//
+// every change to a block goes through here. in a tree with a log, the block
+// is held until the operation's record has been made, so the cache can't write
+// it back while the operation is only partly done
+//
+static void bt_dirty(btree_t *bt, blk_t *b) {
+    bt_wal_t *bw = bt->bt_wal;
+    blk_t **blks;
+    uint32_t maxblks;
+    
+    bc_dirty(bt->bt_bc, b);
+    
+    if (!bw)
+        return;
+    
+    for (uint32_t i = 0; i < bw->bw_nblks; i++) {
+        if (bw->bw_blks[i] == b)
+            return;
+    }
+    
+    if (bw->bw_nblks == bw->bw_maxblks) {
+        maxblks = bw->bw_maxblks * 2;
+        blks = realloc(bw->bw_blks, sizeof(blk_t *) * maxblks);
+        if (!blks) {
+            printf("bt_dirty: no memory to track bl_blkno %" PRIu64 ". the log is no good now\n", b->bl_blkno);
+            lock_lock(bw->bw_lock);
+            if (!bw->bw_err)
+                bw->bw_err = ENOMEM;
+            lock_unlock(bw->bw_lock);
+            return;
+        }
+        bw->bw_blks = blks;
+        bw->bw_maxblks = maxblks;
+    }
+    
+    bc_hold(bt->bt_bc, b);
+    bw->bw_blks[bw->bw_nblks++] = b;
+}
+
+//
+// append a record of the blocks the operation that's just finished changed,
+// tag them with its commit lsn and let them go. bt_rwlock must be held
+// exclusive. returns the commit lsn, or 0 if nothing changed
+//
+static uint64_t bt_wal_log(btree_t *bt) {
+    bt_wal_t *bw = bt->bt_wal;
+    bcache_t *bc = bt->bt_bc;
+    bt_wal_rec_phys_t *bwr;
+    uint32_t blksz = bc->bc_blksz, len, max;
+    uint8_t *buf, *p;
+    uint64_t lsn = 0;
+    
+    if (!bw->bw_nblks)
+        return 0;
+    
+    len = sizeof(bt_wal_rec_phys_t) + bw->bw_nblks * (sizeof(uint64_t) + blksz);
+    
+    lock_lock(bw->bw_lock);
+    
+    if (bw->bw_buflen + len > bw->bw_bufmax) {
+        max = bw->bw_bufmax * 2;
+        if (max < bw->bw_buflen + len)
+            max = bw->bw_buflen + len;
+        buf = realloc(bw->bw_buf, max);
+        if (!buf) {
+            printf("bt_wal_log: no memory for a %" PRIu32 " byte record. the log is no good now\n", len);
+            if (!bw->bw_err)
+                bw->bw_err = ENOMEM;
+            lock_unlock(bw->bw_lock);
+            goto out;
+        }
+        bw->bw_buf = buf;
+        bw->bw_bufmax = max;
+    }
+    
+    bwr = (bt_wal_rec_phys_t *)(bw->bw_buf + bw->bw_buflen);
+    bwr->bwr_magic = BT_WAL_MAGIC;
+    bwr->bwr_blksz = blksz;
+    bwr->bwr_lsn = bw->bw_next;
+    bwr->bwr_len = len;
+    bwr->bwr_nblocks = bw->bw_nblks;
+    bwr->bwr_sum = 0;
+    p = (uint8_t *)bwr + sizeof(bt_wal_rec_phys_t);
+    for (uint32_t i = 0; i < bw->bw_nblks; i++) {
+        memcpy(p, &bw->bw_blks[i]->bl_blkno, sizeof(uint64_t));
+        memcpy(p + sizeof(uint64_t), bw->bw_blks[i]->bl_phys, blksz);
+        p += sizeof(uint64_t) + blksz;
+    }
+    bwr->bwr_sum = bt_wal_csum(bwr, len);
+    
+    bw->bw_buflen += len;
+    bw->bw_next += len;
+    bw->bw_records++;
+    lsn = bw->bw_next;
+    
+    lock_unlock(bw->bw_lock);
+    
+out:
+    for (uint32_t i = 0; i < bw->bw_nblks; i++) {
+        if (lsn)
+            bc_set_lsn(bc, bw->bw_blks[i], lsn);
+        bc_release(bc, bw->bw_blks[i]);
+    }
+    bw->bw_nblks = 0;
+    
+    return lsn;
+}
+
+//
+// write everything home and start the log over. bt_rwlock must be held
+// exclusive, so nothing's being logged. committers still waiting on records
+// before bw_next are let go by the first force
+//
+static int bt_wal_checkpoint(btree_t *bt) {
+    bt_wal_t *bw = bt->bt_wal;
+    int err;
+    
+    err = bt_wal_force(bw, bw->bw_next);
+    if (err)
+        goto error_out;
+    
+    err = bc_file_flush(bt->bt_bc, bt->bt_bf);
+    if (err)
+        goto error_out;
+    
+    lock_lock(bw->bw_lock);
+    while (bw->bw_syncing) {
+        lock_unlock(bw->bw_lock);
+        sched_yield();
+        lock_lock(bw->bw_lock);
+    }
+    err = bt_wal_write_hdr(bw->bw_fd, bw->bw_next);
+    if (err) {
+        lock_unlock(bw->bw_lock);
+        goto error_out;
+    }
+    bw->bw_base = bw->bw_next;
+    bw->bw_written = bw->bw_next;
+    bw->bw_checkpoints++;
+    lock_unlock(bw->bw_lock);
+    
+    return 0;
+    
+error_out:
+    return err;
+}
+
+//
+// the end of a bt_insert or bt_remove, with bt_rwlock still held exclusive.
+// returns the lsn to commit once it's been dropped (see bt_wal_commit)
+//
+static uint64_t bt_wal_end(btree_t *bt) {
+    bt_wal_t *bw = bt->bt_wal;
+    uint64_t lsn;
+    int err;
+    
+    if (!bw)
+        return 0;
+    
+    lsn = bt_wal_log(bt);
+    
+    // nobody else can log anything, so bw_next and bw_base can be read without bw_lock
+    if (bw->bw_next - bw->bw_base > BT_WAL_CKPT_SIZE) {
+        err = bt_wal_checkpoint(bt);
+        if (err)
+            printf("bt_wal_end: checkpoint failed: %s\n", strerror(err));
+    }
+    
+    return lsn;
+}
+
+static int bt_wal_commit(btree_t *bt, uint64_t lsn) {
+    if (!bt->bt_wal)
+        return 0;
+    return bt_wal_force(bt->bt_wal, lsn);
+}
+
+//
+// apply every record in the log at fd to the tree at path, in order, and start
+// the log over after them. *base gets the lsn the next record will have.
+// replay stops at the first record that's cut short, doesn't check out or
+// doesn't follow on from the last one: that's as far as the log got before a
+// crash, or what's left of the log from before the last checkpoint
+//
+static int bt_wal_replay(const char *path, int fd, uint64_t *base, uint64_t *nrecs) {
+    bt_wal_hdr_phys_t *bwh;
+    bt_wal_rec_phys_t *bwr;
+    bc_blkfile_t *bbf = NULL;
+    struct stat st;
+    uint8_t *buf = NULL, *p;
+    uint64_t off = BT_WAL_HDRSZ, lsn, blkno;
+    uint32_t blksz = BT_PHYS_BLKSZ, sum;
+    ssize_t n;
+    int err;
+    
+    *nrecs = 0;
+    
+    if (fstat(fd, &st)) {
+        err = errno;
+        goto error_out;
+    }
+    
+    buf = malloc(st.st_size > BT_WAL_HDRSZ ? st.st_size : BT_WAL_HDRSZ);
+    if (!buf) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    n = pread(fd, buf, st.st_size, 0);
+    if (n != st.st_size) {
+        err = (n < 0) ? errno : EIO;
+        goto error_out;
+    }
+    
+    bwh = (bt_wal_hdr_phys_t *)buf;
+    sum = bwh->bwh_sum;
+    bwh->bwh_sum = 0;
+    if ((st.st_size < BT_WAL_HDRSZ) || (bwh->bwh_magic != BT_WAL_MAGIC) ||
+        (bt_wal_csum(bwh, sizeof(bt_wal_hdr_phys_t)) != sum)) {
+        //
+        // a torn header. everything was home by the time it was written, but
+        // the records after it can't be told apart from new ones any more
+        //
+        if (ftruncate(fd, 0)) {
+            err = errno;
+            goto error_out;
+        }
+        lsn = 0;
+        goto out;
+    }
+    
+    lsn = bwh->bwh_base;
+    
+    while (off + sizeof(bt_wal_rec_phys_t) <= st.st_size) {
+        bwr = (bt_wal_rec_phys_t *)(buf + off);
+        if ((bwr->bwr_magic != BT_WAL_MAGIC) || (bwr->bwr_blksz != blksz) || (bwr->bwr_lsn != lsn) ||
+            (bwr->bwr_len != sizeof(bt_wal_rec_phys_t) + (uint64_t)bwr->bwr_nblocks * (sizeof(uint64_t) + blksz)) ||
+            (bwr->bwr_len > st.st_size - off))
+            break;
+        sum = bwr->bwr_sum;
+        bwr->bwr_sum = 0;
+        if (bt_wal_csum(bwr, bwr->bwr_len) != sum)
+            break;
+        
+        if (!bbf) {
+            err = bc_blkfile_open(path, blksz, 0, &bbf);
+            if (err)
+                goto error_out;
+        }
+        
+        p = (uint8_t *)bwr + sizeof(bt_wal_rec_phys_t);
+        for (uint32_t i = 0; i < bwr->bwr_nblocks; i++) {
+            memcpy(&blkno, p, sizeof(uint64_t));
+            err = bc_blkfile_write(bbf, blkno, p + sizeof(uint64_t));
+            if (err)
+                goto error_out;
+            p += sizeof(uint64_t) + blksz;
+        }
+        
+        lsn += bwr->bwr_len;
+        off += bwr->bwr_len;
+        (*nrecs)++;
+    }
+    
+    if (!bbf) // nothing to replay
+        goto done;
+    
+    err = bc_blkfile_sync(bbf);
+    if (err)
+        goto error_out;
+    
+    err = bc_blkfile_close(bbf);
+    bbf = NULL;
+    if (err)
+        goto error_out;
+    
+out:
+    // it's all home now
+    err = bt_wal_write_hdr(fd, lsn);
+    if (err)
+        goto error_out;
+    
+done:
+    *base = lsn;
+    
+    free(buf);
+    
+    return 0;
+    
+error_out:
+    if (bbf)
+        bc_blkfile_close(bbf);
+    if (buf)
+        free(buf);
+    
+    return err;
+}
+
+static void bt_wal_close(bt_wal_t *bw) {
+    if (bw->bw_fd >= 0)
+        close(bw->bw_fd);
+    if (bw->bw_lock)
+        lock_destroy(bw->bw_lock);
+    if (bw->bw_buf)
+        free(bw->bw_buf);
+    if (bw->bw_spare)
+        free(bw->bw_spare);
+    if (bw->bw_blks)
+        free(bw->bw_blks);
+    free(bw);
+}
+
+//
+// replay the tree at path's log, if it has one, and set it up to be logged to.
+// *bw is NULL for trees without a log. this has to happen before the tree is
+// read from or cached
+//
+static int bt_wal_open(const char *path, bt_wal_t **bw) {
+    bt_wal_t *_bw = NULL;
+    char *wpath;
+    int fd, err;
+    
+    wpath = bt_wal_path(path);
+    if (!wpath) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    fd = open(wpath, O_RDWR);
+    free(wpath);
+    if (fd < 0) {
+        err = errno;
+        if (err == ENOENT) {
+            *bw = NULL;
+            return 0;
+        }
+        goto error_out;
+    }
+    
+    _bw = malloc(sizeof(bt_wal_t));
+    if (!_bw) {
+        close(fd);
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    memset(_bw, 0, sizeof(bt_wal_t));
+    _bw->bw_fd = fd;
+    
+    err = bt_wal_replay(path, fd, &_bw->bw_base, &_bw->bw_replayed);
+    if (err)
+        goto error_out;
+    _bw->bw_written = _bw->bw_next = _bw->bw_durable = _bw->bw_base;
+    
+    _bw->bw_lock = lock_create();
+    if (!_bw->bw_lock) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    _bw->bw_blks = malloc(sizeof(blk_t *) * BT_WAL_NBLKS_DEF);
+    if (!_bw->bw_blks) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    _bw->bw_maxblks = BT_WAL_NBLKS_DEF;
+    
+    *bw = _bw;
+    
+    return 0;
+    
+error_out:
+    if (_bw)
+        bt_wal_close(_bw);
+    
+    return err;
+}
+
 //
 // bitmap-related functions:
 //
@@ -66,33 +618,12 @@ static blk_t *bm_block(bm_t *bm) {
 }
 
 static int bm_bco_init(void **bco, blk_t *b) {
-    bm_t **bm, *_bm;
-    bm_phys_t *bmp = (bm_phys_t *)b->bl_phys;
-    int err;
-    
-    bm = (bm_t **)bco;
+    bm_t *bm = (bm_t *)*bco; // zeroed by the cache
     
-    _bm = malloc(sizeof(bm_t));
-    if (!_bm) {
-        err = ENOMEM;
-        goto error_out;
-    }
-    
-    memset(_bm, 0, sizeof(bm_t));
-    _bm->bm_blk = b;
-    _bm->bm_phys = bmp;
-    
-    *bm = _bm;
+    bm->bm_blk = b;
+    bm->bm_phys = (bm_phys_t *)b->bl_phys;
     
     return 0;
-    
-error_out:
-    return err;
-}
-
-static void bm_bco_destroy(void *bco) {
-    bm_t *bm = (bm_t *)bco;
-    free(bm);
 }
 
 static void bm_bco_dump(void *bco) {
@@ -129,11 +660,18 @@ static void bm_bco_check(void *bco) {
     assert(bmp->bmp_nfree == nfree);
 }
 
+// every sm_balloc and sm_bfree goes through a bitmap, so they're kept cached
+static uint32_t bm_bco_class(void *bco) {
+    return BC_CLASS_PINNED;
+}
+
 static bco_ops_t bm_bco_ops = {
+    .bco_size = sizeof(bm_t),
     .bco_init = bm_bco_init,
-    .bco_destroy = bm_bco_destroy,
+    .bco_destroy = NULL,
     .bco_dump = bm_bco_dump,
-    .bco_check = bm_bco_check
+    .bco_check = bm_bco_check,
+    .bco_class = bm_bco_class
 };
 
 static int bm_get(btree_t *bt, uint64_t blkno, bm_t **bm) {
@@ -141,7 +679,7 @@ static int bm_get(btree_t *bt, uint64_t blkno, bm_t **bm) {
     bm_t *_bm = NULL;
     int err;
     
-    err = bc_get(bc, blkno, &bm_bco_ops, (void **)&_bm);
+    err = bc_file_get(bc, bt->bt_bf, blkno, &bm_bco_ops, (void **)&_bm);
     if (err)
         goto error_out;
     
@@ -160,7 +698,7 @@ static int bm_get(btree_t *bt, uint64_t blkno, bm_t **bm) {
 error_out:
     if (_bm)
         bc_release(bc, bm_block(_bm));
-        
+    
     return err;
 }
 
@@ -189,7 +727,7 @@ int bm_balloc(bm_t *bm, uint32_t *bmind) {
         if (!(*byte & bit)) {
             *byte |= bit;
             bmp->bmp_nfree--;
-            bc_dirty(bc, bm_block(bm));
+            bt_dirty(bt, bm_block(bm));
             break;
         }
         bit >>= 1;
@@ -233,7 +771,7 @@ void bm_bfree(bm_t *bm, uint32_t bmind) {
     *byte &= ~bit; // mark it free
     
     bmp->bmp_nfree++;
-    bc_dirty(bc, bm_block(bm));
+    bt_dirty(bt, bm_block(bm));
     
     return;
 }
@@ -257,33 +795,12 @@ static blk_t *sm_block(sm_t *sm) {
 }
 
 static int sm_bco_init(void **bco, blk_t *b) {
-    sm_t **sm, *_sm;
-    sm_phys_t *smp = (sm_phys_t *)b->bl_phys;
-    int err;
-    
-    sm = (sm_t **)bco;
-    
-    _sm = malloc(sizeof(sm_t));
-    if (!_sm) {
-        err = ENOMEM;
-        goto error_out;
-    }
-    
-    memset(_sm, 0, sizeof(sm_t));
-    _sm->sm_blk = b;
-    _sm->sm_phys = smp;
+    sm_t *sm = (sm_t *)*bco; // zeroed by the cache
     
-    *sm = _sm;
+    sm->sm_blk = b;
+    sm->sm_phys = (sm_phys_t *)b->bl_phys;
     
     return 0;
-    
-error_out:
-    return err;
-}
-
-static void sm_bco_destroy(void *bco) {
-    sm_t *sm = (sm_t *)bco;
-    free(sm);
 }
 
 static void sm_bco_dump(void *bco) {
@@ -300,11 +817,17 @@ static void sm_bco_check(void *bco) {
     assert(smp->smp_rblkno == btn_block(bt->bt_root)->bl_blkno);
 }
 
+static uint32_t sm_bco_class(void *bco) {
+    return BC_CLASS_PINNED;
+}
+
 static bco_ops_t sm_bco_ops = {
+    .bco_size = sizeof(sm_t),
     .bco_init = sm_bco_init,
-    .bco_destroy = sm_bco_destroy,
+    .bco_destroy = NULL,
     .bco_dump = sm_bco_dump,
-    .bco_check = sm_bco_check
+    .bco_check = sm_bco_check,
+    .bco_class = sm_bco_class
 };
 
 static int sm_get(btree_t *bt, sm_t **sm) {
@@ -312,7 +835,7 @@ static int sm_get(btree_t *bt, sm_t **sm) {
     sm_t *_sm = NULL;
     int err;
     
-    err = bc_get(bc, BT_PHYS_SM_OFFSET, &sm_bco_ops, (void **)&_sm);
+    err = bc_file_get(bc, bt->bt_bf, BT_PHYS_SM_OFFSET, &sm_bco_ops, (void **)&_sm);
     if (err)
         goto error_out;
     
@@ -335,6 +858,7 @@ error_out:
     return err;
 }
 
+// allocations and frees are serialized by bt_sm_lock
 static int sm_balloc(sm_t *sm, uint64_t *blkno) {
     btree_t *bt = sm->sm_bt;
     bcache_t *bc = bt->bt_bc;
@@ -346,6 +870,8 @@ static int sm_balloc(sm_t *sm, uint64_t *blkno) {
     uint64_t *smp_map, _blkno;
     int err;
     
+    lock_lock(bt->bt_sm_lock);
+    
     blks_per_bm = (smp->smp_bsz - sizeof(bm_phys_t)) * 8;
     nbmblks = ROUND_UP(smp->smp_nblocks, blks_per_bm) / blks_per_bm;
     
@@ -363,6 +889,10 @@ static int sm_balloc(sm_t *sm, uint64_t *blkno) {
         
         bc_release(bc, bm_block(bm));
         bm = NULL;
+        
+        // the first bitmap is full. start reading in the rest (they're contiguous) while we look
+        if ((i == 0) && (nbmblks > 1))
+            bc_file_prefetch(bc, bt->bt_bf, smp_map[1], nbmblks - 1, &bm_bco_ops);
     }
     
     if (!bm) {
@@ -376,6 +906,8 @@ static int sm_balloc(sm_t *sm, uint64_t *blkno) {
     
     bc_release(bc, bm_block(bm));
     
+    lock_unlock(bt->bt_sm_lock);
+    
     *blkno = _blkno + bmind;
     
     return 0;
@@ -383,6 +915,7 @@ static int sm_balloc(sm_t *sm, uint64_t *blkno) {
 error_out:
     if (bm)
         bc_release(bc, bm_block(bm));
+    lock_unlock(bt->bt_sm_lock);
     
     return err;
 }
@@ -405,6 +938,8 @@ static int sm_bfree(sm_t *sm, uint64_t blkno) {
     mind = blkno / blks_per_bm;
     bmind = blkno % blks_per_bm;
     
+    lock_lock(bt->bt_sm_lock);
+    
     err = bm_get(bt, smp_map[mind], &bm);
     if (err)
         goto error_out;
@@ -414,11 +949,14 @@ static int sm_bfree(sm_t *sm, uint64_t blkno) {
     bc_release(bc, bm_block(bm));
     bm = NULL;
     
+    lock_unlock(bt->bt_sm_lock);
+    
     return 0;
     
 error_out:
     if (bm)
         bc_release(bc, bm_block(bm));
+    lock_unlock(bt->bt_sm_lock);
     
     return err;
 }
@@ -436,10 +974,118 @@ bool btn_phys_is_root(btn_phys_t *btnp) {
     return (btnp->btnp_flags & BTN_PHYS_FLG_IS_ROOT);
 }
 
+bool btn_phys_is_slotted(btn_phys_t *btnp) {
+    return (btnp->btnp_flags & BTN_PHYS_FLG_SLOTTED);
+}
+
+bool btn_phys_is_linked(btn_phys_t *btnp) {
+    return (btnp->btnp_flags & BTN_PHYS_FLG_LINKED);
+}
+
 bool btn_phys_is_empty(btn_phys_t *btnp) {
     return (btnp->btnp_nrecords == 0);
 }
 
+static uint16_t btn_phys_hdrsz(btn_phys_t *btnp) {
+    if (btn_phys_is_linked(btnp))
+        return sizeof(btn_linked_phys_t);
+    return btn_phys_is_slotted(btnp) ? sizeof(btn_slotted_phys_t) : sizeof(btn_phys_t);
+}
+
+uint64_t btn_phys_right(btn_phys_t *btnp) {
+    assert(btn_phys_is_linked(btnp));
+    return ((btn_linked_phys_t *)btnp)->btlp_right;
+}
+
+// NULL if btnp doesn't have one, or it's BTLP_HIGH_UNKNOWN
+btr_phys_t *btn_phys_high_key(btn_phys_t *btnp) {
+    uint16_t high;
+    
+    assert(btn_phys_is_linked(btnp));
+    
+    high = ((btn_linked_phys_t *)btnp)->btlp_high;
+    if ((high == BTLP_HIGH_NONE) || (high == BTLP_HIGH_UNKNOWN))
+        return NULL;
+    
+    return (btr_phys_t *)((uint8_t *)btnp + high);
+}
+
+// the space a high key takes up in the heap
+static uint16_t btn_phys_high_key_size(btr_phys_t *key) {
+    return sizeof(btr_phys_t) + key->btrp_ksz;
+}
+
+// just past the first index pointer: the slots in a slotted node, the records in one that isn't
+static uint8_t *btn_phys_records_start(btn_phys_t *btnp) {
+    uint8_t *p = (uint8_t *)btnp + btn_phys_hdrsz(btnp);
+    if (!btn_phys_is_leaf(btnp))
+        p += sizeof(uint64_t);
+    return p;
+}
+
+// offset of the end of the space records can go in
+static uint16_t btn_phys_records_end(btn_phys_t *btnp, uint16_t blksz) {
+    return btn_phys_is_root(btnp) ? blksz - sizeof(bt_info_phys_t) : blksz;
+}
+
+static uint16_t *btn_phys_slots(btn_phys_t *btnp) {
+    assert(btn_phys_is_slotted(btnp));
+    return (uint16_t *)btn_phys_records_start(btnp);
+}
+
+// the space a record takes up in btnp, its slot included
+static uint16_t btn_phys_record_space(btn_phys_t *btnp, btr_phys_t *btrp) {
+    uint16_t sz = btr_phys_size(btrp);
+    if (btn_phys_is_slotted(btnp))
+        sz += sizeof(uint16_t);
+    return sz;
+}
+
+btr_phys_t *btn_phys_record(btn_phys_t *btnp, uint16_t ind) {
+    btr_phys_t *btrp;
+    
+    assert(ind < btnp->btnp_nrecords);
+    
+    if (btn_phys_is_slotted(btnp))
+        return (btr_phys_t *)((uint8_t *)btnp + btn_phys_slots(btnp)[ind]);
+    
+    btrp = (btr_phys_t *)btn_phys_records_start(btnp);
+    for (uint16_t i = 0; i < ind; i++)
+        btrp = btr_phys_next_record(btrp);
+    
+    return btrp;
+}
+
+btr_phys_t *btn_phys_first_record(btn_phys_t *btnp) {
+    if (btn_phys_is_empty(btnp))
+        return NULL;
+    return btn_phys_record(btnp, 0);
+}
+
+//
+// the record after btrp, which is record ind, or NULL if it's the last one. this
+// is how to walk a node: btn_phys_record has to walk one that isn't slotted
+//
+btr_phys_t *btn_phys_next_record(btn_phys_t *btnp, uint16_t ind, btr_phys_t *btrp) {
+    if (ind + 1 >= btnp->btnp_nrecords)
+        return NULL;
+    if (btn_phys_is_slotted(btnp))
+        return btn_phys_record(btnp, ind + 1);
+    return btr_phys_next_record(btrp);
+}
+
+// where the child pointer of index record ind is. -1 is the first index pointer
+static uint8_t *btn_phys_index_ptr_loc(btn_phys_t *btnp, int ind) {
+    btr_phys_t *btrp;
+    
+    if (ind < 0)
+        return btn_phys_records_start(btnp) - sizeof(uint64_t);
+    
+    btrp = btn_phys_record(btnp, ind);
+    
+    return (uint8_t *)btrp + sizeof(btr_phys_t) + btrp->btrp_ksz;
+}
+
 int btn_phys_iterate_records(btn_phys_t *btnp, int (*callback)(btr_phys_t *btr, void *ctx, bool *stop), void *ctx) {
     btr_phys_t *btrp;
     bool stop = false;
@@ -452,7 +1098,7 @@ int btn_phys_iterate_records(btn_phys_t *btnp, int (*callback)(btr_phys_t *btr,
             goto error_out;
         if (stop)
             goto out;
-        btrp = btr_phys_next_record(btrp);
+        btrp = btn_phys_next_record(btnp, i, btrp);
     }
     
 out:
@@ -462,18 +1108,177 @@ error_out:
     return err;
 }
 
-btr_phys_t *btn_phys_first_record(btn_phys_t *btnp) {
+uint64_t btn_phys_first_index_record_ptr(btn_phys_t *btnp) {
+    return *(uint64_t *)btn_phys_index_ptr_loc(btnp, -1);
+}
+
+//
+// check that btnp's records are inside it, and that they and its free space add
+// up to its size
+//
+static int btn_phys_check_records(btn_phys_t *btnp, uint16_t blksz) {
     btr_phys_t *btrp;
+    uint16_t *slots, heap, high, end, max_freespace;
+    uint8_t *p;
+    int freespace, err;
+    
+    max_freespace = blksz - btn_phys_hdrsz(btnp);
+    if (btn_phys_is_root(btnp))
+        max_freespace -= sizeof(bt_info_phys_t);
+    
+    if (btnp->btnp_freespace > max_freespace) {
+        printf("btn_phys_check_records: btnp->btnp_freespace > max_freespace\n");
+        err = EILSEQ;
+        goto error_out;
+    }
     
-    btrp = (btr_phys_t *)((uint8_t *)btnp + sizeof(btn_phys_t));
+    freespace = max_freespace;
     if (!btn_phys_is_leaf(btnp))
-        btrp = (btr_phys_t *)((uint8_t *)btrp + sizeof(uint64_t));
+        freespace -= sizeof(uint64_t); // for first index pointer
     
-    return btrp;
+    end = btn_phys_records_end(btnp, blksz);
+    if (btn_phys_is_slotted(btnp)) {
+        slots = btn_phys_slots(btnp);
+        heap = ((btn_slotted_phys_t *)btnp)->btsp_heap;
+        if (((uint8_t *)&slots[btnp->btnp_nrecords] > (uint8_t *)btnp + heap) || (heap > end)) {
+            printf("btn_phys_check_records: btsp_heap (%" PRIu16 ") out of range\n", heap);
+            err = EILSEQ;
+            goto error_out;
+        }
+        for (int i = 0; i < btnp->btnp_nrecords; i++) {
+            btrp = (btr_phys_t *)((uint8_t *)btnp + slots[i]);
+            if ((slots[i] < heap) || (slots[i] + sizeof(btr_phys_t) > end) || (slots[i] + btr_phys_size(btrp) > end)) {
+                printf("btn_phys_check_records: record %d (@ %" PRIu16 ") out of range\n", i, slots[i]);
+                err = EILSEQ;
+                goto error_out;
+            }
+            freespace -= btr_phys_size(btrp) + sizeof(uint16_t);
+        }
+        if (btn_phys_is_linked(btnp) && (btrp = btn_phys_high_key(btnp))) {
+            high = ((btn_linked_phys_t *)btnp)->btlp_high;
+            if ((high < heap) || (high + sizeof(btr_phys_t) > end) || (high + btn_phys_high_key_size(btrp) > end)) {
+                printf("btn_phys_check_records: high key (@ %" PRIu16 ") out of range\n", high);
+                err = EILSEQ;
+                goto error_out;
+            }
+            freespace -= btn_phys_high_key_size(btrp);
+        }
+    } else {
+        p = btn_phys_records_start(btnp);
+        for (int i = 0; i < btnp->btnp_nrecords; i++) {
+            btrp = (btr_phys_t *)p;
+            if ((p + sizeof(btr_phys_t) > (uint8_t *)btnp + end) || (p + btr_phys_size(btrp) > (uint8_t *)btnp + end)) {
+                printf("btn_phys_check_records: record %d out of range\n", i);
+                err = EILSEQ;
+                goto error_out;
+            }
+            freespace -= btr_phys_size(btrp);
+            p += btr_phys_size(btrp);
+        }
+    }
+    
+    if (btnp->btnp_freespace != freespace) {
+        printf("btn_phys_check_records: btnp->btnp_freespace != freespace\n");
+        err = EILSEQ;
+        goto error_out;
+    }
+    
+    return 0;
+    
+error_out:
+    return err;
 }
 
-uint64_t btn_phys_first_index_record_ptr(btn_phys_t *btnp) {
-    return *(uint64_t *)((uint8_t *)btn_phys_first_record(btnp) - sizeof(uint64_t));
+//
+// pack a slotted node's records (and a linked one's high key) up against the end
+// of it again, so that all of its free space is between the slots and the
+// records. it's done in place: the records are moved highest first, and none of
+// them moves down, so each one only lands on space that's free or that it's
+// leaving
+//
+static void btn_phys_compact(btn_phys_t *btnp, uint16_t blksz) {
+    uint16_t offs[BT_PHYS_BLKSZ / (sizeof(btr_phys_t) + sizeof(uint16_t)) + 1];
+    uint16_t order[sizeof(offs) / sizeof(uint16_t)];
+    uint16_t *slots = btn_phys_slots(btnp), nrecs = btnp->btnp_nrecords, n = nrecs, end, recsz;
+    btr_phys_t *btrp;
+    int j;
+    
+    assert((blksz <= BT_PHYS_BLKSZ) && (nrecs < sizeof(offs) / sizeof(uint16_t)));
+    
+    // the records' offsets, and then the high key's, if there is one
+    memcpy(offs, slots, nrecs * sizeof(uint16_t));
+    if (btn_phys_is_linked(btnp) && btn_phys_high_key(btnp))
+        offs[n++] = ((btn_linked_phys_t *)btnp)->btlp_high;
+    
+    // by offset, highest first
+    for (int i = 0; i < n; i++) {
+        for (j = i; (j > 0) && (offs[order[j - 1]] < offs[i]); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    
+    end = btn_phys_records_end(btnp, blksz);
+    for (int i = 0; i < n; i++) {
+        btrp = (btr_phys_t *)((uint8_t *)btnp + offs[order[i]]);
+        recsz = (order[i] < nrecs) ? btr_phys_size(btrp) : btn_phys_high_key_size(btrp);
+        end -= recsz;
+        memmove((uint8_t *)btnp + end, btrp, recsz);
+        offs[order[i]] = end;
+    }
+    
+    memcpy(slots, offs, nrecs * sizeof(uint16_t));
+    if (n > nrecs)
+        ((btn_linked_phys_t *)btnp)->btlp_high = offs[nrecs];
+    ((btn_slotted_phys_t *)btnp)->btsp_heap = end;
+}
+
+//
+// make key (its key, that is: it can be a whole record) btnp's high key, or
+// give it none if key is NULL, or make it BTLP_HIGH_UNKNOWN. that's what it
+// ends up as anyway if there isn't room for key. key can't be in btnp
+//
+static void btn_phys_set_high(btn_phys_t *btnp, uint16_t blksz, btr_phys_t *key, bool unknown) {
+    btn_linked_phys_t *btlp = (btn_linked_phys_t *)btnp;
+    btn_slotted_phys_t *btsp = (btn_slotted_phys_t *)btnp;
+    btr_phys_t *old = btn_phys_high_key(btnp), hdr;
+    uint16_t sz;
+    
+    if (old) { // give its space back
+        sz = btn_phys_high_key_size(old);
+        if (btlp->btlp_high == btsp->btsp_heap)
+            btsp->btsp_heap += sz;
+        btnp->btnp_freespace += sz;
+    }
+    
+    btlp->btlp_high = unknown ? BTLP_HIGH_UNKNOWN : BTLP_HIGH_NONE;
+    if (unknown || !key)
+        return;
+    
+    sz = btn_phys_high_key_size(key);
+    if (sz > btnp->btnp_freespace) {
+        btlp->btlp_high = BTLP_HIGH_UNKNOWN;
+        return;
+    }
+    
+    if ((uint8_t *)&btn_phys_slots(btnp)[btnp->btnp_nrecords] + sz > (uint8_t *)btnp + btsp->btsp_heap)
+        btn_phys_compact(btnp, blksz);
+    btsp->btsp_heap -= sz;
+    hdr.btrp_ksz = key->btrp_ksz;
+    hdr.btrp_vsz = 0;
+    memcpy((uint8_t *)btnp + btsp->btsp_heap, &hdr, sizeof(btr_phys_t));
+    memcpy((uint8_t *)btnp + btsp->btsp_heap + sizeof(btr_phys_t), (uint8_t *)key + sizeof(btr_phys_t), key->btrp_ksz);
+    btlp->btlp_high = btsp->btsp_heap;
+    btnp->btnp_freespace -= sz;
+}
+
+static void btn_phys_init(btn_phys_t *btnp, uint16_t blksz, uint16_t flags) {
+    memset(btnp, 0, blksz);
+    btnp->btnp_bp.bp_type = BT_PHYS_TYPE_NODE;
+    btnp->btnp_flags = flags | BTN_PHYS_FLG_SLOTTED;
+    btnp->btnp_freespace = blksz - btn_phys_hdrsz(btnp);
+    if (flags & BTN_PHYS_FLG_IS_ROOT)
+        btnp->btnp_freespace -= sizeof(bt_info_phys_t);
+    ((btn_slotted_phys_t *)btnp)->btsp_heap = btn_phys_records_end(btnp, blksz);
 }
 
 void btn_init_phys(btn_t *btn, uint16_t flags) {
@@ -483,13 +1288,8 @@ void btn_init_phys(btn_t *btn, uint16_t flags) {
     bcache_t *bc = bt->bt_bc;
     btn_phys_t *btnp = btn_phys(btn);
     
-    memset(btnp, 0, blksz);
-    btnp->btnp_bp.bp_type = BT_PHYS_TYPE_NODE;
-    btnp->btnp_flags = flags;
-    btnp->btnp_freespace = blksz - sizeof(btn_phys_t);
-    if (flags & BTN_PHYS_FLG_IS_ROOT)
-        btnp->btnp_freespace -= sizeof(bt_info_phys_t);
-    bc_dirty(bc, btn_block(btn));
+    btn_phys_init(btnp, blksz, flags);
+    bt_dirty(bt, btn_block(btn));
 }
 
 blk_t *btn_block(btn_t *btn) {
@@ -534,6 +1334,11 @@ void btn_dump_phys(btn_t *btn) {
            bt_bp_type_to_string(btnp->btnp_bp.bp_type), btn_phys_is_leaf(btnp) ? "(LEAF)" : "(INDEX)",
            btn_phys_is_root(btnp) ? " (ROOT)" : "", btnp->btnp_flags, btnp->btnp_nrecords, btnp->btnp_freespace);
     
+    if (btn_phys_is_slotted(btnp))
+        printf("btsp_heap %" PRIu16 " ", ((btn_slotted_phys_t *)btnp)->btsp_heap);
+    if (btn_phys_is_linked(btnp))
+        printf("btlp_right %" PRIu64 " btlp_high %" PRIu16 " ", btn_phys_right(btnp), ((btn_linked_phys_t *)btnp)->btlp_high);
+    
     if (btnp->btnp_flags & BTN_PHYS_FLG_IS_ROOT) {
         btip = (bt_info_phys_t *)((uint8_t *)btnp + blksz - sizeof(bt_info_phys_t));
         printf("bti_nnodes %" PRIu32 " ", btip->bti_nnodes);
@@ -543,13 +1348,13 @@ void btn_dump_phys(btn_t *btn) {
     printf("btn_records:");
     btrp = btn_phys_first_record(btnp);
     if (!btn_is_leaf(btn) && (btnp->btnp_nrecords > 0))
-        printf("\n    [-1]: btrp_ptr %" PRIu64 " ", *(uint64_t *)((uint8_t *)btrp - sizeof(uint64_t)));
+        printf("\n    [-1]: btrp_ptr %" PRIu64 " ", btn_phys_first_index_record_ptr(btnp));
     for (int i = 0; i < btnp->btnp_nrecords; i++) {
         printf("\n    [%d]: %p ", i, btrp);
         btn_dump_phys_record(btn, btrp);
         //if (btn_is_leaf(btn) && i == 0)
         //    break; // just dump the first recod for leaves
-        btrp = btr_phys_next_record(btrp);
+        btrp = btn_phys_next_record(btnp, i, btrp);
     }
 #endif
 }
@@ -571,33 +1376,12 @@ static bool bsi_did_split(btn_split_info_t *bsi) {
 }
 
 static int btn_bco_init(void **bco, blk_t *b) {
-    btn_t **btn, *_btn;
-    btn_phys_t *btnp = (btn_phys_t *)b->bl_phys;
-    int err;
-    
-    btn = (btn_t **)bco;
-    
-    _btn = malloc(sizeof(btn_t));
-    if (!_btn) {
-        err = ENOMEM;
-        goto error_out;
-    }
+    btn_t *btn = (btn_t *)*bco; // zeroed by the cache
     
-    memset(_btn, 0, sizeof(btn_t));
-    _btn->btn_blk = b;
-    _btn->btn_phys = btnp;
-    
-    *btn = _btn;
+    btn->btn_blk = b;
+    btn->btn_phys = (btn_phys_t *)b->bl_phys;
     
     return 0;
-    
-error_out:
-    return err;
-}
-
-static void btn_bco_destroy(void *bco) {
-    btn_t *btn = (btn_t *)bco;
-    free(btn);
 }
 
 static void btn_bco_dump(void *bco) {
@@ -611,42 +1395,34 @@ static void btn_bco_check(void *bco) {
     btree_t *bt = btn->btn_bt;
     sm_t *sm = bt->bt_sm;
     sm_phys_t *smp = sm_phys(sm);
-    uint16_t max_freespace, freespace;
-    btr_phys_t *btrp, *rec_space_start, *rec_space_end;
-    bt_info_phys_t *bip;
     
     assert(btnp->btnp_bp.bp_type = BT_PHYS_TYPE_NODE);
     assert((btnp->btnp_flags & ~BTN_PHYS_ALLOWABLE_FLAGS) == 0);
     if (!btn_is_leaf(btn))
         assert(btnp->btnp_nrecords > 0);
     
-    max_freespace = smp->smp_bsz - sizeof(btn_phys_t);
-    if (btn_is_root(btn))
-        max_freespace -= sizeof(bt_info_phys_t);
-    assert(btnp->btnp_freespace <= max_freespace);
+    assert(btn_phys_check_records(btnp, smp->smp_bsz) == 0);
+    if (btn_phys_is_linked(btnp) && btn_phys_high_key(btnp) && btnp->btnp_nrecords && bt->bt_ops->bto_compare_fn)
+        assert(bt->bt_ops->bto_compare_fn(btn_phys_record(btnp, btnp->btnp_nrecords - 1), btn_phys_high_key(btnp)) < 0);
+}
+
+// the root and index nodes are pinned, so scans over the leaves can't push them out
+static uint32_t btn_bco_class(void *bco) {
+    btn_t *btn = (btn_t *)bco;
     
-    rec_space_start = btn_first_record(btn);
-    rec_space_end = (btr_phys_t *)((uint8_t *)btnp + smp->smp_bsz);
-    if (btn_is_root(btn))
-        rec_space_end = (btr_phys_t *)((uint8_t *)rec_space_end - sizeof(bt_info_phys_t));
+    if (bl_type(btn_block(btn)) != BT_PHYS_TYPE_NODE) // a new node, read in before btn_init_phys
+        return BC_CLASS_NORMAL;
     
-    freespace = max_freespace;
-    btrp = btn_first_record(btn);
-    if (!btn_is_leaf(btn))
-        freespace -= sizeof(uint64_t); // for first index pointer
-    for (int i = 0; i < btnp->btnp_nrecords; i++) {
-        assert(btrp >= rec_space_start && btrp < rec_space_end);
-        freespace -= btr_phys_size(btrp);
-        btrp = btr_phys_next_record(btrp);
-    }
-    assert(btnp->btnp_freespace == freespace);
+    return (btn_is_root(btn) || !btn_is_leaf(btn)) ? BC_CLASS_PINNED : BC_CLASS_NORMAL;
 }
 
 static bco_ops_t btn_bco_ops = {
+    .bco_size = sizeof(btn_t),
     .bco_init = btn_bco_init,
-    .bco_destroy = btn_bco_destroy,
+    .bco_destroy = NULL,
     .bco_dump = btn_bco_dump,
-    .bco_check = btn_bco_check
+    .bco_check = btn_bco_check,
+    .bco_class = btn_bco_class
 };
 
 #define BTNG_FLG_INIT 0x0001 // initialize a brand new node (used in btn_alloc)
@@ -657,11 +1433,12 @@ static int btn_get(btree_t *bt, uint64_t blkno, uint32_t flags, uint32_t bip_fla
     btn_t *_btn = NULL;
     int err;
     
-    err = bc_get(bc, blkno, &btn_bco_ops, (void **)&_btn);
+    err = bc_file_get(bc, bt->bt_bf, blkno, &btn_bco_ops, (void **)&_btn);
     if (err)
         goto error_out;
     
-    _btn->btn_bt = bt;
+    if (_btn->btn_bt != bt) // it's been (re)loaded. don't write it under other getters' feet otherwise
+        _btn->btn_bt = bt;
     
     if (flags & BTNG_FLG_INIT) {
         btn_init_phys(_btn, bip_flags);
@@ -703,93 +1480,344 @@ error_out:
     return err;
 }
 
-int btn_insert(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
-    btree_t *bt = btn->btn_bt;
-    bcache_t *bc = bt->bt_bc;
-    btn_phys_t *btnp = btn_phys(btn);
-    btr_phys_t *btrp, *_btrp;
-    uint16_t recsz, tailsz = 0;
-    int comp, err;
-    
-    if(!btn_is_leaf(btn) && (btnp->btnp_nrecords == 0)) { // first index record is special
-        err = btn_insert_first_index_record(btn, 0, to_insert);
-        if (err)
-            goto error_out;
-        goto out;
-    }
-        
-    recsz = btr_phys_size(to_insert);
-    if (recsz > btnp->btnp_freespace) { // we need to split
-        err = btn_insert_split(btn, to_insert, bsi);
-        if (err)
-            goto error_out;
-        goto out;
+// see "concurrency" in btree.h
+static void btn_latch(btn_t *btn, bool exclusive) {
+    if (exclusive) {
+        rwl_lock_exclusive(btn_block(btn)->bl_rwlock);
+        __atomic_store_n(&btn->btn_version, btn->btn_version + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE); // odd before anything in the node changes
+    } else {
+        rwl_lock_shared(btn_block(btn)->bl_rwlock);
     }
+}
+
+static void btn_unlatch(btn_t *btn) {
+    uint64_t version = btn->btn_version;
     
-    // we don't need to split. just insert into our array of records
-    btrp = btn_phys_first_record(btnp);
-    tailsz = 0;
-    for (int i = 0; i < btnp->btnp_nrecords; i++) {
-        comp = bt->bt_ops->bto_compare_fn(to_insert, btrp);
-        if (comp == 0) {
-            err = EEXIST;
-            goto error_out;
-        }
-        if (comp < 0) {
-            _btrp = btrp;
-            for (int j = i; j < btnp->btnp_nrecords; j++) {
-                tailsz += btr_phys_size(_btrp);
-                _btrp = btr_phys_next_record(_btrp);
-            }
-            break;
+    if (version & 1) // latched exclusive
+        __atomic_store_n(&btn->btn_version, version + 1, __ATOMIC_RELEASE);
+    rwl_unlock(btn_block(btn)->bl_rwlock);
+}
+
+//
+// pins (see "concurrency" in btree.h). btn_pin is called with btn latched
+// shared, so whoever has it latched exclusive sees every pin there is
+//
+static void btn_pin(btn_t *btn) {
+    __atomic_add_fetch(&btn->btn_pins, 1, __ATOMIC_RELAXED);
+}
+
+static void btn_unpin(btn_t *btn) {
+    __atomic_sub_fetch(&btn->btn_pins, 1, __ATOMIC_RELEASE); // whatever was read from btn stays before it
+}
+
+static bool btn_pinned(btn_t *btn) {
+    return __atomic_load_n(&btn->btn_pins, __ATOMIC_ACQUIRE) != 0;
+}
+
+static __thread uint32_t bt_tslot_mine = UINT32_MAX;
+static uint32_t bt_tslot_next;
+
+static uint32_t bt_tslot(void) {
+    if (bt_tslot_mine == UINT32_MAX)
+        bt_tslot_mine = __atomic_fetch_add(&bt_tslot_next, 1, __ATOMIC_RELAXED) % BT_NSLOTS;
+    return bt_tslot_mine;
+}
+
+//
+// epochs for bt_find, the same as the block cache's (bc_rcu_enter). bt_rcu_wait
+// is only ever called with latches held, which is fine since bt_find never waits
+// on them
+//
+static uint32_t *bt_rcu_enter(btree_t *bt) {
+    uint32_t *readers;
+    
+    readers = &bt->bt_rcu[bt_tslot()].rs_readers[__atomic_load_n(&bt->bt_rcu_epoch, __ATOMIC_RELAXED) & 1];
+    __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+    
+    return readers;
+}
+
+static void bt_rcu_exit(uint32_t *readers) {
+    __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+}
+
+// wait until no bt_find can still be looking at whatever was unlinked before the call
+static void bt_rcu_wait(btree_t *bt) {
+    uint32_t old;
+    
+    lock_lock(bt->bt_rcu_lock);
+    for (int pass = 0; pass < 2; pass++) {
+        old = __atomic_fetch_add(&bt->bt_rcu_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (int i = 0; i < BT_NSLOTS; i++) {
+            while (__atomic_load_n(&bt->bt_rcu[i].rs_readers[old], __ATOMIC_ACQUIRE))
+                sched_yield();
         }
-        btrp = btr_phys_next_record(btrp);
     }
-    //
-    // btrp now points to the location in the btree node
-    // where this record should be inserted
-    //
-    if (tailsz) // shift existing records over to make room
-        memmove((uint8_t *)btrp + recsz, btrp, tailsz);
-    
-    memcpy(btrp, to_insert, recsz);
-    btnp->btnp_nrecords++;
-    btnp->btnp_freespace -= recsz;
-    bc_dirty(bc, btn_block(btn));
+    lock_unlock(bt->bt_rcu_lock);
+}
+
+//
+// bt_find's side of btn_version. btn_read_begin returns EAGAIN if btn is latched
+// exclusive, and btn_read_end returns EAGAIN if it's been latched exclusive since
+// btn_read_begin returned version
+//
+static int btn_read_begin(btn_t *btn, uint64_t *version) {
+    *version = __atomic_load_n(&btn->btn_version, __ATOMIC_ACQUIRE);
+    if (*version & 1) {
+        sched_yield(); // give the writer a chance to finish
+        return EAGAIN;
+    }
     
-out:
     return 0;
+}
+
+static int btn_read_end(btn_t *btn, uint64_t version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); // whatever was read before the version check stays before it
+    return (__atomic_load_n(&btn->btn_version, __ATOMIC_RELAXED) == version) ? 0 : EAGAIN;
+}
+
+//
+// copy btn's node into buf, without latching it. this races with writers on
+// purpose, so it's kept out of sight of the thread sanitizer and done a word at
+// a time (rather than with an intercepted memcpy). what's in buf is garbage
+// unless btn_read_end says otherwise
+//
+__attribute__((no_sanitize("thread")))
+static void btn_read_copy(btn_t *btn, uint64_t *buf, uint16_t blksz) {
+    void *phys = btn_phys(btn);
+    uint64_t *p = phys; // blocks are at least 8-byte aligned
     
-error_out:
-    return err;
+    for (uint16_t i = 0; i < blksz / sizeof(uint64_t); i++)
+        buf[i] = __atomic_load_n(&p[i], __ATOMIC_RELAXED);
 }
 
-int btn_insert_first_index_record(btn_t *btn, uint64_t ptr, btr_phys_t *to_insert) {
+//
+// find key in btn. returns 0 with its index in *ind if it's there, or ENOENT
+// with the index it would be inserted at if it isn't. slotted nodes are binary
+// searched
+//
+static int btn_search(btn_t *btn, btr_phys_t *key, uint16_t *ind) {
     btree_t *bt = btn->btn_bt;
-    bcache_t *bc = bt->bt_bc;
     btn_phys_t *btnp = btn_phys(btn);
     btr_phys_t *btrp;
-    uint16_t recsz;
-    int err;
+    uint16_t lo = 0, hi = btnp->btnp_nrecords, mid;
+    int comp;
     
-    recsz = btr_phys_size(to_insert) + sizeof(uint64_t);
-    assert(recsz <= btnp->btnp_freespace);
-    assert(!btn_is_leaf(btn) && btnp->btnp_nrecords == 0);
+    if (btn_phys_is_slotted(btnp)) {
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            comp = bt->bt_ops->bto_compare_fn(key, btn_phys_record(btnp, mid));
+            if (comp == 0) {
+                *ind = mid;
+                return 0;
+            }
+            if (comp < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+    } else {
+        btrp = btn_phys_first_record(btnp);
+        for (; lo < hi; lo++) {
+            comp = bt->bt_ops->bto_compare_fn(key, btrp);
+            if (comp == 0) {
+                *ind = lo;
+                return 0;
+            }
+            if (comp < 0)
+                break;
+            btrp = btn_phys_next_record(btnp, lo, btrp);
+        }
+    }
     
-    btrp = btn_first_record(btn);
-    memcpy((uint8_t *)btrp - sizeof(uint64_t), &ptr, sizeof(uint64_t));
-    memcpy(btrp, to_insert, btr_phys_size(to_insert));
+    *ind = lo;
     
-    btnp->btnp_nrecords++;
-    btnp->btnp_freespace -= recsz;
-    bc_dirty(bc, btn_block(btn));
+    return ENOENT;
+}
+
+// which of index node btn's child pointers to follow for key. -1 is the first index pointer
+static int btn_search_index(btn_t *btn, btr_phys_t *key) {
+    uint16_t ind;
     
-    return 0;
+    if (btn_search(btn, key, &ind) == 0)
+        return ind;
+    
+    return ind - 1;
+}
+
+static uint64_t btn_index_ptr(btn_t *btn, int ind) {
+    return *(uint64_t *)btn_phys_index_ptr_loc(btn_phys(btn), ind);
+}
+
+static void btn_set_index_ptr(btn_t *btn, int ind, uint64_t ptr) {
+    btree_t *bt = btn->btn_bt;
+    
+    memcpy(btn_phys_index_ptr_loc(btn_phys(btn), ind), &ptr, sizeof(uint64_t));
+    bt_dirty(bt, btn_block(btn));
+}
+
+//
+// put to_insert in as record ind. the caller has made sure there's room for it.
+// a slotted node is compacted if the gap between its slots and its records is
+// too small
+//
+static void btn_insert_at(btn_t *btn, uint16_t ind, btr_phys_t *to_insert) {
+    btree_t *bt = btn->btn_bt;
+    uint16_t blksz = sm_phys(bt->bt_sm)->smp_bsz;
+    btn_phys_t *btnp = btn_phys(btn);
+    btn_slotted_phys_t *btsp = (btn_slotted_phys_t *)btnp;
+    uint16_t recsz = btr_phys_size(to_insert), space, *slots;
+    uint8_t *p, *end;
+    
+    space = btn_phys_record_space(btnp, to_insert);
+    if (!btn_is_leaf(btn) && btn_is_empty(btn))
+        space += sizeof(uint64_t); // for first index pointer
+    assert((ind <= btnp->btnp_nrecords) && (space <= btnp->btnp_freespace));
+    
+    if (btn_phys_is_slotted(btnp)) {
+        slots = btn_phys_slots(btnp);
+        if ((uint8_t *)&slots[btnp->btnp_nrecords + 1] + recsz > (uint8_t *)btnp + btsp->btsp_heap)
+            btn_phys_compact(btnp, blksz);
+        btsp->btsp_heap -= recsz;
+        memcpy((uint8_t *)btnp + btsp->btsp_heap, to_insert, recsz);
+        memmove(&slots[ind + 1], &slots[ind], (btnp->btnp_nrecords - ind) * sizeof(uint16_t));
+        slots[ind] = btsp->btsp_heap;
+    } else {
+        // shift the records after it over to make room
+        p = btn_phys_records_start(btnp);
+        for (uint16_t i = 0; i < ind; i++)
+            p += btr_phys_size((btr_phys_t *)p);
+        end = p;
+        for (uint16_t i = ind; i < btnp->btnp_nrecords; i++)
+            end += btr_phys_size((btr_phys_t *)end);
+        memmove(p + recsz, p, end - p);
+        memcpy(p, to_insert, recsz);
+    }
+    
+    btnp->btnp_nrecords++;
+    btnp->btnp_freespace -= space;
+    bt_dirty(bt, btn_block(btn));
+}
+
+//
+// take out record ind. in a slotted node, the space it leaves is only part of
+// the gap if it was the lowest record. otherwise it waits for btn_phys_compact
+//
+static void btn_remove_at(btn_t *btn, uint16_t ind) {
+    btree_t *bt = btn->btn_bt;
+    btn_phys_t *btnp = btn_phys(btn);
+    btn_slotted_phys_t *btsp = (btn_slotted_phys_t *)btnp;
+    btr_phys_t *btrp = btn_phys_record(btnp, ind);
+    uint16_t recsz = btr_phys_size(btrp), space = btn_phys_record_space(btnp, btrp), *slots;
+    uint8_t *end;
+    
+    if (btn_phys_is_slotted(btnp)) {
+        slots = btn_phys_slots(btnp);
+        if (slots[ind] == btsp->btsp_heap)
+            btsp->btsp_heap += recsz;
+        memmove(&slots[ind], &slots[ind + 1], (btnp->btnp_nrecords - ind - 1) * sizeof(uint16_t));
+    } else {
+        // shift the records after it over
+        end = (uint8_t *)btrp;
+        for (uint16_t i = ind; i < btnp->btnp_nrecords; i++)
+            end += btr_phys_size((btr_phys_t *)end);
+        memmove(btrp, (uint8_t *)btrp + recsz, end - ((uint8_t *)btrp + recsz));
+    }
+    
+    btnp->btnp_nrecords--;
+    btnp->btnp_freespace += space;
+    if (!btn_is_leaf(btn) && btn_is_empty(btn))
+        btnp->btnp_freespace += sizeof(uint64_t);
+    bt_dirty(bt, btn_block(btn));
+}
+
+// drop records ind onwards, which have been copied to another node
+static void btn_truncate(btn_t *btn, uint16_t ind) {
+    btree_t *bt = btn->btn_bt;
+    btn_phys_t *btnp = btn_phys(btn);
+    btr_phys_t *btrp;
+    
+    if (ind == btnp->btnp_nrecords)
+        return;
+    
+    btrp = btn_phys_record(btnp, ind);
+    for (uint16_t i = ind; i < btnp->btnp_nrecords; i++) {
+        btnp->btnp_freespace += btn_phys_record_space(btnp, btrp);
+        btrp = btn_phys_next_record(btnp, i, btrp);
+    }
+    
+    btnp->btnp_nrecords = ind;
+    if (!btn_is_leaf(btn) && btn_is_empty(btn))
+        btnp->btnp_freespace += sizeof(uint64_t);
+    bt_dirty(bt, btn_block(btn));
+}
+
+int btn_insert(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
+    btn_phys_t *btnp = btn_phys(btn);
+    uint16_t ind;
+    int err;
+    
+    if(!btn_is_leaf(btn) && (btnp->btnp_nrecords == 0)) { // first index record is special
+        err = btn_insert_first_index_record(btn, 0, to_insert);
+        if (err)
+            goto error_out;
+        goto out;
+    }
+    
+    if (btn_search(btn, to_insert, &ind) == 0) {
+        err = EEXIST;
+        goto error_out;
+    }
+    
+    if (btn_phys_record_space(btnp, to_insert) > btnp->btnp_freespace) { // we need to split
+        err = btn_insert_split(btn, to_insert, bsi);
+        if (err)
+            goto error_out;
+        goto out;
+    }
+    
+    // we don't need to split. just insert into our array of records
+    btn_insert_at(btn, ind, to_insert);
+    
+out:
+    return 0;
     
 error_out:
     return err;
 }
 
+int btn_insert_first_index_record(btn_t *btn, uint64_t ptr, btr_phys_t *to_insert) {
+    assert(!btn_is_leaf(btn) && btn_is_empty(btn));
+    
+    btn_set_index_ptr(btn, -1, ptr);
+    btn_insert_at(btn, 0, to_insert);
+    
+    return 0;
+}
+
+//
+// nodes allocated and freed are counted in bt_ndelta, without the root latched,
+// and only added into its bt_info by someone who has it latched exclusive
+//
+static void bt_nnodes_add(btree_t *bt, int32_t n) {
+    __atomic_add_fetch(&bt->bt_ndelta, n, __ATOMIC_RELAXED);
+}
+
+// root has to be latched exclusive
+static void bt_nnodes_fold(btree_t *bt, btn_t *root) {
+    bt_info_phys_t *bip;
+    int32_t n;
+    
+    n = __atomic_exchange_n(&bt->bt_ndelta, 0, __ATOMIC_RELAXED);
+    if (!n)
+        return;
+    
+    bip = btn_root_info(root);
+    bip->bti_nnodes += n;
+    bt_dirty(bt, btn_block(root));
+}
+
 int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     btree_t *bt = btn->btn_bt;
     sm_t *sm = bt->bt_sm;
@@ -797,19 +1825,19 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     uint64_t blkno = 0;
     bcache_t *bc =bt->bt_bc;
     btn_t *nbtn = NULL;
-    btn_phys_t *btnp = btn_phys(btn), *orig_btnp = NULL, *nbtnp;
-    btr_phys_t *split_point = NULL, *insertion_point = NULL, *index_rec, *btrp, *_btrp, *tailrecs;
-    uint16_t split_ind = -1, insertion_ind = -1, headsz = 0, tailsz = 0, itailsz, movesz, nrecsz, maxsz, ntailrecs = 0;
+    btn_phys_t *btnp = btn_phys(btn), *nbtnp = NULL, *orig_btnp = NULL;
+    btr_phys_t *index_rec, *btrp;
+    uint16_t nrecs = btnp->btnp_nrecords, insertion_ind, headsz = 0, tailsz = 0, itailsz, totalsz = 0, prevsz = 0, recsz = 0, nrecsz, maxsz;
+    int split_ind = -1;
     uint32_t ba_flags = 0;
     btn_split_info_t _bsi, rbsi;
     bt_info_phys_t *bip;
-    int comp, err;
+    int err;
     
-    nrecsz = btr_phys_size(to_insert);
-    assert(nrecsz > btnp->btnp_freespace);
+    assert(btn_phys_record_space(btnp, to_insert) > btnp->btnp_freespace);
     
 #if 0
-    printf("bt_insert_split (max bt_max_inline_record_size %u) (nrecsz %u):\n", bt_max_inline_record_size(bt), nrecsz);
+    printf("bt_insert_split (max bt_max_inline_record_size %u) (nrecsz %u):\n", bt_max_inline_record_size(bt), btr_phys_size(to_insert));
     printf(" to_insert: ");
     bt->bt_ops->bto_dump_record_fn(to_insert, !btn_is_leaf(btn));
     printf("\n");
@@ -820,6 +1848,11 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     
     memset(&_bsi, 0, sizeof(btn_split_info_t));
     
+    if (btn_search(btn, to_insert, &insertion_ind) == 0) {
+        err = EEXIST;
+        goto error_out;
+    }
+    
     //
     // save a copy of our original btnp so we can restore if necessary
     //
@@ -835,6 +1868,8 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     //
     if (btn_is_leaf(btn))
         ba_flags |= BTN_PHYS_FLG_IS_LEAF;
+    if (btn_phys_is_linked(btnp))
+        ba_flags |= BTN_PHYS_FLG_LINKED;
     
     // assert(*bsi.reserved);
     // err = btn_alloc(bt, ba_flags, SMBA_RESERVED, &nbtn);
@@ -842,51 +1877,55 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     err = btn_alloc(bt, ba_flags, &nbtn);
     if (err)
         goto error_out;
-    nbtnp = btn_phys(nbtn);
     
     //
-    // find our split and insertion points:
+    // find our split point. sizes here are what records take up in a slotted
+    // node, like our new one. if btn isn't slotted, they take up less in it
     //
-    maxsz = bt_max_inline_record_size(bt);
+    maxsz = bt_max_inline_record_size(bt) + sizeof(uint16_t);
+    nrecsz = btr_phys_size(to_insert) + sizeof(uint16_t);
+    btrp = btn_phys_first_record(btnp);
+    for (int i = 0; i < nrecs; i++) {
+        totalsz += btr_phys_size(btrp) + sizeof(uint16_t);
+        btrp = btn_phys_next_record(btnp, i, btrp);
+    }
     itailsz = nrecsz;
     btrp = btn_phys_first_record(btnp);
-    for (int i = 0; i < btnp->btnp_nrecords; i++) {
-        if (!split_point && (headsz >= maxsz / 2)) {
-            split_point = btrp;
+    for (int i = 0; i < nrecs; i++) {
+        if ((split_ind < 0) && (headsz >= maxsz / 2)) {
             split_ind = i;
-            _btrp = btrp;
-            for (int j = i; j < btnp->btnp_nrecords; j++) {
-                tailsz += btr_phys_size(_btrp);
-                _btrp = btr_phys_next_record(_btrp);
-            }
-            if (!insertion_point) // to_insert will be in the tail
+            tailsz = totalsz - prevsz;
+            if (insertion_ind >= i) // to_insert will be in the tail
                 tailsz += nrecsz;
         }
-        if (!insertion_point) {
-            comp = bt->bt_ops->bto_compare_fn(to_insert, btrp);
-            if (comp == 0) {
-                err = EEXIST;
-                goto error_out;
-            }
-            if (comp < 0) {
-                insertion_point = btrp;
-                insertion_ind = i;
-                _btrp = btrp;
-                for (int j = i; j < btnp->btnp_nrecords; j++) {
-                    itailsz += btr_phys_size(_btrp);
-                    _btrp = btr_phys_next_record(_btrp);
-                }
-                headsz += nrecsz;
-                if (!split_point && (headsz >= maxsz / 2)) {
-                    split_point = btrp;
-                    split_ind = i;
-                    tailsz = itailsz;
-                }
+        if (i == insertion_ind) {
+            itailsz = nrecsz + totalsz - prevsz;
+            headsz += nrecsz;
+            if ((split_ind < 0) && (headsz >= maxsz / 2)) {
+                split_ind = i;
+                tailsz = itailsz;
             }
         }
-        if (!split_point)
-            headsz += btr_phys_size(btrp);
-        btrp = btr_phys_next_record(btrp);
+        recsz = btr_phys_size(btrp) + sizeof(uint16_t);
+        if (split_ind < 0)
+            headsz += recsz;
+        prevsz += recsz;
+        btrp = btn_phys_next_record(btnp, i, btrp);
+    }
+    
+    if (split_ind < 0) {
+        if (insertion_ind < nrecs) {
+            //
+            // it was the last record that took us past half full. it has to
+            // go too, or to_insert would end up in the node to the right of it
+            //
+            split_ind = nrecs - 1;
+            tailsz = recsz;
+            if (insertion_ind == split_ind)
+                tailsz += nrecsz;
+        } else { // to_insert is > all records in btn. it goes in the new node by itself
+            split_ind = nrecs;
+        }
     }
     
     //
@@ -895,47 +1934,33 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     // new root node
     //
     if (btn_is_root(btn)) {
+        bt_nnodes_fold(bt, btn);
         bip = (bt_info_phys_t *)((uint8_t *)btnp + blksz - sizeof(bt_info_phys_t));
         memcpy(&_bsi.bsi_bip, bip, sizeof(bt_info_phys_t));
         btnp->btnp_flags &= ~BTN_PHYS_FLG_IS_ROOT;
         btnp->btnp_freespace += sizeof(bt_info_phys_t);
     }
     
-    // note: !insertion_point implies to_insert is > all records in btn
-    if ((!insertion_point || insertion_point >= split_point) && (tailsz > maxsz)) { // we might need a third node
-        assert(nrecsz > (maxsz / 2)); // this must be the case. to_insert is large
-        assert((headsz + nrecsz) > maxsz);
+    if ((insertion_ind >= split_ind) && (tailsz > maxsz)) { // we might need a third node
         //
         // if we just insert records from insertion point
         // onwards into new node, we might not need a third
         // node. so let's try that
         //
-        split_point = insertion_point;
         split_ind = insertion_ind;
         tailsz = itailsz;
     }
     
-    tailrecs = split_point;
-    if (tailrecs)
-        ntailrecs = btnp->btnp_nrecords - split_ind;
-    
-    //printf(" split_ind %u split point %p insertion_ind %u insertion_point %p ntailrecs %u tailsz %u itailsz %u\n",
-    //            split_ind, split_point, insertion_ind, insertion_point, ntailrecs, tailsz, itailsz);
+    //printf(" split_ind %d insertion_ind %u tailsz %u itailsz %u\n", split_ind, insertion_ind, tailsz, itailsz);
     
-    if (tailrecs) {
+    if (split_ind < nrecs) {
         // move the tail records to our new node
-        movesz = tailsz;
-        if (!insertion_point || (insertion_point >= split_point))
-            movesz -= nrecsz;
-        memcpy(btn_first_record(nbtn), tailrecs, movesz);
-        btnp->btnp_nrecords -= ntailrecs;
-        nbtnp->btnp_nrecords += ntailrecs;
-        btnp->btnp_freespace += movesz;
-        nbtnp->btnp_freespace -= movesz;
-        if (!btn_is_leaf(nbtn))
-            nbtnp->btnp_freespace -= sizeof(uint64_t); // for the first index pointer
-        bc_dirty(bc, btn_block(btn));
-        bc_dirty(bc, btn_block(nbtn));
+        btrp = btn_phys_record(btnp, split_ind);
+        for (int i = split_ind; i < nrecs; i++) {
+            btn_insert_at(nbtn, i - split_ind, btrp);
+            btrp = btn_phys_next_record(btnp, i, btrp);
+        }
+        btn_truncate(btn, split_ind);
         
 #if 0
         printf(" node post move: ");
@@ -947,9 +1972,23 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
 #endif
     }
     
+    //
+    // nbtn goes in to the right of btn. neither has a high key until to_insert
+    // is in, so that it has the room it was sized for, and since it might split
+    // nbtn too. then the node that splits into is left with BTLP_HIGH_UNKNOWN
+    //
+    if (btn_phys_is_linked(btnp)) {
+        nbtnp = btn_phys(nbtn);
+        ((btn_linked_phys_t *)nbtnp)->btlp_right = btn_phys_right(btnp);
+        btn_phys_set_high(nbtnp, blksz, NULL, true);
+        ((btn_linked_phys_t *)btnp)->btlp_right = btn_block(nbtn)->bl_blkno;
+        btn_phys_set_high(btnp, blksz, NULL, true);
+        bt_dirty(bt, btn_block(btn));
+    }
+    
     memset(&rbsi, 0, sizeof(btn_split_info_t));
-    if ((insertion_point && insertion_point < split_point) ||
-            (tailsz > maxsz && nrecsz <= btnp->btnp_freespace)) { // to_insert goes into our original btree node
+    if ((insertion_ind < split_ind) ||
+            (tailsz > maxsz && btn_phys_record_space(btnp, to_insert) <= btnp->btnp_freespace)) { // to_insert goes into our original btree node
         err = btn_insert(btn, to_insert, &rbsi);
         if (err)
             goto error_out;
@@ -960,7 +1999,7 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
             goto error_out;
         if (bsi_did_split(&rbsi)) { // it might have split
             // this should have been the case:
-            assert(tailsz > maxsz && nrecsz > btnp->btnp_freespace);
+            assert(tailsz > maxsz && btn_phys_record_space(btnp, to_insert) > btnp->btnp_freespace);
             // shouldn't ever require 3 nodes for this split, and shouldn't be a root split:
             assert(rbsi.bsi_split_index1 && !rbsi.bsi_split_index2 && !rbsi.bsi_bip.bti_nnodes);
             // pass it back up to the caller via bsi_split_index2
@@ -977,6 +2016,12 @@ int btn_insert_split(btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
     printf("\n");
 #endif
     
+    if (btn_phys_is_linked(btnp)) {
+        if (!bsi_did_split(&rbsi))
+            btn_phys_set_high(nbtnp, blksz, btn_phys_high_key(orig_btnp), ((btn_linked_phys_t *)orig_btnp)->btlp_high == BTLP_HIGH_UNKNOWN);
+        btn_phys_set_high(btnp, blksz, btn_first_record(nbtn), false);
+    }
+    
     // build the index record to return up to the caller
     index_rec = btn_first_record(nbtn);
     err = btr_phys_build_index_record(index_rec, btn_block(nbtn)->bl_blkno, &_bsi.bsi_split_index1);
@@ -1003,50 +2048,14 @@ error_out:
 }
 
 int btn_remove(btn_t *btn, btr_phys_t *to_remove) {
-    btree_t *bt = btn->btn_bt;
-    bcache_t *bc = bt->bt_bc;
-    btn_phys_t *btnp = btn_phys(btn);
-    btr_phys_t *btrp, *_btrp;
-    uint16_t recsz, tailsz;
-    bool found;
-    int comp, err;
-    
-    btrp = btn_phys_first_record(btnp);
-    tailsz = 0;
-    found = false;
-    for (int i = 0; i < btnp->btnp_nrecords; i++) {
-        comp = bt->bt_ops->bto_compare_fn(to_remove, btrp);
-        if (comp < 0) {
-            err = ENOENT;
-            goto error_out;
-        }
-        if (comp == 0) {
-            recsz = btr_phys_size(btrp);
-            _btrp = btr_phys_next_record(btrp);
-            for (int j = i + 1; j < btnp->btnp_nrecords; j++) {
-                tailsz += btr_phys_size(_btrp);
-                _btrp = btr_phys_next_record(_btrp);
-            }
-            found = true;
-            break;
-        }
-        btrp = btr_phys_next_record(btrp);
-    }
+    uint16_t ind;
+    int err;
     
-    if (!found) {
-        err = ENOENT;
+    err = btn_search(btn, to_remove, &ind);
+    if (err)
         goto error_out;
-    }
-    
-    //
-    // btrp points to the record to be removed
-    //
-    if (tailsz) // shift existing records over to make room
-        memmove(btrp, (uint8_t *)btrp + recsz, tailsz);
     
-    btnp->btnp_nrecords--;
-    btnp->btnp_freespace += recsz;
-    bc_dirty(bc, btn_block(btn));
+    btn_remove_at(btn, ind);
     
     return 0;
     
@@ -1056,19 +2065,16 @@ error_out:
 
 int btn_free(btn_t *btn) {
     btree_t *bt = btn->btn_bt;
-    bcache_t *bc = bt->bt_bc;
     sm_t *sm = bt->bt_sm;
-    sm_phys_t *smp = sm_phys(sm);
-    bt_info_phys_t *bip;
     int err;
     
+    bt_rcu_wait(bt); // bt_find may have read a pointer to it
+    
     err = sm_bfree(sm, btn_block(btn)->bl_blkno);
     if (err)
         goto error_out;
     
-    bip = btn_root_info(bt->bt_root);
-    bip->bti_nnodes--;
-    bc_dirty(bc, btn_block(bt->bt_root));
+    bt_nnodes_add(bt, -1);
     
     return 0;
     
@@ -1153,10 +2159,70 @@ static int bt_unlock(btree_t *bt) {
     return rwl_unlock(bt->bt_rwlock);
 }
 
+// the largest record that fits in a node: a slotted (or linked) one, with nothing else in it
 uint16_t bt_max_inline_record_size(btree_t *bt) {
     sm_t *sm = bt->bt_sm;
     sm_phys_t *smp = sm_phys(sm);
-    return smp->smp_bsz - sizeof(btn_phys_t);
+    return smp->smp_bsz - (bt->bt_linked ? sizeof(btn_linked_phys_t) : sizeof(btn_slotted_phys_t)) - sizeof(uint16_t);
+}
+
+//
+// bt_root, held in the cache and latched: exclusive if exclusive is, and it's
+// a leaf or leaf_only isn't set. bt_rwlock's only held while the reference is
+// taken, so nobody waits on the root's latch with it. if the root's been
+// replaced by the time it's latched, it goes again
+//
+static btn_t *bt_root_latch(btree_t *bt, bool exclusive, bool leaf_only) {
+    bcache_t *bc = bt->bt_bc;
+    btn_t *root;
+    bool leaf;
+    
+    for (;;) {
+        bt_lock_shared(bt);
+        root = bt->bt_root;
+        bc_hold(bc, btn_block(root));
+        leaf = btn_is_leaf(root);
+        bt_unlock(bt);
+        
+        btn_latch(root, exclusive && (leaf || !leaf_only));
+        if (btn_is_root(root))
+            return root;
+        
+        btn_unlatch(root);
+        bc_release(bc, btn_block(root));
+    }
+}
+
+//
+// for a writer that's found btn pinned and let go of everything but its
+// reference to it, which this lets go of too. one holding bt_rwlock exclusive
+// for its log (locked) hasn't changed anything yet, so it lets go of that while
+// it waits as well
+//
+static void bt_wait_unpinned(btree_t *bt, btn_t *btn, bool locked) {
+    if (locked)
+        bt_unlock(bt);
+    while (btn_pinned(btn))
+        sched_yield();
+    if (locked)
+        bt_lock_exclusive(bt);
+    bc_release(bt->bt_bc, btn_block(btn));
+}
+
+//
+// for an operation that's changed the node count without the root latched. it
+// only needs it latched for a moment, once it's let go of everything else
+//
+static void bt_nnodes_sync(btree_t *bt) {
+    btn_t *root;
+    
+    if (!__atomic_load_n(&bt->bt_ndelta, __ATOMIC_RELAXED))
+        return;
+    
+    root = bt_root_latch(bt, true, false);
+    bt_nnodes_fold(bt, root);
+    btn_unlatch(root);
+    bc_release(bt->bt_bc, btn_block(root));
 }
 
 bt_info_phys_t *bt_info(btree_t *bt) {
@@ -1164,6 +2230,15 @@ bt_info_phys_t *bt_info(btree_t *bt) {
 }
 
 int bt_create(const char *path) {
+    return bt_create_flags(path, 0);
+}
+
+//
+// a compressed tree's file isn't preallocated: blocks that have never been
+// written read back as zeros, which is what the space manager expects. the log
+// (BT_WAL) is set up first, so an old tree's is never replayed into this one
+//
+int bt_create_flags(const char *path, uint32_t flags) {
     uint8_t *buf = NULL, *byte, bit, *extra;
     sm_phys_t *smp;
     bm_phys_t *bmp;
@@ -1172,16 +2247,36 @@ int bt_create(const char *path) {
     uint64_t *smp_map, blkno;
     btn_phys_t *btnp;
     bt_info_phys_t *btip;
-    ssize_t pret;
+    bc_blkfile_t *bbf = NULL;
     int fd = -1, err;
     
+    if (flags & BT_WAL)
+        err = bt_wal_create(path);
+    else
+        err = bt_wal_unlink(path);
+    if (err)
+        goto error_out;
+    
     fd = creat(path, S_IRWXU);
     if (fd < 0) {
         err = errno;
         goto error_out;
     }
     
-    err = posix_fallocate(fd, 0, BT_START_SIZE);
+    if (!(flags & BT_COMPRESS)) {
+        err = posix_fallocate(fd, 0, BT_START_SIZE);
+        if (err)
+            goto error_out;
+    }
+    
+    err = close(fd);
+    fd = -1;
+    if (err) {
+        err = errno;
+        goto error_out;
+    }
+    
+    err = bc_blkfile_open(path, BT_PHYS_BLKSZ, (flags & BT_COMPRESS) ? BC_COMPRESS : 0, &bbf);
     if (err)
         goto error_out;
     
@@ -1224,11 +2319,9 @@ int bt_create(const char *path) {
         smp_map[i] = blkno++;
     
     // write it out
-    pret = pwrite(fd, buf, BT_PHYS_BLKSZ, BT_PHYS_SM_OFFSET * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_write(bbf, BT_PHYS_SM_OFFSET, buf);
+    if (err)
         goto error_out;
-    }
     
     // set up the bitmaps:
     
@@ -1252,25 +2345,21 @@ int bt_create(const char *path) {
             bit = 1 << 7;
         }
     }
-
+    
     // write it out
     blkno = BT_PHYS_BT_OFFSET + 1;
-    pret = pwrite(fd, bmp, BT_PHYS_BLKSZ, blkno++ * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_write(bbf, blkno++, bmp);
+    if (err)
         goto error_out;
-    }
     
     // rest of the bitmaps are fully zeroed
     memset(bmp, 0, BT_PHYS_BLKSZ);
     bmp->bmp_bp.bp_type = BT_PHYS_TYPE_BM;
     bmp->bmp_nfree = blks_per_bm;
     for (int i = 1; i < nbmblks - 1; i++) {
-        pret = pwrite(fd, bmp, BT_PHYS_BLKSZ, blkno++ * BT_PHYS_BLKSZ);
-        if (pret != BT_PHYS_BLKSZ) {
-            err = EIO;
+        err = bc_blkfile_write(bbf, blkno++, bmp);
+        if (err)
             goto error_out;
-        }
     }
     
     // except for the last one, which might have extra bits. mark them as allocated
@@ -1290,44 +2379,34 @@ int bt_create(const char *path) {
     }
     
     // write it out
-    pret = pwrite(fd, bmp, BT_PHYS_BLKSZ, blkno * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_write(bbf, blkno, bmp);
+    if (err)
         goto error_out;
-    }
     
     //
     // set up the btree root node
     //
     btnp = (btn_phys_t *)buf;
     
-    memset(btnp, 0, BT_PHYS_BLKSZ);
-    btnp->btnp_bp.bp_type = BT_PHYS_TYPE_NODE;
-    btnp->btnp_flags = BTN_PHYS_FLG_IS_ROOT|BTN_PHYS_FLG_IS_LEAF;
-    btnp->btnp_freespace = BT_PHYS_BLKSZ - sizeof(btn_phys_t) - sizeof(bt_info_phys_t);
+    btn_phys_init(btnp, BT_PHYS_BLKSZ, BTN_PHYS_FLG_IS_ROOT|BTN_PHYS_FLG_IS_LEAF|BTN_PHYS_FLG_LINKED);
     
     btip = (bt_info_phys_t *)(buf + BT_PHYS_BLKSZ - sizeof(bt_info_phys_t));
     btip->bti_nnodes = 1;
     
     // write it out
-    pret = pwrite(fd, btnp, BT_PHYS_BLKSZ, BT_PHYS_BT_OFFSET * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_write(bbf, BT_PHYS_BT_OFFSET, btnp);
+    if (err)
         goto error_out;
-    }
     
     // sync everything out
-    err = fsync(fd);
-    if (err) {
-        err = errno;
+    err = bc_blkfile_sync(bbf);
+    if (err)
         goto error_out;
-    }
     
-    err = close(fd);
-    if (err) {
-        err = errno;
+    err = bc_blkfile_close(bbf);
+    bbf = NULL;
+    if (err)
         goto error_out;
-    }
     
     free(buf);
     
@@ -1336,19 +2415,32 @@ int bt_create(const char *path) {
 error_out:
     if (fd >= 0)
         close(fd);
+    if (bbf)
+        bc_blkfile_close(bbf);
     if (buf)
         free(buf);
     
     return err;
 }
 
-int bt_open(const char *path, bt_ops_t *ops, btree_t **bt) {
+//
+// open a tree in bc, which other trees can share. its blocks compete for the
+// same capacity as theirs. with a NULL bc, the tree gets a cache of its own
+//
+int bt_open_shared(const char *path, bt_ops_t *ops, bcache_t *bc, btree_t **bt) {
     btree_t *_bt = NULL;
     uint8_t *buf = NULL;
     sm_phys_t *smp;
+    bc_opts_t bco;
     uint64_t rblkno;
-    ssize_t pret;
-    int fd = -1, err;
+    bc_blkfile_t *bbf = NULL;
+    bt_wal_t *bw = NULL;
+    int err;
+    
+    // bring the file up to date with the log first
+    err = bt_wal_open(path, &bw);
+    if (err)
+        goto error_out;
     
     buf = malloc(BT_PHYS_BLKSZ);
     if (!buf) {
@@ -1356,17 +2448,19 @@ int bt_open(const char *path, bt_ops_t *ops, btree_t **bt) {
         goto error_out;
     }
     
-    fd = open(path, O_RDONLY);
-    if (fd <= 0) {
-        err = errno;
+    err = bc_blkfile_open(path, BT_PHYS_BLKSZ, 0, &bbf);
+    if (err)
+        goto error_out;
+    
+    err = bc_blkfile_read(bbf, BT_PHYS_SM_OFFSET, buf);
+    if (err)
         goto error_out;
-    }
     
-    pret = pread(fd, buf, BT_PHYS_BLKSZ, BT_PHYS_SM_OFFSET * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    // the block cache opens the file itself
+    err = bc_blkfile_close(bbf);
+    bbf = NULL;
+    if (err)
         goto error_out;
-    }
     
     smp = (sm_phys_t *)buf;
     rblkno = smp->smp_rblkno;
@@ -1385,11 +2479,57 @@ int bt_open(const char *path, bt_ops_t *ops, btree_t **bt) {
         goto error_out;
     }
     
-    _bt->bt_bc = bc_create((char *)path, smp->smp_bsz, smp->smp_nblocks * smp->smp_bsz / 8);
-    if (!_bt->bt_bc) {
+    _bt->bt_sm_lock = lock_create();
+    if (!_bt->bt_sm_lock) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    if (posix_memalign((void **)&_bt->bt_rcu, 64, sizeof(bt_rcu_slot_t) * BT_NSLOTS)) {
+        _bt->bt_rcu = NULL;
         err = ENOMEM;
         goto error_out;
     }
+    memset(_bt->bt_rcu, 0, sizeof(bt_rcu_slot_t) * BT_NSLOTS);
+    _bt->bt_rcu_lock = lock_create();
+    if (!_bt->bt_rcu_lock) {
+        err = ENOMEM;
+        goto error_out;
+    }
+    
+    if (bc) {
+        if (bc->bc_blksz != smp->smp_bsz) {
+            printf("bt_open_shared: the cache's block size doesn't match the tree's\n");
+            err = EINVAL;
+            goto error_out;
+        }
+        _bt->bt_bc = bc;
+        _bt->bt_bf = bc_file_open(bc, (char *)path);
+        if (!_bt->bt_bf) {
+            err = ENOMEM;
+            goto error_out;
+        }
+    } else {
+        memset(&bco, 0, sizeof(bc_opts_t));
+        bco.bcop_npartitions = BT_BC_NPARTITIONS;
+        bco.bcop_policy = &bc_policy_2q; // keep index nodes cached across big scans
+        bco.bcop_pinned_pct = BT_BC_PINNED_PCT;
+        
+        _bt->bt_bc = bc_create((char *)path, smp->smp_bsz, smp->smp_nblocks * smp->smp_bsz / 8, &bco);
+        if (!_bt->bt_bc) {
+            err = ENOMEM;
+            goto error_out;
+        }
+        _bt->bt_bf = _bt->bt_bc->bc_file;
+        _bt->bt_private_bc = true;
+    }
+    
+    if (bw) {
+        err = bc_file_set_wal(_bt->bt_bc, _bt->bt_bf, bt_wal_force, bw);
+        if (err)
+            goto error_out;
+        _bt->bt_wal = bw;
+    }
     
     _bt->bt_ops = malloc(sizeof(bt_ops_t));
     if (!_bt->bt_ops) {
@@ -1408,47 +2548,69 @@ int bt_open(const char *path, bt_ops_t *ops, btree_t **bt) {
     err = btn_get(_bt, rblkno, 0, 0, &_bt->bt_root);
     if (err)
         goto error_out;
+    _bt->bt_rblkno = rblkno;
+    _bt->bt_linked = btn_phys_is_linked(btn_phys(_bt->bt_root));
     
     *bt = _bt;
     
     free(buf);
     
-    // block cache has an open fd, so close this now
-    err = close(fd);
-    if (err) {
-        err = errno;
-        goto error_out;
-    }
-    
     return 0;
     
 error_out:
     if (buf)
         free(buf);
-    if (fd >= 0)
-        close(fd);
+    if (bbf)
+        bc_blkfile_close(bbf);
     if (_bt) {
         if (_bt->bt_rwlock)
             rwl_destroy(_bt->bt_rwlock);
+        if (_bt->bt_sm_lock)
+            lock_destroy(_bt->bt_sm_lock);
+        if (_bt->bt_rcu)
+            free(_bt->bt_rcu);
+        if (_bt->bt_rcu_lock)
+            lock_destroy(_bt->bt_rcu_lock);
         if (_bt->bt_sm)
             bc_release(_bt->bt_bc, sm_block(_bt->bt_sm));
         if (_bt->bt_root)
             bc_release(_bt->bt_bc, btn_block(_bt->bt_root));
-        if (_bt->bt_bc)
+        if (_bt->bt_private_bc)
             bc_destroy(_bt->bt_bc);
+        else if (_bt->bt_bf)
+            bc_file_close(_bt->bt_bc, _bt->bt_bf);
         if (_bt->bt_ops)
             free(_bt->bt_ops);
         free(_bt);
     }
+    if (bw)
+        bt_wal_close(bw);
     
     return err;
 }
 
+int bt_open(const char *path, bt_ops_t *ops, btree_t **bt) {
+    return bt_open_shared(path, ops, NULL, bt);
+}
+
+//
+// everything a tree with a log has done is already durable, so syncing it
+// means checkpointing it, which keeps the log (and the replay) short
+//
 int bt_sync(btree_t *bt) {
     bcache_t *bc = bt->bt_bc;
     int err;
     
-    err = bc_flush(bc);
+    if (bt->bt_wal) {
+        bt_lock_exclusive(bt);
+        err = bt_wal_checkpoint(bt);
+        bt_unlock(bt);
+        if (err)
+            goto error_out;
+        return 0;
+    }
+    
+    err = bc_file_flush(bc, bt->bt_bf);
     if (err)
         goto error_out;
     
@@ -1458,11 +2620,23 @@ error_out:
     return err;
 }
 
+//
+// the cache starts out at an eighth of the tree's size. this lets it be
+// rebalanced against other trees' while they're open. a shared cache is
+// resized for everyone using it
+//
+int bt_set_cache_size(btree_t *bt, uint32_t maxsz) {
+    return bc_set_capacity(bt->bt_bc, maxsz);
+}
+
 int bt_close(btree_t *bt) {
     bcache_t *bc = bt->bt_bc;
     int err;
     
-    err = bc_flush(bc);
+    if (bt->bt_wal)
+        err = bt_wal_checkpoint(bt);
+    else
+        err = bc_file_flush(bc, bt->bt_bf);
     if (err)
         goto error_out;
     
@@ -1472,9 +2646,20 @@ int bt_close(btree_t *bt) {
     bc_release(bc, sm_block(bt->bt_sm));
     bt->bt_sm = NULL;
     
-    bc_destroy(bc);
+    if (bt->bt_private_bc) {
+        bc_destroy(bc);
+    } else {
+        err = bc_file_close(bc, bt->bt_bf);
+        if (err)
+            goto error_out;
+    }
     
+    if (bt->bt_wal)
+        bt_wal_close(bt->bt_wal);
     rwl_destroy(bt->bt_rwlock);
+    lock_destroy(bt->bt_sm_lock);
+    free(bt->bt_rcu);
+    lock_destroy(bt->bt_rcu_lock);
     free(bt->bt_ops);
     free(bt);
     
@@ -1493,37 +2678,218 @@ int bt_destroy(const char *path) {
         goto error_out;
     }
     
+    err = bt_wal_unlink(path);
+    if (err)
+        goto error_out;
+    
     return 0;
     
 error_out:
     return err;
 }
 
-int _bt_insert(btree_t *bt, btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
-    bcache_t *bc = bt->bt_bc;
+//
+// the nodes a bt_insert or bt_remove that might change more than a leaf has
+// latched exclusive, from the root down. the ones above btp_top have been let
+// go, once it was clear nothing was going to change them
+//
+typedef struct bt_path {
+    btn_t *btp_nodes[BT_MAX_DEPTH];
+    int btp_depth;
+    int btp_top;
+    bool btp_locked; // bt_rwlock is held exclusive, so bt_root can be replaced
+    bool btp_keep; // nothing's let go early (trees with a log, whose writers hold bt_rwlock throughout)
+    btn_t *btp_pinned; // the leaf was pinned, and everything's let go of to wait for it (bt_wait_unpinned)
+} bt_path_t;
+
+static void bt_path_push(bt_path_t *path, btn_t *btn) {
+    assert(path->btp_depth < BT_MAX_DEPTH);
+    btn_latch(btn, true);
+    path->btp_nodes[path->btp_depth++] = btn;
+}
+
+// unlatch the deepest node, if it hasn't been already. it's still referenced
+static void bt_path_pop(bt_path_t *path) {
+    path->btp_depth--;
+    if (path->btp_depth >= path->btp_top)
+        btn_unlatch(path->btp_nodes[path->btp_depth]);
+}
+
+// let go of every node above top, and of bt_rwlock unless the root's going to be replaced
+static void bt_path_trim(btree_t *bt, bt_path_t *path, int top, bool root_splits) {
+    if (path->btp_keep)
+        return;
+    
+    if (path->btp_locked && !root_splits) {
+        bt_unlock(bt);
+        path->btp_locked = false;
+    }
+    
+    for (int i = path->btp_top; i < top; i++)
+        btn_unlatch(path->btp_nodes[i]);
+    if (top > path->btp_top)
+        path->btp_top = top;
+}
+
+//
+// to_insert is about to go into the leaf at the bottom of path. if the leaf
+// splits, it passes at most two index records up to its parent, each built from
+// one of its records or to_insert. if the parent has room for two of the largest
+// of those, nothing above it changes. if it doesn't, it might split too, and
+// pass up records built from those or its own, and so on up
+//
+static void bt_path_trim_insert(btree_t *bt, bt_path_t *path, btr_phys_t *to_insert) {
+    btn_phys_t *btnp;
+    btr_phys_t *btrp;
+    uint16_t maxsz;
+    int level = path->btp_depth - 1;
+    
+    btnp = btn_phys(path->btp_nodes[level]);
+    if (btn_phys_record_space(btnp, to_insert) <= btnp->btnp_freespace) { // the leaf won't split
+        bt_path_trim(bt, path, level, false);
+        return;
+    }
+    
+    maxsz = btr_phys_index_size(to_insert);
+    while (level > 0) {
+        btrp = btn_phys_first_record(btnp);
+        for (uint16_t i = 0; i < btnp->btnp_nrecords; i++) {
+            if (btr_phys_index_size(btrp) > maxsz)
+                maxsz = btr_phys_index_size(btrp);
+            btrp = btn_phys_next_record(btnp, i, btrp);
+        }
+        
+        btnp = btn_phys(path->btp_nodes[--level]);
+        if (2 * (maxsz + sizeof(uint16_t)) <= btnp->btnp_freespace) { // it won't split
+            bt_path_trim(bt, path, level, false);
+            return;
+        }
+    }
+    
+    // the root might split
+    bt_path_trim(bt, path, 0, true);
+}
+
+//
+// to_remove is about to come out of the leaf at the bottom of path. if that
+// empties it, it's freed and its parent's pointer to it is cleared, but that's
+// as far up as a remove goes
+//
+static void bt_path_trim_remove(btree_t *bt, bt_path_t *path, btr_phys_t *to_remove) {
+    btn_t *btn = path->btp_nodes[path->btp_depth - 1];
+    uint16_t ind;
+    int top = path->btp_depth - 1;
+    
+    if ((top > 0) && (btn_phys(btn)->btnp_nrecords == 1) && (btn_search(btn, to_remove, &ind) == 0))
+        top--;
+    
+    bt_path_trim(bt, path, top, false);
+}
+
+//
+// latch coupling down to the leaf key belongs in: each node is latched before
+// its parent is let go. the leaf's latched exclusive if it's going to be changed,
+// and everything else shared, and if it's pinned, it waits for that and goes
+// again. returns the leaf latched and referenced, or ENOENT if it's been freed
+//
+static int bt_descend(btree_t *bt, btr_phys_t *key, bool exclusive, btn_t **leaf) {
+    bcache_t *bc = bt->bt_bc;
+    btn_t *btn, *child;
+    uint64_t index_ptr;
+    bool locked = exclusive && bt->bt_wal; // writers to a tree with a log already have it exclusive
+    int err;
+    
+again:
+    if (locked) {
+        btn = bt->bt_root;
+        bc_hold(bc, btn_block(btn));
+        btn_latch(btn, btn_is_leaf(btn));
+    } else {
+        btn = bt_root_latch(bt, exclusive, true);
+    }
+    
+    while (!btn_is_leaf(btn)) {
+        index_ptr = btn_index_ptr(btn, btn_search_index(btn, key));
+        if (!index_ptr) {
+            err = ENOENT;
+            goto error_out;
+        }
+        
+        err = btn_get(bt, index_ptr, 0, 0, &child);
+        if (err)
+            goto error_out;
+        
+        // only the root's flags ever change, so child's can be looked at before it's latched
+        btn_latch(child, exclusive && btn_is_leaf(child));
+        btn_unlatch(btn);
+        bc_release(bc, btn_block(btn));
+        btn = child;
+    }
+    
+    if (exclusive && btn_pinned(btn)) {
+        btn_unlatch(btn);
+        bt_wait_unpinned(bt, btn, locked);
+        goto again;
+    }
+    
+    *leaf = btn;
+    
+    return 0;
+    
+error_out:
+    btn_unlatch(btn);
+    bc_release(bc, btn_block(btn));
+    
+    return err;
+}
+
+//
+// a leaf allocated where one was freed, for index record ind of btn, gets the
+// key after it in btn (or btn's high key) as its high key, and the next child
+// btn has to the right of it as its right link, if there is one. the leaf to
+// its left isn't linked to it (see btn_linked_phys_t)
+//
+static void btn_link_refill(btn_t *btn, int ind, btn_t *child) {
+    btree_t *bt = btn->btn_bt;
+    uint16_t blksz = sm_phys(bt->bt_sm)->smp_bsz;
+    btn_phys_t *btnp = btn_phys(btn), *cbtnp = btn_phys(child);
+    uint64_t right = 0;
+    
+    for (int i = ind + 1; (i < btnp->btnp_nrecords) && !right; i++)
+        right = btn_index_ptr(btn, i);
+    ((btn_linked_phys_t *)cbtnp)->btlp_right = right;
+    
+    if (ind + 1 < btnp->btnp_nrecords)
+        btn_phys_set_high(cbtnp, blksz, btn_phys_record(btnp, ind + 1), false);
+    else
+        btn_phys_set_high(cbtnp, blksz, btn_phys_high_key(btnp), ((btn_linked_phys_t *)btnp)->btlp_high == BTLP_HIGH_UNKNOWN);
+    
+    bt_dirty(bt, btn_block(child));
+}
+
+static int _bt_insert(btree_t *bt, bt_path_t *path, btn_t *btn, btr_phys_t *to_insert, btn_split_info_t *bsi) {
+    bcache_t *bc = bt->bt_bc;
     btn_phys_t *btnp = btn_phys(btn);
     btn_t *sbtn = NULL;
-    btr_phys_t *btrp;
     uint64_t index_ptr, sblkno;
     btn_t *child = NULL;
     btn_split_info_t cbsi, ibsi, isbsi;
-    bt_info_phys_t *bip;
-    int comp, err;
+    int ind, comp, err;
     
     if (btn_is_leaf(btn)) {
+        if (btn_pinned(btn)) { // nothing's changed yet. the caller lets go of everything and waits
+            bc_hold(bc, btn_block(btn));
+            path->btp_pinned = btn;
+            err = EAGAIN;
+            goto error_out;
+        }
+        bt_path_trim_insert(bt, path, to_insert);
         err = btn_insert(btn, to_insert, bsi);
         if (err)
             goto error_out;
     } else { // index node
-        btrp = btn_first_record(btn);
-        index_ptr = btn_first_index_record_ptr(btn);
-        for (int i = 0; i < btnp->btnp_nrecords; i++) {
-            comp = bt->bt_ops->bto_compare_fn(to_insert, btrp);
-            if (comp < 0)
-                break;
-            index_ptr = btr_phys_index_ptr(btrp);
-            btrp = btr_phys_next_record(btrp);
-        }
+        ind = btn_search_index(btn, to_insert);
+        index_ptr = btn_index_ptr(btn, ind);
         
         if (index_ptr == 0) {
             //
@@ -1533,32 +2899,33 @@ int _bt_insert(btree_t *bt, btn_t *btn, btr_phys_t *to_insert, btn_split_info_t
             // would be nice to have a btn_level field in nodes so that
             // we can assert we're at level 1 here
             //
-            err = btn_alloc(bt, BTN_PHYS_FLG_IS_LEAF, &child);
+            err = btn_alloc(bt, BTN_PHYS_FLG_IS_LEAF | (btn_phys_is_linked(btnp) ? BTN_PHYS_FLG_LINKED : 0), &child);
             if (err)
                 goto error_out;
+            if (btn_phys_is_linked(btnp))
+                btn_link_refill(btn, ind, child);
             
             // update index ptr
-            memcpy((uint8_t *)btrp - sizeof(uint64_t), &btn_block(child)->bl_blkno, sizeof(uint64_t));
-            bc_dirty(bc, btn_block(btn));
+            btn_set_index_ptr(btn, ind, btn_block(child)->bl_blkno);
             
-            bip = btn_root_info(bt->bt_root);
-            bip->bti_nnodes++;
-            bc_dirty(bc, btn_block(bt->bt_root));
+            bt_nnodes_add(bt, 1);
         } else { // get the child node
             err = btn_get(bt, index_ptr, 0, 0, &child);
             if (err)
                 goto error_out;
         }
         
+        bt_path_push(path, child);
+        
         // recurse
         memset(&cbsi, 0, sizeof(btn_split_info_t));
-        err = _bt_insert(bt, child, to_insert, &cbsi);
+        err = _bt_insert(bt, path, child, to_insert, &cbsi);
         if (err)
             goto error_out;
         
         if (bsi_did_split(&cbsi)) { // our child split
-            bip = btn_root_info(bt->bt_root);
-            bip->bti_nnodes++;
+            assert(path->btp_depth - 2 >= path->btp_top); // bt_path_trim_insert kept btn latched
+            bt_nnodes_add(bt, 1);
             
             // insert the index passed up to us from our child
             memset(&ibsi, 0, sizeof(btn_split_info_t));
@@ -1581,7 +2948,7 @@ int _bt_insert(btree_t *bt, btn_t *btn, btr_phys_t *to_insert, btn_split_info_t
                 // to handle this case, but it would prevent the btn_insert below from ever causing
                 // a split, which is ideal
                 //
-                bip->bti_nnodes++;
+                bt_nnodes_add(bt, 1);
                 if (bsi_did_split(&ibsi)) {
                     //
                     // we split above when we inserted the first record, so now we
@@ -1617,10 +2984,9 @@ int _bt_insert(btree_t *bt, btn_t *btn, btr_phys_t *to_insert, btn_split_info_t
             }
             
             *bsi = ibsi;
-            
-            bc_dirty(bc, btn_block(bt->bt_root));
         }
         
+        bt_path_pop(path);
         bc_release(bc, btn_block(child));
         child = NULL;
     }
@@ -1629,36 +2995,83 @@ out:
     return 0;
     
 error_out:
-    if (child)
+    if (child) {
+        bt_path_pop(path);
         bc_release(bc, btn_block(child));
+    }
     
     return err;
 }
 
-int bt_insert(btree_t *bt, btr_phys_t *to_insert) {
+//
+// the leaf to_insert goes in is all that changes, unless it has to split. so
+// try that first, with just the leaf latched exclusive. EAGAIN if it would
+// split, or has to be allocated
+//
+static int bt_insert_leaf(btree_t *bt, btr_phys_t *to_insert) {
+    bcache_t *bc = bt->bt_bc;
+    btn_split_info_t bsi;
+    btn_phys_t *btnp;
+    btn_t *leaf;
+    int err;
+    
+    err = bt_descend(bt, to_insert, true, &leaf);
+    if (err) {
+        if (err == ENOENT) // the leaf it goes in was freed
+            err = EAGAIN;
+        goto error_out;
+    }
+    
+    btnp = btn_phys(leaf);
+    if (btn_phys_record_space(btnp, to_insert) > btnp->btnp_freespace) {
+        err = EAGAIN;
+    } else {
+        memset(&bsi, 0, sizeof(btn_split_info_t));
+        err = btn_insert(leaf, to_insert, &bsi);
+        assert(!bsi_did_split(&bsi));
+    }
+    
+    btn_unlatch(leaf);
+    bc_release(bc, btn_block(leaf));
+    
+    if (err)
+        goto error_out;
+    
+    return 0;
+    
+error_out:
+    return err;
+}
+
+//
+// latch exclusive from the root down, and once we're at the leaf, let go of
+// everything above what its split can reach. bt_rwlock is held until then, and
+// after if the split can reach the root, so it can be replaced
+//
+static int bt_insert_path(btree_t *bt, btr_phys_t *to_insert) {
     bcache_t *bc = bt->bt_bc;
     sm_t *sm = bt->bt_sm;
     sm_phys_t *smp = sm_phys(sm);
     btn_split_info_t bsi1, bsi2, *bsi;
-    btn_t *rbtn;
+    bt_path_t path;
+    btn_t *root, *rbtn;
     btn_phys_t *rbtnp;
     bt_info_phys_t *btip;
     uint64_t rblkno_old;
     int err;
     
-    bt_lock_exclusive(bt);
-    
-    if (btr_phys_index_size(to_insert) > (bt_max_inline_record_size(bt) - sizeof(bt_info_phys_t) - sizeof(uint64_t))) {
-        // this key is too large to fit in an index node (namely the root index node)
-        err = E2BIG;
-        goto error_out;
+again:
+    memset(&path, 0, sizeof(bt_path_t));
+    if (bt->bt_wal) {
+        path.btp_keep = true;
+    } else {
+        bt_lock_exclusive(bt);
+        path.btp_locked = true;
     }
     
-    if (btr_phys_size(to_insert) > bt_max_inline_record_size(bt)) {
-        // TODO: could support larger records via blocklists
-        err = E2BIG;
-        goto error_out;
-    }
+    root = bt->bt_root;
+    bc_hold(bc, btn_block(root));
+    bt_path_push(&path, root);
     
     memset(&bsi1, 0, sizeof(btn_split_info_t));
     memset(&bsi2, 0, sizeof(btn_split_info_t));
@@ -1672,11 +3085,12 @@ int bt_insert(btree_t *bt, btr_phys_t *to_insert) {
     // bsi1.reserved = bt->bt_nlevels * 2;
     // bsi2.reserved = 2;
     
-    err = _bt_insert(bt, bt->bt_root, to_insert, &bsi1);
+    err = _bt_insert(bt, &path, root, to_insert, &bsi1);
     if (err)
-        goto error_out;
+        goto out;
     
     if (bsi_did_split(&bsi1)) { // root split
+        assert(path.btp_locked || path.btp_keep);
         bsi = &bsi1;
 did_split:
         bc_release(bc, btn_block(bt->bt_root));
@@ -1684,7 +3098,7 @@ did_split:
         
         rblkno_old = smp->smp_rblkno;
         // err = btn_alloc(bt, BTN_PHYS_FLG_IS_ROOT, SMBA_RESERVED, &bt->bt_root);
-        err = btn_alloc(bt, BTN_PHYS_FLG_IS_ROOT, &bt->bt_root);
+        err = btn_alloc(bt, BTN_PHYS_FLG_IS_ROOT | (bt->bt_linked ? BTN_PHYS_FLG_LINKED : 0), &bt->bt_root);
         //
         // we can't recover from failure here. btn_alloc should never
         // fail here since we've reserved space above for the maximum
@@ -1696,8 +3110,10 @@ did_split:
         rbtn = bt->bt_root;
         rbtnp = btn_phys(rbtn);
         
+        lock_lock(bt->bt_sm_lock);
         smp->smp_rblkno = btn_block(rbtn)->bl_blkno;
-        bc_dirty(bc, sm_block(sm));
+        bt_dirty(bt, sm_block(sm));
+        lock_unlock(bt->bt_sm_lock);
         
         //
         // _bt_insert should have set bsi_bip up for us in the case of a root split.
@@ -1722,218 +3138,925 @@ did_split:
                 goto did_split;
             }
         }
+        
+        // bt_find can start from it now. the old root's still latched, so anyone on it will start over
+        __atomic_store_n(&bt->bt_rblkno, btn_block(bt->bt_root)->bl_blkno, __ATOMIC_RELEASE);
     }
     
     // clean up:
     
-    if (bsi_did_split(&bsi1)) {
-        free(bsi1.bsi_split_index1);
-        if (bsi1.bsi_split_index2)
-            free(bsi1.bsi_split_index2);
+    if (bsi_did_split(&bsi1)) {
+        free(bsi1.bsi_split_index1);
+        if (bsi1.bsi_split_index2)
+            free(bsi1.bsi_split_index2);
+    }
+    // sm_unreserve(sm, bsi1.bsi_reserved);
+    
+    if (bsi_did_split(&bsi2)) {
+        free(bsi2.bsi_split_index1);
+        if (bsi2.bsi_split_index2)
+            free(bsi2.bsi_split_index2);
+    }
+    // sm_unreserve(sm, bsi2.bsi_reserved);
+    
+out:
+    //if (bsi.bsi_reserved)
+    //    sm_unreserve(sm, bsi.reserved);
+    
+    if (path.btp_top == 0) // we still have the root latched (or a new one nobody else can get to yet)
+        bt_nnodes_fold(bt, bt->bt_root);
+    bt_path_pop(&path);
+    bc_release(bc, btn_block(root));
+    if (path.btp_locked)
+        bt_unlock(bt);
+    bt_nnodes_sync(bt);
+    
+    if (path.btp_pinned) {
+        bt_wait_unpinned(bt, path.btp_pinned, bt->bt_wal != NULL);
+        goto again;
+    }
+    
+    return err;
+}
+
+int bt_insert(btree_t *bt, btr_phys_t *to_insert) {
+    uint64_t lsn;
+    int err;
+    
+    if (bt->bt_wal)
+        bt_lock_exclusive(bt);
+    
+    if (btr_phys_index_size(to_insert) > (bt_max_inline_record_size(bt) - sizeof(bt_info_phys_t) - sizeof(uint64_t))) {
+        // this key is too large to fit in an index node (namely the root index node)
+        err = E2BIG;
+        goto error_out;
+    }
+    
+    if (btr_phys_size(to_insert) > bt_max_inline_record_size(bt)) {
+        // TODO: could support larger records via blocklists
+        err = E2BIG;
+        goto error_out;
+    }
+    
+    err = bt_insert_leaf(bt, to_insert);
+    if (err == EAGAIN)
+        err = bt_insert_path(bt, to_insert);
+    if (err)
+        goto error_out;
+    
+    if (!bt->bt_wal)
+        return 0;
+    
+    lsn = bt_wal_end(bt);
+    bt_unlock(bt);
+    
+    // wait for it to be durable
+    err = bt_wal_commit(bt, lsn);
+    if (err)
+        return err;
+    
+    return 0;
+    
+error_out:
+    if (bt->bt_wal) {
+        bt_wal_end(bt); // whatever did change has to be logged before it can go home
+        bt_unlock(bt);
+    }
+    
+    return err;
+}
+
+
+//
+// whether key is at or past the high key of btn (a copy in bt_find), and so
+// belongs to something to its right
+//
+static bool btn_past_high(btn_t *btn, btr_phys_t *key) {
+    btree_t *bt = btn->btn_bt;
+    btr_phys_t *high;
+    
+    if (!btn_phys_is_linked(btn_phys(btn)))
+        return false;
+    
+    high = btn_phys_high_key(btn_phys(btn));
+    
+    return high && (bt->bt_ops->bto_compare_fn(key, high) >= 0);
+}
+
+//
+// whether bt_find can go by btn's (a copy's) high key, rather than its parent's
+// version, to know it's in the right place
+//
+static bool btn_high_known(btn_t *btn) {
+    btn_phys_t *btnp = btn_phys(btn);
+    
+    return btn_phys_is_linked(btnp) && (((btn_linked_phys_t *)btnp)->btlp_high != BTLP_HIGH_UNKNOWN);
+}
+
+//
+// hand a found record back as a copy: in rbuf, if the caller gave one (and
+// *size says it's big enough), or malloc'd if not. *size is set to the
+// record's size either way
+//
+static int bt_find_copy_out(btr_phys_t *btrp, btr_phys_t *rbuf, uint16_t *size, btr_phys_t **record) {
+    uint16_t recsz = btr_phys_size(btrp);
+    btr_phys_t *found;
+    
+    if (rbuf) {
+        if (recsz > *size) {
+            *size = recsz;
+            return ENOSPC;
+        }
+        *size = recsz;
+        memcpy(rbuf, btrp, recsz);
+        return 0;
+    }
+    
+    found = malloc(recsz);
+    if (!found)
+        return ENOMEM;
+    memcpy(found, btrp, recsz);
+    *record = found;
+    
+    return 0;
+}
+
+//
+// the last step of bt_find_optimistic for bt_find_pinned: latch leaf instead of
+// copying it. if it hasn't changed since cversion, and it's still where to_find
+// belongs (by its high key, or by its parent btn not having changed since
+// version), then what's in it is what would have been copied. the caller has
+// left its read section, since bt_rcu_wait is called with latches held
+//
+static int bt_find_pin(btn_t *btn, uint64_t version, btn_t *leaf, uint64_t cversion, btr_phys_t *to_find, bt_handle_t *bth, btr_phys_t **record) {
+    uint16_t ind;
+    int err;
+    
+    btn_latch(leaf, false);
+    
+    if (__atomic_load_n(&leaf->btn_version, __ATOMIC_RELAXED) != cversion) {
+        err = EAGAIN;
+        goto error_out;
+    }
+    
+    if (btn_high_known(leaf)) {
+        if (btn_past_high(leaf, to_find)) {
+            err = EAGAIN;
+            goto error_out;
+        }
+    } else {
+        err = btn_read_end(btn, version);
+        if (err)
+            goto error_out;
+    }
+    
+    err = btn_search(leaf, to_find, &ind);
+    if (err) // didn't find it
+        goto error_out;
+    
+    btn_pin(leaf);
+    btn_unlatch(leaf);
+    bth->bth_leaf = leaf;
+    *record = btn_phys_record(btn_phys(leaf), ind);
+    
+    return 0;
+    
+error_out:
+    btn_unlatch(leaf);
+    
+    return err;
+}
+
+//
+// bt_find without latches (see "concurrency" in btree.h). returns EAGAIN if a
+// writer got in its way and it has to start over. if there's a bth, the leaf
+// is latched rather than copied (or, if it was copied, latched once it's been
+// found in), and the record's handed back where it is
+//
+static int bt_find_optimistic(btree_t *bt, btr_phys_t *to_find, bt_handle_t *bth, btr_phys_t *rbuf, uint16_t *size, btr_phys_t **record) {
+    bcache_t *bc = bt->bt_bc;
+    uint16_t blksz = sm_phys(bt->bt_sm)->smp_bsz;
+    uint64_t buf[BT_PHYS_BLKSZ / sizeof(uint64_t)];
+    btn_t copy = { .btn_bt = bt, .btn_phys = (btn_phys_t *)buf };
+    btn_t *btn = NULL, *child = NULL;
+    btr_phys_t *btrp;
+    uint64_t version, cversion, index_ptr;
+    uint32_t *readers;
+    uint16_t ind;
+    int err;
+    
+    readers = bt_rcu_enter(bt);
+    
+    err = btn_get(bt, __atomic_load_n(&bt->bt_rblkno, __ATOMIC_ACQUIRE), 0, 0, &btn);
+    if (err)
+        goto error_out;
+    
+    err = btn_read_begin(btn, &version);
+    if (err)
+        goto error_out;
+    btn_read_copy(btn, buf, blksz);
+    err = btn_read_end(btn, version);
+    if (err)
+        goto error_out;
+    
+    // an old root that's been split in a linked tree knows where the rest went
+    if (!btn_phys_is_linked(copy.btn_phys) && !btn_phys_is_root(copy.btn_phys)) { // it's been replaced
+        err = EAGAIN;
+        goto error_out;
+    }
+    
+    for (;;) {
+        // btn split after its parent sent us here
+        while (btn_past_high(&copy, to_find)) {
+            index_ptr = btn_phys_right(copy.btn_phys);
+            if (!index_ptr) {
+                err = EAGAIN;
+                goto error_out;
+            }
+            
+            err = btn_get(bt, index_ptr, 0, 0, &child);
+            if (err)
+                goto error_out;
+            
+            bc_release(bc, btn_block(btn));
+            btn = child;
+            child = NULL;
+            
+            err = btn_read_begin(btn, &version);
+            if (err)
+                goto error_out;
+            btn_read_copy(btn, buf, blksz);
+            err = btn_read_end(btn, version);
+            if (err)
+                goto error_out;
+            
+            if (!btn_high_known(&copy)) { // there's no parent to go by
+                err = EAGAIN;
+                goto error_out;
+            }
+        }
+        
+        if (btn_phys_is_leaf(copy.btn_phys))
+            break;
+        
+        index_ptr = btn_index_ptr(&copy, btn_search_index(&copy, to_find));
+        if (!index_ptr) {
+            err = ENOENT;
+            goto error_out;
+        }
+        
+        err = btn_get(bt, index_ptr, 0, 0, &child);
+        if (err)
+            goto error_out;
+        
+        err = btn_read_begin(child, &cversion);
+        if (err)
+            goto error_out;
+        
+        if (bth && btn_is_leaf(child)) { // only the root's flags ever change, so child's can be looked at
+            bt_rcu_exit(readers);
+            readers = NULL;
+            err = bt_find_pin(btn, version, child, cversion, to_find, bth, record);
+            if (err)
+                goto error_out;
+            bc_release(bc, btn_block(btn));
+            return 0;
+        }
+        
+        btn_read_copy(child, buf, blksz);
+        err = btn_read_end(child, cversion);
+        if (err)
+            goto error_out;
+        
+        // if btn hasn't changed, child is still where to_find belongs as of cversion.
+        // if child has a high key, that says so by itself
+        if (!btn_high_known(&copy)) {
+            err = btn_read_end(btn, version);
+            if (err)
+                goto error_out;
+        }
+        
+        bc_release(bc, btn_block(btn));
+        btn = child;
+        child = NULL;
+        version = cversion;
+    }
+    
+    err = btn_search(&copy, to_find, &ind);
+    if (err) // didn't find it
+        goto error_out;
+    
+    btrp = btn_phys_record(copy.btn_phys, ind);
+    
+    if (bth) {
+        //
+        // bt_rcu_wait is called with latches held, so waiting on one here has
+        // to be done outside of the read section. btn is still held in the
+        // cache, so its version can't have gone anywhere: if it hasn't moved,
+        // btn is the same as the copy
+        //
+        bt_rcu_exit(readers);
+        readers = NULL;
+        btn_latch(btn, false);
+        if (__atomic_load_n(&btn->btn_version, __ATOMIC_RELAXED) != version) {
+            btn_unlatch(btn);
+            err = EAGAIN;
+            goto error_out;
+        }
+        btn_pin(btn);
+        btn_unlatch(btn);
+        bth->bth_leaf = btn;
+        *record = (btr_phys_t *)((uint8_t *)btn_phys(btn) + ((uint8_t *)btrp - (uint8_t *)buf));
+        
+        return 0;
+    }
+    
+    err = bt_find_copy_out(btrp, rbuf, size, record);
+    if (err)
+        goto error_out;
+    
+    bc_release(bc, btn_block(btn));
+    bt_rcu_exit(readers);
+    
+    return 0;
+    
+error_out:
+    if (child)
+        bc_release(bc, btn_block(child));
+    if (btn)
+        bc_release(bc, btn_block(btn));
+    if (readers)
+        bt_rcu_exit(readers);
+    
+    return err;
+}
+
+static int bt_find_latched(btree_t *bt, btr_phys_t *to_find, bt_handle_t *bth, btr_phys_t *rbuf, uint16_t *size, btr_phys_t **record) {
+    bcache_t *bc = bt->bt_bc;
+    btr_phys_t *btrp;
+    btn_t *leaf = NULL;
+    uint16_t ind;
+    int err;
+    
+    err = bt_descend(bt, to_find, false, &leaf);
+    if (err)
+        goto error_out;
+    
+    err = btn_search(leaf, to_find, &ind);
+    if (err) // didn't find it
+        goto error_out;
+    
+    btrp = btn_phys_record(btn_phys(leaf), ind);
+    
+    if (bth) { // it stays pinned
+        btn_pin(leaf);
+        btn_unlatch(leaf);
+        bth->bth_leaf = leaf;
+        *record = btrp;
+        return 0;
+    }
+    
+    err = bt_find_copy_out(btrp, rbuf, size, record);
+    if (err)
+        goto error_out;
+    
+    btn_unlatch(leaf);
+    bc_release(bc, btn_block(leaf));
+    
+    return 0;
+    
+error_out:
+    if (leaf) {
+        btn_unlatch(leaf);
+        bc_release(bc, btn_block(leaf));
+    }
+    
+    return err;
+}
+
+static int _bt_find(btree_t *bt, btr_phys_t *to_find, bt_handle_t *bth, btr_phys_t *rbuf, uint16_t *size, btr_phys_t **record) {
+    int err;
+    
+    if (sm_phys(bt->bt_sm)->smp_bsz <= BT_PHYS_BLKSZ) { // bt_find_optimistic copies nodes onto the stack
+        for (int i = 0; i < BT_FIND_RETRIES; i++) {
+            err = bt_find_optimistic(bt, to_find, bth, rbuf, size, record);
+            if (err != EAGAIN)
+                return err;
+            __atomic_add_fetch(&bt->bt_find_restarts, 1, __ATOMIC_RELAXED);
+        }
+    }
+    
+    return bt_find_latched(bt, to_find, bth, rbuf, size, record);
+}
+
+// *record is malloc'd, and the caller frees it
+int bt_find(btree_t *bt, btr_phys_t *to_find, btr_phys_t **record) {
+    return _bt_find(bt, to_find, NULL, NULL, NULL, record);
+}
+
+//
+// *record points into a leaf that stays pinned and held in the cache until
+// bt_handle_release(bth). nothing's copied or allocated
+//
+int bt_find_pinned(btree_t *bt, btr_phys_t *to_find, bt_handle_t *bth, btr_phys_t **record) {
+    bth->bth_leaf = NULL;
+    return _bt_find(bt, to_find, bth, NULL, NULL, record);
+}
+
+void bt_handle_release(bt_handle_t *bth) {
+    btn_t *leaf = bth->bth_leaf;
+    
+    if (!leaf)
+        return;
+    
+    btn_unpin(leaf);
+    bc_release(leaf->btn_bt->bt_bc, btn_block(leaf));
+    bth->bth_leaf = NULL;
+}
+
+//
+// copy the record into the caller's buffer, which is *size bytes. *size is set
+// to the record's size, and if that's more than there's room for, it returns
+// ENOSPC and copies nothing
+//
+int bt_find_copy(btree_t *bt, btr_phys_t *to_find, btr_phys_t *record, uint16_t *size) {
+    return _bt_find(bt, to_find, NULL, record, size, NULL);
+}
+
+int bt_update(btree_t *bt, btr_phys_t *to_update) {
+    assert(0);
+}
+
+static int _bt_remove(btree_t *bt, bt_path_t *path, btn_t *btn, btr_phys_t *to_remove) {
+    bcache_t *bc = bt->bt_bc;
+    btn_phys_t *btnp = btn_phys(btn);
+    btn_t *child = NULL;
+    uint64_t index_ptr;
+    int ind, err;
+    
+    if (btn_is_leaf(btn)) {
+        if (btn_pinned(btn)) { // see _bt_insert
+            bc_hold(bc, btn_block(btn));
+            path->btp_pinned = btn;
+            err = EAGAIN;
+            goto error_out;
+        }
+        bt_path_trim_remove(bt, path, to_remove);
+        err = btn_remove(btn, to_remove);
+        if (err)
+            goto error_out;
+    } else { // index
+        ind = btn_search_index(btn, to_remove);
+        index_ptr = btn_index_ptr(btn, ind);
+        
+        if (!index_ptr) {
+            err = ENOENT;
+            goto error_out;
+        }
+        
+        // get the child node
+        err = btn_get(bt, index_ptr, 0, 0, &child);
+        if (err)
+            goto error_out;
+        
+        bt_path_push(path, child);
+        
+        // recurse
+        err = _bt_remove(bt, path, child, to_remove);
+        if (err)
+            goto error_out;
+        
+        if (btn_is_leaf(child) && btn_is_empty(child)) { // chlid leaf node is now empty. free it
+            err = btn_free(child);
+            if (err)
+                goto error_out;
+            
+            // set child index pointer to 0
+            btn_set_index_ptr(btn, ind, 0);
+        }
+        
+        bt_path_pop(path);
+        bc_release(bc, btn_block(child));
+    }
+    
+    return 0;
+    
+error_out:
+    if (child) {
+        bt_path_pop(path);
+        bc_release(bc, btn_block(child));
+    }
+    
+    return err;
+}
+
+//
+// like bt_insert_leaf: try it with just the leaf latched exclusive first. EAGAIN
+// if it might be emptied, and freed
+//
+static int bt_remove_leaf(btree_t *bt, btr_phys_t *to_remove) {
+    bcache_t *bc = bt->bt_bc;
+    btn_t *leaf;
+    int err;
+    
+    err = bt_descend(bt, to_remove, true, &leaf);
+    if (err)
+        goto error_out;
+    
+    if (!btn_is_root(leaf) && (btn_phys(leaf)->btnp_nrecords == 1))
+        err = EAGAIN;
+    else
+        err = btn_remove(leaf, to_remove);
+    
+    btn_unlatch(leaf);
+    bc_release(bc, btn_block(leaf));
+    
+    if (err)
+        goto error_out;
+    
+    return 0;
+    
+error_out:
+    return err;
+}
+
+// a remove never replaces the root, so bt_rwlock's only needed to get to it
+static int bt_remove_path(btree_t *bt, btr_phys_t *to_remove) {
+    bcache_t *bc = bt->bt_bc;
+    bt_path_t path;
+    btn_t *root;
+    int err;
+    
+again:
+    memset(&path, 0, sizeof(bt_path_t));
+    path.btp_keep = (bt->bt_wal != NULL);
+    
+    if (bt->bt_wal) {
+        root = bt->bt_root;
+        bc_hold(bc, btn_block(root));
+        bt_path_push(&path, root);
+    } else {
+        root = bt_root_latch(bt, true, false);
+        path.btp_nodes[path.btp_depth++] = root;
+    }
+    
+    err = _bt_remove(bt, &path, root, to_remove);
+    
+    if (path.btp_top == 0)
+        bt_nnodes_fold(bt, root);
+    bt_path_pop(&path);
+    bc_release(bc, btn_block(root));
+    bt_nnodes_sync(bt);
+    
+    if (path.btp_pinned) {
+        bt_wait_unpinned(bt, path.btp_pinned, bt->bt_wal != NULL);
+        goto again;
+    }
+    
+    return err;
+}
+
+int bt_remove(btree_t *bt, btr_phys_t *to_remove) {
+    uint64_t lsn;
+    int err;
+    
+    if (bt->bt_wal)
+        bt_lock_exclusive(bt);
+    
+    err = bt_remove_leaf(bt, to_remove);
+    if (err == EAGAIN)
+        err = bt_remove_path(bt, to_remove);
+    if (err)
+        goto error_out;
+    
+    if (!bt->bt_wal)
+        return 0;
+    
+    lsn = bt_wal_end(bt);
+    bt_unlock(bt);
+    
+    err = bt_wal_commit(bt, lsn);
+    if (err)
+        return err;
+    
+    return 0;
+    
+error_out:
+    if (bt->bt_wal) {
+        bt_wal_end(bt);
+        bt_unlock(bt);
+    }
+    return err;
+}
+
+int bt_cursor_open(btree_t *bt, bt_cursor_t **btc) {
+    bt_cursor_t *_btc = NULL;
+    uint16_t blksz = sm_phys(bt->bt_sm)->smp_bsz;
+    int err;
+    
+    _btc = malloc(sizeof(bt_cursor_t));
+    if (!_btc) {
+        err = ENOMEM;
+        goto error_out;
     }
-    // sm_unreserve(sm, bsi1.bsi_reserved);
     
-    if (bsi_did_split(&bsi2)) {
-        free(bsi2.bsi_split_index1);
-        if (bsi2.bsi_split_index2)
-            free(bsi2.bsi_split_index2);
+    memset(_btc, 0, sizeof(bt_cursor_t));
+    _btc->btc_bt = bt;
+    
+    // a key's never bigger than a node
+    _btc->btc_key = malloc(blksz);
+    _btc->btc_lo = malloc(blksz);
+    _btc->btc_hi = malloc(blksz);
+    if (!_btc->btc_key || !_btc->btc_lo || !_btc->btc_hi) {
+        err = ENOMEM;
+        goto error_out;
     }
-    // sm_unreserve(sm, bsi2.bsi_reserved);
     
-    bt_unlock(bt);
+    *btc = _btc;
     
     return 0;
     
 error_out:
-    //if (bsi.bsi_reserved)
-    //    sm_unreserve(sm, bsi.reserved);
-    
-    bt_unlock(bt);
+    if (_btc) {
+        if (_btc->btc_key)
+            free(_btc->btc_key);
+        if (_btc->btc_lo)
+            free(_btc->btc_lo);
+        if (_btc->btc_hi)
+            free(_btc->btc_hi);
+        free(_btc);
+    }
     
     return err;
 }
 
-int _bt_find(btree_t *bt, btn_t *btn, btr_phys_t *to_find, btr_phys_t **record) {
-    bcache_t *bc = bt->bt_bc;
-    btn_phys_t *btnp = btn_phys(btn);
-    btr_phys_t *btrp, *found;
-    btn_t *child;
-    uint64_t index_ptr;
-    int comp = -1, err;
+// copy btrp's key into to, as a record with no value
+static void btr_phys_copy_key(btr_phys_t *to, btr_phys_t *btrp) {
+    to->btrp_ksz = btrp->btrp_ksz;
+    to->btrp_vsz = 0;
+    memcpy((uint8_t *)to + sizeof(btr_phys_t), (uint8_t *)btrp + sizeof(btr_phys_t), btrp->btrp_ksz);
+}
+
+static void bt_cursor_let_go(bt_cursor_t *btc) {
+    if (!btc->btc_leaf)
+        return;
     
-    if (btn_is_leaf(btn)) {
-        btrp = btn_first_record(btn);
-        for (int i = 0; i < btnp->btnp_nrecords; i++) {
-            comp = bt->bt_ops->bto_compare_fn(to_find, btrp);
-            if (comp == 0)
-                break;
-            btrp = btr_phys_next_record(btrp);
-        }
-        if (comp) { // didn't find it
-            err = ENOENT;
-            goto error_out;
+    btn_unpin(btc->btc_leaf);
+    bc_release(btc->btc_bt->bt_bc, btn_block(btc->btc_leaf));
+    btc->btc_leaf = NULL;
+}
+
+//
+// queue up reads of the leaves after (or before) btn's child ind, as many as
+// BT_CURSOR_READAHEAD of them, in runs of consecutive blocks. the ones already
+// read ahead on the way to one of btn's other children aren't asked for again
+//
+static void bt_cursor_read_ahead(bt_cursor_t *btc, btn_t *btn, int ind, bool forward) {
+    btree_t *bt = btc->btc_bt;
+    uint64_t blkno = btn_block(btn)->bl_blkno, ptr, start = 0;
+    uint32_t count = 0;
+    int nrecs = btn_phys(btn)->btnp_nrecords, step = forward ? 1 : -1, end, i;
+    
+    end = ind + step * (BT_CURSOR_READAHEAD + 1);
+    i = ind + step;
+    if ((btc->btc_ra_parent == blkno) && (btc->btc_ra_forward == forward) && (forward ? btc->btc_ra_ind > ind : btc->btc_ra_ind < ind))
+        i = btc->btc_ra_ind + step;
+    
+    for (; (i != end) && (i >= -1) && (i < nrecs); i += step) {
+        ptr = btn_index_ptr(btn, i);
+        if (!ptr) // freed
+            continue;
+        if (count && (ptr == start + count)) {
+            count++;
+        } else if (count && (ptr == start - 1)) {
+            start--;
+            count++;
+        } else {
+            if (count)
+                bc_file_prefetch(bt->bt_bc, bt->bt_bf, start, count, &btn_bco_ops);
+            start = ptr;
+            count = 1;
         }
-        // did find it and btrp points to it
-        found = malloc(btr_phys_size(btrp));
-        if (!found) {
-            err = ENOMEM;
-            goto error_out;
+    }
+    if (count)
+        bc_file_prefetch(bt->bt_bc, bt->bt_bf, start, count, &btn_bco_ops);
+    
+    btc->btc_ra_parent = blkno;
+    btc->btc_ra_ind = i - step;
+    btc->btc_ra_forward = forward;
+}
+
+//
+// go down to the leaf that would have the first record at or past key (or the
+// last one before it, going backwards), latching shared the way bt_descend
+// does, and picking up the leaf's bounds on the way. a NULL key means the
+// first leaf (or the last). children that have been freed are stepped over,
+// and if that's all there is on that side of a node, it goes back down from
+// the node's bound instead. returns ENOENT if there's nothing on that side of
+// the tree at all. the leaves past it are read ahead if btc is scanning. the
+// leaf's returned latched and referenced
+//
+static int bt_cursor_descend(bt_cursor_t *btc, btr_phys_t *key, bool forward, bool scanning, btn_t **leaf) {
+    btree_t *bt = btc->btc_bt;
+    bcache_t *bc = bt->bt_bc;
+    btn_t *btn, *child;
+    uint64_t index_ptr;
+    bool last;
+    int ind, nrecs, err;
+    
+again:
+    btc->btc_has_lo = btc->btc_has_hi = false;
+    
+    btn = bt_root_latch(bt, false, false);
+    
+    while (!btn_is_leaf(btn)) {
+        nrecs = btn_phys(btn)->btnp_nrecords;
+        if (key) {
+            ind = btn_search_index(btn, key);
+            if (!forward && (ind >= 0) && (bt->bt_ops->bto_compare_fn(btn_phys_record(btn_phys(btn), ind), key) == 0))
+                ind--; // there's nothing before key under it
+        } else {
+            ind = forward ? -1 : nrecs - 1;
         }
-        memcpy(found, btrp, btr_phys_size(btrp));
-        *record = found;
-    } else { // index
-        btrp = btn_first_record(btn);
-        index_ptr = btn_first_index_record_ptr(btn);
-        for (int i = 0; i < btnp->btnp_nrecords; i++) {
-            comp = bt->bt_ops->bto_compare_fn(to_find, btrp);
-            if (comp < 0)
-                break;
-            index_ptr = btr_phys_index_ptr(btrp);
-            btrp = btr_phys_next_record(btrp);
+        
+        while (!(index_ptr = btn_index_ptr(btn, ind))) {
+            ind += forward ? 1 : -1;
+            if ((ind < nrecs) && (ind >= -1))
+                continue;
+            
+            // nothing left on this side of btn
+            if (forward ? !btc->btc_has_hi : !btc->btc_has_lo) {
+                err = ENOENT;
+                goto error_out;
+            }
+            btr_phys_copy_key(btc->btc_key, forward ? btc->btc_hi : btc->btc_lo);
+            key = btc->btc_key;
+            btn_unlatch(btn);
+            bc_release(bc, btn_block(btn));
+            goto again;
         }
         
-        if (!index_ptr) {
-            err = ENOENT;
-            goto error_out;
+        if (ind >= 0) {
+            btr_phys_copy_key(btc->btc_lo, btn_phys_record(btn_phys(btn), ind));
+            btc->btc_has_lo = true;
+        }
+        if (ind + 1 < nrecs) {
+            btr_phys_copy_key(btc->btc_hi, btn_phys_record(btn_phys(btn), ind + 1));
+            btc->btc_has_hi = true;
         }
         
-        // get the child node
         err = btn_get(bt, index_ptr, 0, 0, &child);
         if (err)
             goto error_out;
         
-        // recurse
-        err = _bt_find(bt, child, to_find, record);
-        if (err)
-            goto error_out;
+        // only the root's flags ever change, so child's can be looked at before it's latched
+        last = false;
+        if (scanning && btn_is_leaf(child)) {
+            bt_cursor_read_ahead(btc, btn, ind, forward);
+            last = forward;
+            for (int i = ind + 1; (i < nrecs) && last; i++)
+                last = !btn_index_ptr(btn, i);
+        }
         
-        bc_release(bc, btn_block(child));
+        btn_latch(child, false);
+        btn_unlatch(btn);
+        bc_release(bc, btn_block(btn));
+        btn = child;
+        
+        // the next leaf is in another parent, which its right link is a good guess at
+        if (last && btn_phys_is_linked(btn_phys(btn)) && btn_phys_right(btn_phys(btn)))
+            bc_file_prefetch(bc, bt->bt_bf, btn_phys_right(btn_phys(btn)), 1, &btn_bco_ops);
     }
     
+    *leaf = btn;
+    
     return 0;
     
 error_out:
+    btn_unlatch(btn);
+    bc_release(bc, btn_block(btn));
+    
     return err;
 }
 
-int bt_find(btree_t *bt, btr_phys_t *to_find, btr_phys_t **record) {
+//
+// put btc on the first record at or past key (or the last before it, going
+// backwards), going on to the leaves after (or before) the one key leads to
+// if there isn't one there. it's scanning if it's come from the leaf before
+//
+static int bt_cursor_land(bt_cursor_t *btc, btr_phys_t *key, bool forward, bool scanning, btr_phys_t **record) {
+    bcache_t *bc = btc->btc_bt->bt_bc;
+    btn_phys_t *btnp;
+    btn_t *leaf;
+    uint16_t ind;
     int err;
     
-    bt_lock_shared(bt);
-    
-    err = _bt_find(bt, bt->bt_root, to_find, record);
-    if (err)
-        goto error_out;
-    
-    bt_unlock(bt);
-    
-    return 0;
-    
-error_out:
-    bt_unlock(bt);
-    return err;
-}
-
-int bt_update(btree_t *bt, btr_phys_t *to_update) {
-    assert(0);
-}
-
-static int _bt_remove(btree_t *bt, btn_t *btn, btr_phys_t *to_remove) {
-    bcache_t *bc = bt->bt_bc;
-    btn_phys_t *btnp = btn_phys(btn);
-    btn_t *child = NULL;
-    btr_phys_t *btrp;
-    uint64_t index_ptr;
-    bt_info_phys_t *bip;
-    int comp, err;
+    bt_cursor_let_go(btc);
     
-    if (btn_is_leaf(btn)) {
-        err = btn_remove(btn, to_remove);
+    for (;;) {
+        err = bt_cursor_descend(btc, key, forward, scanning, &leaf);
         if (err)
             goto error_out;
-    } else { // index
-        btrp = btn_first_record(btn);
-        index_ptr = btn_first_index_record_ptr(btn);
-        for (int i = 0; i < btnp->btnp_nrecords; i++) {
-            comp = bt->bt_ops->bto_compare_fn(to_remove, btrp);
-            if (comp < 0)
-                break;
-            index_ptr = btr_phys_index_ptr(btrp);
-            btrp = btr_phys_next_record(btrp);
-        }
         
-        if (!index_ptr) {
-            err = ENOENT;
-            goto error_out;
+        btnp = btn_phys(leaf);
+        if (key) {
+            btn_search(leaf, key, &ind);
+            btc->btc_ind = forward ? ind : ind - 1;
+        } else {
+            btc->btc_ind = forward ? 0 : btnp->btnp_nrecords - 1;
         }
         
-        // get the child node
-        err = btn_get(bt, index_ptr, 0, 0, &child);
-        if (err)
-            goto error_out;
+        if ((btc->btc_ind >= 0) && (btc->btc_ind < btnp->btnp_nrecords))
+            break;
         
-        // recurse
-        err = _bt_remove(bt, child, to_remove);
-        if (err)
+        // nothing here. try the next leaf
+        btn_unlatch(leaf);
+        bc_release(bc, btn_block(leaf));
+        if (forward ? !btc->btc_has_hi : !btc->btc_has_lo) {
+            err = ENOENT;
             goto error_out;
-        
-        if (btn_is_leaf(child) && btn_is_empty(child)) { // chlid leaf node is now empty. free it
-            err = btn_free(child);
-            if (err)
-                goto error_out;
-            
-            // set child index pointer to 0
-            memset((uint8_t *)btrp - sizeof(uint64_t), 0, sizeof(uint64_t));
-            bc_dirty(bc, btn_block(btn));
         }
-        
-        bc_release(bc, btn_block(child));
+        btr_phys_copy_key(btc->btc_key, forward ? btc->btc_hi : btc->btc_lo);
+        key = btc->btc_key;
+        scanning = true;
     }
     
+    btn_pin(leaf);
+    btn_unlatch(leaf);
+    btc->btc_leaf = leaf;
+    *record = btn_phys_record(btnp, btc->btc_ind);
+    
     return 0;
     
 error_out:
-    if (child)
-        bc_release(bc, btn_block(child));
-    
     return err;
 }
 
-int bt_remove(btree_t *bt, btr_phys_t *to_remove) {
-    int err;
+// the first record at or past key (or in the tree, if key is NULL). ENOENT if there isn't one
+int bt_cursor_seek(bt_cursor_t *btc, btr_phys_t *key, btr_phys_t **record) {
+    return bt_cursor_land(btc, key, true, false, record);
+}
+
+int bt_cursor_next(bt_cursor_t *btc, btr_phys_t **record) {
+    if (!btc->btc_leaf)
+        return bt_cursor_land(btc, NULL, true, false, record);
     
-    bt_lock_exclusive(bt);
+    if (btc->btc_ind + 1 < btn_phys(btc->btc_leaf)->btnp_nrecords) {
+        *record = btn_phys_record(btn_phys(btc->btc_leaf), ++btc->btc_ind);
+        return 0;
+    }
     
-    err = _bt_remove(bt, bt->bt_root, to_remove);
-    if (err)
-        goto error_out;
+    if (!btc->btc_has_hi) {
+        bt_cursor_let_go(btc);
+        return ENOENT;
+    }
     
-    bt_unlock(bt);
+    btr_phys_copy_key(btc->btc_key, btc->btc_hi);
     
-    return 0;
+    return bt_cursor_land(btc, btc->btc_key, true, true, record);
+}
+
+int bt_cursor_prev(bt_cursor_t *btc, btr_phys_t **record) {
+    if (!btc->btc_leaf)
+        return bt_cursor_land(btc, NULL, false, false, record);
     
-error_out:
-    bt_unlock(bt);
-    return err;
+    if (btc->btc_ind > 0) {
+        *record = btn_phys_record(btn_phys(btc->btc_leaf), --btc->btc_ind);
+        return 0;
+    }
+    
+    if (!btc->btc_has_lo) {
+        bt_cursor_let_go(btc);
+        return ENOENT;
+    }
+    
+    btr_phys_copy_key(btc->btc_key, btc->btc_lo);
+    
+    return bt_cursor_land(btc, btc->btc_key, false, true, record);
+}
+
+void bt_cursor_close(bt_cursor_t *btc) {
+    bt_cursor_let_go(btc);
+    free(btc->btc_key);
+    free(btc->btc_lo);
+    free(btc->btc_hi);
+    free(btc);
 }
 
-static int _bt_iterate_disk(int fd, uint64_t rblkno, uint8_t *buf, uint32_t blksz, int (*node_callback)(btn_phys_t *node, void *ctx, bool *stop), void *node_ctx, int (*record_callback)(btr_phys_t *record, void *ctx, bool *stop), void *record_ctx) {
+static int _bt_iterate_disk(bc_blkfile_t *bbf, uint64_t rblkno, uint8_t *buf, uint32_t blksz, int (*node_callback)(btn_phys_t *node, void *ctx, bool *stop), void *node_ctx, int (*record_callback)(btr_phys_t *record, void *ctx, bool *stop), void *record_ctx) {
     btn_phys_t *btnp;
     bt_info_phys_t *btip;
     btr_phys_t *btrp;
     uint32_t nnodes, curr_ind;
     uint64_t *blkno, *blknos = NULL, index_ptr;
     fifo_t *fi = NULL;
-    ssize_t pret;
     bool stop = false;
     int err;
     
     // read in the root node to get nnodes
-    pret = pread(fd, buf, blksz, rblkno * blksz);
-    if (pret != blksz) {
-        err = EIO;
+    err = bc_blkfile_read(bbf, rblkno, buf);
+    if (err)
         goto error_out;
-    }
     
     btnp = (btn_phys_t *)buf;
     if (btnp->btnp_bp.bp_type != BT_PHYS_TYPE_NODE) {
@@ -1971,11 +4094,9 @@ static int _bt_iterate_disk(int fd, uint64_t rblkno, uint8_t *buf, uint32_t blks
             goto error_out;
         
         // read in the node
-        pret = pread(fd, buf, blksz, *blkno * blksz);
-        if (pret != blksz) {
-            err = EIO;
+        err = bc_blkfile_read(bbf, *blkno, buf);
+        if (err)
             goto error_out;
-        }
         
         btnp = (btn_phys_t *)buf;
         if (btnp->btnp_bp.bp_type != BT_PHYS_TYPE_NODE) {
@@ -2001,7 +4122,7 @@ static int _bt_iterate_disk(int fd, uint64_t rblkno, uint8_t *buf, uint32_t blks
                         goto error_out;
                     if (stop)
                         goto out;
-                    btrp = btr_phys_next_record(btrp);
+                    btrp = btn_phys_next_record(btnp, i, btrp);
                 }
             }
         } else { // index node: add all children to fifo
@@ -2021,7 +4142,7 @@ static int _bt_iterate_disk(int fd, uint64_t rblkno, uint8_t *buf, uint32_t blks
                     if (err)
                         goto error_out;
                 }
-                btrp = btr_phys_next_record(btrp);
+                btrp = btn_phys_next_record(btnp, i, btrp);
             }
         }
     }
@@ -2041,8 +4162,52 @@ error_out:
     return err;
 }
 
+//
+// the live tree's records in key order, by way of a cursor. node_callback gets
+// each leaf the cursor gets to, before its records. the callbacks are made with
+// a leaf latched, so they can't change the tree
+//
 int bt_iterate(btree_t *bt, int (*node_callback)(btn_phys_t *node, void *ctx, bool *stop), void *node_ctx, int (*record_callback)(btr_phys_t *record, void *ctx, bool *stop), void *record_ctx) {
-    assert(0);
+    bt_cursor_t *btc;
+    btr_phys_t *btrp;
+    uint64_t blkno = 0;
+    bool stop = false;
+    int err;
+    
+    err = bt_cursor_open(bt, &btc);
+    if (err)
+        goto error_out;
+    
+    while (!stop) {
+        err = bt_cursor_next(btc, &btrp);
+        if (err) {
+            if (err == ENOENT) // the end of the tree, not a callback's ENOENT
+                err = 0;
+            break;
+        }
+        
+        if (node_callback && (btn_block(btc->btc_leaf)->bl_blkno != blkno)) {
+            blkno = btn_block(btc->btc_leaf)->bl_blkno;
+            err = node_callback(btn_phys(btc->btc_leaf), node_ctx, &stop);
+            if (err || stop)
+                break;
+        }
+        
+        if (record_callback) {
+            err = record_callback(btrp, record_ctx, &stop);
+            if (err)
+                break;
+        }
+    }
+    
+    bt_cursor_close(btc);
+    if (err)
+        goto error_out;
+    
+    return 0;
+    
+error_out:
+    return err;
 }
 
 int bt_iterate_disk(const char *path, int (*node_callback)(btn_phys_t *node, void *ctx, bool *stop), void *node_ctx, int (*record_callback)(btr_phys_t *record, void *ctx, bool *stop), void *record_ctx) {
@@ -2050,14 +4215,12 @@ int bt_iterate_disk(const char *path, int (*node_callback)(btn_phys_t *node, voi
     sm_phys_t *smp;
     btn_phys_t *btnp;
     uint16_t blksz;
-    int fd = -1, err;
-    ssize_t pret;
+    bc_blkfile_t *bbf = NULL;
+    int err;
     
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        err = errno;
+    err = bc_blkfile_open(path, BT_PHYS_BLKSZ, 0, &bbf);
+    if (err)
         goto error_out;
-    }
     
     buf = malloc(BT_PHYS_BLKSZ);
     if (!buf) {
@@ -2066,11 +4229,9 @@ int bt_iterate_disk(const char *path, int (*node_callback)(btn_phys_t *node, voi
     }
     
     // read in space manager to get the block size and root blkno
-    pret = pread(fd, buf, BT_PHYS_BLKSZ, BT_PHYS_SM_OFFSET * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_read(bbf, BT_PHYS_SM_OFFSET, buf);
+    if (err)
         goto error_out;
-    }
     
     smp = (sm_phys_t *)buf;
     
@@ -2088,18 +4249,18 @@ int bt_iterate_disk(const char *path, int (*node_callback)(btn_phys_t *node, voi
         goto error_out;
     }
     
-    err = _bt_iterate_disk(fd, smp->smp_rblkno, buf, smp->smp_bsz, node_callback, node_ctx, record_callback, record_ctx);
+    err = _bt_iterate_disk(bbf, smp->smp_rblkno, buf, smp->smp_bsz, node_callback, node_ctx, record_callback, record_ctx);
     if (err)
         goto error_out;
     
     free(buf);
-    close(fd);
+    bc_blkfile_close(bbf);
     
     return 0;
     
 error_out:
-    if (fd >= 0)
-        close(fd);
+    if (bbf)
+        bc_blkfile_close(bbf);
     if (buf)
         free(buf);
     
@@ -2157,6 +4318,11 @@ static int _bt_dump_disk_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
            bt_bp_type_to_string(btnp->btnp_bp.bp_type), btn_phys_is_leaf(btnp) ? "(LEAF)" : "(INDEX)",
            btn_phys_is_root(btnp) ? " (ROOT)" : "", btnp->btnp_flags, btnp->btnp_nrecords, btnp->btnp_freespace);
     
+    if (btn_phys_is_slotted(btnp))
+        printf("btsp_heap %" PRIu16 " ", ((btn_slotted_phys_t *)btnp)->btsp_heap);
+    if (btn_phys_is_linked(btnp))
+        printf("btlp_right %" PRIu64 " btlp_high %" PRIu16 " ", btn_phys_right(btnp), ((btn_linked_phys_t *)btnp)->btlp_high);
+    
     if (btnp->btnp_flags & BTN_PHYS_FLG_IS_ROOT) {
         btip = (bt_info_phys_t *)((uint8_t *)btnp + blksz - sizeof(bt_info_phys_t));
         printf("bti_nnodes %" PRIu32 " ", btip->bti_nnodes);
@@ -2166,13 +4332,13 @@ static int _bt_dump_disk_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
     printf("btn_records:");
     btrp = btn_phys_first_record(btnp);
     if (!btn_phys_is_leaf(btnp))
-        printf("\n    [-1]: btrp_ptr %" PRIu64 " ", *(uint64_t *)((uint8_t *)btrp - sizeof(uint64_t)));
+        printf("\n    [-1]: btrp_ptr %" PRIu64 " ", btn_phys_first_index_record_ptr(btnp));
     for (int i = 0; i < btnp->btnp_nrecords; i++) {
         printf("\n    [%d]: ", i);
         btr_phys_dump(btrp);
         if (!btn_phys_is_leaf(btnp))
-            printf("btrp_ptr %" PRIu64 " ", *(uint64_t *)((uint8_t *)btrp + sizeof(btr_phys_t) + btrp->btrp_ksz));
-        btrp = btr_phys_next_record(btrp);
+            printf("btrp_ptr %" PRIu64 " ", btr_phys_index_ptr(btrp));
+        btrp = btn_phys_next_record(btnp, i, btrp);
     }
 #endif
     
@@ -2191,14 +4357,12 @@ int bt_dump_disk(const char *path) {
     uint64_t *smp_map;
     uint64_t rblkno;
     bt_ddn_cb_ctx_t btddn_ctx;
-    int fd = -1, err;
-    ssize_t pret;
+    bc_blkfile_t *bbf = NULL;
+    int err;
     
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        err = errno;
+    err = bc_blkfile_open(path, BT_PHYS_BLKSZ, 0, &bbf);
+    if (err)
         goto error_out;
-    }
     
     buf = malloc(BT_PHYS_BLKSZ);
     if (!buf) {
@@ -2218,11 +4382,9 @@ int bt_dump_disk(const char *path) {
     // dump space manager and bitmaps:
     //
     
-    pret = pread(fd, buf, BT_PHYS_BLKSZ, BT_PHYS_SM_OFFSET * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_read(bbf, BT_PHYS_SM_OFFSET, buf);
+    if (err)
         goto error_out;
-    }
     
     smp = (sm_phys_t *)buf;
     
@@ -2257,11 +4419,9 @@ int bt_dump_disk(const char *path) {
     smp_map = (uint64_t *)(buf + sizeof(sm_phys_t));
     for (int i = 0; i < nbmblks; i++) {
         printf(" smp_map[%d]: %" PRIu64 "\n", i, smp_map[i]);
-        pret = pread(fd, buf2, blksz, smp_map[i] * blksz);
-        if (pret != blksz) {
-            err = EIO;
+        err = bc_blkfile_read(bbf, smp_map[i], buf2);
+        if (err)
             goto error_out;
-        }
         bmp = (bm_phys_t *)buf2;
         if (bmp->bmp_bp.bp_type != BT_PHYS_TYPE_BM) {
             printf("bt_dump_disk: bmp->bmp_bp.bp_type != BT_PHYS_TYPE_BM\n");
@@ -2290,15 +4450,14 @@ int bt_dump_disk(const char *path) {
     memset(&btddn_ctx, 0, sizeof(bt_ddn_cb_ctx_t));
     btddn_ctx.blksz = blksz;
     
-    err = _bt_iterate_disk(fd, smp->smp_rblkno, buf, blksz, _bt_dump_disk_node_cb, &btddn_ctx, NULL, NULL);
+    err = _bt_iterate_disk(bbf, smp->smp_rblkno, buf, blksz, _bt_dump_disk_node_cb, &btddn_ctx, NULL, NULL);
     if (err)
         goto error_out;
     
-    err = close(fd);
-    if (err) {
-        err = errno;
+    err = bc_blkfile_close(bbf);
+    bbf = NULL;
+    if (err)
         goto error_out;
-    }
     
     free(buf);
     free(buf2);
@@ -2306,8 +4465,8 @@ int bt_dump_disk(const char *path) {
     return 0;
     
 error_out:
-    if (fd >= 0)
-        close(fd);
+    if (bbf)
+        bc_blkfile_close(bbf);
     if (buf)
         free(buf);
     if (buf2)
@@ -2387,7 +4546,6 @@ static int _bt_check_disk_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
     bt_cdn_cb_ctx_t *btcd_ctx = (bt_cdn_cb_ctx_t *)ctx;
     sm_phys_t *smp = btcd_ctx->smp;
     uint8_t *bm = btcd_ctx->bm;
-    uint16_t max_freespace, freespace;
     btr_phys_t *btrp;
     uint64_t index_ptr;
     int err;
@@ -2412,32 +4570,10 @@ static int _bt_check_disk_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
         }
     }
     
-    // check the freespace in the node:
-    
-    max_freespace = smp->smp_bsz - sizeof(btn_phys_t);
-    if (btn_phys_is_root(btnp))
-        max_freespace -= sizeof(bt_info_phys_t);
-    
-    if (btnp->btnp_freespace > max_freespace) {
-        printf("_bt_dump_check_node_cb: btnp->btnp_freespace > max_freespace\n");
-        err = EILSEQ;
-        goto error_out;
-    }
-    
-    freespace = max_freespace;
-    btrp = btn_phys_first_record(btnp);
-    if (!btn_phys_is_leaf(btnp))
-        freespace -= sizeof(uint64_t); // for first index pointer
-    for (int i = 0; i < btnp->btnp_nrecords; i++) {
-        freespace -= btr_phys_size(btrp);
-        btrp = btr_phys_next_record(btrp);
-    }
-    
-    if (btnp->btnp_freespace != freespace) {
-        printf("_bt_dump_check_node_cb: btnp->btnp_freespace != freespace\n");
-        err = EILSEQ;
+    // check the records and freespace in the node:
+    err = btn_phys_check_records(btnp, smp->smp_bsz);
+    if (err)
         goto error_out;
-    }
     
     if (!btn_phys_is_leaf(btnp)) {
         // mark all children as allocated in our bitmap
@@ -2449,7 +4585,7 @@ static int _bt_check_disk_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
             index_ptr = btr_phys_index_ptr(btrp);
             if (index_ptr)
                 bt_cd_bm_set(bm, index_ptr);
-            btrp = btr_phys_next_record(btrp);
+            btrp = btn_phys_next_record(btnp, i, btrp);
         }
     }
     
@@ -2472,14 +4608,12 @@ int bt_check_disk(const char *path) {
     uint64_t remaining;
     bt_cdn_cb_ctx_t btcdn_ctx;
     bt_info_phys_t *bip;
-    int fd = -1, err;
-    ssize_t pret;
+    bc_blkfile_t *bbf = NULL;
+    int err;
     
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        err = errno;
+    err = bc_blkfile_open(path, BT_PHYS_BLKSZ, 0, &bbf);
+    if (err)
         goto error_out;
-    }
     
     buf = malloc(BT_PHYS_BLKSZ);
     if (!buf) {
@@ -2497,11 +4631,9 @@ int bt_check_disk(const char *path) {
     // check space manager:
     //
     
-    pret = pread(fd, buf, BT_PHYS_BLKSZ, BT_PHYS_SM_OFFSET * BT_PHYS_BLKSZ);
-    if (pret != BT_PHYS_BLKSZ) {
-        err = EIO;
+    err = bc_blkfile_read(bbf, BT_PHYS_SM_OFFSET, buf);
+    if (err)
         goto error_out;
-    }
     
     smp = (sm_phys_t *)buf;
     err = sm_phys_check_disk(smp);
@@ -2547,11 +4679,9 @@ int bt_check_disk(const char *path) {
     
     smp_map = (uint64_t *)((uint8_t *)smp + sizeof(sm_phys_t));
     for (int i = 0; i < nbmblks; i++) {
-        pret = pread(fd, buf2, blksz, smp_map[i] * blksz);
-        if (pret != blksz) {
-            err = EIO;
+        err = bc_blkfile_read(bbf, smp_map[i], buf2);
+        if (err)
             goto error_out;
-        }
         bmp = (bm_phys_t *)buf2;
         err = bm_phys_check_disk(bmp);
         if (err)
@@ -2568,16 +4698,14 @@ int bt_check_disk(const char *path) {
     btcdn_ctx.bm = bm;
     
     bt_cd_bm_set(bm, smp->smp_rblkno);
-    err = _bt_iterate_disk(fd, smp->smp_rblkno, buf2, blksz, _bt_check_disk_node_cb, &btcdn_ctx, NULL, NULL);
+    err = _bt_iterate_disk(bbf, smp->smp_rblkno, buf2, blksz, _bt_check_disk_node_cb, &btcdn_ctx, NULL, NULL);
     if (err)
         goto error_out;
     
     // read in the root node and verify nnodes, etc. are correct
-    pret = pread(fd, buf2, blksz, smp->smp_rblkno * blksz);
-    if (pret != blksz) {
-        err = EIO;
+    err = bc_blkfile_read(bbf, smp->smp_rblkno, buf2);
+    if (err)
         goto error_out;
-    }
     
     btroot = (btn_phys_t *)buf2;
     bip = (bt_info_phys_t *)((uint8_t *)btroot + smp->smp_bsz - sizeof(bt_info_phys_t));
@@ -2596,11 +4724,9 @@ int bt_check_disk(const char *path) {
     remaining = _nbmblks * blksz;
     byte = bm;
     for (int i = 0; i < nbmblks; i++) {
-        pret = pread(fd, buf2, blksz, smp_map[i] * blksz);
-        if (pret != blksz) {
-            err = EIO;
+        err = bc_blkfile_read(bbf, smp_map[i], buf2);
+        if (err)
             goto error_out;
-        }
         bmp = (bm_phys_t *)buf2;
         //printf("comparing %u bytes of bitmap %d\n", (remaining < bytes_per_bm) ? remaining : bytes_per_bm, i);
         if (memcmp((uint8_t *)bmp + sizeof(bm_phys_t), byte, (remaining < bytes_per_bm) ? remaining : bytes_per_bm)) {
@@ -2612,11 +4738,10 @@ int bt_check_disk(const char *path) {
         remaining -= bytes_per_bm;
     }
     
-    err = close(fd);
-    if (err) {
-        err = errno;
+    err = bc_blkfile_close(bbf);
+    bbf = NULL;
+    if (err)
         goto error_out;
-    }
     
     free(buf);
     free(buf2);
@@ -2625,8 +4750,8 @@ int bt_check_disk(const char *path) {
     return 0;
     
 error_out:
-    if (fd >= 0)
-        close(fd);
+    if (bbf)
+        bc_blkfile_close(bbf);
     if (buf)
         free(buf);
     if (buf2)
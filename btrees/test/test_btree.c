@@ -8,6 +8,8 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "btree.h"
 #include "tbr.h"
@@ -231,7 +233,7 @@ static void test_node_splitting_1(void) {
     assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
     bt_check(bt);
     
-    n = bt_max_inline_record_size(bt) / sizeof(tbr1_phys_t);
+    n = bt_max_inline_record_size(bt) / (sizeof(tbr1_phys_t) + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -305,7 +307,7 @@ static void test_node_splitting_2(void) {
     assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
     bt_check(bt);
     
-    n = bt_max_inline_record_size(bt) / sizeof(tbr1_phys_t);
+    n = bt_max_inline_record_size(bt) / (sizeof(tbr1_phys_t) + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -382,7 +384,7 @@ static void test_node_splitting_3(void) {
     bt_check(bt);
     
     recsz = sizeof(tbr0_phys_t) + (2 * sizeof(tbr0_str));
-    n = bt_max_inline_record_size(bt) / recsz;
+    n = bt_max_inline_record_size(bt) / (recsz + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -489,7 +491,7 @@ static void test_node_splitting_4(void) {
     bt_check(bt);
     
     recsz = sizeof(tbr0_phys_t) + (2 * sizeof(tbr0_str));
-    n = bt_max_inline_record_size(bt) / recsz;
+    n = bt_max_inline_record_size(bt) / (recsz + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -593,7 +595,7 @@ static void test_node_splitting_5(void) {
     bt_check(bt);
     
     recsz = sizeof(tbr0_phys_t) + (2 * sizeof(tbr0_str));
-    n = bt_max_inline_record_size(bt) / recsz;
+    n = bt_max_inline_record_size(bt) / (recsz + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -706,7 +708,7 @@ static void test_node_splitting_6(void) {
     bt_check(bt);
     
     recsz = sizeof(tbr0_phys_t) + (2 * sizeof(tbr0_str));
-    n = bt_max_inline_record_size(bt) / recsz;
+    n = bt_max_inline_record_size(bt) / (recsz + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -818,7 +820,7 @@ static void test_remove_case_3(void) {
     assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
     bt_check(bt);
     
-    n = bt_max_inline_record_size(bt) / sizeof(tbr1_phys_t) + 1;
+    n = bt_max_inline_record_size(bt) / (sizeof(tbr1_phys_t) + sizeof(uint16_t)) + 1;
     
     //printf("inserting %llu recs\n", n);
     
@@ -926,7 +928,7 @@ static void test_remove_case_2(void) {
     assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
     bt_check(bt);
     
-    n = bt_max_inline_record_size(bt) / sizeof(tbr1_phys_t);
+    n = bt_max_inline_record_size(bt) / (sizeof(tbr1_phys_t) + sizeof(uint16_t));
     
     //printf("inserting %llu recs\n", n);
     
@@ -1060,10 +1062,110 @@ static void test_specific_remove_cases(void) {
     test_remove_case_3();
 }
 
+static int _tln_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
+    if (!btn_phys_is_slotted(btnp))
+        (*(int *)ctx)++;
+    return 0;
+}
+
+//
+// trees made before nodes were slotted have to keep working. write one by hand
+// with a full root leaf in the original layout, then check it, and insert and
+// remove until that leaf has split and been added to and taken from. the leaf
+// keeps its layout, and the nodes it splits into are slotted
+//
+static void test_legacy_nodes(void) {
+    btree_t *bt;
+    bc_blkfile_t *bbf;
+    btn_phys_t *btnp;
+    bt_info_phys_t *bip;
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    uint8_t *buf, *p;
+    char *fname, *tname = "test_legacy_nodes";
+    int n, nlegacy = 0;
+    
+    printf("%s\n", tname);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(bt_create(fname) == 0);
+    
+    // the even ids, as many as fit
+    assert(buf = malloc(BT_PHYS_BLKSZ));
+    memset(buf, 0, BT_PHYS_BLKSZ);
+    btnp = (btn_phys_t *)buf;
+    btnp->btnp_bp.bp_type = BT_PHYS_TYPE_NODE;
+    btnp->btnp_flags = BTN_PHYS_FLG_IS_ROOT|BTN_PHYS_FLG_IS_LEAF;
+    n = (BT_PHYS_BLKSZ - sizeof(btn_phys_t) - sizeof(bt_info_phys_t)) / sizeof(tbr1_phys_t);
+    p = buf + sizeof(btn_phys_t);
+    for (int i = 1; i <= n; i++) {
+        assert(tbr1_build_record(2 * i, 2 * i * 7, (tbr1_phys_t *)p) == 0);
+        p += sizeof(tbr1_phys_t);
+    }
+    btnp->btnp_nrecords = n;
+    btnp->btnp_freespace = BT_PHYS_BLKSZ - sizeof(btn_phys_t) - sizeof(bt_info_phys_t) - n * sizeof(tbr1_phys_t);
+    bip = (bt_info_phys_t *)(buf + BT_PHYS_BLKSZ - sizeof(bt_info_phys_t));
+    bip->bti_nnodes = 1;
+    
+    assert(bc_blkfile_open(fname, BT_PHYS_BLKSZ, 0, &bbf) == 0);
+    assert(bc_blkfile_write(bbf, BT_PHYS_BT_OFFSET, buf) == 0);
+    assert(bc_blkfile_sync(bbf) == 0);
+    assert(bc_blkfile_close(bbf) == 0);
+    
+    assert(bt_check_disk(fname) == 0);
+    assert(tbt_check_disk(fname) == 0);
+    
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    bt_check(bt);
+    
+    // the odd ids go in between, and split it
+    for (int i = 1; i <= n; i++) {
+        assert(tbr1_build_record(2 * i, 0, &rec) == 0);
+        assert(tbr1_insert(bt, &rec) == EEXIST);
+        assert(tbr1_build_record(2 * i - 1, (2 * i - 1) * 7, &rec) == 0);
+        assert(tbr1_insert(bt, &rec) == 0);
+        bt_check(bt);
+    }
+    assert(bt_info(bt)->bti_nnodes > 1);
+    
+    // then every fourth id comes back out
+    for (int i = 4; i <= 2 * n; i += 4) {
+        assert(tbr1_build_record(i, 0, &rec) == 0);
+        assert(tbr1_remove(bt, &rec) == 0);
+        bt_check(bt);
+    }
+    
+    for (int i = 1; i <= 2 * n; i++) {
+        assert(tbr1_build_record(i, 0, &rec) == 0);
+        if ((i % 4) == 0) {
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == ENOENT);
+            continue;
+        }
+        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == i * 7);
+        free(found);
+    }
+    
+    assert(bt_close(bt) == 0);
+    
+    assert(bt_check_disk(fname) == 0);
+    assert(tbt_check_disk(fname) == 0);
+    assert(bt_iterate_disk(fname, _tln_node_cb, &nlegacy, NULL, NULL) == 0);
+    assert(nlegacy == 1);
+    
+    assert(bt_destroy(fname) == 0);
+    
+    free(buf);
+    free(fname);
+}
+
 static void test_specific_cases(void) {
     test_specific_case1();
     test_specific_splitting_cases();
     test_specific_remove_cases();
+    test_legacy_nodes();
 }
 
 // just do inserts
@@ -1362,24 +1464,39 @@ insert:
     return 0;
 }
 
-static void test_random(int nops) {
+static off_t tbw_log_size(const char *fname) {
+    struct stat st;
+    char *wname;
+    
+    assert(wname = malloc(strlen(fname) + strlen(BT_WAL_SUFFIX) + 1));
+    sprintf(wname, "%s%s", fname, BT_WAL_SUFFIX);
+    assert(stat(wname, &st) == 0);
+    free(wname);
+    
+    return st.st_size;
+}
+
+static void test_random(int nops, uint32_t flags) {
     btree_t *bt;
     char thr_name[5];
     thread_t *threads[8];
     tbt_thr_start_arg_t targ[8];
+    bc_snapshot_t bss;
+    struct stat st;
     char *fname, *tname = "test_random";
     int n = nops;
     
-    printf("%s (n %d)\n", tname, n);
+    printf("%s (n %d flags 0x%" PRIx32 ")\n", tname, n, flags);
     
     assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
     sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
     
-    assert(bt_create(fname) == 0);
+    assert(bt_create_flags(fname, flags) == 0);
     assert(bt_check_disk(fname) == 0);
     //bt_dump_disk(fname);
     
     assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    assert(!bt->bt_bf->bf_cmap == !(flags & BT_COMPRESS));
     bt_check(bt);
     
     // spawn 8 threads, have them each do num_ops / 8 random operations
@@ -1405,20 +1522,970 @@ static void test_random(int nops) {
     //bt_dump(bt);
     //tbt_dump(bt);
     
+    // the space manager, bitmaps and index nodes are pinned
+    bc_get_snapshot(bt->bt_bc, &bss, false);
+    assert((bss.bss_pinned > 0) && (bss.bss_pinned <= bss.bss_pinned_max));
+    
+    // walk it through a much smaller cache, and then a bigger one
+    assert(bt_set_cache_size(bt, 64 * BT_PHYS_BLKSZ) == 0);
+    bt_check(bt);
+    assert(bt_set_cache_size(bt, BT_START_SIZE / 4) == 0);
+    bt_check(bt);
+    
     assert(bt_close(bt) == 0);
     
     assert(bt_check_disk(fname) == 0);
     assert(tbt_check_disk(fname) == 0);
     //tbt_dump_disk(fname);
     
+    // only what's been written takes up room
+    assert(stat(fname, &st) == 0);
+    if (flags & BT_COMPRESS)
+        assert(st.st_size < BT_START_SIZE / 8);
+    
+    // closing it checkpointed it, so there's nothing to replay
+    if (flags & BT_WAL) {
+        assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+        assert(bt->bt_wal->bw_replayed == 0);
+        assert(bt_close(bt) == 0);
+    }
+    
+    assert(bt_destroy(fname) == 0);
+    
+    free(fname);
+}
+
+//
+// four trees sharing one small cache, each hammered on by its own thread. every
+// other one is compressed
+//
+static void test_shared_cache(int nops) {
+    btree_t *bts[4];
+    bcache_t *bc;
+    bc_opts_t opts;
+    thread_t *threads[4];
+    tbt_thr_start_arg_t targ[4];
+    bc_snapshot_t bss;
+    char *fnames[4], *tname = "test_shared_cache";
+    int n = nops;
+    
+    printf("%s (n %d)\n", tname, n);
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = BT_BC_NPARTITIONS;
+    opts.bcop_policy = &bc_policy_2q;
+    assert(bc = bc_create(NULL, BT_PHYS_BLKSZ, 256 * BT_PHYS_BLKSZ, &opts));
+    
+    for (int i = 0; i < 4; i++) {
+        assert(fnames[i] = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 4));
+        sprintf(fnames[i], "%s/%s.%d", TEST_BTREE_DIR, tname, i);
+        assert(bt_create_flags(fnames[i], (i % 2) ? BT_COMPRESS : 0) == 0);
+        assert(bt_open_shared(fnames[i], &tbt_bt_ops, bc, &bts[i]) == 0);
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        assert(threads[i] = thread_create("tsc_thr"));
+        memset(&targ[i], 0, sizeof(tbt_thr_start_arg_t));
+        targ[i].t = threads[i];
+        targ[i].bt = bts[i];
+        targ[i].num_ops = n / 4;
+        assert(thread_start(threads[i], tbt_thr_start, &targ[i]) == 0);
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        assert(thread_wait(threads[i], NULL) == 0);
+        thread_destroy(threads[i]);
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        bt_check(bts[i]);
+        assert(bt_sync(bts[i]) == 0);
+        assert(bt_close(bts[i]) == 0);
+        assert(bt_check_disk(fnames[i]) == 0);
+        assert(tbt_check_disk(fnames[i]) == 0);
+    }
+    
+    // every tree's blocks went with it, pinned ones included
+    assert(bc_currsz(bc) == 0);
+    bc_get_snapshot(bc, &bss, false);
+    assert(bss.bss_pinned == 0);
+    bc_check(bc);
+    bc_destroy(bc);
+    
+    for (int i = 0; i < 4; i++) {
+        assert(bt_destroy(fnames[i]) == 0);
+        free(fnames[i]);
+    }
+}
+
+//
+// threads inserting, and then removing, ids that interleave with each other's,
+// so they're all after the same leaves as they split and are freed. then they
+// put them all back, into leaves that have to be allocated again
+//
+#define TCS_NTHREADS 8
+
+typedef struct tcs_thr_arg {
+    thread_t *t;
+    btree_t *bt;
+    int thr; // which of the TCS_NTHREADS this is
+    int n; // ids it has
+    int phase; // 0: insert them, 1: find and remove them, 2: insert them again
+} tcs_thr_arg_t;
+
+static int tcs_thr_start(void *arg) {
+    tcs_thr_arg_t *targ = (tcs_thr_arg_t *)arg;
+    btree_t *bt = targ->bt;
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    uint64_t id;
+    
+    for (int i = 0; i < targ->n; i++) {
+        id = (uint64_t)i * TCS_NTHREADS + targ->thr + 1;
+        assert(tbr1_build_record(id, id * 7, &rec) == 0);
+        if (targ->phase == 1) {
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+            assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id * 7);
+            free(found);
+            assert(bt_remove(bt, (btr_phys_t *)&rec) == 0);
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == ENOENT);
+        } else {
+            assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+            assert(bt_insert(bt, (btr_phys_t *)&rec) == EEXIST);
+        }
+    }
+    
+    return 0;
+}
+
+static void test_concurrent_splits(int nops, uint32_t flags) {
+    btree_t *bt;
+    tcs_thr_arg_t targ[TCS_NTHREADS];
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    char *fname, *tname = "test_concurrent_splits";
+    uint32_t nnodes = 0;
+    int n = nops / TCS_NTHREADS;
+    
+    printf("%s (n %d flags 0x%" PRIx32 ")\n", tname, nops, flags);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(bt_create_flags(fname, flags) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    
+    for (int phase = 0; phase < 3; phase++) {
+        for (int i = 0; i < TCS_NTHREADS; i++) {
+            memset(&targ[i], 0, sizeof(tcs_thr_arg_t));
+            assert(targ[i].t = thread_create("tcs_thr"));
+            targ[i].bt = bt;
+            targ[i].thr = i;
+            targ[i].n = n;
+            targ[i].phase = phase;
+            assert(thread_start(targ[i].t, tcs_thr_start, &targ[i]) == 0);
+        }
+        for (int i = 0; i < TCS_NTHREADS; i++) {
+            assert(thread_wait(targ[i].t, NULL) == 0);
+            thread_destroy(targ[i].t);
+        }
+        
+        bt_check(bt);
+        //
+        // phase 1 frees every leaf but a root one. how many index nodes are
+        // left depends on how the splits in phase 0 interleaved
+        //
+        if (phase == 0)
+            nnodes = bt_info(bt)->bti_nnodes;
+        else if (phase == 1)
+            assert((nnodes == 1) || (bt_info(bt)->bti_nnodes < nnodes));
+        
+        // bti_nnodes has to have kept up
+        assert(bt_sync(bt) == 0);
+        assert(bt_check_disk(fname) == 0);
+        assert(tbt_check_disk(fname) == 0);
+    }
+    
+    for (uint64_t id = 1; id <= (uint64_t)n * TCS_NTHREADS; id++) {
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id * 7);
+        free(found);
+    }
+    
+    assert(bt_close(bt) == 0);
+    assert(bt_check_disk(fname) == 0);
+    assert(bt_destroy(fname) == 0);
+    
+    free(fname);
+}
+
+//
+// bt_find_pinned and bt_find_copy against bt_find: the pinned record is the
+// one in the leaf, and stays put until it's let go of. a buffer that's too
+// small gets nothing but the size it would have needed
+//
+static void test_find_variants(int nops) {
+    btree_t *bt;
+    bt_handle_t bth;
+    tbr1_phys_t rec, out;
+    btr_phys_t *found, *pinned;
+    uint16_t size;
+    char *fname, *tname = "test_find_variants";
+    
+    printf("%s (n %d)\n", tname, nops);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(bt_create(fname) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    
+    for (uint64_t id = 2; id <= (uint64_t)nops * 2; id += 2) {
+        assert(tbr1_build_record(id, id * 7, &rec) == 0);
+        assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+    }
+    
+    for (uint64_t id = 1; id <= (uint64_t)nops * 2 + 1; id++) {
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        if (id % 2) {
+            assert(bt_find_pinned(bt, (btr_phys_t *)&rec, &bth, &pinned) == ENOENT);
+            assert(!bth.bth_leaf);
+            size = sizeof(tbr1_phys_t);
+            assert(bt_find_copy(bt, (btr_phys_t *)&rec, (btr_phys_t *)&out, &size) == ENOENT);
+            continue;
+        }
+        
+        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+        
+        assert(bt_find_pinned(bt, (btr_phys_t *)&rec, &bth, &pinned) == 0);
+        assert(bth.bth_leaf);
+        assert(((uint8_t *)pinned > (uint8_t *)btn_phys(bth.bth_leaf)) && ((uint8_t *)pinned < (uint8_t *)btn_phys(bth.bth_leaf) + BT_PHYS_BLKSZ));
+        assert(btr_phys_size(pinned) == btr_phys_size(found));
+        assert(memcmp(pinned, found, btr_phys_size(found)) == 0);
+        bt_handle_release(&bth);
+        assert(!bth.bth_leaf);
+        
+        memset(&out, 0, sizeof(tbr1_phys_t));
+        size = sizeof(tbr1_phys_t) - 1;
+        assert(bt_find_copy(bt, (btr_phys_t *)&rec, (btr_phys_t *)&out, &size) == ENOSPC);
+        assert(size == btr_phys_size(found));
+        assert(out.tbr1_key.tbr1_id == 0);
+        assert(bt_find_copy(bt, (btr_phys_t *)&rec, (btr_phys_t *)&out, &size) == 0);
+        assert(size == btr_phys_size(found));
+        assert(memcmp(&out, found, size) == 0);
+        
+        free(found);
+    }
+    
+    // a pinned leaf can't change underneath, but others still can
+    assert(tbr1_build_record(2, 0, &rec) == 0);
+    assert(bt_find_pinned(bt, (btr_phys_t *)&rec, &bth, &pinned) == 0);
+    assert(tbr1_build_record((uint64_t)nops * 2 + 1, 0, &rec) == 0);
+    if (!btn_phys_is_root(btn_phys(bth.bth_leaf)))
+        assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+    assert(((tbr1_phys_t *)pinned)->tbr1_key.tbr1_id == 2);
+    assert(((tbr1_phys_t *)pinned)->tbr1_val.tbr1_data == 14);
+    bt_handle_release(&bth);
+    
+    assert(bt_close(bt) == 0);
+    assert(bt_destroy(fname) == 0);
+    
+    free(fname);
+}
+
+//
+// bt_find racing with splits and frees of the nodes it's on its way through.
+// the even ids are there the whole time, so readers have to find every one of
+// them, however many times bt_find has to start over. the writers put in the odd
+// ids (splitting the readers' leaves) and ones past all of them (growing new
+// leaves), and then take them all out again (freeing those)
+//
+#define TCF_NREADERS 4
+#define TCF_NWRITERS 4
+
+typedef struct tcf_thr_arg {
+    thread_t *t;
+    btree_t *bt;
+    int thr;
+    int n; // even ids
+    bool reader;
+    bool *stop; // for readers, set once the writers are done
+} tcf_thr_arg_t;
+
+static int tcf_thr_start(void *arg) {
+    tcf_thr_arg_t *targ = (tcf_thr_arg_t *)arg;
+    btree_t *bt = targ->bt;
+    bt_handle_t bth;
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    uint64_t id;
+    uint16_t size;
+    
+    if (targ->reader) {
+        do {
+            for (int i = 0; i < targ->n; i++) {
+                id = ((uint64_t)(i + targ->thr) % targ->n) * 2 + 2;
+                assert(tbr1_build_record(id, 0, &rec) == 0);
+                switch (i % 3) { // all three ways of getting it
+                    case 0:
+                        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+                        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id * 7);
+                        free(found);
+                        break;
+                    case 1:
+                        assert(bt_find_pinned(bt, (btr_phys_t *)&rec, &bth, &found) == 0);
+                        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id * 7);
+                        bt_handle_release(&bth);
+                        break;
+                    default:
+                        size = sizeof(tbr1_phys_t);
+                        assert(bt_find_copy(bt, (btr_phys_t *)&rec, (btr_phys_t *)&rec, &size) == 0);
+                        assert(rec.tbr1_val.tbr1_data == id * 7);
+                        break;
+                }
+            }
+        } while (!__atomic_load_n(targ->stop, __ATOMIC_ACQUIRE));
+        
+        return 0;
+    }
+    
+    for (int remove = 0; remove < 2; remove++) {
+        for (int i = targ->thr; i < targ->n * 2; i += TCF_NWRITERS) {
+            id = (i < targ->n) ? (uint64_t)i * 2 + 1 : (uint64_t)i * 2 + 2;
+            assert(tbr1_build_record(id, id * 7, &rec) == 0);
+            if (remove)
+                assert(bt_remove(bt, (btr_phys_t *)&rec) == 0);
+            else
+                assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+        }
+    }
+    
+    return 0;
+}
+
+static void test_concurrent_finds(int nops, uint32_t flags) {
+    btree_t *bt;
+    tcf_thr_arg_t targ[TCF_NREADERS + TCF_NWRITERS];
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    char *fname, *tname = "test_concurrent_finds";
+    bool stop = false;
+    
+    printf("%s (n %d flags 0x%" PRIx32 ")\n", tname, nops, flags);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(bt_create_flags(fname, flags) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    
+    for (uint64_t id = 2; id <= (uint64_t)nops * 2; id += 2) {
+        assert(tbr1_build_record(id, id * 7, &rec) == 0);
+        assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+    }
+    
+    for (int i = 0; i < TCF_NREADERS + TCF_NWRITERS; i++) {
+        memset(&targ[i], 0, sizeof(tcf_thr_arg_t));
+        assert(targ[i].t = thread_create("tcf_thr"));
+        targ[i].bt = bt;
+        targ[i].reader = (i < TCF_NREADERS);
+        targ[i].thr = targ[i].reader ? i : i - TCF_NREADERS;
+        targ[i].n = nops;
+        targ[i].stop = &stop;
+        assert(thread_start(targ[i].t, tcf_thr_start, &targ[i]) == 0);
+    }
+    for (int i = TCF_NREADERS; i < TCF_NREADERS + TCF_NWRITERS; i++) {
+        assert(thread_wait(targ[i].t, NULL) == 0);
+        thread_destroy(targ[i].t);
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < TCF_NREADERS; i++) {
+        assert(thread_wait(targ[i].t, NULL) == 0);
+        thread_destroy(targ[i].t);
+    }
+    
+    bt_check(bt);
+    for (uint64_t id = 1; id <= (uint64_t)nops * 4; id++) {
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        if ((id % 2 == 0) && (id <= (uint64_t)nops * 2)) {
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+            free(found);
+        } else {
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == ENOENT);
+        }
+    }
+    
+    assert(bt_close(bt) == 0);
+    assert(bt_check_disk(fname) == 0);
+    assert(bt_destroy(fname) == 0);
+    
+    free(fname);
+}
+
+//
+// walk a linked tree's leaves on disk by their right links, from the leftmost
+// one. with nothing freed that's every record, in order, and each leaf's high
+// key is above its own records and at or below the next leaf's
+//
+static void tbt_check_leaf_links(const char *fname, uint64_t nrecs) {
+    bc_blkfile_t *bbf;
+    btn_phys_t *btnp;
+    btr_phys_t *btrp, *high = NULL, *last = NULL;
+    uint8_t *buf, *hbuf, *lbuf;
+    uint64_t blkno, n = 0;
+    
+    assert(buf = malloc(BT_PHYS_BLKSZ));
+    assert(hbuf = malloc(BT_PHYS_BLKSZ));
+    assert(lbuf = malloc(BT_PHYS_BLKSZ));
+    btnp = (btn_phys_t *)buf;
+    
+    assert(bc_blkfile_open(fname, BT_PHYS_BLKSZ, 0, &bbf) == 0);
+    assert(bc_blkfile_read(bbf, BT_PHYS_SM_OFFSET, buf) == 0);
+    blkno = ((sm_phys_t *)buf)->smp_rblkno;
+    
+    // down the left edge
+    for (;;) {
+        assert(bc_blkfile_read(bbf, blkno, buf) == 0);
+        assert(btn_phys_is_linked(btnp));
+        if (btn_phys_is_leaf(btnp))
+            break;
+        blkno = btn_phys_first_index_record_ptr(btnp);
+        assert(blkno);
+    }
+    
+    // and across
+    for (;;) {
+        for (int i = 0; i < btnp->btnp_nrecords; i++) {
+            btrp = btn_phys_record(btnp, i);
+            if (last)
+                assert(tbt_compare(last, btrp) < 0);
+            if ((i == 0) && high)
+                assert(tbt_compare(high, btrp) <= 0);
+            memcpy(lbuf, btrp, btr_phys_size(btrp));
+            last = (btr_phys_t *)lbuf;
+            n++;
+        }
+        
+        high = btn_phys_high_key(btnp);
+        if (high) {
+            assert(tbt_compare(last, high) < 0);
+            memcpy(hbuf, high, btr_phys_size(high));
+            high = (btr_phys_t *)hbuf;
+        }
+        
+        blkno = btn_phys_right(btnp);
+        if (!blkno) {
+            assert(((btn_linked_phys_t *)btnp)->btlp_high == BTLP_HIGH_NONE);
+            break;
+        }
+        assert(high);
+        
+        assert(bc_blkfile_read(bbf, blkno, buf) == 0);
+        assert(btn_phys_is_leaf(btnp));
+    }
+    assert(n == nrecs);
+    
+    assert(bc_blkfile_close(bbf) == 0);
+    
+    free(lbuf);
+    free(hbuf);
+    free(buf);
+}
+
+//
+// every node of a tree made now is linked to the one to its right and knows the
+// key that starts it. insert in random order so leaves split all over, and check
+// the links. then take out the middle half of the records, which frees leaves,
+// and put them back, which refills the holes
+//
+static void test_linked_leaves(int nops) {
+    btree_t *bt;
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    uint64_t *ids, tmp;
+    char *fname, *tname = "test_linked_leaves";
+    int j;
+    
+    printf("%s (n %d)\n", tname, nops);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(ids = malloc(sizeof(uint64_t) * nops));
+    for (int i = 0; i < nops; i++)
+        ids[i] = i + 1;
+    for (int i = nops - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+    
+    assert(bt_create(fname) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    for (int i = 0; i < nops; i++) {
+        assert(tbr1_build_record(ids[i], ids[i] * 7, &rec) == 0);
+        assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+    }
+    bt_check(bt);
+    assert(bt_close(bt) == 0);
+    
+    assert(bt_check_disk(fname) == 0);
+    tbt_check_leaf_links(fname, nops);
+    
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    for (int remove = 1; remove >= 0; remove--) {
+        for (int i = 0; i < nops; i++) {
+            if ((ids[i] <= (uint64_t)nops / 4) || (ids[i] > (uint64_t)nops * 3 / 4))
+                continue;
+            assert(tbr1_build_record(ids[i], ids[i] * 7, &rec) == 0);
+            if (remove)
+                assert(bt_remove(bt, (btr_phys_t *)&rec) == 0);
+            else
+                assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+        }
+        bt_check(bt);
+    }
+    for (uint64_t id = 1; id <= (uint64_t)nops; id++) {
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id * 7);
+        free(found);
+    }
+    assert(bt_close(bt) == 0);
+    
+    assert(bt_check_disk(fname) == 0);
+    assert(tbt_check_disk(fname) == 0);
+    assert(bt_destroy(fname) == 0);
+    
+    free(ids);
+    free(fname);
+}
+
+static uint64_t tbt_id(btr_phys_t *btrp) {
+    return ((tbr1_phys_t *)btrp)->tbr1_key.tbr1_id;
+}
+
+// the ids from first to last, stepping by two, skipping (hole_lo, hole_hi]
+static void tbt_check_cursor(bt_cursor_t *btc, uint64_t first, uint64_t last, uint64_t hole_lo, uint64_t hole_hi, bool forward) {
+    btr_phys_t *btrp;
+    uint64_t id = forward ? first : last;
+    
+    while ((forward ? bt_cursor_next(btc, &btrp) : bt_cursor_prev(btc, &btrp)) == 0) {
+        assert(tbt_id(btrp) == id);
+        assert(((tbr1_phys_t *)btrp)->tbr1_val.tbr1_data == id * 7);
+        id = forward ? id + 2 : id - 2;
+        if ((id > hole_lo) && (id <= hole_hi))
+            id = forward ? hole_hi + 2 : hole_lo;
+    }
+    assert(id == (forward ? last + 2 : first - 2));
+    assert(!btc->btc_leaf);
+}
+
+//
+// a seek to every odd id (and one past the end), which lands on the even one
+// after it, and a step back and forth from there
+//
+static void tbt_check_seeks(bt_cursor_t *btc, uint64_t n, uint64_t hole_lo, uint64_t hole_hi) {
+    tbr1_phys_t rec;
+    btr_phys_t *btrp;
+    uint64_t after, before;
+    
+    for (uint64_t id = 1; id <= n + 1; id += 2) {
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        if (id > n) {
+            assert(bt_cursor_seek(btc, (btr_phys_t *)&rec, &btrp) == ENOENT);
+            continue;
+        }
+        
+        after = id + 1;
+        if ((after > hole_lo) && (after <= hole_hi))
+            after = hole_hi + 2;
+        before = id - 1;
+        if ((before > hole_lo) && (before <= hole_hi))
+            before = hole_lo;
+        
+        assert(bt_cursor_seek(btc, (btr_phys_t *)&rec, &btrp) == 0);
+        assert(tbt_id(btrp) == after);
+        if (!before) {
+            assert(bt_cursor_prev(btc, &btrp) == ENOENT);
+            continue;
+        }
+        assert(bt_cursor_prev(btc, &btrp) == 0);
+        assert(tbt_id(btrp) == before);
+        assert(bt_cursor_next(btc, &btrp) == 0);
+        assert(tbt_id(btrp) == after);
+    }
+    
+    // and an exact one
+    assert(tbr1_build_record(n, 0, &rec) == 0);
+    assert(bt_cursor_seek(btc, (btr_phys_t *)&rec, &btrp) == 0);
+    assert(tbt_id(btrp) == n);
+    assert(bt_cursor_next(btc, &btrp) == ENOENT);
+}
+
+static int _tbt_count_cb(btr_phys_t *btr, void *ctx, bool *stop) {
+    (*(int *)ctx)++;
+    return 0;
+}
+
+static int _tbt_count_node_cb(btn_phys_t *btnp, void *ctx, bool *stop) {
+    assert(btn_phys_is_leaf(btnp));
+    (*(int *)ctx)++;
+    return 0;
+}
+
+static int _tbt_enoent_cb(btr_phys_t *btr, void *ctx, bool *stop) {
+    (*(int *)ctx)++;
+    return ENOENT;
+}
+
+//
+// cursors over even ids inserted in random order: forwards and backwards from
+// either end, and seeks and turning around in between. then again with the
+// middle half taken out, which frees leaves the cursor has to step over, and
+// the same through bt_iterate
+//
+static void test_cursors(int nops) {
+    btree_t *bt;
+    bt_cursor_t *btc;
+    tbr1_phys_t rec;
+    btr_phys_t *btrp;
+    uint64_t *ids, tmp, n = (uint64_t)nops * 2, lo = (n / 4) & ~1ULL, hi = (n * 3 / 4) & ~1ULL;
+    char *fname, *tname = "test_cursors";
+    int j, nrecs = 0, nleaves = 0;
+    
+    printf("%s (n %d)\n", tname, nops);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(ids = malloc(sizeof(uint64_t) * nops));
+    for (int i = 0; i < nops; i++)
+        ids[i] = (uint64_t)(i + 1) * 2;
+    for (int i = nops - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+    
+    assert(bt_create(fname) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    assert(bt_cursor_open(bt, &btc) == 0);
+    
+    assert(bt_cursor_next(btc, &btrp) == ENOENT);
+    assert(bt_cursor_prev(btc, &btrp) == ENOENT);
+    assert(bt_cursor_seek(btc, NULL, &btrp) == ENOENT);
+    
+    for (int i = 0; i < nops; i++) {
+        assert(tbr1_build_record(ids[i], ids[i] * 7, &rec) == 0);
+        assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+    }
+    
+    tbt_check_cursor(btc, 2, n, 0, 0, true);
+    tbt_check_cursor(btc, 2, n, 0, 0, false);
+    assert(bt_cursor_seek(btc, NULL, &btrp) == 0);
+    assert(tbt_id(btrp) == 2);
+    assert(bt_cursor_prev(btc, &btrp) == ENOENT);
+    tbt_check_seeks(btc, n, 0, 0);
+    
+    for (uint64_t id = lo + 2; id <= hi; id += 2) {
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        assert(bt_remove(bt, (btr_phys_t *)&rec) == 0);
+    }
+    bt_check(bt);
+    
+    tbt_check_cursor(btc, 2, n, lo, hi, true);
+    tbt_check_cursor(btc, 2, n, lo, hi, false);
+    tbt_check_seeks(btc, n, lo, hi);
+    bt_cursor_close(btc);
+    
+    assert(bt_iterate(bt, _tbt_count_node_cb, &nleaves, _tbt_count_cb, &nrecs) == 0);
+    assert(nrecs == nops - (hi - lo) / 2);
+    assert(nleaves > 1);
+    
+    // a callback's own ENOENT isn't the end of the tree
+    nrecs = 0;
+    assert(bt_iterate(bt, NULL, NULL, _tbt_enoent_cb, &nrecs) == ENOENT);
+    assert(nrecs == 1);
+    
+    assert(bt_close(bt) == 0);
+    assert(bt_destroy(fname) == 0);
+    
+    free(ids);
+    free(fname);
+}
+
+#define TCC_NSCANNERS 2
+#define TCC_NWRITERS 4
+
+typedef struct tcc_thr_arg {
+    thread_t *t;
+    btree_t *bt;
+    int thr;
+    int n; // even ids
+    bool scanner;
+    bool *stop; // for scanners, set once the writers are done
+} tcc_thr_arg_t;
+
+//
+// what a scanner does while it's on a record now and then: the lookups a scan
+// (or a merge join, with its second cursor) makes as it goes. the writers
+// splitting leaves under it mustn't get stuck behind it, or it behind them
+//
+static void tcc_read_more(btree_t *bt, bt_cursor_t *btc, int n, uint64_t id) {
+    tbr1_phys_t rec;
+    btr_phys_t *btrp;
+    bt_handle_t bth;
+    uint64_t other = (id * 31) % n * 2 + 2;
+    
+    assert(tbr1_build_record(other, 0, &rec) == 0);
+    assert(bt_find(bt, (btr_phys_t *)&rec, &btrp) == 0);
+    assert(((tbr1_phys_t *)btrp)->tbr1_val.tbr1_data == other * 7);
+    free(btrp);
+    
+    assert(bt_find_pinned(bt, (btr_phys_t *)&rec, &bth, &btrp) == 0);
+    assert(((tbr1_phys_t *)btrp)->tbr1_val.tbr1_data == other * 7);
+    assert(bt_cursor_seek(btc, (btr_phys_t *)&rec, &btrp) == 0);
+    assert(tbt_id(btrp) == other);
+    bt_handle_release(&bth);
+}
+
+static int tcc_thr_start(void *arg) {
+    tcc_thr_arg_t *targ = (tcc_thr_arg_t *)arg;
+    btree_t *bt = targ->bt;
+    bt_cursor_t *btc, *btc2;
+    tbr1_phys_t rec;
+    btr_phys_t *btrp;
+    uint64_t id, last, even;
+    bool forward = targ->thr % 2;
+    
+    if (targ->scanner) {
+        assert(bt_cursor_open(bt, &btc) == 0);
+        assert(bt_cursor_open(bt, &btc2) == 0);
+        do {
+            forward = !forward;
+            last = forward ? 0 : UINT64_MAX;
+            even = forward ? 2 : (uint64_t)targ->n * 2;
+            while ((forward ? bt_cursor_next(btc, &btrp) : bt_cursor_prev(btc, &btrp)) == 0) {
+                id = tbt_id(btrp);
+                assert(forward ? (id > last) : (id < last));
+                assert(((tbr1_phys_t *)btrp)->tbr1_val.tbr1_data == id * 7);
+                if (id % 2 == 0) {
+                    assert(id == even);
+                    even = forward ? even + 2 : even - 2;
+                }
+                if (id % 16 == 0)
+                    tcc_read_more(bt, btc2, targ->n, id);
+                last = id;
+            }
+            assert(even == (forward ? (uint64_t)targ->n * 2 + 2 : 0));
+        } while (!__atomic_load_n(targ->stop, __ATOMIC_ACQUIRE));
+        bt_cursor_close(btc2);
+        bt_cursor_close(btc);
+        
+        return 0;
+    }
+    
+    // odd ids, in among the even ones and then past them, where their leaves are freed again
+    for (int remove = 0; remove < 2; remove++) {
+        for (int i = targ->thr; i < targ->n * 2; i += TCC_NWRITERS) {
+            id = (uint64_t)i * 2 + 1;
+            assert(tbr1_build_record(id, id * 7, &rec) == 0);
+            if (remove)
+                assert(bt_remove(bt, (btr_phys_t *)&rec) == 0);
+            else
+                assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+        }
+    }
+    
+    return 0;
+}
+
+//
+// cursors walking back and forth over the even ids while writers put odd ones
+// in and take them out again, splitting and freeing leaves under them. they
+// have to see every even id, in order, every time. and they look other ids up
+// on the way (tcc_read_more)
+//
+static void test_concurrent_scans(int nops, uint32_t flags) {
+    btree_t *bt;
+    tcc_thr_arg_t targ[TCC_NSCANNERS + TCC_NWRITERS];
+    tbr1_phys_t rec;
+    char *fname, *tname = "test_concurrent_scans";
+    bool stop = false;
+    
+    printf("%s (n %d flags 0x%" PRIx32 ")\n", tname, nops, flags);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    
+    assert(bt_create_flags(fname, flags) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    
+    for (uint64_t id = 2; id <= (uint64_t)nops * 2; id += 2) {
+        assert(tbr1_build_record(id, id * 7, &rec) == 0);
+        assert(bt_insert(bt, (btr_phys_t *)&rec) == 0);
+    }
+    
+    for (int i = 0; i < TCC_NSCANNERS + TCC_NWRITERS; i++) {
+        memset(&targ[i], 0, sizeof(tcc_thr_arg_t));
+        assert(targ[i].t = thread_create("tcc_thr"));
+        targ[i].bt = bt;
+        targ[i].scanner = (i < TCC_NSCANNERS);
+        targ[i].thr = targ[i].scanner ? i : i - TCC_NSCANNERS;
+        targ[i].n = nops;
+        targ[i].stop = &stop;
+        assert(thread_start(targ[i].t, tcc_thr_start, &targ[i]) == 0);
+    }
+    for (int i = TCC_NSCANNERS; i < TCC_NSCANNERS + TCC_NWRITERS; i++) {
+        assert(thread_wait(targ[i].t, NULL) == 0);
+        thread_destroy(targ[i].t);
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < TCC_NSCANNERS; i++) {
+        assert(thread_wait(targ[i].t, NULL) == 0);
+        thread_destroy(targ[i].t);
+    }
+    
+    bt_check(bt);
+    assert(bt_close(bt) == 0);
+    assert(bt_check_disk(fname) == 0);
+    assert(bt_destroy(fname) == 0);
+    
+    free(fname);
+}
+
+static void tbw_copy(const char *from, const char *to) {
+    uint8_t buf[64 * 1024];
+    ssize_t n;
+    int ifd, ofd;
+    
+    assert((ifd = open(from, O_RDONLY)) >= 0);
+    assert((ofd = open(to, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) >= 0);
+    while ((n = read(ifd, buf, sizeof(buf))) > 0)
+        assert(write(ofd, buf, n) == n);
+    assert(n == 0);
+    assert(close(ifd) == 0);
+    assert(close(ofd) == 0);
+}
+
+//
+// open a tree that was made by test_wal_replay and check that it has ids 1 to n
+// but every third one, and n + 1 if last, after replaying nrecs log records
+//
+static void tbw_check(const char *fname, int n, bool last, uint64_t nrecs) {
+    btree_t *bt;
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    assert(bt->bt_wal->bw_replayed == nrecs);
+    bt_check(bt);
+    for (uint64_t i = 1; i <= n + 1; i++) {
+        assert(tbr1_build_record(i, 0, &rec) == 0);
+        if ((i <= n) ? ((i % 3) == 0) : !last) {
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == ENOENT);
+            continue;
+        }
+        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == i * 7);
+        free(found);
+    }
+    assert(bt_close(bt) == 0);
+    
+    assert(bt_check_disk(fname) == 0);
+    assert(tbt_check_disk(fname) == 0);
+}
+
+//
+// 'crash' a tree with a log by copying its file and its log while it's still
+// open, and open the copy. everything that was committed has to be there. then
+// do it again with the log's last record torn, which loses just the last
+// operation
+//
+static void test_wal_replay(int nops, uint32_t flags) {
+    btree_t *bt;
+    tbr1_phys_t rec;
+    off_t logsz;
+    char *fname, *cname, *wname, *cwname, *tname = "test_wal_replay";
+    int n = (nops < 2048) ? nops : 2048; // small enough not to be checkpointed
+    
+    printf("%s (n %d flags 0x%" PRIx32 ")\n", tname, n, flags);
+    
+    assert(fname = malloc(strlen(TEST_BTREE_DIR) + strlen(tname) + 2));
+    sprintf(fname, "%s/%s", TEST_BTREE_DIR, tname);
+    assert(cname = malloc(strlen(fname) + strlen(".crash") + 1));
+    sprintf(cname, "%s.crash", fname);
+    assert(wname = malloc(strlen(fname) + strlen(BT_WAL_SUFFIX) + 1));
+    sprintf(wname, "%s%s", fname, BT_WAL_SUFFIX);
+    assert(cwname = malloc(strlen(cname) + strlen(BT_WAL_SUFFIX) + 1));
+    sprintf(cwname, "%s%s", cname, BT_WAL_SUFFIX);
+    
+    assert(bt_create_flags(fname, BT_WAL | flags) == 0);
+    assert(bt_open(fname, &tbt_bt_ops, &bt) == 0);
+    assert(bt->bt_wal);
+    
+    for (uint64_t i = 1; i <= n + 1; i++) {
+        assert(tbr1_build_record(i, i * 7, &rec) == 0);
+        assert(tbr1_insert(bt, &rec) == 0);
+        if (i == n) { // take every third one back out before the last insert
+            for (uint64_t j = 3; j <= n; j += 3) {
+                assert(tbr1_build_record(j, 0, &rec) == 0);
+                assert(tbr1_remove(bt, &rec) == 0);
+            }
+        }
+    }
+    assert(bt->bt_wal->bw_records == n + (n / 3) + 1);
+    assert(bt->bt_wal->bw_checkpoints == 0);
+    
+    // the file is as it was created. everything's in the log, and durable
+    logsz = tbw_log_size(fname);
+    assert(logsz == BT_WAL_HDRSZ + bt->bt_wal->bw_next - bt->bt_wal->bw_base);
+    assert(bt->bt_wal->bw_durable == bt->bt_wal->bw_next);
+    
+    tbw_copy(fname, cname);
+    tbw_copy(wname, cwname);
+    tbw_check(cname, n, true, n + (n / 3) + 1);
+    
+    tbw_copy(fname, cname);
+    tbw_copy(wname, cwname);
+    assert(truncate(cwname, logsz - 1) == 0);
+    tbw_check(cname, n, false, n + (n / 3));
+    
+    // closing it checkpoints it, so there's nothing left to replay
+    assert(bt_close(bt) == 0);
+    tbw_check(fname, n, true, 0);
+    
+    assert(bt_destroy(cname) == 0);
+    assert(access(cwname, F_OK) && (errno == ENOENT));
     assert(bt_destroy(fname) == 0);
     
     free(fname);
+    free(cname);
+    free(wname);
+    free(cwname);
 }
 
 static void test_random_cases(int nops) {
     test_node_splitting_random(nops);
-    test_random(nops);
+    test_random(nops, 0);
+    test_random(nops, BT_COMPRESS);
+    test_random(nops, BT_WAL);
+    test_wal_replay(nops, 0);
+    test_wal_replay(nops, BT_COMPRESS);
+    test_shared_cache(nops);
+    test_concurrent_splits(nops, 0);
+    test_concurrent_splits(nops, BT_WAL);
+    test_find_variants(nops);
+    test_concurrent_finds(nops, 0);
+    test_concurrent_finds(nops, BT_WAL);
+    test_linked_leaves(nops);
+    test_cursors(nops);
+    test_concurrent_scans(nops, 0);
+    test_concurrent_scans(nops, BT_WAL);
 }
 
 #define DEFAULT_NUM_OPS (1 << 10)
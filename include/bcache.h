@@ -2,6 +2,7 @@
 #define _BLOCK_CACHE_H_
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <sys/queue.h> // on macOS
 #include <bsd/sys/queue.h> // on Linux
 
@@ -11,12 +12,137 @@
 
 typedef struct block blk_t;
 
+//
+// bc_file_t:
+//  a backing file. any number of them can share one cache: blocks are keyed by
+//  (file, blkno), and all files share the cache's capacity and replacement
+//  policy. each file's dirty blocks can be flushed on their own
+//
+typedef struct bc_file {
+    int bf_fd;
+    uint32_t bf_id; // never reused while the cache is around
+    bool bf_direct; // BC_DIRECT, and the file system went along with it
+    uint32_t bf_dioalign; // O_DIRECT offset, length and memory alignment
+    void *bf_bounce; // for I/O when the block size isn't a multiple of bf_dioalign
+    lock_t *bf_bounce_lock;
+    uint8_t *bf_map; // BC_MMAP: the whole file
+    size_t bf_mapsz;
+    uint32_t bf_nwriteback; // blocks with B_WRITEBACK set. updated atomically
+    struct bc_cmap *bf_cmap; // compressed files only (see below)
+    int (*bf_wal)(void *ctx, uint64_t lsn); // see bc_file_set_wal
+    void *bf_wal_ctx;
+    LIST_ENTRY(bc_file) bf_link;
+} bc_file_t;
+
+//
+// write-ahead logging:
+//  a file's owner can keep a log of its changes and set a hook with
+//  bc_file_set_wal. each dirty block is tagged with the lsn of the log record
+//  that covers what's in it (bc_set_lsn), and the cache calls the hook with the
+//  highest lsn of the blocks it's about to write out before it writes them,
+//  without any partition locks held. the hook returns once the log is on
+//  stable storage up to that lsn (or an error, and the blocks stay dirty).
+//  blocks that are referenced are never written back or flushed by the
+//  flusher, so holding a reference on a block from the time it's changed
+//  until its log record has been made (see bc_hold) keeps half finished
+//  changes off the disk. bc_flush doesn't wait for references, so it should
+//  only be called between changes. mapped files can't have a log: the kernel
+//  writes their pages back whenever it likes
+//
+
+//
+// compressed files:
+//  a file set up with BC_COMPRESS stores each block LZ compressed, in an
+//  extent of however many BC_CSECT byte sectors it takes (or as it is, if it
+//  doesn't compress). a map from blkno to extent is kept in memory and written
+//  out whole, to a new extent, whenever the file is synced. then the header
+//  slot the last sync didn't use is pointed at it, so a crash leaves the file
+//  as of the last bc_flush (or bc_blkfile_sync). extents are never overwritten
+//  in place: a block's old extent is only reused once a map that doesn't
+//  refer to it has been committed. blocks that have never been written read
+//  back as zeros. files say whether they're compressed themselves, so
+//  BC_COMPRESS only matters when they're empty. everything above bc_rw (and
+//  bl_phys) only ever sees uncompressed blocks
+//
+#define BC_CMAGIC    0x62634c5a4d415030ULL // "bcLZMAP0"
+#define BC_CVERSION  1
+#define BC_CSECT     64 // allocation unit
+#define BC_CHDR_SLOTSZ 512 // there are two header slots at the start of the file
+#define BC_CDATA_START (2 * BC_CHDR_SLOTSZ)
+#define BC_CEXT_RAW  0x80000000 // in ce_len: the block is stored uncompressed
+
+typedef struct
+__attribute__((__packed__))
+bc_chdr {
+    uint64_t ch_magic;
+    uint32_t ch_version;
+    uint32_t ch_blksz;
+    uint64_t ch_gen; // commits so far. the slot with the highest valid one wins
+    uint64_t ch_nblocks; // map entries
+    uint64_t ch_map_sect;
+    uint32_t ch_map_len; // bytes
+    uint32_t ch_map_sum;
+    uint32_t ch_sum; // of everything above
+} bc_chdr_t;
+
+typedef struct
+__attribute__((__packed__))
+bc_cext {
+    uint32_t ce_sect;
+    uint32_t ce_len; // bytes (| BC_CEXT_RAW). 0 for blocks that were never written
+} bc_cext_t;
+
+typedef struct bc_cmap {
+    lock_t *cm_lock; // everything below
+    lock_t *cm_commit_lock; // one commit at a time
+    uint32_t cm_blksz;
+    bc_cext_t *cm_map; // by blkno
+    uint64_t cm_nblocks;
+    uint64_t cm_maxblocks;
+    uint64_t *cm_used; // bitmaps of sectors: ones in use,
+    uint64_t *cm_held; // ones only the committed map still refers to,
+    uint64_t *cm_freeing; // and ones being freed by the commit in progress
+    uint64_t cm_nwords; // of cm_used and cm_held
+    uint64_t cm_nfreeing; // words of cm_freeing
+    uint64_t cm_nsects; // the file's size, in sectors
+    uint64_t cm_hint; // where to look for free sectors next
+    uint64_t cm_gen;
+    bc_cext_t cm_mapext; // where the committed map is
+    bool cm_dirty; // the map has changed since it was committed
+} bc_cmap_t;
+
+//
+// bc_blkfile_t:
+//  a file accessed a block at a time without a cache, compressed or not. for
+//  tools that read files directly, and for setting up new ones
+//
+typedef struct bc_blkfile {
+    bc_file_t *bbf_file;
+    uint32_t bbf_blksz;
+} bc_blkfile_t;
+
+// block classes (see bco_class)
+#define BC_CLASS_NORMAL 0 // left to the replacement policy
+#define BC_CLASS_PINNED 1 // kept in the partition's pinned pool while there's room in it
+
 // 'block cache object' operations
+//
+// if bco_size is set, the cache provides the object's memory: *bco points to
+// bco_size zeroed bytes when bco_init is called, and bco_destroy (if any)
+// mustn't free it. otherwise bco_init allocates the object itself
+//
+// bco_class (optional) says which BC_CLASS_* a block belongs in. it's asked
+// when the block has been read in and whenever it's dirtied (a brand new block
+// is read in before it's initialized, but is dirtied once it has been), with
+// bcp_lock held, so it mustn't call back into the cache
+//
 typedef struct bco_ops {
+    size_t bco_size;
     int (*bco_init)(void **bco, blk_t *b);
     void (*bco_destroy)(void *bco);
     void (*bco_dump)(void *bco);
     void (*bco_check)(void *bco);
+    uint32_t (*bco_class)(void *bco);
 } bco_ops_t;
 
 //
@@ -36,18 +162,39 @@ void bl_phys_dump(blk_phys_t *bp);
 //
 // block_t:
 //
-#define B_DIRTY 0x0001 // block is dirty
+#define B_DIRTY     0x0001 // block is dirty
+#define B_LOADING   0x0002 // block is being read in from disk. bl_phys and bl_bco aren't valid yet
+#define B_WRITEBACK 0x0004 // block is being written out to disk. it can't be evicted
+#define B_ERROR     0x0008 // block failed to load. it'll be re-read on the next bc_get
+#define B_PREFETCHED 0x0010 // block was read in by bc_prefetch and hasn't been gotten since
+#define B_PINNED    0x0020 // block is in the pinned pool, not the replacement policy. it's never a victim
+
+//
+// hits don't take bcp_lock (see bc_find_fast), so bl_refcnt is only ever
+// changed atomically, and bl_flags is only changed with bcp_lock held but
+// read without it. blocks that aren't in the cache have a bl_refcnt of
+// BL_DEAD, and can't be referenced until they're reused
+//
+#define BL_DEAD (-1)
 
 struct block {
     rw_lock_t *bl_rwlock;
+    lock_t *bl_iolock; // held by the loading thread while B_LOADING is set
+    bc_file_t *bl_file;
     uint64_t bl_blkno;
     int bl_refcnt;
     uint32_t bl_flags;
     void *bl_bco; // back pointer to 'block cache object'
-    bco_ops_t *bl_bco_ops;
+    bco_ops_t *bl_bco_ops; // shared with the caller of bc_get. not a copy
+    void *bl_bcoslot; // space for the bco, if its ops have a bco_size
     LIST_ENTRY(block) bl_ht_link; // hash table link
-    TAILQ_ENTRY(block) bl_fl_link; // free list link
-    LIST_ENTRY(block) bl_dl_link; // dirty list link
+    TAILQ_ENTRY(block) bl_pl_link; // replacement policy (or pinned pool) list link
+    uint32_t bl_pstate; // replacement policy private state
+    bool bl_ref; // CLOCK reference bit. set by hits (without bcp_lock), cleared by the policy
+    TAILQ_ENTRY(block) bl_dl_link; // dirty list link
+    uint64_t bl_dirtied; // when it was last made dirty (ms, CLOCK_MONOTONIC)
+    int bl_ioerr; // result of the read, for the loading thread
+    uint64_t bl_lsn; // log record covering bl_phys's contents (see bc_file_set_wal). 0 if none
     blk_phys_t *bl_phys;
 };
 
@@ -70,30 +217,407 @@ typedef struct bc_stats {
     uint64_t bcs_misses;
     uint64_t bcs_writes;
     uint64_t bcs_flushes;
+    uint64_t bcs_evictions;
+    uint64_t bcs_evictions_clean; // victims that were clean when they were picked
+    uint64_t bcs_evictions_dirty; // victims that had to be written out first
+    uint64_t bcs_enomem; // gets and prefetches that found every block in use
+    uint64_t bcs_ghost_hits; // misses on blocks the policy remembered evicting
+    uint64_t bcs_fg_writebacks; // dirty victims written out by bc_get
+    uint64_t bcs_bg_writebacks; // dirty blocks written out by the flusher
+    uint64_t bcs_prefetches; // blocks read in by bc_prefetch
+    uint64_t bcs_prefetch_hits; // first gets of prefetched blocks
+    uint64_t bcs_prefetch_drops; // bc_prefetch requests dropped because the queue was full
+    uint64_t bcs_flush_runs; // pwritevs issued by bc_flush
+    uint64_t bcs_flush_blocks; // blocks written by bc_flush
+    uint64_t bcs_flush_maxrun; // longest run bc_flush has written in one go
+    uint64_t bcs_lock_acquires; // partition lock acquisitions
+    uint64_t bcs_lock_wait_ns; // time spent getting them
+    uint64_t bcs_dirty_max; // longest any partition's dirty list has been
+    uint64_t bcs_pin_overflows; // blocks that should have been pinned, but the pinned pool was full
+    uint64_t bcs_admissions; // blocks the tinylfu filter let into the main cache over its victim
+    uint64_t bcs_rejections; // blocks the tinylfu filter evicted from its window without admitting them
+    uint64_t bcs_read_bytes; // read from the backing files (compressed size, for compressed files)
+    uint64_t bcs_write_bytes; // written to them, including compressed files' maps and headers
 } bc_stats_t;
 
+//
+// bc_hist_t:
+//  a latency histogram. bucket i counts latencies in [2^i, 2^(i + 1)) ns (0
+//  goes in bucket 0), and the last bucket counts everything longer
+//
+#define BC_HIST_NBUCKETS 32
+
+typedef struct bc_hist {
+    uint64_t bh_count;
+    uint64_t bh_sum; // ns
+    uint64_t bh_max; // ns
+    uint64_t bh_buckets[BC_HIST_NBUCKETS];
+} bc_hist_t;
+
+#define BC_HIST_HIT   0 // bc_get(_many)s that found everything cached
+#define BC_HIST_MISS  1 // bc_get(_many)s that read something in
+#define BC_HIST_READ  2 // batches of reads handed to the I/O backend
+#define BC_HIST_WRITE 3 // batches of writes handed to the I/O backend (or msyncs)
+#define BC_HIST_SYNC  4 // fsync/fdatasync/sync_file_range
+#define BC_HIST_LOCK  5 // waits for partition locks
+#define BC_NHISTS     6
+
+// upper bound (ns) of the bucket the q'th quantile (0 to 1) falls in
+uint64_t bc_hist_quantile(bc_hist_t *bh, double q);
+
+//
+// stats are kept in BC_NSLOTS cache line sized slots rather than under the
+// partition locks. each thread updates its own slot (threads share them
+// round robin once there are more than that), and readers add them all up
+//
+#define BC_NSLOTS 16
+
+typedef struct bc_stats_slot {
+    bc_stats_t ss_stats;
+    bc_hist_t ss_hists[BC_NHISTS];
+} __attribute__((aligned(64))) bc_stats_slot_t;
+
+// what bc_get_snapshot returns
+typedef struct bc_snapshot {
+    uint64_t bss_time; // when it was taken (ms, CLOCK_MONOTONIC)
+    uint64_t bss_since; // when the stats were last reset, or the cache created
+    bc_stats_t bss_stats;
+    bc_hist_t bss_hists[BC_NHISTS];
+    uint32_t bss_pinned; // blocks in the pinned pools right now
+    uint32_t bss_pinned_max; // what the pinned pools can hold
+    uint32_t bss_unpinned; // blocks the replacement policy has right now
+} bc_snapshot_t;
+
+typedef struct bc_partition bc_part_t;
+
+//
+// bc_policy_t:
+//  replacement policy. the policy tracks every block in a partition that isn't
+//  pinned and picks which unreferenced block gets evicted when the partition is
+//  full. policy state is per partition, and all ops but bpo_access are called
+//  with bcp_lock held. hits don't otherwise call into the policy; they just set
+//  the block's bl_ref, and it's up to the policy to make use of that when it
+//  picks a victim. bpo_access is optional. it's called for every get of key,
+//  hit or miss, and on lock-free hits it's called without bcp_lock, from
+//  inside a bc_rcu section, so it has to be safe to run alongside everything
+//  else
+//
+typedef struct bc_policy {
+    const char *bpo_name;
+    int (*bpo_init)(bc_part_t *bcp, uint32_t nblocks);
+    void (*bpo_destroy)(bc_part_t *bcp);
+    void (*bpo_insert)(bc_part_t *bcp, blk_t *b); // b was just read in (and is referenced)
+    void (*bpo_failed)(bc_part_t *bcp, blk_t *b); // b couldn't be read in. it's not worth keeping
+    blk_t *(*bpo_victim)(bc_part_t *bcp); // an evictable block, or NULL if there are none
+    void (*bpo_evict)(bc_part_t *bcp, blk_t *b); // b (from bpo_victim) is being evicted
+    void (*bpo_remove)(bc_part_t *bcp, blk_t *b); // b is being pinned. it stays cached, but isn't the policy's any more
+    void (*bpo_resize)(bc_part_t *bcp, uint32_t nblocks); // bc_set_capacity changed the partition's size. optional
+    void (*bpo_access)(bc_part_t *bcp, uint64_t key); // key was asked for. optional
+    void (*bpo_dump)(bc_part_t *bcp);
+    void (*bpo_check)(bc_part_t *bcp);
+} bc_policy_t;
+
+extern bc_policy_t bc_policy_lru; // LRU, approximated with CLOCK reference bits
+extern bc_policy_t bc_policy_2q; // 2Q (Johnson & Shasha). scan resistant
+extern bc_policy_t bc_policy_tinylfu; // W-TinyLFU (Einziger et al.). admits blocks by estimated frequency
+
+//
+// bc_part_t:
+//  the cache is split into partitions keyed by (file, blkno). each partition has
+//  its own lock, hash table, dirty list, replacement policy state and capacity
+//
+struct bc_partition {
+    struct bcache *bcp_bc; // the cache it's part of
+    lock_t *bcp_lock;
+    blk_list_t *bcp_ht; // hash table
+    uint32_t bcp_htsz; // number of hash buckets
+    uint32_t bcp_htseq; // odd while bcp_ht and bcp_htsz are being swapped out
+    blk_list_t *bcp_ht_old; // table being rehashed into bcp_ht, if any
+    uint32_t bcp_htsz_old;
+    uint32_t bcp_rehash; // next bucket of bcp_ht_old to move
+    blk_tailq_t bcp_dl; // dirty list, in the order blocks were dirtied
+    uint32_t bcp_ndirty;
+    blk_list_t bcp_unused; // arena blocks that aren't in use
+    uint32_t bcp_nblocks; // arena blocks the partition owns, in use or not
+    bc_policy_t *bcp_policy;
+    void *bcp_policy_data;
+    uint32_t bcp_nwriteback; // blocks with B_WRITEBACK set
+    uint32_t bcp_currsz;
+    uint32_t bcp_maxsz;
+    blk_tailq_t bcp_pinned; // the pinned pool, oldest first
+    uint32_t bcp_npinned;
+    uint32_t bcp_pinned_max; // bc_pinned_pct of the partition's capacity, in blocks
+};
+
+#define BC_FLUSHER   0x0001 // run a background flusher thread
+#define BC_HUGEPAGES 0x0002 // back the arena with huge pages if there are any reserved (or transparent ones if not)
+#define BC_DIRECT    0x0004 // bypass the page cache (O_DIRECT), so blocks aren't cached twice
+#define BC_MMAP      0x0008 // map the file and point blocks into the mapping instead of reading them in
+#define BC_COMPRESS  0x0010 // set empty files up compressed. compressed files can't be mapped, and are never O_DIRECT
+
+#define BC_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define BC_BCOSZ_DEF 64 // bytes of bco slot per block
+#define BC_PINNED_PCT_DEF 10 // % of a partition's capacity
+#define BC_DIO_ALIGN_DEF 4096 // O_DIRECT alignment, if we can't find out what it really is
+
+#define BC_DIRTY_HIWAT_DEF   50   // % of a partition's capacity
+#define BC_DIRTY_LOWAT_DEF   25   // % of a partition's capacity
+#define BC_DIRTY_MAXAGE_DEF  5000 // ms
+#define BC_FLUSHER_INTVL_DEF 50   // ms
+
+#define BC_FLUSH_MAXRUN 256 // most blocks bc_flush hands to the I/O backend at once
+#define BC_LOAD_MAXRUN 64 // most blocks read in at once
+#define BC_REHASH_STEP 8 // old hash buckets each lookup moves over while a partition is rehashing
+#define BC_GET_MANY_STACK 16 // bc_get_many only allocates memory for more blocks than this
+
+#define BC_PREFETCH_QSZ 64 // bc_prefetch requests that can be queued up
+#define BC_PREFETCH_IDLE 500 // us the prefetch thread sleeps for when there's nothing to do
+
+// how bc_flush gets written data onto stable storage
+#define BC_SYNC_FSYNC     0 // fsync (the default)
+#define BC_SYNC_FDATASYNC 1 // fdatasync. skips metadata that isn't needed to read the data back
+#define BC_SYNC_RANGE     2 // sync_file_range (linux only, fsync elsewhere). waits for the data
+                            // to reach the device, but doesn't flush its write cache
+
+//
+// bc_io_t:
+//  I/O backend. bio_rw does a batch of reads or writes and waits for all of
+//  them. each request is a run of adjacent blocks of one file. bio_rw is called
+//  without any partition locks held, from any number of threads at once
+//
+typedef struct bc_io_req {
+    bc_file_t *bior_file;
+    uint64_t bior_off;
+    struct iovec *bior_iov;
+    int bior_iovcnt;
+    ssize_t bior_res; // bytes transferred, or -errno
+    uint32_t *bior_npending; // backend private
+} bc_ioreq_t;
+
+#define BC_IO_READ  0
+#define BC_IO_WRITE 1
+
+struct bcache;
+
+typedef struct bc_io {
+    const char *bio_name;
+    int (*bio_init)(struct bcache *bc);
+    void (*bio_destroy)(struct bcache *bc);
+    void (*bio_rw)(struct bcache *bc, int op, bc_ioreq_t *reqs, uint32_t nreqs);
+} bc_io_t;
+
+extern bc_io_t bc_io_pread; // preadv/pwritev, one request at a time
+extern bc_io_t bc_io_uring; // io_uring (linux only). bc_create falls back to bc_io_pread without it
+
+#define BC_URING_DEPTH 256 // submission queue entries
+#define BC_URING_WAIT 1000 // most us to wait for a completion before checking again
+
+// bc_create options. passing NULL for opts gets the defaults
+typedef struct bc_opts {
+    uint32_t bcop_npartitions; // 0 is the same as 1
+    bc_policy_t *bcop_policy; // NULL is the same as &bc_policy_lru
+    uint32_t bcop_flags;
+    //
+    // flusher tuning (0 gets the default). once a partition is more than
+    // bcop_dirty_hiwat % dirty, the flusher writes out its oldest unreferenced
+    // dirty blocks until it's down to bcop_dirty_lowat %. blocks that have been
+    // dirty for longer than bcop_dirty_maxage ms are written out regardless
+    //
+    uint32_t bcop_dirty_hiwat;
+    uint32_t bcop_dirty_lowat;
+    uint32_t bcop_dirty_maxage;
+    uint32_t bcop_flusher_intvl; // ms between flusher passes
+    uint32_t bcop_sync; // BC_SYNC_*
+    bc_io_t *bcop_io; // NULL is the same as &bc_io_pread
+    uint32_t bcop_bcosz; // bytes of bco slot per block. bco_ops' bco_size can't be any bigger
+    uint32_t bcop_pinned_pct; // % of each partition's capacity pinned blocks can take up. 0 gets the default
+    char *bcop_trace; // trace to this file from the start (see bc_trace_start)
+} bc_opts_t;
+
+typedef struct bc_prefetch_req {
+    bc_file_t *pf_file;
+    uint64_t pf_blkno;
+    uint32_t pf_count;
+    bco_ops_t *pf_bco_ops;
+} bc_pf_req_t;
+
+//
+// bc_arena_t:
+//  one mapping's worth of block frames, blk_ts and bco slots
+//
+typedef struct bc_arena {
+    struct bc_arena *ba_next;
+    void *ba_base;
+    size_t ba_size;
+    blk_t *ba_blks;
+    uint32_t ba_nblocks;
+} bc_arena_t;
+
+LIST_HEAD(bc_file_list, bc_file);
+
+//
+// tracing:
+//  a trace file is a bc_trace_hdr_t followed by bc_trace_rec_ts, one for every
+//  block got, dirtied or released and every flush. each thread slot buffers its
+//  records and writes them out BC_TRACE_BATCH at a time, so the file is only in
+//  time order per thread. sort it by btr_time before replaying it
+//
+#define BC_TRACE_MAGIC   0x52544342 // "BCTR"
+#define BC_TRACE_VERSION 1
+#define BC_TRACE_BATCH   256 // records a slot buffers before writing them out
+
+#define BC_TRACE_GET     1
+#define BC_TRACE_DIRTY   2
+#define BC_TRACE_RELEASE 3
+#define BC_TRACE_FLUSH   4 // btr_blkno is unused
+
+#define BC_TRACE_ALLFILES UINT32_MAX // btr_file of a flush of the whole cache
+
+typedef struct
+__attribute__((__packed__))
+bc_trace_hdr {
+    uint32_t bth_magic;
+    uint32_t bth_version;
+    uint32_t bth_blksz;
+    uint32_t bth_maxsz; // cache capacity when the trace was started
+} bc_trace_hdr_t;
+
+typedef struct
+__attribute__((__packed__))
+bc_trace_rec {
+    uint64_t btr_time; // ns, monotonic
+    uint64_t btr_blkno;
+    uint32_t btr_file; // bf_id, or BC_TRACE_ALLFILES
+    uint16_t btr_thread; // numbered in order of their first record
+    uint8_t btr_op; // BC_TRACE_*
+    uint8_t btr_pad;
+} bc_trace_rec_t;
+
+typedef struct bc_trace_buf {
+    lock_t *tb_lock;
+    uint32_t tb_n;
+    bc_trace_rec_t tb_recs[BC_TRACE_BATCH];
+} bc_trace_buf_t;
+
+typedef struct bc_trace {
+    int bt_fd;
+    uint64_t bt_off; // where the next batch goes. claimed atomically
+    int bt_err; // first write error
+    bc_trace_buf_t bt_bufs[BC_NSLOTS];
+} bc_trace_t;
+
+//
+// bc_rcu_slot_t:
+//  lock-free lookups walk hash tables that bc_set_capacity can replace, and
+//  trace records go into a bc_trace_t that bc_trace_stop frees. both count
+//  themselves in as readers of the current epoch in their thread's slot, and
+//  an old table or trace is only freed once every reader that could have seen
+//  it has left (see bc_rcu_wait)
+//
+typedef struct bc_rcu_slot {
+    uint32_t rs_readers[2]; // by epoch parity
+} __attribute__((aligned(64))) bc_rcu_slot_t;
+
 typedef struct bcache {
-    lock_t *bc_lock;
-    int bc_fd;
-    blk_list_t *bc_ht; // hash table
-    blk_list_t bc_dl; // dirty list
-    blk_tailq_t bc_fl; // free list
+    uint32_t bc_flags; // bcop_flags
     uint32_t bc_blksz;
-    uint32_t bc_currsz;
     uint32_t bc_maxsz;
-    bc_stats_t bc_stats;
+    uint32_t bc_nparts;
+    bc_part_t *bc_parts;
+    thread_t *bc_flusher;
+    lock_t *bc_flusher_lock; // protects bc_flusher_stop
+    bool bc_flusher_stop;
+    uint32_t bc_dirty_hiwat;
+    uint32_t bc_dirty_lowat;
+    uint32_t bc_dirty_maxage;
+    uint32_t bc_flusher_intvl;
+    uint32_t bc_sync;
+    bc_io_t *bc_io;
+    void *bc_io_data;
+    uint32_t bc_bcosz;
+    uint32_t bc_pinned_pct;
+    uint32_t bc_nblocks; // in all arenas
+    bc_arena_t *bc_arena; // newest first
+    lock_t *bc_resize_lock; // one bc_set_capacity at a time
+    bc_file_t *bc_file; // the file bc_create opened, if any. bc_get etc. use it
+    lock_t *bc_files_lock; // protects bc_files and bc_nextid
+    struct bc_file_list bc_files; // every open file, bc_file included
+    uint32_t bc_nextid;
+    lock_t *bc_pf_lock; // protects the bc_pf_* fields
+    thread_t *bc_pf_thread; // started by the first bc_prefetch
+    bool bc_pf_stop;
+    bc_pf_req_t bc_pf_q[BC_PREFETCH_QSZ];
+    uint32_t bc_pf_head;
+    uint32_t bc_pf_nreqs;
+    bc_file_t *bc_pf_busy; // file of the request the prefetch thread is working on
+    bc_stats_slot_t *bc_stats; // BC_NSLOTS of them
+    uint64_t bc_stats_since;
+    bc_rcu_slot_t *bc_rcu; // BC_NSLOTS of them
+    uint32_t bc_rcu_epoch;
+    lock_t *bc_rcu_lock; // one bc_rcu_wait at a time
+    bc_trace_t *bc_trace; // non-NULL while tracing
 } bcache_t;
 
-bcache_t *bc_create(char *path, uint32_t blksz, uint32_t maxsz);
+//
+// bc_sim_t:
+//  replays a trace against a replacement policy and capacity without any file
+//  or I/O behind it (see bc_sim_create). the counts are of what the real cache
+//  would have done
+//
+typedef struct bc_sim {
+    bcache_t *bs_bc;
+    blk_t *bs_blks;
+    bc_file_t **bs_files; // by btr_file
+    uint32_t bs_nfiles;
+    uint64_t bs_gets;
+    uint64_t bs_misses;
+    uint64_t bs_writes; // dirty blocks evicted or flushed
+    uint64_t bs_bypassed; // misses that found every block referenced
+} bc_sim_t;
+
+// path can be NULL for a cache that's only used through bc_file_open
+bcache_t *bc_create(char *path, uint32_t blksz, uint32_t maxsz, bc_opts_t *opts);
 void bc_destroy(bcache_t *bc);
 
+bc_file_t *bc_file_open(bcache_t *bc, char *path);
+int bc_file_close(bcache_t *bc, bc_file_t *bf);
+int bc_file_get(bcache_t *bc, bc_file_t *bf, uint64_t blkno, bco_ops_t *bco_ops, void **bco);
+int bc_file_get_many(bcache_t *bc, bc_file_t *bf, uint64_t *blknos, uint32_t nblks, bco_ops_t *bco_ops, void **bcos);
+int bc_file_prefetch(bcache_t *bc, bc_file_t *bf, uint64_t blkno, uint32_t count, bco_ops_t *bco_ops);
+int bc_file_flush(bcache_t *bc, bc_file_t *bf);
+int bc_file_set_wal(bcache_t *bc, bc_file_t *bf, int (*wal)(void *ctx, uint64_t lsn), void *ctx);
+
 int bc_get(bcache_t *bc, uint64_t blkno, bco_ops_t *bco_ops, void **bco);
+int bc_get_many(bcache_t *bc, uint64_t *blknos, uint32_t nblks, bco_ops_t *bco_ops, void **bcos);
+int bc_prefetch(bcache_t *bc, uint64_t blkno, uint32_t count, bco_ops_t *bco_ops);
 void bc_dirty(bcache_t *bc, blk_t *b);
 void bc_release(bcache_t *bc, blk_t *b);
+void bc_hold(bcache_t *bc, blk_t *b); // another reference on a block that's already referenced
+void bc_set_lsn(bcache_t *bc, blk_t *b, uint64_t lsn);
 
 int bc_iterate(bcache_t *bc, int (*callback)(blk_t *b, void *ctx, bool *stop), void *ctx);
 
 int bc_flush(bcache_t *bc);
+int bc_set_capacity(bcache_t *bc, uint32_t maxsz);
+
+void bc_get_stats(bcache_t *bc, bc_stats_t *bcs);
+void bc_get_snapshot(bcache_t *bc, bc_snapshot_t *bss, bool reset); // reset zeroes everything once it's been read
+uint32_t bc_currsz(bcache_t *bc);
+
+// flags is BC_COMPRESS or 0. read only files are opened read only
+int bc_blkfile_open(const char *path, uint32_t blksz, uint32_t flags, bc_blkfile_t **bbf);
+int bc_blkfile_read(bc_blkfile_t *bbf, uint64_t blkno, void *buf);
+int bc_blkfile_write(bc_blkfile_t *bbf, uint64_t blkno, void *buf);
+int bc_blkfile_sync(bc_blkfile_t *bbf);
+int bc_blkfile_close(bc_blkfile_t *bbf); // syncs compressed files first
+
+int bc_trace_start(bcache_t *bc, const char *path);
+int bc_trace_stop(bcache_t *bc); // returns the first error writing the trace out
+
+// nblocks is the capacity in blocks, split over nparts partitions like bc_create would
+bc_sim_t *bc_sim_create(bc_policy_t *policy, uint32_t nblocks, uint32_t nparts);
+void bc_sim_step(bc_sim_t *bs, bc_trace_rec_t *btr);
+void bc_sim_destroy(bc_sim_t *bs);
 
 void bc_dump(bcache_t *bc);
 void bc_check(bcache_t *bc);
@@ -19,12 +19,93 @@
 // btree node flags
 #define BTN_PHYS_FLG_IS_ROOT   0x0001
 #define BTN_PHYS_FLG_IS_LEAF   0x0002
-#define BTN_PHYS_ALLOWABLE_FLAGS (BTN_PHYS_FLG_IS_ROOT|BTN_PHYS_FLG_IS_LEAF)
+#define BTN_PHYS_FLG_SLOTTED   0x0004 // slotted layout (see btn_slotted_phys_t). nodes without it have the original one
+#define BTN_PHYS_FLG_LINKED    0x0008 // slotted, with a right link and a high key (see btn_linked_phys_t)
+#define BTN_PHYS_ALLOWABLE_FLAGS (BTN_PHYS_FLG_IS_ROOT|BTN_PHYS_FLG_IS_LEAF|BTN_PHYS_FLG_SLOTTED|BTN_PHYS_FLG_LINKED)
 
 #define BT_START_SIZE     (64 * 1024 * 1024) // 64MB
 
+#define BT_BC_NPARTITIONS 8 // number of block cache partitions
+#define BT_BC_PINNED_PCT 25 // % of the block cache the space manager, bitmaps and index nodes can keep pinned
+
+// bt_create_flags flags
+#define BT_COMPRESS 0x0001 // store blocks compressed (see BC_COMPRESS). the file only takes up what's been written
+#define BT_WAL      0x0002 // keep a write-ahead log, so every bt_insert and bt_remove is durable once it returns
+
 typedef struct btree btree_t;
 
+//
+// write-ahead log:
+//  a tree created with BT_WAL has a log file next to it (its path plus
+//  BT_WAL_SUFFIX). every bt_insert and bt_remove appends one record to it with
+//  the full images of the blocks it changed, and returns once the record is on
+//  stable storage. threads that commit at the same time share a write and an
+//  fdatasync: whoever gets there first writes out every record logged so far,
+//  and the rest wait for it. the changed blocks stay dirty in the cache, which
+//  forces the log out past them before it writes any of them home (see
+//  bc_file_set_wal). once the log grows past BT_WAL_CKPT_SIZE, and on bt_sync
+//  and bt_close, the tree is checkpointed: everything is flushed home and the
+//  log starts over at the beginning of its file. the file isn't truncated, so
+//  records are written over ones that are already there, which saves the
+//  fdatasyncs having to update its size. bt_open replays whatever's in the log
+//  first. lsns are positions in the log since it was created, so they only ever
+//  go up, and the header says which lsn the file's first record has. replay
+//  stops at the first record that doesn't follow on from the one before it, or
+//  doesn't check out. a record's commit lsn is where it ends
+//
+#define BT_WAL_SUFFIX ".wal"
+#define BT_WAL_MAGIC 0x4c415742 // "BWAL"
+#define BT_WAL_HDRSZ 512 // records start after this
+#define BT_WAL_CKPT_SIZE (16 * 1024 * 1024) // log size that triggers a checkpoint
+#define BT_WAL_NBLKS_DEF 32 // blocks an operation can change before bw_blks has to grow
+
+//
+// the header is only rewritten by checkpoints, once everything is home, so if
+// it's torn there's nothing in the log that's needed
+//
+typedef struct
+__attribute__((__packed__))
+bt_wal_hdr_phys {
+    uint32_t bwh_magic;
+    uint32_t bwh_sum; // of the header, with bwh_sum zeroed
+    uint64_t bwh_base; // lsn of the first record
+} bt_wal_hdr_phys_t;
+
+typedef struct
+__attribute__((__packed__))
+bt_wal_rec_phys {
+    uint32_t bwr_magic;
+    uint32_t bwr_blksz;
+    uint64_t bwr_lsn; // where the record starts
+    uint32_t bwr_len; // bytes, this header included
+    uint32_t bwr_nblocks;
+    uint32_t bwr_sum; // of the whole record, with bwr_sum zeroed
+    //struct { uint64_t blkno; uint8_t block[bwr_blksz]; } bwr_blocks[];
+} bt_wal_rec_phys_t;
+
+typedef struct bt_wal {
+    int bw_fd;
+    lock_t *bw_lock; // everything up to bw_blks
+    uint8_t *bw_buf; // records that haven't been written out yet
+    uint32_t bw_buflen;
+    uint32_t bw_bufmax;
+    uint8_t *bw_spare; // swapped with bw_buf by whoever's writing it out
+    uint32_t bw_sparemax;
+    uint64_t bw_base; // lsn of the file's first record
+    uint64_t bw_written; // lsn bw_buf starts at
+    uint64_t bw_next; // lsn the next record will start at
+    uint64_t bw_durable; // everything before this is on stable storage
+    bool bw_syncing; // someone's writing records out
+    int bw_err; // the first error writing the log. it's not written to again
+    uint64_t bw_records; // stats: records logged,
+    uint64_t bw_syncs; // fdatasyncs they took,
+    uint64_t bw_checkpoints; // checkpoints,
+    uint64_t bw_replayed; // and records bt_open replayed
+    blk_t **bw_blks; // blocks changed by the operation in progress, each held. bt_rwlock protects these (see bt_insert)
+    uint32_t bw_nblks;
+    uint32_t bw_maxblks;
+} bt_wal_t;
+
 // all btree records start with this header
 typedef struct
 __attribute__((__packed__))
@@ -52,10 +133,70 @@ btree_node_phys {
     //bt_info_phys_t btnp_info; // in root node only
 } btn_phys_t;
 
+//
+// node layouts:
+//  the original layout packs the records right after the header, in key order,
+//  so finding one means walking them all and inserting one means moving every
+//  record after it. nodes with BTN_PHYS_FLG_SLOTTED have a slot array after the
+//  header instead, with the offset of each record in key order, and the records
+//  themselves are packed up against the end of the node (or bt_info_phys_t in the
+//  root), in no particular order. so a node can be binary searched, and inserting
+//  and removing only moves slots. the space between the slots and the records
+//  is free, and so is any left behind by removed records: that's reclaimed by
+//  compacting the node in place once the gap is too small. every node a tree
+//  allocates is slotted. ones from files made before that keep their layout
+//  until they're freed. in both layouts, index nodes have the pointer to the
+//  child for keys less than the first record's right after the header
+//
+typedef struct
+__attribute__((__packed__))
+btree_slotted_node_phys {
+    btn_phys_t btsp_btnp;
+    uint16_t btsp_heap; // offset of the lowest record
+    //uint64_t btsp_first_index_ptr; // in index nodes only
+    //uint16_t btsp_slots[btnp_nrecords];
+    //uint8_t btsp_free[];
+    //uint8_t btsp_records[];
+    //bt_info_phys_t btnp_info; // in root node only
+} btn_slotted_phys_t;
+
+//
+// linked nodes (B-link):
+//  a tree created now has BTN_PHYS_FLG_LINKED on every node, and one from
+//  before it has it on none (a split gives the new node the old one's layout).
+//  a linked node has a slotted node's layout, with the blkno of the node to its
+//  right on the same level, and its high key: keys from there up belong to the
+//  node to its right, or ones further along. the high key is kept, key only, in
+//  the heap with the records. a split hands the node's right link and high key
+//  on to the new node, which takes the top half of its keys, and points the node
+//  at it, with the new node's first key as its high key. so a reader that gets
+//  to a node after it's split, with a key that's moved, just moves right (see
+//  "concurrency" below). leaves are linked left to right, but a freed leaf
+//  isn't unlinked from the one to its left, and one allocated where it was
+//  isn't linked in, so a walk over the leaves has to treat the links as hints
+//
+#define BTLP_HIGH_NONE    0 // the rightmost node on its level: no key's too high for it
+#define BTLP_HIGH_UNKNOWN 0xffff // there wasn't room for it. readers have to go by the parent instead
+
+typedef struct
+__attribute__((__packed__))
+btree_linked_node_phys {
+    btn_slotted_phys_t btlp_btsp;
+    uint64_t btlp_right; // 0 if there's nothing to the right
+    uint16_t btlp_high; // offset of the high key, or one of BTLP_HIGH_*
+    //uint64_t btsp_first_index_ptr; // in index nodes only
+    //uint16_t btsp_slots[btnp_nrecords];
+    //uint8_t btsp_free[];
+    //uint8_t btsp_records[]; // and the high key
+    //bt_info_phys_t btnp_info; // in root node only
+} btn_linked_phys_t;
+
 typedef struct btree_node {
     btree_t *btn_bt;
     blk_t *btn_blk;
     btn_phys_t *btn_phys;
+    uint64_t btn_version; // odd while the node's latched exclusive (see "concurrency" below)
+    uint32_t btn_pins; // cursors and bt_handle_ts on the leaf (see "concurrency" below)
 } btn_t;
 
 typedef struct
@@ -95,25 +236,144 @@ typedef struct btree_ops {
     void (*bto_check_record_fn)(btr_phys_t *btr);
 } bt_ops_t;
 
+//
+// concurrency:
+//  every node's block has a latch (bl_rwlock), held shared to read the node and
+//  exclusive to change it. operations take them from the root down, latching
+//  each node before they let go of its parent, so they only ever wait on nodes
+//  below the ones they hold. bt_find latches shared all the way down. bt_insert
+//  and bt_remove first do the same down to the leaf, which they latch exclusive:
+//  most of the time the leaf is all that changes. if it would split (or be
+//  freed), they start over and latch exclusive from the root, and once they get
+//  to the leaf they let go of everything above the highest node the split (or
+//  free) can reach. bt_rwlock only guards bt_root, shared for long enough to
+//  take a reference to it and exclusive to replace it. the root's latched after
+//  that, and if it isn't the root anymore by then, it's gone again. a tree with
+//  a log still lets one writer in at a time, holding bt_rwlock exclusive: each
+//  log record has to be the images of blocks only its operation changed
+//
+//  a cursor, or a bt_find_pinned record, stays on its leaf between calls. that
+//  can't be a latch, since its thread might go on to wait on nodes above it. so
+//  the leaf's pinned instead (btn_pins, counted up with it latched shared), and
+//  left alone while it is: a writer that gets a pinned leaf latched exclusive
+//  lets go of everything it holds, bt_rwlock included, and waits for the pins to
+//  go before starting over. nothing waits on a pin while holding anything else
+//
+//  bt_find doesn't latch anything, so readers don't write to the same lock words
+//  on the upper levels of the tree. every node has a version (btn_version) that's
+//  bumped when it's latched exclusive and again when it's let go. bt_find copies
+//  each node on its way down and only believes the copy if the version was even
+//  and didn't move while it was taken, and only follows a child pointer if the
+//  parent's version still hadn't moved once it had the child's. otherwise a
+//  writer got in the way (a split, say) and it starts over from bt_rblkno. after
+//  BT_FIND_RETRIES of those it latches its way down like everything else. in a
+//  linked tree, a node that's split since bt_find read its parent is still right
+//  about the keys it kept, and its high key says which ones it didn't: bt_find
+//  goes by that instead of the parent's version, and moves right when the key
+//  it's looking for is at or past it. so it only starts over when it's caught a
+//  node in the middle of changing. nodes are only ever freed once every bt_find
+//  that could have read a pointer to them has finished (see bt_rcu_wait), so the
+//  links and pointers it follows never lead anywhere that's been reused
+//
+#define BT_MAX_DEPTH 32 // a tree of 1KB nodes never gets anywhere near this
+#define BT_FIND_RETRIES 8
+
+//
+// bt_rcu_slot_t:
+//  bt_find counts itself in as a reader of the current epoch, in its thread's
+//  slot, for as long as it's in the tree without latches
+//
+#define BT_NSLOTS 16
+
+typedef struct bt_rcu_slot {
+    uint32_t rs_readers[2]; // by epoch parity
+} __attribute__((aligned(64))) bt_rcu_slot_t;
+
 struct btree {
-    rw_lock_t *bt_rwlock;
+    rw_lock_t *bt_rwlock; // see above
+    lock_t *bt_sm_lock; // the space manager and bitmaps
+    int32_t bt_ndelta; // nodes allocated (less those freed) that the root's bt_info doesn't count yet
     bt_ops_t *bt_ops;
     bcache_t *bt_bc;
+    bc_file_t *bt_bf; // the tree's file in bt_bc
+    bool bt_private_bc; // bt_bc is ours alone (bt_open)
     btn_t *bt_root;
+    uint64_t bt_rblkno; // bt_root's, for bt_find to start from without bt_rwlock
+    uint64_t bt_find_restarts; // times bt_find had to start over
+    bool bt_linked; // its nodes are linked (see btn_linked_phys_t)
+    bt_rcu_slot_t *bt_rcu; // BT_NSLOTS of them
+    uint32_t bt_rcu_epoch;
+    lock_t *bt_rcu_lock; // one bt_rcu_wait at a time
     sm_t *bt_sm;
+    bt_wal_t *bt_wal; // NULL unless the tree has a log (BT_WAL)
 };
 
+//
+// bt_handle_t:
+//  what bt_find_pinned hands back along with a record: the leaf the record's
+//  in, pinned (see "concurrency" above) and held in the cache until
+//  bt_handle_release. the record isn't copied anywhere. the thread holding a
+//  handle can go on reading the tree, but mustn't change it, the same as with a
+//  cursor (below)
+//
+typedef struct bt_handle {
+    btn_t *bth_leaf;
+} bt_handle_t;
+
+//
+// cursors:
+//  walk a live tree's records in key order. a cursor keeps the leaf it's on
+//  pinned (see "concurrency" above) and held in the cache between calls, and the
+//  records it hands back point into that leaf, so they're good until the next
+//  call on it. the thread using a cursor can go on reading the tree (bt_find,
+//  other cursors) while it's on a record, but mustn't change it: a change to the
+//  leaf it's on would wait for its own pin. getting to the next (or previous)
+//  leaf means letting go of this one and going back down from the root to the
+//  key that bounds it, since right links can be stale (see btn_linked_phys_t).
+//  once it's going from leaf to leaf, the ones after it in its parent (and its
+//  right link) are read ahead. a cursor that's new or has run off either end
+//  isn't on anything: bt_cursor_next starts it at the first record, and
+//  bt_cursor_prev at the last
+//
+#define BT_CURSOR_READAHEAD 8 // leaves
+
+typedef struct bt_cursor {
+    btree_t *btc_bt;
+    btn_t *btc_leaf; // NULL unless it's on a record
+    int btc_ind; // the record's
+    btr_phys_t *btc_key; // what it goes back down by
+    btr_phys_t *btc_lo; // btc_leaf's keys are in [btc_lo, btc_hi)
+    btr_phys_t *btc_hi;
+    bool btc_has_lo; // there's nothing to the left of btc_leaf if not
+    bool btc_has_hi; // or to the right
+    uint64_t btc_ra_parent; // the leaves read ahead last: whose children they were,
+    int btc_ra_ind; // the index of the last one,
+    bool btc_ra_forward; // and which way
+} bt_cursor_t;
+
 int bt_create(const char *path);
+int bt_create_flags(const char *path, uint32_t flags);
 int bt_open(const char *path, bt_ops_t *ops, btree_t **bt);
+int bt_open_shared(const char *path, bt_ops_t *ops, bcache_t *bc, btree_t **bt);
 int bt_sync(btree_t *bt);
+int bt_set_cache_size(btree_t *bt, uint32_t maxsz);
 int bt_close(btree_t *bt);
 int bt_destroy(const char *path);
 
 int bt_insert(btree_t *bt, btr_phys_t *to_insert);
 int bt_find(btree_t *bt, btr_phys_t *to_find, btr_phys_t **record);
+int bt_find_pinned(btree_t *bt, btr_phys_t *to_find, bt_handle_t *bth, btr_phys_t **record);
+void bt_handle_release(bt_handle_t *bth);
+int bt_find_copy(btree_t *bt, btr_phys_t *to_find, btr_phys_t *record, uint16_t *size);
 int bt_update(btree_t *bt, btr_phys_t *to_update);
 int bt_remove(btree_t *bt, btr_phys_t *to_remove);
 
+int bt_cursor_open(btree_t *bt, bt_cursor_t **btc);
+int bt_cursor_seek(bt_cursor_t *btc, btr_phys_t *key, btr_phys_t **record);
+int bt_cursor_next(bt_cursor_t *btc, btr_phys_t **record);
+int bt_cursor_prev(bt_cursor_t *btc, btr_phys_t **record);
+void bt_cursor_close(bt_cursor_t *btc);
+
 int bt_iterate(btree_t *bt, int (*node_callback)(btn_phys_t *node, void *ctx, bool *stop), void *node_ctx, int (*record_callback)(btr_phys_t *record, void *ctx, bool *stop), void *record_ctx);
 int bt_iterate_disk(const char *path, int (*node_callback)(btn_phys_t *node, void *ctx, bool *stop), void *node_ctx, int (*record_callback)(btr_phys_t *record, void *ctx, bool *stop), void *record_ctx);
 
@@ -138,8 +398,15 @@ uint64_t btr_phys_index_ptr(btr_phys_t *btrp);
 
 bool btn_phys_is_leaf(btn_phys_t *btnp);
 bool btn_phys_is_root(btn_phys_t *btnp);
+bool btn_phys_is_slotted(btn_phys_t *btnp);
+bool btn_phys_is_linked(btn_phys_t *btnp);
+uint64_t btn_phys_right(btn_phys_t *btnp);
+btr_phys_t *btn_phys_high_key(btn_phys_t *btnp);
+uint64_t btn_phys_first_index_record_ptr(btn_phys_t *btnp);
 int btn_phys_iterate_records(btn_phys_t *btnp, int (*callback)(btr_phys_t *btr, void *ctx, bool *stop), void *ctx);
 btr_phys_t *btn_phys_first_record(btn_phys_t *btnp);
+btr_phys_t *btn_phys_next_record(btn_phys_t *btnp, uint16_t ind, btr_phys_t *btrp);
+btr_phys_t *btn_phys_record(btn_phys_t *btnp, uint16_t ind);
 
 typedef struct btn_split_info {
     btr_phys_t *bsi_split_index1;
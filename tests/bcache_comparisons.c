@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "bcache.h"
+
+//
+// compares block cache configurations on the same workload: nthreads threads
+// doing random bc_gets over a file a few times bigger than the cache, 80% of
+// them to a hot 20% of the file, dirtying one get in ten
+//
+
+#define BCC_FNAME "/var/tmp/bcache_comparisons"
+
+#define BCC_NUM_OPS_DEF  (256 * 1024)
+#define BCC_FILESZ_DEF   (256 * 1024 * 1024)
+#define BCC_CACHESZ_DEF  (64 * 1024 * 1024)
+#define BCC_BLKSZ_DEF    4096
+#define BCC_NTHREADS_DEF 4
+
+typedef struct bcc_phys {
+    uint64_t bccp_blkno;
+} bcc_phys_t;
+
+static int bcc_init(void **bco, blk_t *b) {
+    *(blk_t **)*bco = b;
+    return 0;
+}
+
+static bco_ops_t bcc_ops = {
+    .bco_size = sizeof(blk_t *),
+    .bco_init = bcc_init,
+    .bco_destroy = NULL,
+    .bco_dump = NULL,
+    .bco_check = NULL
+};
+
+typedef struct bcc_thr_arg {
+    thread_t *t;
+    bcache_t *bc;
+    uint64_t nblocks;
+    int num_ops;
+    unsigned int seed;
+} bcc_thr_arg_t;
+
+static int bcc_thr_start(void *arg) {
+    bcc_thr_arg_t *targ = (bcc_thr_arg_t *)arg;
+    bcache_t *bc = targ->bc;
+    uint64_t blkno, nhot = targ->nblocks / 5;
+    blk_t **bp, *b;
+    
+    for (int i = 0; i < targ->num_ops; i++) {
+        if ((rand_r(&targ->seed) % 10) < 8)
+            blkno = rand_r(&targ->seed) % nhot;
+        else
+            blkno = nhot + rand_r(&targ->seed) % (targ->nblocks - nhot);
+        assert(bc_get(bc, blkno, &bcc_ops, (void **)&bp) == 0);
+        b = *bp;
+        assert(((bcc_phys_t *)b->bl_phys)->bccp_blkno == blkno);
+        if ((rand_r(&targ->seed) % 10) == 0) {
+            rwl_lock_exclusive(b->bl_rwlock);
+            bc_dirty(bc, b);
+            rwl_unlock(b->bl_rwlock);
+        }
+        bc_release(bc, b);
+    }
+    
+    return 0;
+}
+
+static void bcc_create_file(size_t filesz, uint32_t blksz) {
+    bcc_phys_t *bccp;
+    uint8_t *buf;
+    int fd;
+    
+    assert(unlink(BCC_FNAME) == 0 || (errno == ENOENT));
+    fd = open(BCC_FNAME, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    
+    assert(buf = malloc(blksz));
+    memset(buf, 0, blksz);
+    bccp = (bcc_phys_t *)buf;
+    for (uint64_t i = 0; i < filesz / blksz; i++) {
+        bccp->bccp_blkno = i;
+        assert(pwrite(fd, buf, blksz, i * blksz) == blksz);
+    }
+    assert(fsync(fd) == 0);
+    assert(close(fd) == 0);
+    free(buf);
+}
+
+//
+// how much of the file is in the page cache, i.e. cached a second time
+//
+static size_t bcc_page_cache_resident(size_t filesz) {
+    size_t pgsz = sysconf(_SC_PAGESIZE), npages = (filesz + pgsz - 1) / pgsz, nres = 0;
+    unsigned char *vec;
+    void *addr;
+    int fd;
+    
+    fd = open(BCC_FNAME, O_RDONLY);
+    assert(fd >= 0);
+    addr = mmap(NULL, filesz, PROT_READ, MAP_SHARED, fd, 0);
+    assert(addr != MAP_FAILED);
+    assert(vec = malloc(npages));
+    assert(mincore(addr, filesz, vec) == 0);
+    for (size_t i = 0; i < npages; i++)
+        nres += vec[i] & 1;
+    free(vec);
+    munmap(addr, filesz);
+    close(fd);
+    
+    return nres * pgsz;
+}
+
+static double diff_timespec(struct timespec tend, struct timespec tstart) {
+    return (tend.tv_sec - tstart.tv_sec) + ((tend.tv_nsec - tstart.tv_nsec) / 1e9);
+}
+
+static void bcc_run(const char *name, size_t filesz, size_t cachesz, uint32_t blksz, int nthreads, int num_ops,
+                    bc_opts_t *opts) {
+    bcc_thr_arg_t *targs;
+    struct timespec tstart, tend;
+    bcache_t *bc;
+    bc_snapshot_t bss;
+    bc_stats_t *bcs;
+    double t;
+    int fd;
+    
+    // start cold
+    fd = open(BCC_FNAME, O_RDONLY);
+    assert(fd >= 0);
+    assert(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+    close(fd);
+    
+    assert(bc = bc_create(BCC_FNAME, blksz, cachesz, opts));
+    assert(targs = malloc(sizeof(bcc_thr_arg_t) * nthreads));
+    
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int i = 0; i < nthreads; i++) {
+        targs[i].bc = bc;
+        targs[i].nblocks = filesz / blksz;
+        targs[i].num_ops = num_ops / nthreads;
+        targs[i].seed = i + 1; // every configuration sees the same gets
+        assert(targs[i].t = thread_create("bcc_thread"));
+        assert(thread_start(targs[i].t, bcc_thr_start, &targs[i]) == 0);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        assert(thread_wait(targs[i].t, NULL) == 0);
+        thread_destroy(targs[i].t);
+    }
+    assert(bc_flush(bc) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    t = diff_timespec(tend, tstart);
+    
+    bc_get_snapshot(bc, &bss, false);
+    bcs = &bss.bss_stats;
+    printf("%-12s %.3fs (%.0f ops/s) hits %" PRIu64 " misses %" PRIu64 " writes %" PRIu64 " "
+           "bcache %" PRIu32 "MB page cache %zuMB direct %s\n", name, t, num_ops / t, bcs->bcs_hits,
+           bcs->bcs_misses, bcs->bcs_writes, bc->bc_maxsz >> 20, bcc_page_cache_resident(filesz) >> 20,
+           bc->bc_file->bf_direct ? "yes" : "no");
+    printf("%-12s hit p50 %" PRIu64 "ns p99 %" PRIu64 "ns miss p50 %" PRIu64 "ns p99 %" PRIu64 "ns\n", "",
+           bc_hist_quantile(&bss.bss_hists[BC_HIST_HIT], 0.5), bc_hist_quantile(&bss.bss_hists[BC_HIST_HIT], 0.99),
+           bc_hist_quantile(&bss.bss_hists[BC_HIST_MISS], 0.5), bc_hist_quantile(&bss.bss_hists[BC_HIST_MISS], 0.99));
+    
+    bc_destroy(bc);
+    free(targs);
+}
+
+int main(int argc, char **argv) {
+    size_t filesz = BCC_FILESZ_DEF;
+    uint32_t cachesz = BCC_CACHESZ_DEF, blksz = BCC_BLKSZ_DEF;
+    int ch, num_ops = BCC_NUM_OPS_DEF, nthreads = BCC_NTHREADS_DEF;
+    char *trace = NULL;
+    bc_opts_t opts;
+    
+    struct option longopts[] = {
+        { "num",      required_argument,   NULL,   'n' },
+        { "filesz",   required_argument,   NULL,   'f' },
+        { "cachesz",  required_argument,   NULL,   'c' },
+        { "blksz",    required_argument,   NULL,   'b' },
+        { "threads",  required_argument,   NULL,   't' },
+        { "trace",    required_argument,   NULL,   'r' },
+        { NULL,                0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                num_ops = (int)strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                filesz = (size_t)strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'c':
+                cachesz = (uint32_t)strtoul(optarg, NULL, 10) << 20;
+                break;
+            case 'b':
+                blksz = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                nthreads = (int)strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                trace = optarg;
+                break;
+            default:
+                printf("usage: %s [--num <num-ops>] [--filesz <MB>] [--cachesz <MB>] [--blksz <bytes>] "
+                       "[--threads <num-threads>] [--trace <file>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if (!num_ops || !blksz || !nthreads || (filesz / blksz < 5) || (cachesz < blksz)) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    printf("file %zuMB cache %" PRIu32 "MB blksz %" PRIu32 " threads %d ops %d\n", filesz >> 20, cachesz >> 20,
+           blksz, nthreads, num_ops);
+    bcc_create_file(filesz, blksz);
+    
+    // buffered vs O_DIRECT. the first run is traced, for bcache_sim
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 16;
+    opts.bcop_trace = trace;
+    bcc_run("buffered", filesz, cachesz, blksz, nthreads, num_ops, &opts);
+    opts.bcop_trace = NULL;
+    opts.bcop_flags = BC_DIRECT;
+    bcc_run("direct", filesz, cachesz, blksz, nthreads, num_ops, &opts);
+    opts.bcop_io = &bc_io_uring;
+    bcc_run("direct+uring", filesz, cachesz, blksz, nthreads, num_ops, &opts);
+    opts.bcop_flags = BC_MMAP;
+    opts.bcop_io = NULL;
+    bcc_run("mmap", filesz, cachesz, blksz, nthreads, num_ops, &opts);
+    
+    // a file that fits in the cache: pread copies vs. pointing into the mapping
+    opts.bcop_flags = 0;
+    bcc_run("fits", filesz, filesz, blksz, nthreads, num_ops, &opts);
+    opts.bcop_flags = BC_MMAP;
+    bcc_run("fits+mmap", filesz, filesz, blksz, nthreads, num_ops, &opts);
+    
+    assert(unlink(BCC_FNAME) == 0);
+    
+    return 0;
+}
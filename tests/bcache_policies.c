@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "bcache.h"
+
+//
+// compares replacement policies on skewed workloads: nthreads threads doing
+// bc_gets whose block numbers follow a Zipf distribution over a file several
+// times bigger than the cache, first on their own and then with every thread
+// breaking off for a sequential scan every so often. the scans are what an
+// admission filter (tinylfu) is for: their blocks are only ever asked for once
+//
+
+#define BCP_FNAME "/var/tmp/bcache_policies"
+
+#define BCP_NUM_OPS_DEF   (1024 * 1024)
+#define BCP_FILESZ_DEF    (256 * 1024 * 1024)
+#define BCP_CACHESZ_DEF   (32 * 1024 * 1024)
+#define BCP_BLKSZ_DEF     4096
+#define BCP_NTHREADS_DEF  4
+#define BCP_THETA_DEF     0.99
+#define BCP_SCAN_EVERY    16384 // gets between a thread's scans
+
+typedef struct bcp_phys {
+    uint64_t bcpp_blkno;
+} bcp_phys_t;
+
+static int bcp_init(void **bco, blk_t *b) {
+    *(blk_t **)*bco = b;
+    return 0;
+}
+
+static bco_ops_t bcp_ops = {
+    .bco_size = sizeof(blk_t *),
+    .bco_init = bcp_init,
+    .bco_destroy = NULL,
+    .bco_dump = NULL,
+    .bco_check = NULL
+};
+
+typedef struct bcp_thr_arg {
+    thread_t *t;
+    bcache_t *bc;
+    double *cdf; // of the Zipf distribution, by rank
+    uint64_t nblocks;
+    uint64_t scanlen; // 0 for no scans
+    int num_ops;
+    unsigned int seed;
+} bcp_thr_arg_t;
+
+static double *bcp_zipf_cdf(uint64_t n, double theta) {
+    double *cdf, sum = 0.0;
+    
+    assert(cdf = malloc(sizeof(double) * n));
+    for (uint64_t i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), theta);
+        cdf[i] = sum;
+    }
+    for (uint64_t i = 0; i < n; i++)
+        cdf[i] /= sum;
+    
+    return cdf;
+}
+
+//
+// a Zipf distributed block number. ranks are scattered over the file so that
+// the hot blocks aren't all next to each other
+//
+static uint64_t bcp_zipf_blkno(bcp_thr_arg_t *targ) {
+    double u = (double)rand_r(&targ->seed) / ((double)RAND_MAX + 1.0);
+    uint64_t lo = 0, hi = targ->nblocks - 1, mid;
+    
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (targ->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return (lo * 2654435761ULL) % targ->nblocks;
+}
+
+static void bcp_get(bcache_t *bc, uint64_t blkno) {
+    blk_t **bp;
+    
+    assert(bc_get(bc, blkno, &bcp_ops, (void **)&bp) == 0);
+    assert(((bcp_phys_t *)(*bp)->bl_phys)->bcpp_blkno == blkno);
+    bc_release(bc, *bp);
+}
+
+static int bcp_thr_start(void *arg) {
+    bcp_thr_arg_t *targ = (bcp_thr_arg_t *)arg;
+    uint64_t start;
+    int i = 0;
+    
+    while (i < targ->num_ops) {
+        bcp_get(targ->bc, bcp_zipf_blkno(targ));
+        i++;
+        if (targ->scanlen && !(i % BCP_SCAN_EVERY)) {
+            start = rand_r(&targ->seed) % targ->nblocks;
+            for (uint64_t j = 0; (j < targ->scanlen) && (i < targ->num_ops); j++, i++)
+                bcp_get(targ->bc, (start + j) % targ->nblocks);
+        }
+    }
+    
+    return 0;
+}
+
+static void bcp_create_file(size_t filesz, uint32_t blksz) {
+    bcp_phys_t *bcpp;
+    uint8_t *buf;
+    int fd;
+    
+    assert(unlink(BCP_FNAME) == 0 || (errno == ENOENT));
+    fd = open(BCP_FNAME, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    
+    assert(buf = malloc(blksz));
+    memset(buf, 0, blksz);
+    bcpp = (bcp_phys_t *)buf;
+    for (uint64_t i = 0; i < filesz / blksz; i++) {
+        bcpp->bcpp_blkno = i;
+        assert(pwrite(fd, buf, blksz, i * blksz) == blksz);
+    }
+    assert(fsync(fd) == 0);
+    assert(close(fd) == 0);
+    free(buf);
+}
+
+static double diff_timespec(struct timespec tend, struct timespec tstart) {
+    return (tend.tv_sec - tstart.tv_sec) + ((tend.tv_nsec - tstart.tv_nsec) / 1e9);
+}
+
+static void bcp_run(bc_policy_t *policy, double *cdf, uint64_t scanlen, size_t filesz, size_t cachesz, uint32_t blksz,
+                    int nthreads, int num_ops) {
+    bcp_thr_arg_t *targs;
+    struct timespec tstart, tend;
+    bcache_t *bc;
+    bc_opts_t opts;
+    bc_stats_t bcs;
+    double t;
+    
+    memset(&opts, 0, sizeof(bc_opts_t));
+    opts.bcop_npartitions = 16;
+    opts.bcop_policy = policy;
+    
+    assert(bc = bc_create(BCP_FNAME, blksz, cachesz, &opts));
+    assert(targs = malloc(sizeof(bcp_thr_arg_t) * nthreads));
+    
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (int i = 0; i < nthreads; i++) {
+        targs[i].bc = bc;
+        targs[i].cdf = cdf;
+        targs[i].nblocks = filesz / blksz;
+        targs[i].scanlen = scanlen;
+        targs[i].num_ops = num_ops / nthreads;
+        targs[i].seed = i + 1; // every policy sees the same gets
+        assert(targs[i].t = thread_create("bcp_thread"));
+        assert(thread_start(targs[i].t, bcp_thr_start, &targs[i]) == 0);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        assert(thread_wait(targs[i].t, NULL) == 0);
+        thread_destroy(targs[i].t);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    t = diff_timespec(tend, tstart);
+    
+    bc_get_stats(bc, &bcs);
+    printf("  %-8s hit%% %6.2f  %.3fs (%.0f ops/s) misses %" PRIu64 " admissions %" PRIu64 " rejections %" PRIu64 "\n",
+           policy->bpo_name, (100.0 * bcs.bcs_hits) / (bcs.bcs_hits + bcs.bcs_misses), t, num_ops / t,
+           bcs.bcs_misses, bcs.bcs_admissions, bcs.bcs_rejections);
+    
+    bc_destroy(bc);
+    free(targs);
+}
+
+int main(int argc, char **argv) {
+    bc_policy_t *policies[] = { &bc_policy_lru, &bc_policy_2q, &bc_policy_tinylfu };
+    size_t filesz = BCP_FILESZ_DEF;
+    uint32_t cachesz = BCP_CACHESZ_DEF, blksz = BCP_BLKSZ_DEF;
+    int ch, num_ops = BCP_NUM_OPS_DEF, nthreads = BCP_NTHREADS_DEF;
+    uint64_t scanlen = 0;
+    double theta = BCP_THETA_DEF, *cdf;
+    
+    struct option longopts[] = {
+        { "num",      required_argument,   NULL,   'n' },
+        { "filesz",   required_argument,   NULL,   'f' },
+        { "cachesz",  required_argument,   NULL,   'c' },
+        { "blksz",    required_argument,   NULL,   'b' },
+        { "threads",  required_argument,   NULL,   't' },
+        { "theta",    required_argument,   NULL,   'z' },
+        { "scanlen",  required_argument,   NULL,   's' },
+        { NULL,                0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                num_ops = (int)strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                filesz = (size_t)strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'c':
+                cachesz = (uint32_t)strtoul(optarg, NULL, 10) << 20;
+                break;
+            case 'b':
+                blksz = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                nthreads = (int)strtol(optarg, NULL, 10);
+                break;
+            case 'z':
+                theta = strtod(optarg, NULL);
+                break;
+            case 's':
+                scanlen = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                printf("usage: %s [--num <num-ops>] [--filesz <MB>] [--cachesz <MB>] [--blksz <bytes>] "
+                       "[--threads <num-threads>] [--theta <zipf-skew>] [--scanlen <blocks>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if (!num_ops || !blksz || !nthreads || (theta <= 0.0) || (filesz / blksz < 2) || (cachesz < blksz)) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    // by default each scan is as big as the cache
+    if (!scanlen)
+        scanlen = cachesz / blksz;
+    
+    printf("file %zuMB cache %" PRIu32 "MB blksz %" PRIu32 " threads %d ops %d theta %.2f\n", filesz >> 20,
+           cachesz >> 20, blksz, nthreads, num_ops, theta);
+    bcp_create_file(filesz, blksz);
+    cdf = bcp_zipf_cdf(filesz / blksz, theta);
+    
+    printf("zipf:\n");
+    for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+        bcp_run(policies[p], cdf, 0, filesz, cachesz, blksz, nthreads, num_ops);
+    
+    printf("zipf + %" PRIu64 " block scans every %d gets:\n", scanlen, BCP_SCAN_EVERY);
+    for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+        bcp_run(policies[p], cdf, scanlen, filesz, cachesz, blksz, nthreads, num_ops);
+    
+    free(cdf);
+    assert(unlink(BCP_FNAME) == 0);
+    
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "bcache.h"
+
+//
+// replays a block cache trace (see bc_trace_start, or bcache_comparisons
+// --trace) against a range of cache sizes and policies, and prints the miss
+// ratio each would have had. nothing is read or written but the trace
+//
+
+#define BCS_MINBLKS_DEF 16
+
+typedef struct bcs_rec {
+    bc_trace_rec_t r_rec;
+    uint64_t r_seq; // position in the file, so a thread's records stay in order
+} bcs_rec_t;
+
+static int bcs_rec_cmp(const void *a, const void *b) {
+    const bcs_rec_t *x = a, *y = b;
+    
+    if (x->r_rec.btr_time != y->r_rec.btr_time)
+        return (x->r_rec.btr_time > y->r_rec.btr_time) ? 1 : -1;
+    
+    return (x->r_seq > y->r_seq) - (x->r_seq < y->r_seq);
+}
+
+static bc_trace_rec_t *bcs_read_trace(const char *path, bc_trace_hdr_t *bth, uint64_t *nrecs) {
+    bc_trace_rec_t *recs;
+    bcs_rec_t *srecs;
+    struct stat st;
+    ssize_t len;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("bcache_sim: couldn't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    assert(fstat(fd, &st) == 0);
+    if ((st.st_size < sizeof(bc_trace_hdr_t)) || (read(fd, bth, sizeof(bc_trace_hdr_t)) != sizeof(bc_trace_hdr_t)) ||
+        (bth->bth_magic != BC_TRACE_MAGIC) || (bth->bth_version != BC_TRACE_VERSION)) {
+        printf("bcache_sim: %s isn't a version %d trace\n", path, BC_TRACE_VERSION);
+        close(fd);
+        return NULL;
+    }
+    
+    *nrecs = (st.st_size - sizeof(bc_trace_hdr_t)) / sizeof(bc_trace_rec_t);
+    len = sizeof(bc_trace_rec_t) * *nrecs;
+    assert(recs = malloc(len ? len : 1));
+    assert(read(fd, recs, len) == len);
+    close(fd);
+    
+    // slots write their records out a batch at a time, so put them back in time order
+    assert(srecs = malloc(sizeof(bcs_rec_t) * (*nrecs ? *nrecs : 1)));
+    for (uint64_t i = 0; i < *nrecs; i++) {
+        srecs[i].r_rec = recs[i];
+        srecs[i].r_seq = i;
+    }
+    qsort(srecs, *nrecs, sizeof(bcs_rec_t), bcs_rec_cmp);
+    for (uint64_t i = 0; i < *nrecs; i++)
+        recs[i] = srecs[i].r_rec;
+    free(srecs);
+    
+    return recs;
+}
+
+int main(int argc, char **argv) {
+    bc_policy_t *policies[] = { &bc_policy_lru, &bc_policy_2q, &bc_policy_tinylfu }, *policy = NULL;
+    uint32_t minblks = BCS_MINBLKS_DEF, maxblks = 0, nparts = 1, npolicies;
+    uint64_t nrecs, nops[BC_TRACE_FLUSH + 1], nthreads = 0;
+    static bool seen[UINT16_MAX + 1]; // by btr_thread
+    bc_trace_rec_t *recs;
+    bc_trace_hdr_t bth;
+    bc_sim_t *bs;
+    char *trace = NULL;
+    int ch;
+    
+    struct option longopts[] = {
+        { "trace",       required_argument,   NULL,   'r' },
+        { "policy",      required_argument,   NULL,   'p' },
+        { "min",         required_argument,   NULL,   'm' },
+        { "max",         required_argument,   NULL,   'x' },
+        { "partitions",  required_argument,   NULL,   'n' },
+        { NULL,                   0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'r':
+                trace = optarg;
+                break;
+            case 'p':
+                for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+                    if (strcmp(optarg, policies[i]->bpo_name) == 0)
+                        policy = policies[i];
+                }
+                if (!policy) {
+                    printf("%s: no policy %s\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                minblks = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'x':
+                maxblks = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                nparts = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("usage: %s --trace <file> [--policy <lru|2q|tinylfu>] [--min <blocks>] [--max <blocks>] "
+                       "[--partitions <num-partitions>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if (!trace || !minblks || !nparts || (maxblks && (maxblks < minblks))) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    recs = bcs_read_trace(trace, &bth, &nrecs);
+    if (!recs)
+        return -1;
+    
+    memset(nops, 0, sizeof(nops));
+    for (uint64_t i = 0; i < nrecs; i++) {
+        if (recs[i].btr_op <= BC_TRACE_FLUSH)
+            nops[recs[i].btr_op]++;
+        if (!seen[recs[i].btr_thread]) {
+            seen[recs[i].btr_thread] = true;
+            nthreads++;
+        }
+    }
+    
+    // up to 4x the traced cache's size by default
+    if (!maxblks)
+        maxblks = bth.bth_blksz ? 4 * (bth.bth_maxsz / bth.bth_blksz) : minblks;
+    if (minblks < nparts) // every partition needs a block
+        minblks = nparts;
+    if (maxblks < minblks)
+        maxblks = minblks;
+    
+    printf("trace %s: blksz %" PRIu32 " cache %" PRIu32 " blocks, %" PRIu64 " gets %" PRIu64 " dirties %" PRIu64 " "
+           "releases %" PRIu64 " flushes, %" PRIu64 " threads\n", trace, bth.bth_blksz,
+           bth.bth_blksz ? bth.bth_maxsz / bth.bth_blksz : 0, nops[BC_TRACE_GET], nops[BC_TRACE_DIRTY],
+           nops[BC_TRACE_RELEASE], nops[BC_TRACE_FLUSH], nthreads);
+    
+    if (policy) {
+        policies[0] = policy;
+        npolicies = 1;
+    } else
+        npolicies = sizeof(policies) / sizeof(policies[0]);
+    
+    printf("%10s", "blocks");
+    for (int p = 0; p < npolicies; p++)
+        printf("  %6s miss%% %12s", policies[p]->bpo_name, "writes");
+    printf("\n");
+    
+    // doubling as far as maxblks, and then maxblks itself
+    for (uint64_t nblks = minblks; ; nblks = (nblks * 2 < maxblks) ? nblks * 2 : maxblks) {
+        printf("%10" PRIu64, nblks);
+        for (int p = 0; p < npolicies; p++) {
+            assert(bs = bc_sim_create(policies[p], (uint32_t)nblks, nparts));
+            for (uint64_t i = 0; i < nrecs; i++)
+                bc_sim_step(bs, &recs[i]);
+            printf("  %12.2f %12" PRIu64, bs->bs_gets ? (100.0 * bs->bs_misses) / bs->bs_gets : 0.0, bs->bs_writes);
+            if (bs->bs_bypassed)
+                printf(" (%" PRIu64 " bypassed)", bs->bs_bypassed);
+            bc_sim_destroy(bs);
+        }
+        printf("\n");
+        if (nblks == maxblks)
+            break;
+    }
+    
+    free(recs);
+    
+    return 0;
+}
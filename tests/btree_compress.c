@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "btree.h"
+#include "tbr.h"
+#include "tbr0.h"
+
+//
+// what compressing a B-tree's blocks buys: the same tbr0 records (string
+// keys that share long prefixes, and values that repeat) are inserted into an
+// uncompressed tree and a compressed one, in random order, so most nodes are
+// around half full. then each tree is reopened with a cache much smaller than
+// it is and looked up at random. reports the file sizes, the bytes the cache
+// read and wrote, and how long it all took
+//
+
+#define BTC_FNAME "/var/tmp/btree_compress"
+
+#define BTC_NUM_RECS_DEF (128 * 1024)
+#define BTC_NUM_FINDS_DEF (256 * 1024)
+#define BTC_CACHESZ_DEF (1024 * BT_PHYS_BLKSZ)
+
+static int btc_compare(btr_phys_t *btr1, btr_phys_t *btr2) {
+    return tbr_phys_compare((tbr_phys_t *)btr1, (tbr_phys_t *)btr2);
+}
+
+static bt_ops_t btc_ops = {
+    .bto_compare_fn = btc_compare,
+    .bto_dump_record_fn = NULL,
+    .bto_check_record_fn = NULL
+};
+
+static tbr0_phys_t *btc_record(uint32_t i, bool key_only) {
+    char kstr[64], vstr[64];
+    tbr0_phys_t *tbr0p;
+    
+    sprintf(kstr, "tbr0-key-%010" PRIu32, i);
+    sprintf(vstr, "tbr0-val-%" PRIu32 "-%s", i % 100, "xxxxxxxxxxxxxxxx");
+    assert(tbr0_build_record(kstr, key_only ? NULL : vstr, &tbr0p) == 0);
+    
+    return tbr0p;
+}
+
+static double diff_timespec(struct timespec tend, struct timespec tstart) {
+    return (tend.tv_sec - tstart.tv_sec) + ((tend.tv_nsec - tstart.tv_nsec) / 1e9);
+}
+
+static void btc_run(uint32_t flags, uint32_t *order, uint32_t nrecs, uint32_t nfinds, uint32_t cachesz) {
+    struct timespec tstart, tend;
+    tbr0_phys_t *tbr0p;
+    btr_phys_t *found;
+    bc_stats_t bcs;
+    struct stat st;
+    btree_t *bt;
+    unsigned int seed = 1;
+    double tins, tfind;
+    uint64_t wbytes;
+    
+    assert(bt_create_flags(BTC_FNAME, flags) == 0);
+    assert(bt_open(BTC_FNAME, &btc_ops, &bt) == 0);
+    
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (uint32_t i = 0; i < nrecs; i++) {
+        tbr0p = btc_record(order[i], false);
+        assert(bt_insert(bt, (btr_phys_t *)tbr0p) == 0);
+        free(tbr0p);
+    }
+    assert(bt_sync(bt) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    tins = diff_timespec(tend, tstart);
+    bc_get_stats(bt->bt_bc, &bcs);
+    wbytes = bcs.bcs_write_bytes;
+    assert(bt_close(bt) == 0);
+    assert(stat(BTC_FNAME, &st) == 0);
+    
+    assert(bt_open(BTC_FNAME, &btc_ops, &bt) == 0);
+    assert(bt_set_cache_size(bt, cachesz) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (uint32_t i = 0; i < nfinds; i++) {
+        tbr0p = btc_record(rand_r(&seed) % nrecs, true);
+        assert(bt_find(bt, (btr_phys_t *)tbr0p, &found) == 0);
+        free(found);
+        free(tbr0p);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    tfind = diff_timespec(tend, tstart);
+    bc_get_stats(bt->bt_bc, &bcs);
+    assert(bt_close(bt) == 0);
+    
+    printf("  %-12s size %8.2fMB (%8.2fMB allocated) written %8.2fMB insert %.3fs | "
+           "read %8.2fMB (%.0f bytes/miss) find %.3fs (%.0f finds/s)\n", flags & BT_COMPRESS ? "compressed" : "uncompressed",
+           st.st_size / 1048576.0, st.st_blocks * 512 / 1048576.0, wbytes / 1048576.0, tins, bcs.bcs_read_bytes / 1048576.0,
+           bcs.bcs_misses ? (double)bcs.bcs_read_bytes / bcs.bcs_misses : 0.0, tfind, nfinds / tfind);
+    
+    assert(bt_destroy(BTC_FNAME) == 0);
+}
+
+int main(int argc, char **argv) {
+    uint32_t nrecs = BTC_NUM_RECS_DEF, nfinds = BTC_NUM_FINDS_DEF, cachesz = BTC_CACHESZ_DEF, *order, j, tmp;
+    unsigned int seed = 1;
+    int ch;
+    
+    struct option longopts[] = {
+        { "num",      required_argument,   NULL,   'n' },
+        { "finds",    required_argument,   NULL,   'f' },
+        { "cachesz",  required_argument,   NULL,   'c' },
+        { NULL,                0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                nrecs = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                nfinds = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                cachesz = (uint32_t)strtoul(optarg, NULL, 10) * BT_PHYS_BLKSZ;
+                break;
+            default:
+                printf("usage: %s [--num <num-records>] [--finds <num-finds>] [--cachesz <blocks>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if (!nrecs || !cachesz) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    assert(order = malloc(sizeof(uint32_t) * nrecs));
+    for (uint32_t i = 0; i < nrecs; i++)
+        order[i] = i;
+    for (uint32_t i = nrecs - 1; i > 0; i--) {
+        j = rand_r(&seed) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    
+    printf("records %" PRIu32 " finds %" PRIu32 " cache %" PRIu32 " blocks\n", nrecs, nfinds, cachesz / BT_PHYS_BLKSZ);
+    btc_run(0, order, nrecs, nfinds, cachesz);
+    btc_run(BT_COMPRESS, order, nrecs, nfinds, cachesz);
+    
+    free(order);
+    
+    return 0;
+}
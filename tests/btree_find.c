@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "btree.h"
+#include "tbr.h"
+#include "tbr1.h"
+
+//
+// how bt_find scales with reader threads. it doesn't latch anything on its
+// way down, so readers don't fight over the root's and the other upper nodes'
+// lock words. runs the readers by themselves and then next to a writer that
+// keeps splitting nodes under them, and reports lookups per second and how
+// many times bt_find had to start over. then one reader by itself, with each
+// way of getting a record back: a malloc'd copy (bt_find), a copy in a buffer
+// of its own (bt_find_copy), and the record where it is (bt_find_pinned)
+//
+
+#define BTF_FNAME "/var/tmp/btree_find"
+
+#define BTF_NUM_RECS_DEF (64 * 1024)
+#define BTF_NTHREADS_DEF 8
+#define BTF_SECS 2
+
+static int btf_compare(btr_phys_t *btr1, btr_phys_t *btr2) {
+    return tbr_phys_compare((tbr_phys_t *)btr1, (tbr_phys_t *)btr2);
+}
+
+static bt_ops_t btf_ops = {
+    .bto_compare_fn = btf_compare,
+    .bto_dump_record_fn = NULL,
+    .bto_check_record_fn = NULL
+};
+
+typedef struct btf_thr_arg {
+    thread_t *t;
+    btree_t *bt;
+    bool writer;
+    uint32_t nrecs; // in the tree to begin with
+    uint32_t seed;
+    bool *stop;
+    uint64_t nops; // out
+} btf_thr_arg_t;
+
+static uint64_t btf_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int btf_thr_start(void *arg) {
+    btf_thr_arg_t *targ = (btf_thr_arg_t *)arg;
+    tbr1_phys_t rec;
+    btr_phys_t *found;
+    uint64_t id;
+    
+    while (!__atomic_load_n(targ->stop, __ATOMIC_ACQUIRE)) {
+        if (targ->writer) { // odd ids land between the readers'
+            id = (uint64_t)(rand_r(&targ->seed) % targ->nrecs) * 2 + 1;
+            assert(tbr1_build_record(id, id, &rec) == 0);
+            if (bt_insert(targ->bt, (btr_phys_t *)&rec) == EEXIST)
+                assert(bt_remove(targ->bt, (btr_phys_t *)&rec) == 0);
+        } else {
+            id = (uint64_t)(rand_r(&targ->seed) % targ->nrecs) * 2 + 2;
+            assert(tbr1_build_record(id, 0, &rec) == 0);
+            assert(bt_find(targ->bt, (btr_phys_t *)&rec, &found) == 0);
+            free(found);
+        }
+        targ->nops++;
+    }
+    
+    return 0;
+}
+
+static void btf_run(btree_t *bt, uint32_t nrecs, int nthreads, bool writer) {
+    btf_thr_arg_t *targs;
+    uint64_t start, restarts, finds = 0;
+    bool stop = false;
+    int n = nthreads + (writer ? 1 : 0);
+    double t;
+    
+    assert(targs = malloc(sizeof(btf_thr_arg_t) * n));
+    
+    restarts = __atomic_load_n(&bt->bt_find_restarts, __ATOMIC_RELAXED);
+    start = btf_now();
+    for (int i = 0; i < n; i++) {
+        memset(&targs[i], 0, sizeof(btf_thr_arg_t));
+        targs[i].bt = bt;
+        targs[i].writer = (i == nthreads);
+        targs[i].nrecs = nrecs;
+        targs[i].seed = i + 1;
+        targs[i].stop = &stop;
+        assert(targs[i].t = thread_create("btf_thread"));
+        assert(thread_start(targs[i].t, btf_thr_start, &targs[i]) == 0);
+    }
+    sleep(BTF_SECS);
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < n; i++) {
+        assert(thread_wait(targs[i].t, NULL) == 0);
+        thread_destroy(targs[i].t);
+        if (!targs[i].writer)
+            finds += targs[i].nops;
+    }
+    t = (btf_now() - start) / 1e9;
+    restarts = __atomic_load_n(&bt->bt_find_restarts, __ATOMIC_RELAXED) - restarts;
+    
+    printf("  readers %2d%s  %10.0f finds/s  %8.0f finds/s/thread  restarts %" PRIu64, nthreads, writer ? " + writer" : "         ",
+           finds / t, finds / t / nthreads, restarts);
+    if (writer)
+        printf(" (%" PRIu64 " writes)", targs[nthreads].nops);
+    printf("\n");
+    
+    free(targs);
+}
+
+static void btf_variants(btree_t *bt, uint32_t nrecs) {
+    const char *names[] = { "bt_find", "bt_find_copy", "bt_find_pinned" };
+    unsigned int seed = 1;
+    bt_handle_t bth;
+    tbr1_phys_t rec, out;
+    btr_phys_t *found;
+    uint64_t start, id, n;
+    uint16_t size;
+    double t;
+    
+    for (int v = 0; v < 3; v++) {
+        n = 0;
+        start = btf_now();
+        do {
+            for (int i = 0; i < 1024; i++) {
+                id = (uint64_t)(rand_r(&seed) % nrecs) * 2 + 2;
+                assert(tbr1_build_record(id, 0, &rec) == 0);
+                switch (v) {
+                    case 0:
+                        assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+                        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id);
+                        free(found);
+                        break;
+                    case 1:
+                        size = sizeof(tbr1_phys_t);
+                        assert(bt_find_copy(bt, (btr_phys_t *)&rec, (btr_phys_t *)&out, &size) == 0);
+                        assert(out.tbr1_val.tbr1_data == id);
+                        break;
+                    default:
+                        assert(bt_find_pinned(bt, (btr_phys_t *)&rec, &bth, &found) == 0);
+                        assert(((tbr1_phys_t *)found)->tbr1_val.tbr1_data == id);
+                        bt_handle_release(&bth);
+                        break;
+                }
+            }
+            n += 1024;
+        } while (btf_now() - start < BTF_SECS * 1000000000ULL);
+        t = (btf_now() - start) / 1e9;
+        printf("  %-14s %10.0f finds/s\n", names[v], n / t);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t nrecs = BTF_NUM_RECS_DEF;
+    int ch, nthreads = BTF_NTHREADS_DEF;
+    tbr1_phys_t rec;
+    btree_t *bt;
+    
+    struct option longopts[] = {
+        { "num",      required_argument,   NULL,   'n' },
+        { "threads",  required_argument,   NULL,   't' },
+        { NULL,                0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                nrecs = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                nthreads = (int)strtol(optarg, NULL, 10);
+                break;
+            default:
+                printf("usage: %s [--num <num-records>] [--threads <num-threads>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if ((nthreads < 1) || (nrecs < 1)) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    assert(bt_create(BTF_FNAME) == 0);
+    assert(bt_open(BTF_FNAME, &btf_ops, &bt) == 0);
+    for (uint64_t id = 2; id <= (uint64_t)nrecs * 2; id += 2) {
+        assert(tbr1_build_record(id, id, &rec) == 0);
+        assert(tbr1_insert(bt, &rec) == 0);
+    }
+    
+    printf("records %" PRIu32 " (cpus %ld)\n", nrecs, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int n = 1; n <= nthreads; n *= 2)
+        btf_run(bt, nrecs, n, false);
+    for (int n = 1; n <= nthreads; n *= 2)
+        btf_run(bt, nrecs, n, true);
+    btf_variants(bt, nrecs);
+    
+    assert(bt_close(bt) == 0);
+    assert(bt_destroy(BTF_FNAME) == 0);
+    
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "btree.h"
+#include "tbr.h"
+#include "tbr1.h"
+
+//
+// range queries on a live tree: a cursor seeks to the start of the range and
+// steps through the leaf it's on, against a bt_find for every key in it. then
+// whole-tree scans from a cold start, by cursor (which reads the leaves ahead)
+// and by bt_iterate_disk, which reads the file itself outside the cache
+//
+
+#define BTS_FNAME "/var/tmp/btree_scan"
+
+#define BTS_NUM_RECS_DEF (256 * 1024)
+#define BTS_NRANGES 4096
+
+static int bts_compare(btr_phys_t *btr1, btr_phys_t *btr2) {
+    return tbr_phys_compare((tbr_phys_t *)btr1, (tbr_phys_t *)btr2);
+}
+
+static bt_ops_t bts_ops = {
+    .bto_compare_fn = bts_compare,
+    .bto_dump_record_fn = NULL,
+    .bto_check_record_fn = NULL
+};
+
+static uint64_t bts_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bts_drop_page_cache(void) {
+    int fd;
+    
+    fd = open(BTS_FNAME, O_RDONLY);
+    assert(fd >= 0);
+    assert(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+    close(fd);
+}
+
+static void bts_ranges(btree_t *bt, uint32_t nrecs, uint32_t len) {
+    bt_cursor_t *btc;
+    tbr1_phys_t rec;
+    btr_phys_t *btrp, *found;
+    uint64_t start, id, n;
+    unsigned int seed = len;
+    double tc, tf;
+    
+    assert(bt_cursor_open(bt, &btc) == 0);
+    n = 0;
+    start = bts_now();
+    for (int i = 0; i < BTS_NRANGES; i++) {
+        id = rand_r(&seed) % (nrecs - len + 1) + 1;
+        assert(tbr1_build_record(id, 0, &rec) == 0);
+        assert(bt_cursor_seek(btc, (btr_phys_t *)&rec, &btrp) == 0);
+        for (uint32_t j = 1; j < len; j++)
+            assert(bt_cursor_next(btc, &btrp) == 0);
+        assert(((tbr1_phys_t *)btrp)->tbr1_key.tbr1_id == id + len - 1);
+        n += len;
+    }
+    tc = (bts_now() - start) / 1e9;
+    bt_cursor_close(btc);
+    
+    seed = len;
+    start = bts_now();
+    for (int i = 0; i < BTS_NRANGES; i++) {
+        id = rand_r(&seed) % (nrecs - len + 1) + 1;
+        for (uint32_t j = 0; j < len; j++) {
+            assert(tbr1_build_record(id + j, 0, &rec) == 0);
+            assert(bt_find(bt, (btr_phys_t *)&rec, &found) == 0);
+            free(found);
+        }
+    }
+    tf = (bts_now() - start) / 1e9;
+    
+    printf("  range %5" PRIu32 "  cursor %10.0f records/s  bt_find %10.0f records/s\n", len, n / tc, n / tf);
+}
+
+static int bts_count_cb(btr_phys_t *btr, void *ctx, bool *stop) {
+    (*(uint64_t *)ctx)++;
+    return 0;
+}
+
+static void bts_full_scans(uint32_t nrecs) {
+    btree_t *bt;
+    bt_cursor_t *btc;
+    btr_phys_t *btrp;
+    bc_stats_t bcs;
+    uint64_t start, n = 0;
+    double t;
+    
+    bts_drop_page_cache();
+    assert(bt_open(BTS_FNAME, &bts_ops, &bt) == 0);
+    assert(bt_cursor_open(bt, &btc) == 0);
+    start = bts_now();
+    while (bt_cursor_next(btc, &btrp) == 0)
+        n++;
+    t = (bts_now() - start) / 1e9;
+    assert(n == nrecs);
+    bt_cursor_close(btc);
+    bc_get_stats(bt->bt_bc, &bcs);
+    printf("  cold scan, cursor          %10.0f records/s  (%" PRIu64 " misses, %" PRIu64 " prefetched, %" PRIu64 " prefetch hits, %" PRIu64 " dropped)\n",
+           n / t, bcs.bcs_misses, bcs.bcs_prefetches, bcs.bcs_prefetch_hits, bcs.bcs_prefetch_drops);
+    assert(bt_close(bt) == 0);
+    
+    bts_drop_page_cache();
+    n = 0;
+    start = bts_now();
+    assert(bt_iterate_disk(BTS_FNAME, NULL, NULL, bts_count_cb, &n) == 0);
+    t = (bts_now() - start) / 1e9;
+    assert(n == nrecs);
+    printf("  cold scan, bt_iterate_disk %10.0f records/s\n", n / t);
+}
+
+int main(int argc, char **argv) {
+    uint32_t nrecs = BTS_NUM_RECS_DEF, *ids, tmp;
+    int ch, j;
+    tbr1_phys_t rec;
+    btree_t *bt;
+    
+    struct option longopts[] = {
+        { "num",      required_argument,   NULL,   'n' },
+        { NULL,                0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                nrecs = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("usage: %s [--num <num-records>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if (nrecs < 1024) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    // in random order, so the leaves are all over the file
+    assert(ids = malloc(sizeof(uint32_t) * nrecs));
+    for (uint32_t i = 0; i < nrecs; i++)
+        ids[i] = i + 1;
+    srand(1);
+    for (uint32_t i = nrecs - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+    
+    assert(bt_create(BTS_FNAME) == 0);
+    assert(bt_open(BTS_FNAME, &bts_ops, &bt) == 0);
+    for (uint32_t i = 0; i < nrecs; i++) {
+        assert(tbr1_build_record(ids[i], ids[i], &rec) == 0);
+        assert(tbr1_insert(bt, &rec) == 0);
+    }
+    
+    printf("records %" PRIu32 "\n", nrecs);
+    for (uint32_t len = 1; len <= 1000; len *= 10)
+        bts_ranges(bt, nrecs, len);
+    assert(bt_close(bt) == 0);
+    
+    bts_full_scans(nrecs);
+    
+    assert(bt_destroy(BTS_FNAME) == 0);
+    free(ids);
+    
+    return 0;
+}
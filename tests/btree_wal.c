@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "btree.h"
+#include "tbr.h"
+#include "tbr1.h"
+
+//
+// what a write-ahead log does for commit latency: every insert has to be
+// durable before it returns. without a log that takes a bt_sync, which writes
+// every dirty node home and fsyncs the file. with one (BT_WAL) it's a single
+// append to the log, and threads committing at the same time share its
+// fdatasync. reports throughput, commit latencies and how many records each
+// log fdatasync covered
+//
+
+#define BTW_FNAME "/var/tmp/btree_wal"
+
+#define BTW_NUM_RECS_DEF (16 * 1024)
+#define BTW_NTHREADS_DEF 8
+
+static int btw_compare(btr_phys_t *btr1, btr_phys_t *btr2) {
+    return tbr_phys_compare((tbr_phys_t *)btr1, (tbr_phys_t *)btr2);
+}
+
+static bt_ops_t btw_ops = {
+    .bto_compare_fn = btw_compare,
+    .bto_dump_record_fn = NULL,
+    .bto_check_record_fn = NULL
+};
+
+typedef struct btw_thr_arg {
+    thread_t *t;
+    btree_t *bt;
+    bool sync; // bt_sync after every insert
+    uint64_t first; // id
+    uint32_t nrecs;
+    uint64_t *lat; // ns, one per insert
+} btw_thr_arg_t;
+
+static uint64_t btw_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int btw_thr_start(void *arg) {
+    btw_thr_arg_t *targ = (btw_thr_arg_t *)arg;
+    tbr1_phys_t rec;
+    uint64_t start, id;
+    
+    for (uint32_t i = 0; i < targ->nrecs; i++) {
+        // scatter the ids so threads don't all land in the same leaf
+        id = ((targ->first + i) * 2654435761ULL) & 0xffffffffffffULL;
+        assert(tbr1_build_record(id + 1, id, &rec) == 0);
+        start = btw_now();
+        assert(tbr1_insert(targ->bt, &rec) == 0);
+        if (targ->sync)
+            assert(bt_sync(targ->bt) == 0);
+        targ->lat[i] = btw_now() - start;
+    }
+    
+    return 0;
+}
+
+static int btw_lat_cmp(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void btw_run(bool wal, uint32_t nrecs, int nthreads) {
+    btw_thr_arg_t *targs;
+    btree_t *bt;
+    uint64_t *lat, start, sum = 0, records = 0, syncs = 0;
+    double t;
+    
+    assert(bt_create_flags(BTW_FNAME, wal ? BT_WAL : 0) == 0);
+    assert(bt_open(BTW_FNAME, &btw_ops, &bt) == 0);
+    
+    assert(targs = malloc(sizeof(btw_thr_arg_t) * nthreads));
+    assert(lat = malloc(sizeof(uint64_t) * nrecs));
+    
+    start = btw_now();
+    for (int i = 0; i < nthreads; i++) {
+        targs[i].bt = bt;
+        targs[i].sync = !wal;
+        targs[i].first = (uint64_t)i * (nrecs / nthreads);
+        targs[i].nrecs = nrecs / nthreads;
+        targs[i].lat = lat + targs[i].first;
+        assert(targs[i].t = thread_create("btw_thread"));
+        assert(thread_start(targs[i].t, btw_thr_start, &targs[i]) == 0);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        assert(thread_wait(targs[i].t, NULL) == 0);
+        thread_destroy(targs[i].t);
+    }
+    t = (btw_now() - start) / 1e9;
+    
+    nrecs = (nrecs / nthreads) * nthreads;
+    qsort(lat, nrecs, sizeof(uint64_t), btw_lat_cmp);
+    for (uint32_t i = 0; i < nrecs; i++)
+        sum += lat[i];
+    
+    if (wal) {
+        records = bt->bt_wal->bw_records;
+        syncs = bt->bt_wal->bw_syncs;
+    }
+    
+    printf("  %-5s threads %2d  %8.0f commits/s  latency mean %7.1fus p50 %7.1fus p99 %8.1fus", wal ? "wal" : "sync",
+           nthreads, nrecs / t, sum / 1e3 / nrecs, lat[nrecs / 2] / 1e3, lat[(nrecs * 99) / 100] / 1e3);
+    if (wal)
+        printf("  %.2f records/fdatasync", syncs ? (double)records / syncs : 0.0);
+    printf("\n");
+    
+    assert(bt_close(bt) == 0);
+    assert(bt_destroy(BTW_FNAME) == 0);
+    free(lat);
+    free(targs);
+}
+
+int main(int argc, char **argv) {
+    uint32_t nrecs = BTW_NUM_RECS_DEF;
+    int ch, nthreads = BTW_NTHREADS_DEF;
+    
+    struct option longopts[] = {
+        { "num",      required_argument,   NULL,   'n' },
+        { "threads",  required_argument,   NULL,   't' },
+        { NULL,                0,          NULL,    0 }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                nrecs = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                nthreads = (int)strtol(optarg, NULL, 10);
+                break;
+            default:
+                printf("usage: %s [--num <num-records>] [--threads <num-threads>]\n", argv[0]);
+                return -1;
+        }
+    }
+    
+    if ((nthreads < 1) || (nrecs < nthreads)) {
+        printf("%s: bad arguments\n", argv[0]);
+        return -1;
+    }
+    
+    printf("records %" PRIu32 "\n", nrecs);
+    btw_run(false, nrecs, 1);
+    btw_run(true, nrecs, 1);
+    if (nthreads > 1) {
+        btw_run(false, nrecs, nthreads);
+        btw_run(true, nrecs, nthreads);
+    }
+    
+    return 0;
+}